@@ -0,0 +1,231 @@
+#include "risk/server/server.h"
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace {
+
+risk::server::Server* running = nullptr;
+
+void usage(const char* program)
+{
+    std::cerr
+        << "usage: " << program << " [--host ADDRESS] [--port PORT] [--unix PATH] [--shards N]\n"
+        << "    [--coalesce MS] [--turn-timeout MS] [--wal DIR [--commit-window MS]\n"
+        << "    [--snapshot-interval MS] [--hibernate-after MS] [--io uring|threads]\n"
+        << "    [--archive DIR [--replay-port PORT] [--replay-unix PATH]]] [--follow ADDRESS]\n"
+        << "  Serves risk games over TCP (default 127.0.0.1:7000) and/or a Unix socket,\n"
+        << "  on one shard per core unless --shards is given. With --coalesce, a game\n"
+        << "  sends at most one update per MS milliseconds. With --turn-timeout, a player\n"
+        << "  who has not moved for MS milliseconds has their turn played for them.\n"
+        << "  With --wal, changes are logged to DIR before they are acknowledged and\n"
+        << "  replayed from there on startup. Every --snapshot-interval (default 60000)\n"
+        << "  the games are snapshotted and the log before that is dropped. The log is\n"
+        << "  written with io_uring where the kernel allows it, unless --io says otherwise.\n"
+        << "  With --hibernate-after, games idle for MS milliseconds are moved out of\n"
+        << "  memory until they are asked for again. With --archive, games that end are\n"
+        << "  kept in DIR, compressed and indexed by id, from the next snapshot on, and\n"
+        << "  their logs can be downloaded on --replay-port and/or --replay-unix.\n"
+        << "  With --follow, runs as a hot standby of the server with a --wal at ADDRESS,\n"
+        << "  HOST:PORT or a Unix socket path, with as many shards. It takes no moves\n"
+        << "  until SIGUSR1 promotes it. Replication lag is reported every 10 seconds.\n";
+}
+
+// Prints how far standbys are behind, on a primary or a standby, until
+// stop is called
+class ReplicationReport {
+public:
+    ReplicationReport(const risk::server::Server& server, bool standby)
+        : standby_(standby)
+        , thread_([this, &server] { run(server); })
+    {}
+
+    ~ReplicationReport() { stop(); }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            stopped_ = true;
+        }
+        stopped_changed_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+private:
+    static constexpr std::chrono::seconds interval{10};
+
+    void run(const risk::server::Server& server)
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        while (!stopped_changed_.wait_for(lock, interval, [this] { return stopped_; })) {
+            const auto replication = server.replication();
+            if (replication.followers > 0) {
+                std::cerr << "replication: " << replication.followers << " followers, " << replication.behind
+                          << " records behind, lag " << replication.lag.count() << " us\n";
+            }
+            if (standby_) {
+                std::cerr << "replication: following on " << replication.following << " of "
+                          << server.shards() << " shards\n";
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable stopped_changed_;
+    bool stopped_ = false;
+    const bool standby_;
+    std::thread thread_;
+};
+
+// Each connection is a descriptor, so allow as many as the hard limit
+void raise_file_limit()
+{
+    rlimit limit{};
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    risk::server::ServerOptions options;
+    options.shards = std::max(1U, std::thread::hardware_concurrency());
+
+    const option long_options[] = {
+        {"host", required_argument, nullptr, 'h'},
+        {"port", required_argument, nullptr, 'p'},
+        {"unix", required_argument, nullptr, 'u'},
+        {"shards", required_argument, nullptr, 's'},
+        {"coalesce", required_argument, nullptr, 'c'},
+        {"turn-timeout", required_argument, nullptr, 't'},
+        {"wal", required_argument, nullptr, 'w'},
+        {"commit-window", required_argument, nullptr, 'W'},
+        {"snapshot-interval", required_argument, nullptr, 'S'},
+        {"hibernate-after", required_argument, nullptr, 'H'},
+        {"io", required_argument, nullptr, 'i'},
+        {"archive", required_argument, nullptr, 'a'},
+        {"replay-port", required_argument, nullptr, 'r'},
+        {"replay-unix", required_argument, nullptr, 'R'},
+        {"follow", required_argument, nullptr, 'f'},
+        {"help", no_argument, nullptr, '?'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int option;
+    while ((option = ::getopt_long(argc, argv, "h:p:u:s:c:t:w:W:S:H:i:a:r:R:f:", long_options, nullptr)) != -1) {
+        switch (option) {
+        case 'h':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = static_cast<std::uint16_t>(std::atoi(optarg));
+            break;
+        case 'u':
+            options.unix_path = optarg;
+            break;
+        case 's':
+            options.shards = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'c':
+            options.coalesce = std::chrono::milliseconds{std::strtol(optarg, nullptr, 10)};
+            break;
+        case 't':
+            options.turn_timeout = std::chrono::milliseconds{std::strtol(optarg, nullptr, 10)};
+            break;
+        case 'w':
+            options.wal_dir = optarg;
+            break;
+        case 'W':
+            options.commit_window = std::chrono::milliseconds{std::strtol(optarg, nullptr, 10)};
+            break;
+        case 'S':
+            options.snapshot_interval = std::chrono::milliseconds{std::strtol(optarg, nullptr, 10)};
+            break;
+        case 'H':
+            options.hibernate_after = std::chrono::milliseconds{std::strtol(optarg, nullptr, 10)};
+            break;
+        case 'i':
+            if (optarg == std::string{"uring"}) {
+                options.io = risk::server::DiskIo::Backend::Uring;
+            } else if (optarg == std::string{"threads"}) {
+                options.io = risk::server::DiskIo::Backend::Threads;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'a':
+            options.archive_dir = optarg;
+            break;
+        case 'r':
+            options.replay_port = static_cast<std::uint16_t>(std::atoi(optarg));
+            break;
+        case 'R':
+            options.replay_unix_path = optarg;
+            break;
+        case 'f':
+            options.follow = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!options.port && options.unix_path.empty()) {
+        options.port = 7000;
+    }
+
+    raise_file_limit();
+
+    try {
+        risk::server::Server server{options};
+        running = &server;
+
+        std::signal(SIGPIPE, SIG_IGN);
+        std::signal(SIGINT, [] (int) { running->stop(); });
+        std::signal(SIGTERM, [] (int) { running->stop(); });
+        std::signal(SIGUSR1, [] (int) { running->promote(); });
+
+        if (options.port) {
+            std::cerr << "listening on " << options.host << ':' << server.port() << '\n';
+        }
+        if (!options.unix_path.empty()) {
+            std::cerr << "listening on " << options.unix_path << '\n';
+        }
+        if (options.replay_port) {
+            std::cerr << "serving replays on " << options.host << ':' << server.replay_port() << '\n';
+        }
+        if (!options.replay_unix_path.empty()) {
+            std::cerr << "serving replays on " << options.replay_unix_path << '\n';
+        }
+        if (!options.follow.empty()) {
+            std::cerr << "following " << options.follow << '\n';
+        }
+        std::cerr << server.shards() << " shards\n";
+        ReplicationReport report{server, !options.follow.empty()};
+        server.run();
+        report.stop();
+        running = nullptr;
+    } catch (const std::exception& error) {
+        std::cerr << argv[0] << ": " << error.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include "risk/server/router.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <csignal>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace {
+
+void usage(const char* program)
+{
+    std::cerr
+        << "usage: " << program << " [--host ADDRESS] [--port PORT] [--unix PATH]\n"
+        << "    (--worker ADDRESS ... | --workers FILE) [--concurrent-moves N]\n"
+        << "  Routes risk games over TCP (default 127.0.0.1:7000) and/or a Unix socket\n"
+        << "  to the risk_server workers at each --worker ADDRESS, HOST:PORT or a Unix\n"
+        << "  socket path, or at the addresses in FILE, one per line. Games are spread\n"
+        << "  by consistent hashing of their ids. SIGHUP reads FILE again, and the games\n"
+        << "  whose worker changed are moved, --concurrent-moves (default 32) at a time.\n";
+}
+
+std::vector<std::string> read_workers(const std::string& path)
+{
+    std::ifstream in{path};
+    if (!in) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    std::vector<std::string> workers;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line[0] != '#') {
+            workers.push_back(line);
+        }
+    }
+    return workers;
+}
+
+void raise_file_limit()
+{
+    rlimit limit{};
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    risk::server::RouterOptions options;
+    std::string workers_file;
+
+    const option long_options[] = {
+        {"host", required_argument, nullptr, 'h'},
+        {"port", required_argument, nullptr, 'p'},
+        {"unix", required_argument, nullptr, 'u'},
+        {"worker", required_argument, nullptr, 'w'},
+        {"workers", required_argument, nullptr, 'W'},
+        {"concurrent-moves", required_argument, nullptr, 'm'},
+        {"help", no_argument, nullptr, '?'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int option;
+    while ((option = ::getopt_long(argc, argv, "h:p:u:w:W:m:", long_options, nullptr)) != -1) {
+        switch (option) {
+        case 'h':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = static_cast<std::uint16_t>(std::atoi(optarg));
+            break;
+        case 'u':
+            options.unix_path = optarg;
+            break;
+        case 'w':
+            options.workers.push_back(optarg);
+            break;
+        case 'W':
+            workers_file = optarg;
+            break;
+        case 'm':
+            options.concurrent_moves = std::strtoul(optarg, nullptr, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (options.workers.empty() == workers_file.empty()) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!options.port && options.unix_path.empty()) {
+        options.port = 7000;
+    }
+
+    raise_file_limit();
+
+    // Signals are taken by a thread of their own, as reloading is not
+    // something a handler can do
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    try {
+        if (!workers_file.empty()) {
+            options.workers = read_workers(workers_file);
+        }
+        risk::server::Router router{options};
+
+        std::thread signal_thread([&router, &signals, &workers_file] {
+            int signal = 0;
+            while (::sigwait(&signals, &signal) == 0 && signal == SIGHUP) {
+                if (workers_file.empty()) {
+                    continue;
+                }
+                try {
+                    const auto workers = read_workers(workers_file);
+                    router.set_workers(workers);
+                    std::cerr << "routing to " << workers.size() << " workers\n";
+                } catch (const std::exception& error) {
+                    std::cerr << "keeping the workers: " << error.what() << '\n';
+                }
+            }
+            router.stop();
+        });
+
+        if (options.port) {
+            std::cerr << "listening on " << options.host << ':' << router.port() << '\n';
+        }
+        if (!options.unix_path.empty()) {
+            std::cerr << "listening on " << options.unix_path << '\n';
+        }
+        std::cerr << "routing to " << options.workers.size() << " workers\n";
+        router.run();
+        signal_thread.join();
+
+        const auto migrations = router.migrations();
+        if (migrations.moved > 0) {
+            std::cerr << "moved " << migrations.moved << " games, pausing each for "
+                      << migrations.total_pause.count() / static_cast<std::int64_t>(migrations.moved)
+                      << " us on average and at most " << migrations.longest_pause.count() << " us\n";
+        }
+    } catch (const std::exception& error) {
+        std::cerr << argv[0] << ": " << error.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
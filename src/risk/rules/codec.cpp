@@ -0,0 +1,377 @@
+#include "risk/rules/codec.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace risk {
+
+namespace rules {
+
+unsigned StateCodec::owner_bits(std::size_t players)
+{
+    unsigned bits = 0;
+    while ((std::size_t{1} << bits) < players + 1) {
+        ++bits;
+    }
+    return bits;
+}
+
+void StateCodec::encode(const State& state, std::vector<std::uint8_t>& out) const
+{
+    const auto& territories = state.board_.territories_;
+    const auto& players = state.players_;
+    const auto& occupation = state.turn_.occupation;
+    ensure(territories.size() == board_.territories_.size(), std::invalid_argument("State is not on this board"));
+
+    auto territory_index = [&territories] (Territory::Id id) {
+        auto iter = std::find_if(
+            std::begin(territories), std::end(territories),
+            [id] (const Territory& territory) {
+                return territory.id() == id;
+            }
+        );
+        return static_cast<std::uint64_t>(iter - std::begin(territories));
+    };
+
+    out.push_back(flags(state));
+    put_varint(out, players.size());
+    for (const auto& player : players) {
+        put_varint(out, zigzag(player.id_));
+        put_varint(out, player.units_left_to_place_);
+    }
+    put_varint(out, state.cards_.size());
+    put_varint(out, state.trades_);
+    if (occupation) {
+        put_varint(out, territory_index(occupation->from));
+        put_varint(out, territory_index(occupation->to));
+        put_varint(out, occupation->min_units);
+    }
+
+    BitWriter bits{out};
+
+    // Owners as 1 + their position in the player order, 0 for none. Once
+    // every territory is claimed the 1 is left out, and so is a bit on
+    // most boards.
+    const bool claimed = all_claimed(state);
+    const auto width = owner_bits(claimed ? players.size() - 1 : players.size());
+    for (const auto& territory : territories) {
+        std::uint64_t owner = 0;
+        if (territory.owner_) {
+            for (std::size_t i = 0; i < players.size(); ++i) {
+                if (players[i].id_ == *territory.owner_) {
+                    owner = claimed ? i : i + 1;
+                    break;
+                }
+            }
+        }
+        bits.put(owner, width);
+    }
+
+    // An owned territory holds at least one unit, apart from one being
+    // occupied, and most hold just the one: a single 0 bit, or a 1 and the
+    // rest in nibbles
+    const auto occupied = occupation ? territory_index(occupation->to) : territories.size();
+    for (std::size_t i = 0; i < territories.size(); ++i) {
+        if (territories[i].owner_) {
+            const auto extra = territories[i].units_ - (i == occupied ? 0 : 1);
+            bits.put(extra > 0, 1);
+            if (extra > 0) {
+                bits.put_nibbles(extra - 1);
+            }
+        }
+    }
+
+    for (const auto& player : players) {
+        bits.put_nibbles(player.cards_.size());
+        for (const auto& card : player.cards_) {
+            bits.put(static_cast<std::uint64_t>(card.kind()), 2);
+        }
+    }
+    for (const auto& card : state.cards_) {
+        bits.put(static_cast<std::uint64_t>(card.kind()), 2);
+    }
+    bits.flush();
+}
+
+void StateCodec::decode(const std::uint8_t* in, std::size_t size, State& state) const
+{
+    const auto* end = in + size;
+
+    ensure(in != end, DecodeError{});
+    const auto flags = *in++;
+    ensure((flags & 7) < phase_count, DecodeError{});
+    state.phase_ = static_cast<Phase>(flags & 7);
+    state.turn_.conquered = flags & (1 << 3);
+
+    const auto player_count = get_varint(in, end);
+    ensure(player_count > 0 && player_count <= 64, DecodeError{});
+    auto& players = state.players_;
+    players.resize(player_count, Player{0});
+    for (auto& player : players) {
+        player.id_ = static_cast<Player::Id>(unzigzag(get_varint(in, end)));
+        player.units_left_to_place_ = get_varint(in, end);
+    }
+
+    const auto deck_size = get_varint(in, end);
+    ensure(deck_size <= size * 4, DecodeError{});
+    state.trades_ = get_varint(in, end);
+
+    auto& territories = state.board_.territories_;
+    if (territories.size() != board_.territories_.size()) {
+        state.board_ = board_;
+    }
+
+    auto occupied = territories.size();
+    if (flags & (1 << 4)) {
+        const auto from = get_varint(in, end);
+        const auto to = get_varint(in, end);
+        ensure(from < territories.size() && to < territories.size(), DecodeError{});
+        occupied = to;
+        state.turn_.occupation = Occupation{
+            territories[from].id_,
+            territories[to].id_,
+            static_cast<std::size_t>(get_varint(in, end)),
+        };
+    } else {
+        state.turn_.occupation.reset();
+    }
+
+    BitReader bits{in, end};
+
+    const bool claimed = flags & (1 << 5);
+    const auto width = owner_bits(claimed ? players.size() - 1 : players.size());
+    for (auto& territory : territories) {
+        const auto owner = bits.get(width) + (claimed ? 1 : 0);
+        ensure(owner <= players.size(), DecodeError{});
+        if (owner > 0) {
+            territory.owner_ = players[owner - 1].id_;
+        } else {
+            territory.owner_.reset();
+        }
+    }
+
+    for (std::size_t i = 0; i < territories.size(); ++i) {
+        auto& territory = territories[i];
+        if (!territory.owner_) {
+            territory.units_ = 0;
+            continue;
+        }
+        const auto extra = bits.get(1) ? bits.get_nibbles() + 1 : 0;
+        territory.units_ = extra + (i == occupied ? 0 : 1);
+    }
+
+    for (auto& player : players) {
+        const auto cards = bits.get_nibbles();
+        ensure(cards <= deck_size + board_.territories_.size() + 2, DecodeError{});
+        player.cards_.clear();
+        for (std::size_t i = 0; i < cards; ++i) {
+            player.cards_.emplace_back(static_cast<Card::Kind>(bits.get(2)));
+        }
+    }
+
+    state.cards_.clear();
+    for (std::size_t i = 0; i < deck_size; ++i) {
+        state.cards_.emplace_back(static_cast<Card::Kind>(bits.get(2)));
+    }
+}
+
+State StateCodec::decode(const std::uint8_t* in, std::size_t size) const
+{
+    State state{board_, Phase::Placing, {}, {}};
+    decode(in, size, state);
+    return state;
+}
+
+std::uint8_t StateCodec::flags(const State& state)
+{
+    return static_cast<std::uint8_t>(
+        static_cast<unsigned>(state.phase_)
+        | unsigned{state.turn_.conquered} << 3
+        | unsigned{state.turn_.occupation.has_value()} << 4
+        | unsigned{all_claimed(state)} << 5
+    );
+}
+
+bool StateCodec::all_claimed(const State& state)
+{
+    const auto& territories = state.board_.territories_;
+    return std::all_of(std::begin(territories), std::end(territories), [] (const Territory& territory) {
+        return territory.owner_.has_value();
+    });
+}
+
+void StateCodec::put_cards(std::vector<std::uint8_t>& out, const std::vector<Card>& cards)
+{
+    put_varint(out, cards.size());
+
+    BitWriter bits{out};
+    for (const auto& card : cards) {
+        bits.put(static_cast<std::uint64_t>(card.kind()), 2);
+    }
+    bits.flush();
+}
+
+void StateCodec::get_cards(const std::uint8_t*& in, const std::uint8_t* end, std::vector<Card>& cards)
+{
+    const auto count = get_varint(in, end);
+    ensure(count <= static_cast<std::uint64_t>(end - in) * 4, DecodeError{});
+
+    BitReader bits{in, end};
+    cards.clear();
+    for (std::size_t i = 0; i < count; ++i) {
+        cards.emplace_back(static_cast<Card::Kind>(bits.get(2)));
+    }
+}
+
+void StateCodec::diff(const State& from, const State& to, std::vector<std::uint8_t>& out) const
+{
+    const auto& before = from.board_.territories_;
+    const auto& after = to.board_.territories_;
+    ensure(before.size() == after.size(), std::invalid_argument("States are not on the same board"));
+
+    auto same_turn = [] (const Turn& a, const Turn& b) {
+        return a.conquered == b.conquered
+            && a.occupation.has_value() == b.occupation.has_value()
+            && (!a.occupation || (a.occupation->from == b.occupation->from
+                                  && a.occupation->to == b.occupation->to
+                                  && a.occupation->min_units == b.occupation->min_units));
+    };
+    auto same_cards = [] (const std::vector<Card>& a, const std::vector<Card>& b) {
+        return std::equal(
+            std::begin(a), std::end(a), std::begin(b), std::end(b),
+            [] (const Card& x, const Card& y) { return x.kind() == y.kind(); }
+        );
+    };
+    auto same_players = [&] {
+        return std::equal(
+            std::begin(from.players_), std::end(from.players_),
+            std::begin(to.players_), std::end(to.players_),
+            [&] (const Player& x, const Player& y) {
+                return x.id_ == y.id_
+                    && x.units_left_to_place_ == y.units_left_to_place_
+                    && same_cards(x.cards_, y.cards_);
+            }
+        );
+    };
+
+    std::vector<std::size_t> changed;
+    for (std::size_t i = 0; i < after.size(); ++i) {
+        if (before[i].owner_ != after[i].owner_ || before[i].units_ != after[i].units_) {
+            changed.push_back(i);
+        }
+    }
+
+    std::uint8_t sections = 0;
+    if (from.phase_ != to.phase_ || from.trades_ != to.trades_ || !same_turn(from.turn_, to.turn_)) {
+        sections |= Header;
+    }
+    if (!same_players()) {
+        sections |= Players;
+    }
+    if (!same_cards(from.cards_, to.cards_)) {
+        sections |= Deck;
+    }
+    if (!changed.empty()) {
+        sections |= Territories;
+    }
+    out.push_back(sections);
+
+    if (sections & Header) {
+        out.push_back(flags(to));
+        put_varint(out, to.trades_);
+        if (to.turn_.occupation) {
+            put_varint(out, zigzag(to.turn_.occupation->from));
+            put_varint(out, zigzag(to.turn_.occupation->to));
+            put_varint(out, to.turn_.occupation->min_units);
+        }
+    }
+
+    if (sections & Players) {
+        put_varint(out, to.players_.size());
+        for (const auto& player : to.players_) {
+            put_varint(out, zigzag(player.id_));
+            put_varint(out, player.units_left_to_place_);
+            put_cards(out, player.cards_);
+        }
+    }
+
+    if (sections & Deck) {
+        put_cards(out, to.cards_);
+    }
+
+    // Territories as gaps between changed positions, then owner and units.
+    // Owners are 0 for none, otherwise the zigzagged id plus one.
+    if (sections & Territories) {
+        put_varint(out, changed.size());
+        std::size_t previous = 0;
+        for (auto index : changed) {
+            const auto& territory = after[index];
+            put_varint(out, index - previous);
+            put_varint(out, territory.owner_ ? zigzag(*territory.owner_) + 1 : 0);
+            put_varint(out, territory.units_);
+            previous = index;
+        }
+    }
+}
+
+void StateCodec::patch(const std::uint8_t* in, std::size_t size, State& state) const
+{
+    const auto* end = in + size;
+
+    ensure(in != end, DecodeError{});
+    const auto sections = *in++;
+
+    if (sections & Header) {
+        ensure(in != end, DecodeError{});
+        const auto flags = *in++;
+        ensure((flags & 7) < phase_count, DecodeError{});
+        state.phase_ = static_cast<Phase>(flags & 7);
+        state.turn_.conquered = flags & (1 << 3);
+        state.trades_ = get_varint(in, end);
+        if (flags & (1 << 4)) {
+            const auto from = static_cast<Territory::Id>(unzigzag(get_varint(in, end)));
+            const auto to = static_cast<Territory::Id>(unzigzag(get_varint(in, end)));
+            state.turn_.occupation = Occupation{from, to, static_cast<std::size_t>(get_varint(in, end))};
+        } else {
+            state.turn_.occupation.reset();
+        }
+    }
+
+    if (sections & Players) {
+        const auto count = get_varint(in, end);
+        ensure(count > 0 && count <= 64, DecodeError{});
+        state.players_.resize(count, Player{0});
+        for (auto& player : state.players_) {
+            player.id_ = static_cast<Player::Id>(unzigzag(get_varint(in, end)));
+            player.units_left_to_place_ = get_varint(in, end);
+            get_cards(in, end, player.cards_);
+        }
+    }
+
+    if (sections & Deck) {
+        get_cards(in, end, state.cards_);
+    }
+
+    if (sections & Territories) {
+        auto& territories = state.board_.territories_;
+        const auto count = get_varint(in, end);
+        std::size_t index = 0;
+        for (std::size_t i = 0; i < count; ++i) {
+            index += get_varint(in, end);
+            ensure(index < territories.size(), DecodeError{});
+
+            auto& territory = territories[index];
+            const auto owner = get_varint(in, end);
+            if (owner > 0) {
+                territory.owner_ = static_cast<Player::Id>(unzigzag(owner - 1));
+            } else {
+                territory.owner_.reset();
+            }
+            territory.units_ = get_varint(in, end);
+        }
+    }
+}
+
+}
+
+}
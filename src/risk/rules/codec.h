@@ -0,0 +1,146 @@
+#pragma once
+
+#include "risk/rules/event_log.h"
+#include "risk/rules/state.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace risk {
+
+namespace rules {
+
+// Packs values of up to 57 bits into a byte stream, least significant bit
+// first
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<std::uint8_t>& out)
+        : out_(out)
+    {}
+
+    void put(std::uint64_t value, unsigned bits)
+    {
+        buffer_ |= value << used_;
+        used_ += bits;
+        while (used_ >= 8) {
+            out_.push_back(static_cast<std::uint8_t>(buffer_));
+            buffer_ >>= 8;
+            used_ -= 8;
+        }
+    }
+
+    // Variable length in nibbles: three value bits and a continuation bit
+    void put_nibbles(std::uint64_t value)
+    {
+        while (value >= 8) {
+            put((value & 7) | 8, 4);
+            value >>= 3;
+        }
+        put(value, 4);
+    }
+
+    void flush()
+    {
+        if (used_ > 0) {
+            out_.push_back(static_cast<std::uint8_t>(buffer_));
+        }
+        buffer_ = 0;
+        used_ = 0;
+    }
+
+private:
+    std::vector<std::uint8_t>& out_;
+    std::uint64_t buffer_ = 0;
+    unsigned used_ = 0;
+};
+
+class BitReader {
+public:
+    BitReader(const std::uint8_t*& in, const std::uint8_t* end)
+        : in_(in)
+        , end_(end)
+    {}
+
+    std::uint64_t get(unsigned bits)
+    {
+        while (available_ < bits) {
+            ensure(in_ != end_, DecodeError{});
+            buffer_ |= std::uint64_t{*in_++} << available_;
+            available_ += 8;
+        }
+        const auto value = buffer_ & ((std::uint64_t{1} << bits) - 1);
+        buffer_ >>= bits;
+        available_ -= bits;
+        return value;
+    }
+
+    std::uint64_t get_nibbles()
+    {
+        std::uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 3) {
+            const auto nibble = get(4);
+            value |= (nibble & 7) << shift;
+            if (!(nibble & 8)) {
+                return value;
+            }
+        }
+        throw DecodeError{};
+    }
+
+private:
+    const std::uint8_t*& in_;
+    const std::uint8_t* end_;
+    std::uint64_t buffer_ = 0;
+    unsigned available_ = 0;
+};
+
+// Compact binary snapshots of a State. Only what changes during a game is
+// stored; the territories and borders come from the Board both ends agree
+// on. Owners are packed into ceil(log2(players + 1)) bits each, or
+// ceil(log2(players)) once every territory is claimed, counts are varints,
+// a territory's units past the first take one bit when there are none and
+// nibbles otherwise, and cards take two bits.
+class StateCodec {
+public:
+    explicit StateCodec(Board board)
+        : board_(std::move(board))
+    {}
+
+    // Appends the encoding of the state to `out`
+    void encode(const State& state, std::vector<std::uint8_t>& out) const;
+
+    // Decodes into an existing State, reusing its storage. Once the State
+    // has held a snapshot of the same shape this does not allocate.
+    void decode(const std::uint8_t* in, std::size_t size, State& state) const;
+
+    State decode(const std::uint8_t* in, std::size_t size) const;
+
+    // Appends a patch that turns `from` into `to`. Only the territories
+    // that differ are listed, and the players, deck and turn are only
+    // included when they changed.
+    void diff(const State& from, const State& to, std::vector<std::uint8_t>& out) const;
+
+    // Applies a patch made by diff to the State it was made from
+    void patch(const std::uint8_t* in, std::size_t size, State& state) const;
+
+private:
+    // What a patch contains
+    enum Section : std::uint8_t {
+        Header = 1 << 0,
+        Players = 1 << 1,
+        Deck = 1 << 2,
+        Territories = 1 << 3,
+    };
+
+    static unsigned owner_bits(std::size_t players);
+    static std::uint8_t flags(const State& state);
+    static bool all_claimed(const State& state);
+    static void put_cards(std::vector<std::uint8_t>& out, const std::vector<Card>& cards);
+    static void get_cards(const std::uint8_t*& in, const std::uint8_t* end, std::vector<Card>& cards);
+
+    Board board_;
+};
+
+}
+
+}
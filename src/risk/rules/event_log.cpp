@@ -0,0 +1,204 @@
+#include "risk/rules/event_log.h"
+
+#include <stdexcept>
+
+namespace risk {
+
+namespace rules {
+
+void put_varint(std::vector<std::uint8_t>& out, std::uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<std::uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<std::uint8_t>(value));
+}
+
+std::uint64_t get_varint(const std::uint8_t*& in, const std::uint8_t* end)
+{
+    std::uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        ensure(in != end, DecodeError{});
+        const auto byte = *in++;
+        value |= std::uint64_t{byte & 0x7fU} << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw DecodeError{};
+}
+
+std::uint64_t zigzag(std::int64_t value)
+{
+    return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+}
+
+std::int64_t unzigzag(std::uint64_t value)
+{
+    return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+}
+
+void encode(std::vector<std::uint8_t>& out, const PlaceUnit& command)
+{
+    put_varint(out, zigzag(command.player));
+    put_varint(out, zigzag(command.territory));
+}
+
+void encode(std::vector<std::uint8_t>& out, const TradeCards& command)
+{
+    put_varint(out, zigzag(command.player));
+    for (auto card : command.cards) {
+        put_varint(out, card);
+    }
+}
+
+void encode(std::vector<std::uint8_t>& out, const Attack& command)
+{
+    put_varint(out, zigzag(command.player));
+    put_varint(out, zigzag(command.from));
+    put_varint(out, zigzag(command.to));
+    put_varint(out, command.dice);
+}
+
+void encode(std::vector<std::uint8_t>& out, const Occupy& command)
+{
+    put_varint(out, zigzag(command.player));
+    put_varint(out, command.units);
+}
+
+void encode(std::vector<std::uint8_t>& out, const Fortify& command)
+{
+    put_varint(out, zigzag(command.player));
+    put_varint(out, zigzag(command.from));
+    put_varint(out, zigzag(command.to));
+    put_varint(out, command.units);
+}
+
+void encode(std::vector<std::uint8_t>& out, const EndPhase& command)
+{
+    put_varint(out, zigzag(command.player));
+}
+
+void encode(std::vector<std::uint8_t>& out, const Command& command)
+{
+    out.push_back(static_cast<std::uint8_t>(command.index()));
+    std::visit([&out] (const auto& cmd) { encode(out, cmd); }, command);
+}
+
+Command decode_command(const std::uint8_t*& in, const std::uint8_t* end)
+{
+    ensure(in != end, DecodeError{});
+    const auto index = *in++;
+
+    auto id = [&] { return static_cast<int>(unzigzag(get_varint(in, end))); };
+    auto count = [&] { return static_cast<std::size_t>(get_varint(in, end)); };
+
+    switch (index) {
+    case command_index<PlaceUnit>: {
+        auto player = id();
+        return PlaceUnit{player, id()};
+    }
+    case command_index<TradeCards>: {
+        auto player = id();
+        std::array<std::size_t, 3> cards{};
+        for (auto& card : cards) {
+            card = count();
+        }
+        return TradeCards{player, cards};
+    }
+    case command_index<Attack>: {
+        auto player = id();
+        auto from = id();
+        auto to = id();
+        return Attack{player, from, to, count()};
+    }
+    case command_index<Occupy>: {
+        auto player = id();
+        return Occupy{player, count()};
+    }
+    case command_index<Fortify>: {
+        auto player = id();
+        auto from = id();
+        auto to = id();
+        return Fortify{player, from, to, count()};
+    }
+    case command_index<EndPhase>:
+        return EndPhase{id()};
+    }
+    throw DecodeError{};
+}
+
+std::uint64_t hash_state(const std::vector<Territory>& territories, Phase phase,
+                         const std::vector<Player>& players, std::size_t current,
+                         const std::vector<Card>& cards, const Turn& turn, std::size_t trades)
+{
+    Fnv1a hash;
+    hash.add(static_cast<std::uint64_t>(phase));
+
+    for (const auto& territory : territories) {
+        hash.add(territory.id());
+        hash.add(territory.owner().has_value());
+        hash.add(territory.owner().value_or(0));
+        hash.add(territory.units());
+    }
+
+    for (std::size_t i = 0; i < players.size(); ++i) {
+        const auto& player = players[(current + i) % players.size()];
+        const auto hand = player.cards();
+        hash.add(player.id());
+        hash.add(player.units());
+        hash.add(hand.size());
+        for (const auto& card : hand) {
+            hash.add(static_cast<std::uint64_t>(card.kind()));
+        }
+    }
+
+    hash.add(cards.size());
+    for (const auto& card : cards) {
+        hash.add(static_cast<std::uint64_t>(card.kind()));
+    }
+
+    hash.add(turn.conquered);
+    hash.add(turn.occupation.has_value());
+    if (turn.occupation) {
+        hash.add(turn.occupation->from);
+        hash.add(turn.occupation->to);
+        hash.add(turn.occupation->min_units);
+    }
+    hash.add(trades);
+
+    return hash.value();
+}
+
+std::uint64_t hash_state(const State& state)
+{
+    return hash_state(
+        state.board().territories(), state.phase(), state.players(), 0,
+        state.cards(), state.turn(), state.trades()
+    );
+}
+
+void EventLog::deal(std::uint64_t seed)
+{
+    bytes_.push_back(deal_tag);
+    put_varint(bytes_, seed);
+}
+
+void EventLog::hash(std::uint64_t state_hash)
+{
+    bytes_.push_back(hash_tag);
+    for (unsigned i = 0; i < 8; ++i) {
+        bytes_.push_back(static_cast<std::uint8_t>(state_hash >> (8 * i)));
+    }
+}
+
+EventLog::Reader EventLog::reader(std::size_t offset) const
+{
+    ensure(offset <= bytes_.size(), std::out_of_range("Offset past end of log"));
+    return Reader{bytes_.data(), bytes_.data() + offset, bytes_.data() + bytes_.size()};
+}
+
+}
+
+}
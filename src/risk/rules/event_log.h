@@ -0,0 +1,169 @@
+#pragma once
+
+#include "risk/rules/state.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace risk {
+
+namespace rules {
+
+class DecodeError : public std::exception
+{
+public:
+    const char* what() const noexcept override { return "Malformed encoding"; }
+};
+
+// LEB128 varints. Signed values are zigzag encoded first.
+void put_varint(std::vector<std::uint8_t>& out, std::uint64_t value);
+std::uint64_t get_varint(const std::uint8_t*& in, const std::uint8_t* end);
+std::uint64_t zigzag(std::int64_t value);
+std::int64_t unzigzag(std::uint64_t value);
+
+// Command fields as varints
+void encode(std::vector<std::uint8_t>& out, const PlaceUnit& command);
+void encode(std::vector<std::uint8_t>& out, const TradeCards& command);
+void encode(std::vector<std::uint8_t>& out, const Attack& command);
+void encode(std::vector<std::uint8_t>& out, const Occupy& command);
+void encode(std::vector<std::uint8_t>& out, const Fortify& command);
+void encode(std::vector<std::uint8_t>& out, const EndPhase& command);
+
+// A command is its Command::index() followed by its fields
+void encode(std::vector<std::uint8_t>& out, const Command& command);
+Command decode_command(const std::uint8_t*& in, const std::uint8_t* end);
+
+// FNV-1a, fed 64 bits at a time
+class Fnv1a {
+public:
+    void add(std::uint64_t value)
+    {
+        for (unsigned i = 0; i < 8; ++i) {
+            hash_ ^= (value >> (8 * i)) & 0xff;
+            hash_ *= 0x100000001b3;
+        }
+    }
+
+    std::uint64_t value() const { return hash_; }
+
+private:
+    std::uint64_t hash_ = 0xcbf29ce484222325;
+};
+
+// Hash of a State's contents, with the players starting from `current`
+std::uint64_t hash_state(const std::vector<Territory>& territories, Phase phase,
+                         const std::vector<Player>& players, std::size_t current,
+                         const std::vector<Card>& cards, const Turn& turn, std::size_t trades);
+
+std::uint64_t hash_state(const State& state);
+
+// Compact binary record of everything that changed a game. Each move is
+// followed by the dice it rolled, and optionally by the hash of the State
+// it produced, so a game can be rebuilt without its dice.
+class EventLog {
+public:
+    enum class Event {
+        Command,
+        Roll,
+        Deal,
+        Hash,
+    };
+
+    class Reader;
+
+    explicit EventLog(bool hashes = false)
+        : hashes_(hashes)
+    {}
+
+    explicit EventLog(std::vector<std::uint8_t> bytes)
+        : hashes_(false)
+        , bytes_(std::move(bytes))
+    {}
+
+    // Whether State hashes are recorded after each move
+    bool hashes() const { return hashes_; }
+    const auto& bytes() const { return bytes_; }
+
+    void command(const Command& command) { encode(bytes_, command); }
+    void roll(int eyes) { bytes_.push_back(static_cast<std::uint8_t>(roll_tag | eyes)); }
+    void deal(std::uint64_t seed);
+    void hash(std::uint64_t state_hash);
+
+    // Reads from `offset` bytes into the log, which must be an event boundary
+    Reader reader(std::size_t offset = 0) const;
+
+private:
+    // Commands are tagged with their Command::index(), rolls carry the eyes
+    // in the low bits of the tag
+    static constexpr std::uint8_t deal_tag = 0x80;
+    static constexpr std::uint8_t hash_tag = 0x81;
+    static constexpr std::uint8_t roll_tag = 0xc0;
+
+    bool hashes_;
+    std::vector<std::uint8_t> bytes_;
+};
+
+class EventLog::Reader {
+public:
+    Reader(const std::uint8_t* begin, const std::uint8_t* in, const std::uint8_t* end)
+        : begin_(begin)
+        , in_(in)
+        , end_(end)
+    {}
+
+    bool done() const { return in_ == end_; }
+    std::size_t offset() const { return in_ - begin_; }
+
+    Event peek() const
+    {
+        ensure(!done(), DecodeError{});
+        if (*in_ < deal_tag) {
+            return Event::Command;
+        }
+        if (*in_ >= roll_tag) {
+            return Event::Roll;
+        }
+        ensure(*in_ <= hash_tag, DecodeError{});
+        return *in_ == deal_tag ? Event::Deal : Event::Hash;
+    }
+
+    Command command()
+    {
+        ensure(peek() == Event::Command, DecodeError{});
+        return decode_command(in_, end_);
+    }
+
+    int roll()
+    {
+        ensure(peek() == Event::Roll, DecodeError{});
+        return *in_++ & ~roll_tag;
+    }
+
+    std::uint64_t deal()
+    {
+        ensure(peek() == Event::Deal, DecodeError{});
+        ++in_;
+        return get_varint(in_, end_);
+    }
+
+    std::uint64_t hash()
+    {
+        ensure(peek() == Event::Hash, DecodeError{});
+        ensure(end_ - in_ > 8, DecodeError{});
+        ++in_;
+        std::uint64_t state_hash = 0;
+        for (unsigned i = 0; i < 8; ++i) {
+            state_hash |= std::uint64_t{*in_++} << (8 * i);
+        }
+        return state_hash;
+    }
+
+private:
+    const std::uint8_t* begin_;
+    const std::uint8_t* in_;
+    const std::uint8_t* end_;
+};
+
+}
+
+}
@@ -0,0 +1,656 @@
+#pragma once
+
+#include "risk/rules/event_log.h"
+#include "risk/rules/policies.h"
+#include "risk/rules/state.h"
+
+#include <algorithm>
+#include <exception>
+#include <random>
+#include <stdexcept>
+
+namespace risk {
+
+namespace rules {
+
+// Working copy of the mutable parts of a State. Commands are validated and
+// applied against it, and the result is only turned into a new State once
+// every command has succeeded.
+template <typename Rules>
+class Transaction {
+public:
+    Transaction(const State& state, const Dice& dice, const Rules& rules);
+
+    void apply(const Command& command);
+
+    // Applies a command from a trusted source, such as a recorded game,
+    // without the phase and turn checks
+    void apply_trusted(const Command& command);
+
+    // See BasicGame::deal_random_placement
+    void deal_random_placement(std::uint64_t seed);
+
+    // Called whenever a territory gets a new owner
+    void on_owner_changed(OwnerChanged callback) { owner_changed_ = std::move(callback); }
+
+    State commit() const;
+
+    // Same as hash_state(commit()), without building the State
+    std::uint64_t hash() const;
+
+private:
+    void apply(const PlaceUnit& command);
+    void apply(const TradeCards& command);
+    void apply(const Attack& command);
+    void apply(const Occupy& command);
+    void apply(const Fortify& command);
+    void apply(const EndPhase& command);
+
+    void begin_turn();
+    void end_turn();
+
+    Player& current_player() { return players_[turn_]; }
+    // Linear, as boards and player lists are small enough that building an
+    // index costs a single command more than it saves
+    Territory& territory(Territory::Id id);
+    std::size_t player_index(Player::Id id) const;
+    void change_owner(Territory& territory, Player::Id owner);
+    std::size_t territories_owned_by(Player::Id id) const;
+    std::vector<int> roll(std::size_t dice) const;
+
+    const Dice& dice_;
+    const Rules& rules_;
+    Board board_;
+    std::vector<Territory> territories_;
+    std::vector<Player> players_;
+    std::vector<Card> cards_;
+    Phase phase_;
+    Turn turn_state_;
+    std::size_t trades_;
+    std::size_t turn_ = 0;
+    std::size_t units_left_to_place_ = 0;
+    OwnerChanged owner_changed_;
+};
+
+template <typename Rules>
+Transaction<Rules>::Transaction(const State& state, const Dice& dice, const Rules& rules)
+    : dice_(dice)
+    , rules_(rules)
+    , board_(state.board())
+    , territories_(board_.territories())
+    , players_(state.players())
+    , cards_(state.cards())
+    , phase_(state.phase())
+    , turn_state_(state.turn())
+    , trades_(state.trades())
+{
+    for (const auto& player : players_) {
+        units_left_to_place_ += player.units();
+    }
+}
+
+template <typename Rules>
+void Transaction<Rules>::apply(const Command& command)
+{
+    ensure(command_allowed(phase_, command.index()), IllegalMove{});
+
+    std::visit(
+        [this] (const auto& cmd) {
+            player_index(cmd.player);
+            ensure(current_player().id() == cmd.player, PlayerNotInTurn{});
+            apply(cmd);
+        },
+        command
+    );
+}
+
+template <typename Rules>
+void Transaction<Rules>::apply_trusted(const Command& command)
+{
+    std::visit([this] (const auto& cmd) { apply(cmd); }, command);
+}
+
+template <typename Rules>
+void Transaction<Rules>::apply(const PlaceUnit& command)
+{
+    auto& target = territory(command.territory);
+
+    if (phase_ == Phase::Reinforce) {
+        ensure(target.owner() == command.player, IllegalMove{});
+
+        target.add_units(1);
+        current_player().placed_unit();
+        if (current_player().units() == 0) {
+            phase_ = Phase::Attack;
+        }
+        return;
+    }
+
+    // TODO: Any unclaimed territories?
+    // TODO:  - Selected territory must be unclaimed
+    if (!target.owner()) {
+        change_owner(target, command.player);
+    } else if (target.owner() != command.player) {
+        throw IllegalMove{}; // "Player not allowed to place unit in a territory owned by another player"
+    }
+
+    target.add_units(1);
+    current_player().placed_unit();
+    --units_left_to_place_;
+
+    turn_ = (turn_ + 1) % players_.size();
+    if (units_left_to_place_ == 0) {
+        begin_turn();
+    }
+}
+
+template <typename Rules>
+void Transaction<Rules>::apply(const TradeCards& command)
+{
+    auto& player = current_player();
+    const auto hand = player.cards();
+
+    auto indices = command.cards;
+    std::sort(std::begin(indices), std::end(indices));
+    ensure(indices[2] < hand.size(), std::out_of_range("Card index not in range"));
+    ensure(indices[0] != indices[1] && indices[1] != indices[2], IllegalMove{});
+
+    std::size_t wildcards = 0;
+    std::array<bool, 3> kinds{};
+    for (auto index : indices) {
+        const auto kind = hand[index].kind();
+        if (kind == Card::Kind::Wildcard) {
+            ++wildcards;
+        } else {
+            kinds[static_cast<std::size_t>(kind)] = true;
+        }
+    }
+    const auto distinct_kinds = std::count(std::begin(kinds), std::end(kinds), true);
+    const bool all_same = distinct_kinds <= 1;
+    const bool all_different = static_cast<std::size_t>(distinct_kinds) + wildcards == 3;
+    ensure(all_same || all_different, IllegalMove{});
+
+    // Traded cards go back under the deck
+    auto traded = player.take_cards(command.cards);
+    cards_.insert(std::begin(cards_), std::begin(traded), std::end(traded));
+
+    const auto value = rules_.trade_value(trades_, traded);
+    ++trades_;
+
+    player.give_units_to_place(player.units() + value);
+    if (player.cards().size() < 3) {
+        phase_ = Phase::Reinforce;
+    }
+}
+
+template <typename Rules>
+void Transaction<Rules>::apply(const Attack& command)
+{
+    auto& from = territory(command.from);
+    auto& to = territory(command.to);
+
+    ensure(from.owner() == command.player, IllegalMove{});
+    ensure(to.owner() && to.owner() != command.player, IllegalMove{});
+    ensure(board_.adjacent(from.id(), to.id()), IllegalMove{});
+    ensure(command.dice >= 1 && command.dice <= 3 && command.dice < from.units(), IllegalMove{});
+
+    const auto attacker = roll(command.dice);
+    const auto defender = roll(std::min<std::size_t>(2, to.units()));
+
+    for (std::size_t i = 0; i < std::min(attacker.size(), defender.size()); ++i) {
+        if (attacker[i] > defender[i]) {
+            to.remove_units(1);
+        } else {
+            from.remove_units(1);
+        }
+    }
+
+    if (to.units() > 0) {
+        return;
+    }
+
+    const auto defender_id = *to.owner();
+    change_owner(to, command.player);
+
+    // An eliminated player hands over their cards
+    if (territories_owned_by(defender_id) == 0) {
+        auto& defending_player = players_[player_index(defender_id)];
+        for (const auto& card : defending_player.take_all_cards()) {
+            current_player().give_card(card);
+        }
+    }
+
+    turn_state_.conquered = true;
+    turn_state_.occupation = Occupation{
+        from.id(),
+        to.id(),
+        std::min(command.dice, from.units() - 1),
+    };
+    phase_ = Phase::Occupy;
+}
+
+template <typename Rules>
+void Transaction<Rules>::apply(const Occupy& command)
+{
+    const auto occupation = *turn_state_.occupation;
+    auto& from = territory(occupation.from);
+    auto& to = territory(occupation.to);
+
+    ensure(command.units >= occupation.min_units && command.units < from.units(), IllegalMove{});
+
+    from.remove_units(command.units);
+    to.add_units(command.units);
+    turn_state_.occupation.reset();
+
+    phase_ = rules_.has_won(command.player, territories_) ? Phase::GameOver : Phase::Attack;
+}
+
+template <typename Rules>
+void Transaction<Rules>::apply(const Fortify& command)
+{
+    auto& from = territory(command.from);
+    auto& to = territory(command.to);
+
+    ensure(from.owner() == command.player && to.owner() == command.player, IllegalMove{});
+    ensure(board_.adjacent(from.id(), to.id()), IllegalMove{});
+    ensure(command.units >= 1 && command.units < from.units(), IllegalMove{});
+
+    from.remove_units(command.units);
+    to.add_units(command.units);
+
+    end_turn();
+}
+
+template <typename Rules>
+void Transaction<Rules>::apply(const EndPhase&)
+{
+    if (phase_ == Phase::Fortify) {
+        end_turn();
+        return;
+    }
+
+    // Holding five or more cards forces a trade
+    if (phase_ == Phase::TradeCards) {
+        ensure(current_player().cards().size() < 5, IllegalMove{});
+    }
+
+    phase_ = phase_after_end[static_cast<std::size_t>(phase_)];
+}
+
+template <typename Rules>
+void Transaction<Rules>::begin_turn()
+{
+    auto& player = current_player();
+
+    player.give_units_to_place(rules_.reinforcements(territories_owned_by(player.id())));
+
+    turn_state_ = Turn{};
+    phase_ = player.cards().size() >= 3 ? Phase::TradeCards : Phase::Reinforce;
+}
+
+template <typename Rules>
+void Transaction<Rules>::end_turn()
+{
+    if (turn_state_.conquered && !cards_.empty()) {
+        current_player().give_card(cards_.back());
+        cards_.pop_back();
+    }
+
+    // Eliminated players are skipped
+    do {
+        turn_ = (turn_ + 1) % players_.size();
+    } while (territories_owned_by(current_player().id()) == 0);
+
+    begin_turn();
+}
+
+template <typename Rules>
+Territory& Transaction<Rules>::territory(Territory::Id id)
+{
+    auto iter = std::find_if(std::begin(territories_), std::end(territories_), [id] (const Territory& territory) {
+        return territory.id() == id;
+    });
+    ensure(iter != std::end(territories_), std::out_of_range("Territory ID not in range"));
+    return *iter;
+}
+
+template <typename Rules>
+std::size_t Transaction<Rules>::player_index(Player::Id id) const
+{
+    auto iter = std::find_if(std::begin(players_), std::end(players_), [id] (const Player& player) {
+        return player.id() == id;
+    });
+    ensure(iter != std::end(players_), std::out_of_range("Player ID not in range"));
+    return static_cast<std::size_t>(iter - std::begin(players_));
+}
+
+template <typename Rules>
+void Transaction<Rules>::change_owner(Territory& territory, Player::Id owner)
+{
+    territory.owner(owner);
+    if (owner_changed_) {
+        owner_changed_(territory.id(), owner);
+    }
+}
+
+template <typename Rules>
+std::size_t Transaction<Rules>::territories_owned_by(Player::Id id) const
+{
+    return std::count_if(
+        std::begin(territories_), std::end(territories_),
+        [id] (const Territory& territory) {
+            return territory.owner() == id;
+        }
+    );
+}
+
+template <typename Rules>
+std::vector<int> Transaction<Rules>::roll(std::size_t dice) const
+{
+    std::vector<int> eyes(dice);
+    std::generate(std::begin(eyes), std::end(eyes), dice_);
+    std::sort(std::begin(eyes), std::end(eyes), std::greater<>{});
+    return eyes;
+}
+
+template <typename Rules>
+std::uint64_t Transaction<Rules>::hash() const
+{
+    return hash_state(territories_, phase_, players_, turn_, cards_, turn_state_, trades_);
+}
+
+template <typename Rules>
+void Transaction<Rules>::deal_random_placement(std::uint64_t seed)
+{
+    ensure(phase_ == Phase::Placing, IllegalMove{});
+
+    std::vector<std::size_t> unclaimed;
+    std::vector<std::vector<std::size_t>> owned(players_.size());
+    for (std::size_t i = 0; i < territories_.size(); ++i) {
+        if (auto owner = territories_[i].owner()) {
+            owned[player_index(*owner)].push_back(i);
+        } else {
+            unclaimed.push_back(i);
+        }
+    }
+
+    std::mt19937_64 rng{seed};
+    for (std::size_t i = unclaimed.size(); i > 1; --i) {
+        std::uniform_int_distribution<std::size_t> pick{0, i - 1};
+        std::swap(unclaimed[i - 1], unclaimed[pick(rng)]);
+    }
+
+    std::size_t next_unclaimed = 0;
+    for (; units_left_to_place_ > 0; --units_left_to_place_) {
+        auto& player = current_player();
+        auto& territories = owned[turn_];
+
+        if (next_unclaimed < unclaimed.size()) {
+            const auto index = unclaimed[next_unclaimed++];
+            change_owner(territories_[index], player.id());
+            territories_[index].add_units(1);
+            territories.push_back(index);
+        } else if (!territories.empty()) {
+            std::uniform_int_distribution<std::size_t> pick{0, territories.size() - 1};
+            territories_[territories[pick(rng)]].add_units(1);
+        }
+
+        player.placed_unit();
+        turn_ = (turn_ + 1) % players_.size();
+    }
+
+    begin_turn();
+}
+
+template <typename Rules>
+State Transaction<Rules>::commit() const
+{
+    // The players are only rotated once, however many turns were taken
+    auto players = players_;
+    std::rotate(std::begin(players), std::begin(players) + turn_, std::end(players));
+
+    return State{
+        Board{territories_, board_.borders()},
+        phase_,
+        players,
+        cards_,
+        turn_state_,
+        trades_,
+    };
+}
+
+// The rules variant is a policy type, see ClassicRules for what it
+// provides. Variants are resolved at compile time.
+template <typename Rules>
+class BasicGame {
+public:
+    BasicGame(Board board, std::vector<Player> players, Dice dice, Rules rules = {})
+        : BasicGame(board, players, std::move(dice), nullptr, std::move(rules))
+    {}
+
+    // Records every state-changing event, dice included, to the log
+    BasicGame(Board board, std::vector<Player> players, Dice dice, EventLog& log, Rules rules = {})
+        : BasicGame(board, players, std::move(dice), &log, std::move(rules))
+    {}
+
+    void give_units_to_each_player();
+    void decide_starting_player();
+
+    const auto& state() const { return state_; }
+    const auto& rules() const { return rules_; }
+    void update(State new_state) { state_ = new_state; }
+
+    int roll_dice() const;
+
+    void place_unit(Player::Id id, Territory::Id territory);
+
+    // Validates the command against the phase table and applies it
+    void apply(const Command& command);
+
+    // Applies the commands in order as one atomic update. If a command
+    // fails, BatchFailed is thrown with its index and the state is left
+    // untouched.
+    void apply_batch(const std::vector<Command>& commands);
+
+    // Finishes the placement phase as if every player, in turn, placed each
+    // of their remaining units on a uniformly random unclaimed territory,
+    // or on one of their own once all are claimed. The end-of-placement
+    // state is built directly from one shuffle of the unclaimed territories
+    // instead of going through place_unit.
+    void deal_random_placement(std::uint64_t seed);
+
+    bool is_player_turn(Player::Id id) const
+    {
+        return state().current_player().id() == id;
+    }
+
+    bool player_exists(Player::Id id) const
+    {
+        auto players = state().players();
+        return std::any_of(
+            std::begin(players), std::end(players),
+            [id] (const Player& player) {
+                return player.id() == id;
+            }
+        );
+    }
+
+    bool territory_exists(Territory::Id id) const
+    {
+        auto territories = state().board().territories();
+        return std::any_of(
+            std::begin(territories), std::end(territories),
+            [id] (const Territory& territory) {
+                return territory.id() == id;
+            }
+        );
+    }
+
+
+private:
+    BasicGame(Board board, std::vector<Player> players, Dice dice, EventLog* log, Rules rules)
+        : state_(board, Phase::Placing, players, classic_deck(board))
+        , dice_(std::move(dice))
+        , rules_(std::move(rules))
+        , log_(log)
+    {
+        give_units_to_each_player();
+        decide_starting_player();
+    }
+
+    void record(const Command& command, const int* rolls, std::size_t count, std::uint64_t state_hash);
+
+    State state_;
+    Dice dice_;
+    Rules rules_;
+    EventLog* log_;
+};
+
+using Game = BasicGame<ClassicRules>;
+
+template <typename Rules>
+void BasicGame<Rules>::give_units_to_each_player()
+{
+    auto players = state().players();
+    const auto units = rules_.starting_units(players.size());
+
+    std::for_each(
+        std::begin(players), std::end(players),
+        [units] (Player& player) {
+            player.give_units_to_place(units);
+        }
+    );
+
+    auto new_state = State{
+        state().board(),
+        Phase::Placing,
+        players,
+        state().cards(),
+    };
+
+    update(new_state);
+}
+
+template <typename Rules>
+void BasicGame<Rules>::decide_starting_player()
+{
+    const int dice = roll_dice();
+
+    auto players = state().players();
+    std::rotate(std::begin(players), std::begin(players) + (dice - 1) % players.size(), std::end(players));
+
+    auto new_state = State{
+        state().board(),
+        Phase::Placing,
+        players,
+        state().cards(),
+    };
+
+    update(new_state);
+}
+
+template <typename Rules>
+void BasicGame<Rules>::place_unit(Player::Id player_id, Territory::Id territory_id)
+{
+    apply(PlaceUnit{player_id, territory_id});
+}
+
+template <typename Rules>
+int BasicGame<Rules>::roll_dice() const
+{
+    const int eyes = dice_();
+    if (log_) {
+        log_->roll(eyes);
+    }
+    return eyes;
+}
+
+template <typename Rules>
+void BasicGame<Rules>::apply(const Command& command)
+{
+    std::vector<int> rolls;
+    const Dice recording = [this, &rolls] {
+        const int eyes = dice_();
+        rolls.push_back(eyes);
+        return eyes;
+    };
+
+    Transaction<Rules> transaction{state(), log_ ? recording : dice_, rules_};
+    transaction.apply(command);
+    update(transaction.commit());
+
+    if (log_) {
+        record(command, rolls.data(), rolls.size(), log_->hashes() ? hash_state(state()) : 0);
+    }
+}
+
+template <typename Rules>
+void BasicGame<Rules>::deal_random_placement(std::uint64_t seed)
+{
+    Transaction<Rules> transaction{state(), dice_, rules_};
+    transaction.deal_random_placement(seed);
+    update(transaction.commit());
+
+    if (log_) {
+        log_->deal(seed);
+        if (log_->hashes()) {
+            log_->hash(hash_state(state()));
+        }
+    }
+}
+
+template <typename Rules>
+void BasicGame<Rules>::apply_batch(const std::vector<Command>& commands)
+{
+    std::vector<int> rolls;
+    const Dice recording = [this, &rolls] {
+        const int eyes = dice_();
+        rolls.push_back(eyes);
+        return eyes;
+    };
+
+    // Where each command's dice end, and the hash of the State it produced
+    std::vector<std::size_t> rolls_end;
+    std::vector<std::uint64_t> hashes;
+
+    Transaction<Rules> transaction{state(), log_ ? recording : dice_, rules_};
+
+    for (std::size_t i = 0; i < commands.size(); ++i) {
+        try {
+            transaction.apply(commands[i]);
+        } catch (...) {
+            throw BatchFailed{i, std::current_exception()};
+        }
+
+        if (log_) {
+            rolls_end.push_back(rolls.size());
+            hashes.push_back(log_->hashes() ? transaction.hash() : 0);
+        }
+    }
+
+    update(transaction.commit());
+
+    if (log_) {
+        std::size_t first = 0;
+        for (std::size_t i = 0; i < commands.size(); ++i) {
+            record(commands[i], rolls.data() + first, rolls_end[i] - first, hashes[i]);
+            first = rolls_end[i];
+        }
+    }
+}
+
+template <typename Rules>
+void BasicGame<Rules>::record(const Command& command, const int* rolls, std::size_t count, std::uint64_t state_hash)
+{
+    log_->command(command);
+    for (std::size_t i = 0; i < count; ++i) {
+        log_->roll(rolls[i]);
+    }
+    if (log_->hashes()) {
+        log_->hash(state_hash);
+    }
+}
+
+}
+
+}
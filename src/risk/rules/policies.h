@@ -0,0 +1,146 @@
+#pragma once
+
+#include "risk/rules/state.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace risk {
+
+namespace rules {
+
+// The classic rules. A rules variant derives from ClassicRules, or from
+// another variant, and hides the parts it changes:
+//
+//   std::size_t starting_units(std::size_t players) const;
+//   std::size_t reinforcements(std::size_t territories_owned) const;
+//   std::size_t trade_value(std::size_t trades, const std::vector<Card>& set) const;
+//   bool has_won(Player::Id player, const std::vector<Territory>& territories) const;
+struct ClassicRules {
+    // 35 each for up to three players, five fewer for each additional player
+    std::size_t starting_units(std::size_t players) const
+    {
+        return players <= 3 ? 35 : 50 - 5 * std::min<std::size_t>(players, 6);
+    }
+
+    // TODO: Continent bonuses
+    std::size_t reinforcements(std::size_t territories_owned) const
+    {
+        return std::max<std::size_t>(3, territories_owned / 3);
+    }
+
+    // Escalating: 4, 6, 8, 10, 12, 15 and then five more for each set
+    std::size_t trade_value(std::size_t trades, const std::vector<Card>&) const
+    {
+        constexpr std::array<std::size_t, 6> first_trades{4, 6, 8, 10, 12, 15};
+        return trades < first_trades.size()
+            ? first_trades[trades]
+            : first_trades.back() + 5 * (trades + 1 - first_trades.size());
+    }
+
+    bool has_won(Player::Id player, const std::vector<Territory>& territories) const
+    {
+        return std::all_of(
+            std::begin(territories), std::end(territories),
+            [player] (const Territory& territory) {
+                return territory.owner() == player;
+            }
+        );
+    }
+};
+
+// Sets are worth the same all game: 4 for infantry, 6 for cavalry, 8 for
+// artillery and 10 for one of each. Wildcards count as the best set.
+template <typename Base = ClassicRules>
+struct FixedCardValues : Base {
+    using Base::Base;
+
+    std::size_t trade_value(std::size_t, const std::vector<Card>& set) const
+    {
+        std::array<std::size_t, 3> kinds{};
+        for (const auto& card : set) {
+            if (card.kind() != Card::Kind::Wildcard) {
+                ++kinds[static_cast<std::size_t>(card.kind())];
+            }
+        }
+
+        // Unless two cards share a kind the wildcards can make one of each
+        constexpr std::array<std::size_t, 3> values{4, 6, 8};
+        auto same = std::find_if(
+            std::begin(kinds), std::end(kinds),
+            [] (std::size_t count) { return count >= 2; }
+        );
+        return same == std::end(kinds) ? 10 : values[same - std::begin(kinds)];
+    }
+};
+
+template <std::size_t Units, typename Base = ClassicRules>
+struct StartingUnits : Base {
+    using Base::Base;
+
+    std::size_t starting_units(std::size_t) const { return Units; }
+};
+
+// A player wins by holding every capital. Without capitals only the base
+// rules decide.
+template <typename Base = ClassicRules>
+struct CapitalRules : Base {
+    CapitalRules(std::vector<Territory::Id> capitals = {})
+        : capitals(std::move(capitals))
+    {}
+
+    bool has_won(Player::Id player, const std::vector<Territory>& territories) const
+    {
+        if (capitals.empty()) {
+            return Base::has_won(player, territories);
+        }
+        return std::all_of(
+            std::begin(capitals), std::end(capitals),
+            [&] (Territory::Id capital) {
+                return std::any_of(
+                    std::begin(territories), std::end(territories),
+                    [&] (const Territory& territory) {
+                        return territory.id() == capital && territory.owner() == player;
+                    }
+                );
+            }
+        ) || Base::has_won(player, territories);
+    }
+
+    std::vector<Territory::Id> capitals;
+};
+
+// A player wins by holding every territory of their secret mission
+template <typename Base = ClassicRules>
+struct MissionRules : Base {
+    MissionRules(std::unordered_map<Player::Id, std::vector<Territory::Id>> missions = {})
+        : missions(std::move(missions))
+    {}
+
+    bool has_won(Player::Id player, const std::vector<Territory>& territories) const
+    {
+        // Without a mission, or with an empty one, the base rules decide
+        auto mission = missions.find(player);
+        if (mission == missions.end() || mission->second.empty()) {
+            return Base::has_won(player, territories);
+        }
+
+        return std::all_of(
+            std::begin(mission->second), std::end(mission->second),
+            [&] (Territory::Id target) {
+                return std::any_of(
+                    std::begin(territories), std::end(territories),
+                    [&] (const Territory& territory) {
+                        return territory.id() == target && territory.owner() == player;
+                    }
+                );
+            }
+        );
+    }
+
+    std::unordered_map<Player::Id, std::vector<Territory::Id>> missions;
+};
+
+}
+
+}
@@ -0,0 +1,38 @@
+#include "risk/rules/replay.h"
+
+namespace risk {
+
+namespace rules {
+
+std::optional<Player::Id> OwnershipHistory::owner_at(Territory::Id territory, std::size_t move) const
+{
+    const auto& history = changes(territory);
+    auto change = std::upper_bound(
+        std::begin(history), std::end(history), move,
+        [] (std::size_t move, const Change& change) {
+            return move < change.move;
+        }
+    );
+
+    if (change == std::begin(history)) {
+        return std::nullopt;
+    }
+    return std::prev(change)->owner;
+}
+
+std::size_t OwnershipHistory::times_conquered(Territory::Id territory) const
+{
+    const auto& history = changes(territory);
+    return history.empty() ? 0 : history.size() - 1;
+}
+
+const std::vector<OwnershipHistory::Change>& OwnershipHistory::changes(Territory::Id territory) const
+{
+    auto iter = changes_.find(territory);
+    ensure(iter != changes_.end(), std::out_of_range("Territory ID not in range"));
+    return iter->second;
+}
+
+}
+
+}
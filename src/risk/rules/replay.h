@@ -0,0 +1,333 @@
+#pragma once
+
+#include "risk/rules/codec.h"
+#include "risk/rules/event_log.h"
+#include "risk/rules/game.h"
+#include "risk/rules/state.h"
+
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace risk {
+
+namespace rules {
+
+class ReplayDiverged : public std::exception
+{
+public:
+    explicit ReplayDiverged(std::size_t move)
+        : move_(move)
+    {}
+
+    const char* what() const noexcept override { return "Replay diverged from recorded game"; }
+
+    // The first move whose State did not match the recorded hash
+    std::size_t move() const { return move_; }
+
+private:
+    std::size_t move_;
+};
+
+enum class Verify {
+    Nothing,
+    Hashes,
+};
+
+// Rebuilds a game from its event log. The log is trusted: commands skip the
+// phase and turn checks and are all applied to one Transaction, so no State
+// is built until one is asked for. The hashes recorded in the log can be
+// checked after each move.
+template <typename Rules = ClassicRules>
+class Replay {
+public:
+    Replay(Board board, std::vector<Player> players, const EventLog& log,
+           Verify verify = Verify::Nothing, Rules rules = {})
+        : reader_(log.reader())
+        , verify_(verify)
+        , rules_(std::move(rules))
+        , dice_([this] { return reader_.roll(); })
+        , transaction_(BasicGame<Rules>(board, players, dice_, rules_).state(), dice_, rules_)
+    {}
+
+    // Resumes a replay from a State taken after `moves` moves, with the
+    // next move at `offset` in the log
+    Replay(const State& state, const EventLog& log, std::size_t offset, std::size_t moves,
+           Verify verify = Verify::Nothing, Rules rules = {})
+        : reader_(log.reader(offset))
+        , verify_(verify)
+        , rules_(std::move(rules))
+        , dice_([this] { return reader_.roll(); })
+        , transaction_(state, dice_, rules_)
+        , moves_(moves)
+    {}
+
+    Replay(const Replay&) = delete;
+    Replay& operator=(const Replay&) = delete;
+
+    // Applies the next move. Returns false at the end of the log.
+    bool step();
+    void run() { while (step()) {} }
+
+    // Number of moves applied so far
+    std::size_t moves() const { return moves_; }
+    // Where in the log the next move starts
+    std::size_t offset() const { return reader_.offset(); }
+    State state() const { return transaction_.commit(); }
+
+    // Called for every ownership change while replaying
+    void on_owner_changed(OwnerChanged callback) { transaction_.on_owner_changed(std::move(callback)); }
+
+private:
+    EventLog::Reader reader_;
+    Verify verify_;
+    Rules rules_;
+    Dice dice_;
+    Transaction<Rules> transaction_;
+    std::size_t moves_ = 0;
+};
+
+template <typename Rules>
+bool Replay<Rules>::step()
+{
+    if (reader_.done()) {
+        return false;
+    }
+
+    switch (reader_.peek()) {
+    case EventLog::Event::Command:
+        transaction_.apply_trusted(reader_.command());
+        break;
+    case EventLog::Event::Deal:
+        transaction_.deal_random_placement(reader_.deal());
+        break;
+    default:
+        // Dice and hashes always follow a move
+        throw DecodeError{};
+    }
+    ++moves_;
+
+    if (!reader_.done() && reader_.peek() == EventLog::Event::Hash) {
+        const auto recorded = reader_.hash();
+        if (verify_ == Verify::Hashes && recorded != transaction_.hash()) {
+            throw ReplayDiverged{moves_ - 1};
+        }
+    }
+
+    return true;
+}
+
+// Keeps a checkpoint every `interval` moves, so that any move can be
+// reached by a binary search for the nearest one and at most `interval`
+// moves from there. A shorter interval seeks faster and keeps more
+// checkpoints around. Checkpoints are StateCodec snapshots, which save
+// writes out to be kept next to the log, so the log only has to be
+// replayed in full once.
+//
+// The log is read on every seek, so it must outlive the index.
+template <typename Rules = ClassicRules>
+class ReplayIndex {
+public:
+    // Replays the log to take the checkpoints
+    ReplayIndex(Board board, std::vector<Player> players, const EventLog& log,
+                std::size_t interval = 64, Rules rules = {});
+
+    // Loads the checkpoints save wrote for this log, replaying the moves
+    // after the last one. Throws DecodeError if they are malformed or do
+    // not match the log.
+    ReplayIndex(Board board, const EventLog& log, const std::uint8_t* index, std::size_t size, Rules rules = {});
+
+    ReplayIndex(Board, std::vector<Player>, const EventLog&&, std::size_t = 64, Rules = {}) = delete;
+    ReplayIndex(Board, const EventLog&&, const std::uint8_t*, std::size_t, Rules = {}) = delete;
+
+    // Total number of moves in the log
+    std::size_t moves() const { return moves_; }
+
+    // The State after the first `move` moves. Throws DecodeError if the
+    // log ends before it.
+    State seek(std::size_t move) const;
+
+    // Appends the checkpoints to `out`
+    void save(std::vector<std::uint8_t>& out) const;
+
+private:
+    struct Checkpoint {
+        std::size_t move;
+        // Of the next move in the log
+        std::size_t offset;
+        // Of the snapshot in snapshots_
+        std::size_t begin;
+        std::size_t size;
+    };
+
+    void add(std::size_t move, std::size_t offset, const State& state);
+
+    const EventLog& log_;
+    Rules rules_;
+    StateCodec codec_;
+    std::vector<Checkpoint> checkpoints_;
+    std::vector<std::uint8_t> snapshots_;
+    std::size_t moves_ = 0;
+};
+
+template <typename Rules>
+ReplayIndex<Rules>::ReplayIndex(Board board, std::vector<Player> players, const EventLog& log,
+                                std::size_t interval, Rules rules)
+    : log_(log)
+    , rules_(std::move(rules))
+    , codec_(board)
+{
+    ensure(interval > 0, std::invalid_argument("Checkpoint interval must be positive"));
+
+    Replay<Rules> replay{board, players, log, Verify::Nothing, rules_};
+    add(0, replay.offset(), replay.state());
+
+    while (replay.step()) {
+        if (replay.moves() % interval == 0) {
+            add(replay.moves(), replay.offset(), replay.state());
+        }
+    }
+    moves_ = replay.moves();
+}
+
+// Saved as the log's length and move count, the number of checkpoints and
+// then each checkpoint's move and offset, as the difference from the one
+// before, and its snapshot's size and bytes
+template <typename Rules>
+ReplayIndex<Rules>::ReplayIndex(Board board, const EventLog& log, const std::uint8_t* index, std::size_t size,
+                                Rules rules)
+    : log_(log)
+    , rules_(std::move(rules))
+    , codec_(std::move(board))
+{
+    const auto* in = index;
+    const auto* end = index + size;
+
+    ensure(get_varint(in, end) == log.bytes().size(), DecodeError{});
+    moves_ = get_varint(in, end);
+    const auto count = get_varint(in, end);
+    ensure(count > 0 && count <= size, DecodeError{});
+
+    std::size_t move = 0;
+    std::size_t offset = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        move += get_varint(in, end);
+        offset += get_varint(in, end);
+        const auto length = get_varint(in, end);
+        ensure(move <= moves_ && offset <= log.bytes().size(), DecodeError{});
+        ensure(length <= static_cast<std::uint64_t>(end - in), DecodeError{});
+        ensure(i == 0 ? move == 0 : move > checkpoints_.back().move, DecodeError{});
+
+        checkpoints_.push_back({move, offset, snapshots_.size(), length});
+        snapshots_.insert(std::end(snapshots_), in, in + length);
+        in += length;
+    }
+    ensure(in == end, DecodeError{});
+
+    // The log has to end as many moves after the last checkpoint as the
+    // index says
+    const auto& last = checkpoints_.back();
+    Replay<Rules> replay{
+        codec_.decode(snapshots_.data() + last.begin, last.size), log_, last.offset, last.move, Verify::Nothing, rules_
+    };
+    while (replay.step()) {}
+    ensure(replay.moves() == moves_, DecodeError{});
+}
+
+template <typename Rules>
+void ReplayIndex<Rules>::add(std::size_t move, std::size_t offset, const State& state)
+{
+    const auto begin = snapshots_.size();
+    codec_.encode(state, snapshots_);
+    checkpoints_.push_back({move, offset, begin, snapshots_.size() - begin});
+}
+
+template <typename Rules>
+State ReplayIndex<Rules>::seek(std::size_t move) const
+{
+    ensure(move <= moves_, std::out_of_range("Move not in replay"));
+
+    auto checkpoint = std::upper_bound(
+        std::begin(checkpoints_), std::end(checkpoints_), move,
+        [] (std::size_t move, const Checkpoint& checkpoint) {
+            return move < checkpoint.move;
+        }
+    );
+    --checkpoint;
+
+    const auto state = codec_.decode(snapshots_.data() + checkpoint->begin, checkpoint->size);
+    Replay<Rules> replay{state, log_, checkpoint->offset, checkpoint->move, Verify::Nothing, rules_};
+    while (replay.moves() < move) {
+        // The log ended before the index says it does
+        ensure(replay.step(), DecodeError{});
+    }
+    return replay.state();
+}
+
+template <typename Rules>
+void ReplayIndex<Rules>::save(std::vector<std::uint8_t>& out) const
+{
+    put_varint(out, log_.bytes().size());
+    put_varint(out, moves_);
+    put_varint(out, checkpoints_.size());
+
+    std::size_t move = 0;
+    std::size_t offset = 0;
+    for (const auto& checkpoint : checkpoints_) {
+        put_varint(out, checkpoint.move - move);
+        put_varint(out, checkpoint.offset - offset);
+        put_varint(out, checkpoint.size);
+        out.insert(std::end(out), std::begin(snapshots_) + checkpoint.begin,
+                   std::begin(snapshots_) + checkpoint.begin + checkpoint.size);
+        move = checkpoint.move;
+        offset = checkpoint.offset;
+    }
+}
+
+// Who owned each territory over the course of a recorded game. The
+// ownership changes the engine reports during one replay are kept as a
+// sorted list per territory, so lookups are a binary search.
+class OwnershipHistory {
+public:
+    template <typename Rules = ClassicRules>
+    OwnershipHistory(Board board, std::vector<Player> players, const EventLog& log, Rules rules = {});
+
+    // The owner after the first `move` moves
+    std::optional<Player::Id> owner_at(Territory::Id territory, std::size_t move) const;
+
+    // Number of times the territory was conquered, not counting the
+    // initial claim
+    std::size_t times_conquered(Territory::Id territory) const;
+
+private:
+    struct Change {
+        // The change is in effect after this many moves
+        std::size_t move;
+        Player::Id owner;
+    };
+
+    const std::vector<Change>& changes(Territory::Id territory) const;
+
+    std::unordered_map<Territory::Id, std::vector<Change>> changes_;
+};
+
+template <typename Rules>
+OwnershipHistory::OwnershipHistory(Board board, std::vector<Player> players, const EventLog& log, Rules rules)
+{
+    for (const auto& territory : board.territories()) {
+        changes_[territory.id()];
+    }
+
+    Replay<Rules> replay{board, players, log, Verify::Nothing, std::move(rules)};
+    replay.on_owner_changed(
+        [this, &replay] (Territory::Id territory, Player::Id owner) {
+            changes_[territory].push_back({replay.moves() + 1, owner});
+        }
+    );
+    replay.run();
+}
+
+}
+
+}
@@ -0,0 +1,146 @@
+#include "risk/rules/state.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace risk {
+
+namespace rules {
+
+void Player::placed_unit()
+{
+    assert(units_left_to_place_);
+    --units_left_to_place_;
+}
+
+std::vector<Card> Player::take_cards(std::array<std::size_t, 3> indices)
+{
+    std::sort(std::begin(indices), std::end(indices), std::greater<>{});
+
+    std::vector<Card> taken;
+    for (auto index : indices) {
+        assert(index < cards_.size());
+        taken.push_back(cards_[index]);
+        cards_.erase(std::begin(cards_) + index);
+    }
+    return taken;
+}
+
+std::vector<Card> Player::take_all_cards()
+{
+    std::vector<Card> taken;
+    std::swap(taken, cards_);
+    return taken;
+}
+
+void Territory::remove_units(std::size_t units)
+{
+    assert(units <= units_);
+    units_ -= units;
+}
+
+Board::Board(std::vector<Territory> territories, std::vector<Border> borders)
+    : territories_(territories)
+    , borders_(borders)
+{
+    // Keep borders as sorted (low, high) pairs so adjacency is a binary search
+    for (auto& border : borders_) {
+        if (border.second < border.first) {
+            std::swap(border.first, border.second);
+        }
+    }
+    std::sort(std::begin(borders_), std::end(borders_));
+    borders_.erase(std::unique(std::begin(borders_), std::end(borders_)), std::end(borders_));
+}
+
+bool Board::adjacent(Territory::Id a, Territory::Id b) const
+{
+    return std::binary_search(
+        std::begin(borders_), std::end(borders_),
+        Border{std::min(a, b), std::max(a, b)}
+    );
+}
+
+Board classic_board()
+{
+    std::vector<Territory> territories;
+    for (Territory::Id id = 1; id <= 42; ++id) {
+        territories.emplace_back(id);
+    }
+
+    // North America:  1 Alaska, 2 Northwest Territory, 3 Greenland, 4 Alberta,
+    //                 5 Ontario, 6 Quebec, 7 Western US, 8 Eastern US,
+    //                 9 Central America
+    // South America: 10 Venezuela, 11 Peru, 12 Brazil, 13 Argentina
+    // Europe:        14 Iceland, 15 Scandinavia, 16 Great Britain,
+    //                17 Northern Europe, 18 Ukraine, 19 Western Europe,
+    //                20 Southern Europe
+    // Africa:        21 North Africa, 22 Egypt, 23 East Africa, 24 Congo,
+    //                25 South Africa, 26 Madagascar
+    // Asia:          27 Ural, 28 Siberia, 29 Yakutsk, 30 Kamchatka, 31 Irkutsk,
+    //                32 Afghanistan, 33 Mongolia, 34 China, 35 Middle East,
+    //                36 India, 37 Siam, 38 Japan
+    // Australia:     39 Indonesia, 40 New Guinea, 41 Western Australia,
+    //                42 Eastern Australia
+    std::vector<Board::Border> borders{
+        {1, 2}, {1, 4}, {1, 30},
+        {2, 3}, {2, 4}, {2, 5},
+        {3, 5}, {3, 6}, {3, 14},
+        {4, 5}, {4, 7},
+        {5, 6}, {5, 7}, {5, 8},
+        {6, 8},
+        {7, 8}, {7, 9},
+        {8, 9},
+        {9, 10},
+        {10, 11}, {10, 12},
+        {11, 12}, {11, 13},
+        {12, 13}, {12, 21},
+        {14, 15}, {14, 16},
+        {15, 16}, {15, 17}, {15, 18},
+        {16, 17}, {16, 19},
+        {17, 18}, {17, 19}, {17, 20},
+        {18, 20}, {18, 27}, {18, 32}, {18, 35},
+        {19, 20}, {19, 21},
+        {20, 21}, {20, 22}, {20, 35},
+        {21, 22}, {21, 23}, {21, 24},
+        {22, 23}, {22, 35},
+        {23, 24}, {23, 25}, {23, 26}, {23, 35},
+        {24, 25},
+        {25, 26},
+        {27, 28}, {27, 32}, {27, 34},
+        {28, 29}, {28, 31}, {28, 33}, {28, 34},
+        {29, 30}, {29, 31},
+        {30, 31}, {30, 33}, {30, 38},
+        {31, 33},
+        {32, 34}, {32, 35}, {32, 36},
+        {33, 34}, {33, 38},
+        {34, 36}, {34, 37},
+        {35, 36},
+        {36, 37},
+        {37, 39},
+        {39, 40}, {39, 41},
+        {40, 41}, {40, 42},
+        {41, 42},
+    };
+
+    return Board{territories, borders};
+}
+
+std::vector<Card> classic_deck(const Board& board)
+{
+    constexpr std::array<Card::Kind, 3> kinds{
+        Card::Kind::Infantry,
+        Card::Kind::Cavalry,
+        Card::Kind::Artillery,
+    };
+
+    std::vector<Card> deck{Card::Kind::Wildcard, Card::Kind::Wildcard};
+    for (std::size_t i = 0; i < board.territories().size(); ++i) {
+        deck.push_back(kinds[i % kinds.size()]);
+    }
+    return deck;
+}
+
+}
+
+}
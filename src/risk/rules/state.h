@@ -0,0 +1,278 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace risk {
+
+namespace rules {
+
+class PlayerNotInTurn : public std::exception
+{
+public:
+};
+
+class IllegalMove : public std::exception
+{
+public:
+};
+
+class BatchFailed : public std::exception
+{
+public:
+    BatchFailed(std::size_t index, std::exception_ptr reason)
+        : index_(index)
+        , reason_(reason)
+    {}
+
+    const char* what() const noexcept override { return "Command in batch failed"; }
+
+    // Position of the first command in the batch that could not be applied
+    std::size_t index() const { return index_; }
+    std::exception_ptr reason() const { return reason_; }
+
+private:
+    std::size_t index_;
+    std::exception_ptr reason_;
+};
+
+template <typename Error>
+void ensure(bool condition, Error err)
+{
+    if (!condition) {
+        throw err;
+    }
+}
+
+class Card {
+public:
+    enum class Kind {
+        Infantry,
+        Cavalry,
+        Artillery,
+        Wildcard,
+    };
+
+    Card(Kind kind)
+        : kind_(kind)
+    {}
+
+    auto kind() const { return kind_; }
+
+private:
+    Kind kind_;
+};
+
+class StateCodec;
+
+class Player {
+public:
+    using Id = int;
+    Player(Id id)
+        : id_(id)
+    {}
+    auto id() const { return id_; }
+    void give_units_to_place(std::size_t units) { units_left_to_place_ = units; }
+    void placed_unit();
+    std::size_t units() const { return units_left_to_place_; }
+
+    auto cards() const { return cards_; }
+    void give_card(Card card) { cards_.push_back(card); }
+    std::vector<Card> take_cards(std::array<std::size_t, 3> indices);
+    std::vector<Card> take_all_cards();
+private:
+    friend class StateCodec;
+
+    int id_;
+    std::size_t units_left_to_place_ = 0;
+    std::vector<Card> cards_;
+};
+
+class Territory {
+public:
+    using Id = int;
+
+    Territory(Id id)
+        : id_(id)
+    {}
+
+    auto id() const { return id_; }
+
+    std::optional<Player::Id> owner() const { return owner_; }
+    void owner(Player::Id id) { owner_ = id; }
+
+    std::size_t units() const { return units_; }
+    void add_units(std::size_t units) { units_ += units; }
+    void remove_units(std::size_t units);
+
+private:
+    friend class StateCodec;
+
+    Id id_;
+    std::string_view name_;
+    std::optional<Player::Id> owner_;
+    std::size_t units_ = 0;
+};
+
+class Board {
+public:
+    using Border = std::pair<Territory::Id, Territory::Id>;
+
+    Board() = default; // TODO: Remove
+    Board(std::vector<Territory> territories, std::vector<Border> borders = {});
+
+    auto territories() const { return territories_; }
+    auto borders() const { return borders_; }
+
+    bool adjacent(Territory::Id a, Territory::Id b) const;
+
+private:
+    friend class StateCodec;
+
+    std::vector<Territory> territories_;
+    std::vector<Border> borders_;
+};
+
+// The classic 42 territory map
+Board classic_board();
+
+// One card per territory, cycling through the three kinds, plus two wildcards
+std::vector<Card> classic_deck(const Board& board);
+
+enum class Phase {
+    Placing,
+    Reinforce,
+    TradeCards,
+    Attack,
+    Occupy,
+    Fortify,
+    GameOver,
+};
+
+constexpr std::size_t phase_count = static_cast<std::size_t>(Phase::GameOver) + 1;
+
+// A conquered territory waiting for the attacker to move units in
+struct Occupation {
+    Territory::Id from;
+    Territory::Id to;
+    std::size_t min_units;
+};
+
+// What has happened so far in the current player's turn
+struct Turn {
+    bool conquered = false;
+    std::optional<Occupation> occupation;
+};
+
+class State {
+public:
+    State(Board board, Phase phase, std::vector<Player> players, std::vector<Card> cards,
+          Turn turn = {}, std::size_t trades = 0)
+        : board_(board)
+        , phase_(phase)
+        , players_(players)
+        , cards_(cards)
+        , turn_(turn)
+        , trades_(trades)
+    {}
+
+    auto board() const { return board_; }
+    auto phase() const { return phase_; }
+    auto players() const { return players_; }
+    auto current_player() const { return players_.at(0); }
+    auto cards() const { return cards_; }
+    auto turn() const { return turn_; }
+    // Number of card sets traded in so far this game
+    auto trades() const { return trades_; }
+
+private:
+    friend class StateCodec;
+
+    Board board_;
+    Phase phase_;
+    std::vector<Player> players_;
+    std::vector<Card> cards_;
+    Turn turn_;
+    std::size_t trades_;
+};
+
+using Dice = std::function<int ()>;
+using OwnerChanged = std::function<void (Territory::Id, Player::Id)>;
+
+struct PlaceUnit {
+    Player::Id player;
+    Territory::Id territory;
+};
+
+struct TradeCards {
+    Player::Id player;
+    std::array<std::size_t, 3> cards;
+};
+
+struct Attack {
+    Player::Id player;
+    Territory::Id from;
+    Territory::Id to;
+    std::size_t dice;
+};
+
+struct Occupy {
+    Player::Id player;
+    std::size_t units;
+};
+
+struct Fortify {
+    Player::Id player;
+    Territory::Id from;
+    Territory::Id to;
+    std::size_t units;
+};
+
+struct EndPhase {
+    Player::Id player;
+};
+
+using Command = std::variant<PlaceUnit, TradeCards, Attack, Occupy, Fortify, EndPhase>;
+
+// Position of a command type in Command, for switching on Command::index()
+template <typename T>
+constexpr std::size_t command_index = Command{T{}}.index();
+
+// Commands accepted in each phase, indexed by Phase and Command::index()
+constexpr std::array<std::array<bool, std::variant_size_v<Command>>, phase_count> allowed_commands{{
+    // PlaceUnit TradeCards Attack Occupy Fortify EndPhase
+    {{ true,     false,     false, false, false,  false }}, // Placing
+    {{ true,     false,     false, false, false,  false }}, // Reinforce
+    {{ false,    true,      false, false, false,  true  }}, // TradeCards
+    {{ false,    false,     true,  false, false,  true  }}, // Attack
+    {{ false,    false,     false, true,  false,  false }}, // Occupy
+    {{ false,    false,     false, false, true,   true  }}, // Fortify
+    {{ false,    false,     false, false, false,  false }}, // GameOver
+}};
+
+// Phase entered on EndPhase. Ending the Fortify phase ends the turn.
+constexpr std::array<Phase, phase_count> phase_after_end{
+    Phase::Placing,
+    Phase::Reinforce,
+    Phase::Reinforce,
+    Phase::Fortify,
+    Phase::Occupy,
+    Phase::Reinforce,
+    Phase::GameOver,
+};
+
+constexpr bool command_allowed(Phase phase, std::size_t command_index)
+{
+    return allowed_commands[static_cast<std::size_t>(phase)][command_index];
+}
+
+}
+
+}
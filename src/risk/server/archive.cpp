@@ -0,0 +1,584 @@
+#include "risk/server/archive.h"
+
+#include "risk/rules/state.h"
+#include "risk/server/protocol.h"
+#include "risk/server/wal.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_set>
+
+namespace risk {
+
+namespace server {
+
+namespace {
+
+constexpr char segment_magic[8] = {'r', 'i', 's', 'k', 's', 'e', 'g', 'm'};
+constexpr char index_magic[8] = {'r', 'i', 's', 'k', 'i', 'n', 'd', 'x'};
+
+template <typename T>
+T get(const std::uint8_t* in)
+{
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value |= std::uint64_t{in[i]} << (8 * i);
+    }
+    return static_cast<T>(value);
+}
+
+template <typename T>
+void put(std::uint8_t* out, T value)
+{
+    const auto bits = static_cast<std::uint64_t>(value);
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        out[i] = static_cast<std::uint8_t>(bits >> (8 * i));
+    }
+}
+
+void write_all(int fd, const std::uint8_t* data, std::size_t size, std::uint64_t offset)
+{
+    for (std::size_t written = 0; written < size;) {
+        const auto count = ::pwrite(fd, data + written, size - written, static_cast<off_t>(offset + written));
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "pwrite");
+        }
+        written += static_cast<std::size_t>(count);
+    }
+}
+
+void read_at(int fd, std::uint8_t* out, std::size_t size, std::uint64_t offset)
+{
+    for (std::size_t read = 0; read < size;) {
+        const auto count = ::pread(fd, out + read, size - read, static_cast<off_t>(offset + read));
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(count < 0 ? errno : EIO, std::generic_category(), "pread");
+        }
+        read += static_cast<std::size_t>(count);
+    }
+}
+
+// Moves as Replay counts them: commands and deals
+std::uint32_t count_moves(const Buffer& events)
+{
+    rules::EventLog::Reader reader{events.data(), events.data(), events.data() + events.size()};
+    std::uint32_t moves = 0;
+    while (!reader.done()) {
+        switch (reader.peek()) {
+        case rules::EventLog::Event::Command:
+            reader.command();
+            ++moves;
+            break;
+        case rules::EventLog::Event::Deal:
+            reader.deal();
+            ++moves;
+            break;
+        case rules::EventLog::Event::Roll:
+            reader.roll();
+            break;
+        case rules::EventLog::Event::Hash:
+            reader.hash();
+            break;
+        }
+    }
+    return moves;
+}
+
+bool by_game(const Archive::Entry& a, const Archive::Entry& b)
+{
+    return a.game < b.game;
+}
+
+}
+
+Archive::Archive(const std::string& directory, std::uint64_t segment_size)
+    : directory_(directory)
+    , segment_size_(segment_size)
+{
+    std::unique_ptr<DIR, int (*)(DIR*)> dir{::opendir(directory.c_str()), ::closedir};
+    if (!dir) {
+        throw std::system_error(errno, std::generic_category(), "opendir " + directory);
+    }
+    const std::string suffix = ".segment";
+    std::vector<std::uint32_t> numbers;
+    while (const auto* entry = ::readdir(dir.get())) {
+        const std::string name = entry->d_name;
+        if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            numbers.push_back(static_cast<std::uint32_t>(std::stoul(name)));
+        }
+    }
+    std::sort(std::begin(numbers), std::end(numbers));
+    for (std::size_t i = 0; i < numbers.size(); ++i) {
+        rules::ensure(numbers[i] == i, std::runtime_error(directory + " is missing archive segments"));
+    }
+
+    if (numbers.empty()) {
+        open_segment(0);
+        return;
+    }
+
+    for (const auto number : numbers) {
+        FileDescriptor file{::open(path(number, ".segment").c_str(), O_RDWR | O_CLOEXEC)};
+        if (!file) {
+            throw std::system_error(errno, std::generic_category(), "open " + path(number, ".segment"));
+        }
+        segments_.push_back(std::move(file));
+    }
+
+    // Sealed segments are read through their index, which a crash while
+    // sealing may have left unwritten
+    const auto active = numbers.back();
+    for (std::uint32_t segment = 0; segment < active; ++segment) {
+        std::vector<Entry> entries;
+        if (!load_index(segment, entries)) {
+            entries = scan_segment(segment);
+            write_index(segment, entries);
+        }
+        index_.insert(std::end(index_), std::begin(entries), std::end(entries));
+    }
+    active_ = scan_segment(active);
+    index_.insert(std::end(index_), std::begin(active_), std::end(active_));
+
+    std::sort(std::begin(index_), std::end(index_), by_game);
+    index_.erase(
+        std::unique(std::begin(index_), std::end(index_), [] (const Entry& a, const Entry& b) { return a.game == b.game; }),
+        std::end(index_)
+    );
+}
+
+std::optional<Archive::Entry> Archive::find(std::uint64_t game) const
+{
+    const Entry key{game, 0, 0, 0, 0, 0, 0, 0, 0};
+    for (const auto* entries : {&index_, &recent_}) {
+        auto iter = std::lower_bound(std::begin(*entries), std::end(*entries), key, by_game);
+        if (iter != std::end(*entries) && iter->game == game) {
+            return *iter;
+        }
+    }
+    return std::nullopt;
+}
+
+std::vector<Archive::Entry> Archive::scan(std::uint64_t first, std::uint64_t last) const
+{
+    const Entry from{first, 0, 0, 0, 0, 0, 0, 0, 0};
+    const Entry to{last, 0, 0, 0, 0, 0, 0, 0, 0};
+    auto range = [&] (const std::vector<Entry>& entries) {
+        return std::make_pair(
+            std::lower_bound(std::begin(entries), std::end(entries), from, by_game),
+            std::upper_bound(std::begin(entries), std::end(entries), to, by_game)
+        );
+    };
+
+    std::vector<Entry> out;
+    if (first > last) {
+        return out;
+    }
+    const auto [index_first, index_last] = range(index_);
+    const auto [recent_first, recent_last] = range(recent_);
+    out.reserve((index_last - index_first) + (recent_last - recent_first));
+    std::merge(index_first, index_last, recent_first, recent_last, std::back_inserter(out), by_game);
+    return out;
+}
+
+void Archive::append(const std::vector<FinishedGame>& games)
+{
+    Buffer batch;
+    Buffer compressed;
+    std::vector<Entry> entries;
+    std::unordered_set<std::uint64_t> seen;
+    for (const auto& game : games) {
+        if (find(game.id) || !seen.insert(game.id).second) {
+            continue;
+        }
+
+        auto size = ::compressBound(static_cast<uLong>(game.events.size()));
+        compressed.resize(size);
+        const auto result = ::compress2(
+            compressed.data(), &size, game.events.data(), static_cast<uLong>(game.events.size()), Z_DEFAULT_COMPRESSION
+        );
+        rules::ensure(result == Z_OK, std::runtime_error("Could not compress a game's log"));
+
+        if (end_ + batch.size() + record_header_size + size > segment_size_ && (!active_.empty() || !entries.empty())) {
+            flush(batch, entries);
+            seal();
+        }
+
+        const auto start = batch.size();
+        batch.resize(start + record_header_size);
+        auto* out = batch.data() + start;
+        put(out + 4, static_cast<std::uint32_t>(size));
+        put(out + 8, game.id);
+        put(out + 16, static_cast<std::uint32_t>(game.events.size()));
+        const auto moves = count_moves(game.events);
+        put(out + 20, moves);
+        out[24] = game.players;
+        out[25] = game.winner;
+        out[26] = game.map;
+        out[27] = 0;
+        batch.insert(std::end(batch), compressed.data(), compressed.data() + size);
+        put(batch.data() + start, crc32(batch.data() + start + 4, record_header_size - 4 + size));
+
+        entries.push_back(Entry{
+            game.id, end_ + start + record_header_size, static_cast<std::uint32_t>(segments_.size() - 1),
+            static_cast<std::uint32_t>(size), static_cast<std::uint32_t>(game.events.size()), moves,
+            game.players, game.winner, game.map,
+        });
+    }
+    flush(batch, entries);
+}
+
+rules::EventLog Archive::load(const Entry& entry) const
+{
+    const auto damaged = std::runtime_error(path(entry.segment, ".segment") + " is damaged");
+    rules::ensure(entry.segment < segments_.size(), damaged);
+
+    Buffer record(record_header_size + entry.size);
+    read_at(segments_[entry.segment].get(), record.data(), record.size(), entry.offset - record_header_size);
+    rules::ensure(crc32(record.data() + 4, record.size() - 4) == get<std::uint32_t>(record.data()), damaged);
+
+    std::vector<std::uint8_t> events(entry.length);
+    auto length = static_cast<uLongf>(events.size());
+    const auto result = ::uncompress(
+        events.data(), &length, record.data() + record_header_size, static_cast<uLong>(entry.size)
+    );
+    rules::ensure(result == Z_OK && length == events.size(), damaged);
+    return rules::EventLog{std::move(events)};
+}
+
+std::string Archive::path(std::uint32_t segment, const char* suffix) const
+{
+    return directory_ + "/" + std::to_string(segment) + suffix;
+}
+
+void Archive::open_segment(std::uint32_t segment)
+{
+    const auto name = path(segment, ".segment");
+    FileDescriptor file{::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+    if (!file) {
+        throw std::system_error(errno, std::generic_category(), "open " + name);
+    }
+    std::uint8_t header[segment_header_size];
+    std::memcpy(header, segment_magic, sizeof(segment_magic));
+    put(header + 8, version);
+    put(header + 12, segment);
+    write_all(file.get(), header, sizeof(header), 0);
+    if (::fdatasync(file.get()) < 0) {
+        throw std::system_error(errno, std::generic_category(), "fdatasync " + name);
+    }
+    sync_directory(name);
+
+    segments_.push_back(std::move(file));
+    end_ = segment_header_size;
+}
+
+std::vector<Archive::Entry> Archive::scan_segment(std::uint32_t segment)
+{
+    const auto name = path(segment, ".segment");
+    const int fd = segments_[segment].get();
+    const auto bytes = read_all(fd);
+
+    // Created by a crash before its header was synced
+    if (bytes.size() < segment_header_size && segment + 1 == segments_.size()) {
+        segments_.pop_back();
+        open_segment(segment);
+        return {};
+    }
+    rules::ensure(
+        bytes.size() >= segment_header_size && std::memcmp(bytes.data(), segment_magic, sizeof(segment_magic)) == 0
+            && get<std::uint32_t>(bytes.data() + 12) == segment,
+        std::runtime_error(name + " is not an archive segment")
+    );
+    rules::ensure(get<std::uint32_t>(bytes.data() + 8) == version, std::runtime_error(name + " has an unsupported version"));
+
+    std::vector<Entry> entries;
+    std::uint64_t end = segment_header_size;
+    while (bytes.size() - end >= record_header_size) {
+        const auto* in = bytes.data() + end;
+        const auto size = get<std::uint32_t>(in + 4);
+        if (bytes.size() - end - record_header_size < size || crc32(in + 4, record_header_size - 4 + size) != get<std::uint32_t>(in)) {
+            break;
+        }
+        entries.push_back(Entry{
+            get<std::uint64_t>(in + 8), end + record_header_size, segment, size,
+            get<std::uint32_t>(in + 16), get<std::uint32_t>(in + 20), in[24], in[25], in[26],
+        });
+        end += record_header_size + size;
+    }
+
+    if (end < bytes.size()) {
+        if (::ftruncate(fd, static_cast<off_t>(end)) < 0) {
+            throw std::system_error(errno, std::generic_category(), "ftruncate " + name);
+        }
+    }
+    end_ = end;
+    return entries;
+}
+
+bool Archive::load_index(std::uint32_t segment, std::vector<Entry>& out) const
+{
+    FileDescriptor file{::open(path(segment, ".index").c_str(), O_RDONLY | O_CLOEXEC)};
+    if (!file) {
+        if (errno == ENOENT) {
+            return false;
+        }
+        throw std::system_error(errno, std::generic_category(), "open " + path(segment, ".index"));
+    }
+    const auto bytes = read_all(file.get());
+    if (bytes.size() < index_header_size + 4 || std::memcmp(bytes.data(), index_magic, sizeof(index_magic)) != 0
+        || get<std::uint32_t>(bytes.data() + 8) != version
+        || bytes.size() != index_header_size + std::size_t{get<std::uint32_t>(bytes.data() + 12)} * index_entry_size + 4
+        || crc32(bytes.data(), bytes.size() - 4) != get<std::uint32_t>(bytes.data() + bytes.size() - 4)) {
+        return false;
+    }
+
+    const auto count = get<std::uint32_t>(bytes.data() + 12);
+    out.reserve(out.size() + count);
+    for (std::uint32_t i = 0; i < count; ++i) {
+        const auto* in = bytes.data() + index_header_size + std::size_t{i} * index_entry_size;
+        out.push_back(Entry{
+            get<std::uint64_t>(in), get<std::uint64_t>(in + 8), segment, get<std::uint32_t>(in + 16),
+            get<std::uint32_t>(in + 20), get<std::uint32_t>(in + 24), in[28], in[29], in[30],
+        });
+    }
+    return true;
+}
+
+void Archive::write_index(std::uint32_t segment, const std::vector<Entry>& entries) const
+{
+    auto sorted = entries;
+    std::sort(std::begin(sorted), std::end(sorted), by_game);
+
+    Buffer bytes(index_header_size + sorted.size() * index_entry_size + 4);
+    std::memcpy(bytes.data(), index_magic, sizeof(index_magic));
+    put(bytes.data() + 8, version);
+    put(bytes.data() + 12, static_cast<std::uint32_t>(sorted.size()));
+    for (std::size_t i = 0; i < sorted.size(); ++i) {
+        const auto& entry = sorted[i];
+        auto* out = bytes.data() + index_header_size + i * index_entry_size;
+        put(out, entry.game);
+        put(out + 8, entry.offset);
+        put(out + 16, entry.size);
+        put(out + 20, entry.length);
+        put(out + 24, entry.moves);
+        out[28] = entry.players;
+        out[29] = entry.winner;
+        out[30] = entry.map;
+        out[31] = 0;
+    }
+    put(bytes.data() + bytes.size() - 4, crc32(bytes.data(), bytes.size() - 4));
+
+    // Put in place whole, or not at all
+    const auto name = path(segment, ".index");
+    const auto temporary = name + ".tmp";
+    FileDescriptor file{::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+    if (!file) {
+        throw std::system_error(errno, std::generic_category(), "open " + temporary);
+    }
+    write_all(file.get(), bytes.data(), bytes.size(), 0);
+    if (::fdatasync(file.get()) < 0) {
+        throw std::system_error(errno, std::generic_category(), "fdatasync " + temporary);
+    }
+    if (::rename(temporary.c_str(), name.c_str()) < 0) {
+        throw std::system_error(errno, std::generic_category(), "rename " + name);
+    }
+    sync_directory(name);
+}
+
+void Archive::seal()
+{
+    const auto segment = static_cast<std::uint32_t>(segments_.size() - 1);
+    write_index(segment, active_);
+    active_.clear();
+    open_segment(segment + 1);
+}
+
+void Archive::flush(Buffer& batch, std::vector<Entry>& entries)
+{
+    if (batch.empty()) {
+        return;
+    }
+    const auto& file = segments_.back();
+    write_all(file.get(), batch.data(), batch.size(), end_);
+    if (::fdatasync(file.get()) < 0) {
+        throw std::system_error(errno, std::generic_category(), "fdatasync " + path(static_cast<std::uint32_t>(segments_.size() - 1), ".segment"));
+    }
+    end_ += batch.size();
+    active_.insert(std::end(active_), std::begin(entries), std::end(entries));
+
+    std::sort(std::begin(entries), std::end(entries), by_game);
+    const auto middle = static_cast<std::ptrdiff_t>(recent_.size());
+    recent_.insert(std::end(recent_), std::begin(entries), std::end(entries));
+    std::inplace_merge(std::begin(recent_), std::begin(recent_) + middle, std::end(recent_), by_game);
+    if (recent_.size() > merge_after) {
+        const auto merged = static_cast<std::ptrdiff_t>(index_.size());
+        index_.insert(std::end(index_), std::begin(recent_), std::end(recent_));
+        std::inplace_merge(std::begin(index_), std::begin(index_) + merged, std::end(index_), by_game);
+        recent_.clear();
+    }
+    batch.clear();
+    entries.clear();
+}
+
+class Archiver::Acceptor : public EventLoop::Handler {
+public:
+    Acceptor(Archiver& archiver, FileDescriptor fd)
+        : archiver_(archiver)
+        , fd_(std::move(fd))
+    {
+        archiver_.loop_.add(fd_.get(), EPOLLIN, *this);
+    }
+
+    ~Acceptor() override { archiver_.loop_.remove(fd_.get()); }
+
+    void on_events(std::uint32_t) override { archiver_.accept(fd_.get()); }
+
+private:
+    Archiver& archiver_;
+    FileDescriptor fd_;
+};
+
+Archiver::Archiver(const std::string& directory, std::uint64_t segment_size)
+    : archive_(directory, segment_size)
+    , wakeup_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    if (!wakeup_) {
+        throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+    loop_.add(wakeup_.get(), EPOLLIN, *this);
+}
+
+Archiver::~Archiver()
+{
+    connections_.clear();
+    acceptors_.clear();
+    loop_.remove(wakeup_.get());
+}
+
+void Archiver::serve(FileDescriptor listener)
+{
+    acceptors_.push_back(std::make_unique<Acceptor>(*this, std::move(listener)));
+}
+
+void Archiver::run()
+{
+    loop_.run();
+    drain();
+}
+
+bool Archiver::submit(FinishedGame&& game)
+{
+    if (!queue_.try_push(std::move(game))) {
+        return false;
+    }
+    const std::uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(wakeup_.get(), &one, sizeof(one));
+    return true;
+}
+
+void Archiver::on_events(std::uint32_t)
+{
+    std::uint64_t value;
+    while (::read(wakeup_.get(), &value, sizeof(value)) > 0) {}
+    drain();
+}
+
+void Archiver::drain()
+{
+    queue_.drain([this] (FinishedGame&& game) { batch_.push_back(std::move(game)); });
+    if (batch_.empty()) {
+        return;
+    }
+    archive_.append(batch_);
+
+    std::lock_guard<std::mutex> lock{archived_mutex_};
+    for (const auto& game : batch_) {
+        if (archived_.size() <= game.shard) {
+            archived_.resize(game.shard + 1);
+        }
+        archived_[game.shard].push_back(game.id);
+    }
+    batch_.clear();
+}
+
+void Archiver::take_archived(std::size_t shard, std::vector<std::uint64_t>& games)
+{
+    std::lock_guard<std::mutex> lock{archived_mutex_};
+    if (shard < archived_.size()) {
+        games.insert(std::end(games), std::begin(archived_[shard]), std::end(archived_[shard]));
+        archived_[shard].clear();
+    }
+}
+
+void Archiver::accept(int listener)
+{
+    while (true) {
+        FileDescriptor fd{::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)};
+        if (!fd) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        const int client = fd.get();
+        connections_[client] = std::make_unique<Connection>(loop_, std::move(fd), static_cast<Connection::Listener&>(*this));
+    }
+}
+
+void Archiver::on_frame(Connection& connection, const std::uint8_t* frame, std::size_t size)
+{
+    reply_.clear();
+
+    Request request;
+    if (!decode_request(frame, size, request) || request.type != Frame::Replay) {
+        encode_error(reply_, 0, ErrorCode::BadRequest);
+        connection.send(reply_);
+        return;
+    }
+    const auto entry = archive_.find(request.game);
+    if (!entry) {
+        encode_error(reply_, request.game, ErrorCode::NoSuchGame);
+        connection.send(reply_);
+        return;
+    }
+
+    encode_archived(
+        reply_, entry->game,
+        ArchivedGame{entry->size, entry->length, entry->moves, entry->players, entry->winner, entry->map}
+    );
+    // Only the frame headers are built here, the log is sent from the file
+    for (std::uint32_t sent = 0; sent < entry->size;) {
+        const auto part = static_cast<std::uint32_t>(std::min<std::size_t>(entry->size - sent, max_payload));
+        encode_log_header(reply_, entry->game, part);
+        connection.send(reply_);
+        connection.send_file(archive_.file(*entry), entry->offset + sent, part);
+        reply_.clear();
+        sent += part;
+    }
+}
+
+void Archiver::on_close(Connection& connection)
+{
+    connections_.erase(connection.fd());
+}
+
+}
+
+}
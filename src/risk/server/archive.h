@@ -0,0 +1,186 @@
+#pragma once
+
+#include "risk/rules/event_log.h"
+#include "risk/server/buffer_pool.h"
+#include "risk/server/connection.h"
+#include "risk/server/event_loop.h"
+#include "risk/server/mpsc_queue.h"
+#include "risk/server/socket.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+// A game that ended, on its way to the archive
+struct FinishedGame {
+    std::uint64_t id = 0;
+    std::uint8_t players = 0;
+    std::uint8_t winner = 0;
+    std::uint8_t map = 0;
+    // Its whole rules::EventLog
+    Buffer events;
+    // That handed it over, to be told once it is archived
+    std::uint32_t shard = 0;
+};
+
+// Finished games, kept for good in a directory of append-only segment
+// files. Each game's event log is compressed with zlib and appended to
+// the newest segment, and once a segment is full it is sealed with an
+// index file of its games sorted by id, so that opening the archive
+// reads the indexes instead of the logs. The index of every game is held
+// in memory, sorted, so a lookup or a scan over a range of ids is a
+// binary search away.
+//
+// A segment `<n>.segment` starts with the magic "risksegm", u32 version
+// and u32 n. A game is a CRC-32 of the rest of it, then u32 compressed
+// size, u64 game id, u32 log length, u32 moves, u8 players, u8 winner,
+// u8 map, u8 zero and the compressed log. Games are only written once
+// the ones before them are durable, and a game cut short by a crash is
+// cut off when the segment is opened again.
+//
+// An index `<n>.index` starts with the magic "riskindx", u32 version and
+// u32 games, followed by each game's u64 id, u64 offset of its log, u32
+// compressed size, u32 log length, u32 moves, u8 players, u8 winner, u8
+// map and u8 zero, and ends with a CRC-32 of what comes before it.
+// Integers are LE.
+class Archive {
+public:
+    static constexpr std::uint32_t version = 1;
+    static constexpr std::uint8_t classic_map = 0;
+    static constexpr std::uint64_t default_segment_size = 64 * 1024 * 1024;
+
+    struct Entry {
+        std::uint64_t game;
+        // Of the compressed log in its segment
+        std::uint64_t offset;
+        std::uint32_t segment;
+        std::uint32_t size;
+        // Of the log uncompressed
+        std::uint32_t length;
+        std::uint32_t moves;
+        std::uint8_t players;
+        std::uint8_t winner;
+        std::uint8_t map;
+    };
+
+    // Opens the archive in `directory`, starting one if it is empty. A
+    // segment is sealed once it holds `segment_size` bytes.
+    explicit Archive(const std::string& directory, std::uint64_t segment_size = default_segment_size);
+
+    Archive(const Archive&) = delete;
+    Archive& operator=(const Archive&) = delete;
+
+    std::size_t games() const { return index_.size() + recent_.size(); }
+    std::optional<Entry> find(std::uint64_t game) const;
+    // The games with ids from `first` to `last`, in order
+    std::vector<Entry> scan(std::uint64_t first, std::uint64_t last) const;
+
+    // Writes the games not archived yet and syncs them
+    void append(const std::vector<FinishedGame>& games);
+
+    // The game's event log. A damaged one is a std::runtime_error.
+    rules::EventLog load(const Entry& entry) const;
+    // The segment file holding the game's compressed log, `size` bytes
+    // from `offset`, for sending it as it is. Open as long as the archive.
+    int file(const Entry& entry) const { return segments_[entry.segment].get(); }
+
+private:
+    static constexpr std::size_t segment_header_size = 16;
+    static constexpr std::size_t record_header_size = 28;
+    static constexpr std::size_t index_header_size = 16;
+    static constexpr std::size_t index_entry_size = 32;
+    // Recent games beyond this many are merged into the index
+    static constexpr std::size_t merge_after = 4096;
+
+    std::string path(std::uint32_t segment, const char* suffix) const;
+    void open_segment(std::uint32_t segment);
+    // The games in the segment, which is cut short after the last whole one
+    std::vector<Entry> scan_segment(std::uint32_t segment);
+    bool load_index(std::uint32_t segment, std::vector<Entry>& out) const;
+    void write_index(std::uint32_t segment, const std::vector<Entry>& entries) const;
+    void seal();
+    // Writes and syncs the batch, then indexes its games
+    void flush(Buffer& batch, std::vector<Entry>& entries);
+
+    const std::string directory_;
+    const std::uint64_t segment_size_;
+    // Indexed by segment number
+    std::vector<FileDescriptor> segments_;
+    std::uint64_t end_ = 0;
+    // Of the segment being appended to, for its index once it is sealed
+    std::vector<Entry> active_;
+
+    std::vector<Entry> index_;
+    // Games archived since the last merge, kept apart so an append does
+    // not move the whole index
+    std::vector<Entry> recent_;
+};
+
+// Runs an Archive on a thread of its own, so that compressing and syncing
+// finished games keeps off the shards. Games are handed over through a
+// bounded queue.
+//
+// The same thread serves downloads of archived games on listening sockets
+// of their own. A connection sends Replay requests and is answered with
+// an Error of NoSuchGame, or an Archived frame followed by the game's
+// compressed log in Log frames. The log goes from the segment file to the
+// socket with sendfile, as it is stored.
+class Archiver : private EventLoop::Handler, private Connection::Listener {
+public:
+    explicit Archiver(const std::string& directory, std::uint64_t segment_size = Archive::default_segment_size);
+    ~Archiver() override;
+
+    EventLoop& loop() { return loop_; }
+    // Only safe while the loop is not running
+    const Archive& archive() const { return archive_; }
+
+    // Serves downloads on `listener` once the loop runs. Only safe while
+    // the loop is not running.
+    void serve(FileDescriptor listener);
+
+    // Runs the loop until it is stopped, then archives what is left
+    void run();
+
+    // From any thread. Returns false, leaving `game` as it was, when the
+    // queue is full.
+    bool submit(FinishedGame&& game);
+
+    // From any thread. Adds the ids of the games `shard` submitted that
+    // were archived and synced since the last call to `games`.
+    void take_archived(std::size_t shard, std::vector<std::uint64_t>& games);
+
+private:
+    static constexpr std::size_t queue_capacity = 4096;
+
+    class Acceptor;
+
+    void on_events(std::uint32_t events) override;
+    void drain();
+    void accept(int listener);
+    void on_frame(Connection& connection, const std::uint8_t* frame, std::size_t size) override;
+    void on_close(Connection& connection) override;
+
+    Archive archive_;
+    EventLoop loop_;
+    FileDescriptor wakeup_;
+    MpscQueue<FinishedGame> queue_{queue_capacity};
+    std::vector<FinishedGame> batch_;
+    std::mutex archived_mutex_;
+    // Indexed by shard
+    std::vector<std::vector<std::uint64_t>> archived_;
+    std::vector<std::unique_ptr<Acceptor>> acceptors_;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+    std::vector<std::uint8_t> reply_;
+};
+
+}
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+using Buffer = std::vector<std::uint8_t>;
+
+// Recycles send buffers so encoding a frame reuses capacity instead of
+// allocating. Not thread safe; each shard has its own.
+class BufferPool {
+public:
+    // An empty buffer, with whatever capacity it had before
+    Buffer acquire()
+    {
+        if (free_.empty()) {
+            return {};
+        }
+        auto buffer = std::move(free_.back());
+        free_.pop_back();
+        return buffer;
+    }
+
+    void release(Buffer buffer)
+    {
+        if (free_.size() < max_buffers && buffer.capacity() <= max_capacity) {
+            buffer.clear();
+            free_.push_back(std::move(buffer));
+        }
+    }
+
+private:
+    static constexpr std::size_t max_buffers = 1024;
+    static constexpr std::size_t max_capacity = 64 * 1024;
+
+    std::vector<Buffer> free_;
+};
+
+}
+
+}
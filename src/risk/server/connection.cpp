@@ -0,0 +1,273 @@
+#include "risk/server/connection.h"
+
+#include "risk/server/protocol.h"
+
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+
+namespace risk {
+
+namespace server {
+
+Connection::Connection(EventLoop& loop, FileDescriptor fd, Listener& listener)
+    : loop_(loop)
+    , fd_(std::move(fd))
+    , listener_(listener)
+{
+    set_nonblocking(fd_.get());
+    loop_.add(fd_.get(), EPOLLIN | EPOLLOUT | EPOLLRDHUP, *this);
+}
+
+Connection::~Connection()
+{
+    if (fd_) {
+        loop_.remove(fd_.get());
+    }
+}
+
+void Connection::send(const std::uint8_t* data, std::size_t size)
+{
+    if (closed_) {
+        return;
+    }
+
+    // Nothing queued, so try the socket before copying anything
+    const auto written = output_.empty() ? write(data, size) : 0;
+    if (written < size && !closed_) {
+        output_.push_back(Chunk{std::make_shared<const std::vector<std::uint8_t>>(data + written, data + size), 0});
+        pending_ += size - written;
+    }
+}
+
+void Connection::send(SharedBuffer data)
+{
+    if (closed_) {
+        return;
+    }
+
+    const auto written = output_.empty() ? write(data->data(), data->size()) : 0;
+    if (written < data->size() && !closed_) {
+        pending_ += data->size() - written;
+        output_.push_back(Chunk{std::move(data), written});
+    }
+}
+
+void Connection::send_file(int file, std::uint64_t offset, std::size_t size)
+{
+    if (closed_) {
+        return;
+    }
+
+    const auto written = output_.empty() ? write_file(file, offset, size) : 0;
+    if (written < size && !closed_) {
+        pending_ += size - written;
+        output_.push_back(Chunk{nullptr, static_cast<std::size_t>(offset + written), file, size - written});
+    }
+}
+
+std::size_t Connection::write(const std::uint8_t* data, std::size_t size)
+{
+    std::size_t written = 0;
+    while (written < size) {
+        const auto count = ::send(fd_.get(), data + written, size - written, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close();
+            }
+            break;
+        }
+        written += count;
+    }
+    return written;
+}
+
+std::size_t Connection::write_file(int file, std::uint64_t offset, std::size_t size)
+{
+    auto position = static_cast<off_t>(offset);
+    std::size_t written = 0;
+    while (written < size) {
+        const auto count = ::sendfile(fd_.get(), file, &position, size - written);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            // The file ending early is as much an error as the socket failing
+            if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                close();
+            }
+            break;
+        }
+        written += count;
+    }
+    return written;
+}
+
+void Connection::close()
+{
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    loop_.remove(fd_.get());
+    ::shutdown(fd_.get(), SHUT_RDWR);
+    loop_.defer([this] { listener_.on_close(*this); });
+}
+
+FileDescriptor Connection::release()
+{
+    if (closed_) {
+        return {};
+    }
+    closed_ = true;
+    loop_.remove(fd_.get());
+    output_.clear();
+    pending_ = 0;
+    return std::move(fd_);
+}
+
+void Connection::on_events(std::uint32_t events)
+{
+    if (events & EPOLLOUT) {
+        flush();
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        read();
+    }
+}
+
+void Connection::read()
+{
+    // Complete frames are decoded straight from this buffer. Only a
+    // trailing partial frame is copied into input_.
+    thread_local std::array<std::uint8_t, 64 * 1024> buffer;
+
+    while (!closed_) {
+        const auto count = ::read(fd_.get(), buffer.data(), buffer.size());
+        if (count == 0) {
+            close();
+            return;
+        }
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close();
+            }
+            return;
+        }
+
+        const auto* data = buffer.data();
+        auto size = static_cast<std::size_t>(count);
+
+        // Top up the partial frame, first until its length is known
+        if (!input_.empty()) {
+            if (input_.size() < length_size) {
+                const auto take = std::min(size, length_size - input_.size());
+                input_.insert(std::end(input_), data, data + take);
+                data += take;
+                size -= take;
+            }
+            if (input_.size() >= length_size) {
+                const auto needed = length_size + (input_[0] | std::size_t{input_[1]} << 8);
+                const auto take = std::min(size, needed - input_.size());
+                input_.insert(std::end(input_), data, data + take);
+                data += take;
+                size -= take;
+
+                if (input_.size() == needed) {
+                    listener_.on_frame(*this, input_.data() + length_size, needed - length_size);
+                    input_.clear();
+                }
+            }
+            if (!input_.empty()) {
+                continue;
+            }
+        }
+
+        const auto used = dispatch(data, size);
+        input_.insert(std::end(input_), data + used, data + size);
+    }
+}
+
+std::size_t Connection::dispatch(const std::uint8_t* data, std::size_t size)
+{
+    std::size_t offset = 0;
+    while (!closed_ && size - offset >= length_size) {
+        const std::size_t length = data[offset] | std::size_t{data[offset + 1]} << 8;
+        if (size - offset - length_size < length) {
+            break;
+        }
+        listener_.on_frame(*this, data + offset + length_size, length);
+        offset += length_size + length;
+    }
+    return offset;
+}
+
+void Connection::flush()
+{
+    std::array<iovec, 64> vectors;
+
+    std::size_t done = 0;
+    while (done < output_.size() && !closed_) {
+        if (output_[done].file >= 0) {
+            auto& chunk = output_[done];
+            const auto written = write_file(chunk.file, chunk.offset, chunk.size);
+            pending_ -= written;
+            if (written < chunk.size) {
+                chunk.offset += written;
+                chunk.size -= written;
+                break;
+            }
+            ++done;
+            continue;
+        }
+
+        // Gather as many queued chunks as one writev takes, up to a file
+        std::size_t count = 0;
+        for (auto i = done; i < output_.size() && output_[i].file < 0 && count < vectors.size(); ++i, ++count) {
+            const auto& chunk = output_[i];
+            vectors[count].iov_base = const_cast<std::uint8_t*>(chunk.data->data() + chunk.offset);
+            vectors[count].iov_len = chunk.data->size() - chunk.offset;
+        }
+
+        auto written = ::writev(fd_.get(), vectors.data(), static_cast<int>(count));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close();
+            }
+            break;
+        }
+
+        pending_ -= written;
+        while (written > 0) {
+            auto& chunk = output_[done];
+            const auto left = chunk.data->size() - chunk.offset;
+            if (static_cast<std::size_t>(written) < left) {
+                chunk.offset += written;
+                break;
+            }
+            written -= left;
+            ++done;
+        }
+    }
+
+    output_.erase(std::begin(output_), std::begin(output_) + done);
+}
+
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "risk/server/event_loop.h"
+#include "risk/server/socket.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+// Frames encoded once and shared by every connection they are sent to
+using SharedBuffer = std::shared_ptr<const std::vector<std::uint8_t>>;
+
+// A non-blocking stream socket that splits its input into frames with a
+// little-endian u16 length prefix. Output the socket does not take right
+// away is queued, shared buffers by reference, and written with writev.
+// Ranges of files are queued as they are and sent with sendfile, so their
+// bytes never pass through user space.
+class Connection : public EventLoop::Handler {
+public:
+    class Listener {
+    public:
+        virtual ~Listener() = default;
+        // `frame` holds the bytes after the length prefix and is only
+        // valid during the call
+        virtual void on_frame(Connection& connection, const std::uint8_t* frame, std::size_t size) = 0;
+        // Called once, from a deferred task, after the socket was closed
+        virtual void on_close(Connection& connection) = 0;
+    };
+
+    Connection(EventLoop& loop, FileDescriptor fd, Listener& listener);
+    ~Connection() override;
+
+    int fd() const { return fd_.get(); }
+    bool closed() const { return closed_; }
+
+    // Bytes waiting for the socket to become writable
+    std::size_t pending() const { return pending_; }
+
+    // Writes what the socket takes right away and copies the rest
+    void send(const std::uint8_t* data, std::size_t size);
+    void send(const std::vector<std::uint8_t>& data) { send(data.data(), data.size()); }
+    // Writes what the socket takes right away and keeps a reference to
+    // the buffer for the rest
+    void send(SharedBuffer data);
+    // Sends `size` bytes of `file` from `offset` once what is queued
+    // before them is sent. The file must stay open until then.
+    void send_file(int file, std::uint64_t offset, std::size_t size);
+    void close();
+    // Stops serving the socket and hands it over, to be served by another
+    // loop. Whatever is queued is dropped, and on_close is never called.
+    FileDescriptor release();
+
+    void on_events(std::uint32_t events) override;
+
+private:
+    void read();
+    // Hands out every complete frame in [data, data + size) and returns
+    // how many bytes they took
+    std::size_t dispatch(const std::uint8_t* data, std::size_t size);
+    // Writes from [data, data + size) until the socket would block and
+    // returns how many bytes it took, after closing on errors
+    std::size_t write(const std::uint8_t* data, std::size_t size);
+    // The same for a range of a file
+    std::size_t write_file(int file, std::uint64_t offset, std::size_t size);
+    void flush();
+
+    EventLoop& loop_;
+    FileDescriptor fd_;
+    Listener& listener_;
+    bool closed_ = false;
+
+    // A partial frame left over from the last read
+    std::vector<std::uint8_t> input_;
+    struct Chunk {
+        SharedBuffer data;
+        std::size_t offset;
+        // A range of this file instead of data, from offset
+        int file = -1;
+        std::size_t size = 0;
+    };
+
+    std::vector<Chunk> output_;
+    std::size_t pending_ = 0;
+};
+
+}
+
+}
@@ -0,0 +1,403 @@
+#include "risk/server/disk_io.h"
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+namespace {
+
+FileDescriptor make_eventfd()
+{
+    FileDescriptor fd{::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)};
+    if (!fd) {
+        throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+    return fd;
+}
+
+void drain_eventfd(int fd)
+{
+    std::uint64_t value;
+    while (::read(fd, &value, sizeof(value)) > 0) {}
+}
+
+class Mapping {
+public:
+    Mapping(int fd, std::size_t size, off_t offset)
+        : size_(size)
+        , address_(::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset))
+    {
+        if (address_ == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        }
+    }
+
+    ~Mapping() { ::munmap(address_, size_); }
+
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+
+    template <typename T>
+    T* at(std::size_t offset) const { return reinterpret_cast<T*>(static_cast<char*>(address_) + offset); }
+
+private:
+    std::size_t size_;
+    void* address_;
+};
+
+// An io_uring instance driven through the raw system calls. Each write
+// takes two entries, the write and an fdatasync linked to it. Writes
+// that do not fit in the ring wait in a queue of their own.
+class UringIo : public DiskIo {
+public:
+    UringIo()
+        : ring_(setup(params_))
+        , ready_(make_eventfd())
+        , sq_(ring_.get(), params_.sq_off.array + params_.sq_entries * sizeof(unsigned), IORING_OFF_SQ_RING)
+        , cq_(ring_.get(), params_.cq_off.cqes + params_.cq_entries * sizeof(io_uring_cqe), IORING_OFF_CQ_RING)
+        , sqes_(ring_.get(), params_.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES)
+    {
+        const int fd = ready_.get();
+        if (::syscall(__NR_io_uring_register, ring_.get(), IORING_REGISTER_EVENTFD, &fd, 1) < 0) {
+            throw std::system_error(errno, std::generic_category(), "io_uring_register");
+        }
+    }
+
+    ~UringIo() override
+    {
+        // The kernel may still be using the buffers
+        while (in_flight_ > 0) {
+            if (::syscall(__NR_io_uring_enter, ring_.get(), 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0
+                && errno != EINTR) {
+                break;
+            }
+            auto* head = cq_.at<unsigned>(params_.cq_off.head);
+            const auto tail = __atomic_load_n(cq_.at<unsigned>(params_.cq_off.tail), __ATOMIC_ACQUIRE);
+            in_flight_ -= std::min<std::size_t>(in_flight_, tail - *head);
+            __atomic_store_n(head, tail, __ATOMIC_RELEASE);
+        }
+    }
+
+    const char* name() const override { return "io_uring"; }
+
+    void write_and_sync(int fd, std::uint64_t offset, Buffer data, Done done) override
+    {
+        std::size_t slot;
+        if (free_.empty()) {
+            slot = writes_.size();
+            writes_.emplace_back();
+        } else {
+            slot = free_.back();
+            free_.pop_back();
+        }
+        writes_[slot] = Write{fd, offset, std::move(data), 0, std::move(done), 0, 0, false};
+
+        queued_.push_back(slot);
+        submit_queued();
+    }
+
+    int ready_fd() const override { return ready_.get(); }
+
+    void reap() override
+    {
+        drain_eventfd(ready_.get());
+
+        auto* head = cq_.at<unsigned>(params_.cq_off.head);
+        const auto mask = *cq_.at<unsigned>(params_.cq_off.ring_mask);
+        const auto* cqes = cq_.at<io_uring_cqe>(params_.cq_off.cqes);
+        for (;;) {
+            const auto tail = __atomic_load_n(cq_.at<unsigned>(params_.cq_off.tail), __ATOMIC_ACQUIRE);
+            if (*head == tail) {
+                break;
+            }
+            const auto cqe = cqes[*head & mask];
+            __atomic_store_n(head, *head + 1, __ATOMIC_RELEASE);
+            --in_flight_;
+            complete(cqe.user_data, cqe.res);
+        }
+        submit_queued();
+    }
+
+private:
+    struct Write {
+        int fd;
+        std::uint64_t offset;
+        Buffer data;
+        std::size_t written;
+        Done done;
+        int error;
+        unsigned outstanding;
+        bool synced;
+    };
+
+    static FileDescriptor setup(io_uring_params& params)
+    {
+        params = io_uring_params{};
+        FileDescriptor ring{static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params))};
+        if (!ring) {
+            throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+        }
+        return ring;
+    }
+
+    void submit_queued()
+    {
+        unsigned submitted = 0;
+        while (!queued_.empty() && in_flight_ + 2 <= params_.sq_entries) {
+            prepare(queued_.front());
+            queued_.pop_front();
+            submitted += 2;
+        }
+        if (submitted == 0) {
+            return;
+        }
+
+        __atomic_store_n(sq_.at<unsigned>(params_.sq_off.tail), sq_tail_, __ATOMIC_RELEASE);
+        while (::syscall(__NR_io_uring_enter, ring_.get(), submitted, 0, 0, nullptr, 0) < 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+            }
+        }
+    }
+
+    // The rest of the write, then the sync once it succeeded
+    void prepare(std::size_t slot)
+    {
+        auto& write = writes_[slot];
+
+        auto* sqe = next_sqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = write.fd;
+        sqe->addr = reinterpret_cast<std::uint64_t>(write.data.data() + write.written);
+        sqe->len = static_cast<std::uint32_t>(write.data.size() - write.written);
+        sqe->off = write.offset + write.written;
+        sqe->user_data = slot << 1;
+
+        sqe = next_sqe();
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = write.fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = slot << 1 | 1;
+
+        write.outstanding = 2;
+        in_flight_ += 2;
+    }
+
+    io_uring_sqe* next_sqe()
+    {
+        const auto mask = *sq_.at<unsigned>(params_.sq_off.ring_mask);
+        const auto index = sq_tail_++ & mask;
+        sq_.at<unsigned>(params_.sq_off.array)[index] = index;
+
+        auto* sqe = sqes_.at<io_uring_sqe>(0) + index;
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    void complete(std::uint64_t user_data, int result)
+    {
+        const auto slot = static_cast<std::size_t>(user_data >> 1);
+        auto& write = writes_[slot];
+
+        if (user_data & 1) {
+            // Cancelled when a short write broke the link
+            if (result == 0) {
+                write.synced = true;
+            } else if (result != -ECANCELED) {
+                write.error = -result;
+            }
+        } else if (result < 0) {
+            write.error = -result;
+        } else {
+            write.written += static_cast<std::size_t>(result);
+        }
+
+        if (--write.outstanding > 0) {
+            return;
+        }
+        if (write.error != 0) {
+            throw std::system_error(write.error, std::generic_category(), "io_uring write");
+        }
+        if (write.written < write.data.size() || !write.synced) {
+            queued_.push_front(slot);
+            return;
+        }
+
+        auto data = std::move(write.data);
+        auto done = std::move(write.done);
+        write = Write{};
+        free_.push_back(slot);
+        done(std::move(data));
+    }
+
+    static constexpr unsigned entries = 64;
+
+    io_uring_params params_{};
+    FileDescriptor ring_;
+    FileDescriptor ready_;
+    Mapping sq_;
+    Mapping cq_;
+    Mapping sqes_;
+    unsigned sq_tail_ = 0;
+    // Entries submitted and not completed, which the ring must have room for
+    std::size_t in_flight_ = 0;
+
+    std::vector<Write> writes_;
+    std::vector<std::size_t> free_;
+    std::deque<std::size_t> queued_;
+};
+
+// pwrite and fdatasync on a few threads of its own
+class ThreadIo : public DiskIo {
+public:
+    explicit ThreadIo(std::size_t threads)
+        : ready_(make_eventfd())
+    {
+        for (std::size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this] { work(); });
+        }
+    }
+
+    ~ThreadIo() override
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            stopping_ = true;
+        }
+        queued_changed_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    const char* name() const override { return "threads"; }
+
+    void write_and_sync(int fd, std::uint64_t offset, Buffer data, Done done) override
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            queued_.push_back(Job{fd, offset, std::move(data), std::move(done), 0});
+        }
+        queued_changed_.notify_one();
+    }
+
+    int ready_fd() const override { return ready_.get(); }
+
+    void reap() override
+    {
+        drain_eventfd(ready_.get());
+
+        std::vector<Job> finished;
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            finished.swap(finished_);
+        }
+        for (auto& job : finished) {
+            if (job.error != 0) {
+                throw std::system_error(job.error, std::generic_category(), "write");
+            }
+            job.done(std::move(job.data));
+        }
+    }
+
+private:
+    struct Job {
+        int fd;
+        std::uint64_t offset;
+        Buffer data;
+        Done done;
+        int error;
+    };
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        for (;;) {
+            queued_changed_.wait(lock, [this] { return stopping_ || !queued_.empty(); });
+            if (queued_.empty()) {
+                return;
+            }
+            auto job = std::move(queued_.front());
+            queued_.pop_front();
+            lock.unlock();
+
+            std::size_t written = 0;
+            while (written < job.data.size() && job.error == 0) {
+                const auto count = ::pwrite(
+                    job.fd, job.data.data() + written, job.data.size() - written,
+                    static_cast<off_t>(job.offset + written)
+                );
+                if (count >= 0) {
+                    written += static_cast<std::size_t>(count);
+                } else if (errno != EINTR) {
+                    job.error = errno;
+                }
+            }
+            if (job.error == 0 && ::fdatasync(job.fd) < 0) {
+                job.error = errno;
+            }
+
+            lock.lock();
+            finished_.push_back(std::move(job));
+            const std::uint64_t one = 1;
+            [[maybe_unused]] auto signalled = ::write(ready_.get(), &one, sizeof(one));
+        }
+    }
+
+    FileDescriptor ready_;
+    std::mutex mutex_;
+    std::condition_variable queued_changed_;
+    std::deque<Job> queued_;
+    std::vector<Job> finished_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+}
+
+std::unique_ptr<DiskIo> DiskIo::create(Backend backend)
+{
+    if (backend != Backend::Threads) {
+        try {
+            return std::make_unique<UringIo>();
+        } catch (const std::system_error&) {
+            if (backend == Backend::Uring) {
+                throw;
+            }
+        }
+    }
+    return std::make_unique<ThreadIo>(2);
+}
+
+void DiskIo::wait()
+{
+    pollfd ready{ready_fd(), POLLIN, 0};
+    while (::poll(&ready, 1, -1) < 0) {
+        if (errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "poll");
+        }
+    }
+    reap();
+}
+
+}
+
+}
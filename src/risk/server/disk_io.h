@@ -0,0 +1,53 @@
+#pragma once
+
+#include "risk/server/buffer_pool.h"
+#include "risk/server/socket.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace risk {
+
+namespace server {
+
+// Durable file writes that never block the calling thread. A write is
+// handed over with its buffer, and once the data is written and synced
+// its callback runs on the calling thread from reap, which is meant to be
+// called whenever ready_fd is readable. Any failure is thrown from reap
+// as std::system_error.
+//
+// The io_uring backend submits each write linked to an fdatasync, so
+// both go to the kernel in one system call. Where io_uring is not
+// available, a pool of threads does the same with pwrite and fdatasync.
+class DiskIo {
+public:
+    enum class Backend {
+        Automatic, // io_uring if the kernel allows it, otherwise threads
+        Uring,
+        Threads,
+    };
+
+    // Gets the buffer back once the write is durable
+    using Done = std::function<void (Buffer data)>;
+
+    static std::unique_ptr<DiskIo> create(Backend backend = Backend::Automatic);
+
+    virtual ~DiskIo() = default;
+
+    virtual const char* name() const = 0;
+
+    // Writes all of `data` at `offset` in `fd`, then syncs the file's data
+    virtual void write_and_sync(int fd, std::uint64_t offset, Buffer data, Done done) = 0;
+
+    // Readable when reap has callbacks to run
+    virtual int ready_fd() const = 0;
+    virtual void reap() = 0;
+
+    // Blocks until ready_fd is readable, then reaps
+    void wait();
+};
+
+}
+
+}
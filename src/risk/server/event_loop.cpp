@@ -0,0 +1,94 @@
+#include "risk/server/event_loop.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <system_error>
+
+namespace risk {
+
+namespace server {
+
+EventLoop::EventLoop()
+    : epoll_(::epoll_create1(EPOLL_CLOEXEC))
+    , wakeup_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    if (!epoll_ || !wakeup_) {
+        throw std::system_error(errno, std::generic_category(), "epoll");
+    }
+
+    // The wakeup descriptor is the only one registered without a handler
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (::epoll_ctl(epoll_.get(), EPOLL_CTL_ADD, wakeup_.get(), &event) < 0) {
+        throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+    }
+}
+
+void EventLoop::add(int fd, std::uint32_t events, Handler& handler)
+{
+    epoll_event event{};
+    event.events = events | EPOLLET;
+    event.data.ptr = &handler;
+    if (::epoll_ctl(epoll_.get(), EPOLL_CTL_ADD, fd, &event) < 0) {
+        throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+    }
+}
+
+void EventLoop::remove(int fd)
+{
+    ::epoll_ctl(epoll_.get(), EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void EventLoop::run()
+{
+    std::array<epoll_event, 256> events;
+
+    while (!stopped_.load(std::memory_order_relaxed)) {
+        const int count = ::epoll_wait(epoll_.get(), events.data(), events.size(), -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "epoll_wait");
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (auto* handler = static_cast<Handler*>(events[i].data.ptr)) {
+                handler->on_events(events[i].events);
+            } else {
+                std::uint64_t value;
+                while (::read(wakeup_.get(), &value, sizeof(value)) > 0) {}
+            }
+        }
+
+        // Tasks may defer more tasks
+        while (!deferred_.empty()) {
+            auto tasks = std::move(deferred_);
+            deferred_.clear();
+            for (auto& task : tasks) {
+                task();
+            }
+        }
+    }
+}
+
+void EventLoop::stop()
+{
+    stopped_.store(true, std::memory_order_relaxed);
+    wake();
+}
+
+void EventLoop::wake()
+{
+    const std::uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(wakeup_.get(), &one, sizeof(one));
+}
+
+}
+
+}
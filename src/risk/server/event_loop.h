@@ -0,0 +1,51 @@
+#pragma once
+
+#include "risk/server/socket.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+// A single-threaded epoll loop. File descriptors are registered
+// edge-triggered, so handlers must drain them until EAGAIN.
+class EventLoop {
+public:
+    class Handler {
+    public:
+        virtual ~Handler() = default;
+        virtual void on_events(std::uint32_t events) = 0;
+    };
+
+    EventLoop();
+
+    // EPOLLET is added to `events`
+    void add(int fd, std::uint32_t events, Handler& handler);
+    void remove(int fd);
+
+    // Dispatches events until stop is called
+    void run();
+
+    // Safe to call from any thread or a signal handler
+    void stop();
+
+    // Runs `task` once the current batch of events has been dispatched,
+    // so a handler can safely destroy itself or its peers
+    void defer(std::function<void ()> task) { deferred_.push_back(std::move(task)); }
+
+private:
+    void wake();
+
+    FileDescriptor epoll_;
+    FileDescriptor wakeup_;
+    std::atomic<bool> stopped_{false};
+    std::vector<std::function<void ()>> deferred_;
+};
+
+}
+
+}
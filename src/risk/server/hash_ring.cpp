@@ -0,0 +1,78 @@
+#include "risk/server/hash_ring.h"
+
+#include "risk/rules/state.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace risk {
+
+namespace server {
+
+namespace {
+
+// The splitmix64 finalizer. Game ids are often sequential, and this
+// spreads them over the whole ring.
+std::uint64_t mix(std::uint64_t value)
+{
+    value += 0x9e3779b97f4a7c15;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111eb;
+    return value ^ (value >> 31);
+}
+
+// FNV-1a
+std::uint64_t hash_name(const std::string& name)
+{
+    std::uint64_t hash = 0xcbf29ce484222325;
+    for (const auto c : name) {
+        hash = (hash ^ static_cast<std::uint8_t>(c)) * 0x100000001b3;
+    }
+    return hash;
+}
+
+}
+
+void HashRing::add(Node node, const std::string& name)
+{
+    rules::ensure(!contains(node), std::invalid_argument("Node already on the ring"));
+
+    const auto base = hash_name(name);
+    for (std::size_t i = 0; i < points_; ++i) {
+        ring_.push_back(Point{mix(base + i), node});
+    }
+    // Ties, unlikely as they are, go to the lower node whatever the order
+    // of adding
+    std::sort(std::begin(ring_), std::end(ring_), [] (const Point& a, const Point& b) {
+        return a.hash != b.hash ? a.hash < b.hash : a.node < b.node;
+    });
+}
+
+void HashRing::remove(Node node)
+{
+    ring_.erase(
+        std::remove_if(std::begin(ring_), std::end(ring_), [node] (const Point& point) { return point.node == node; }),
+        std::end(ring_)
+    );
+}
+
+bool HashRing::contains(Node node) const
+{
+    return std::any_of(std::begin(ring_), std::end(ring_), [node] (const Point& point) { return point.node == node; });
+}
+
+HashRing::Node HashRing::owner(std::uint64_t key) const
+{
+    const auto hash = mix(key);
+    auto point = std::lower_bound(std::begin(ring_), std::end(ring_), hash, [] (const Point& point, std::uint64_t hash) {
+        return point.hash < hash;
+    });
+    if (point == std::end(ring_)) {
+        point = std::begin(ring_);
+    }
+    return point->node;
+}
+
+}
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+// Consistent hashing of keys onto nodes. Each node is hashed by name to
+// `points` places on a ring of 64-bit hashes, and a key belongs to the
+// node at the first place at or after the key's hash. Adding a node only
+// takes keys from the others, about a fair share of them, and removing
+// one only hands its own keys out; every other key stays where it was.
+class HashRing {
+public:
+    using Node = std::uint32_t;
+
+    static constexpr std::size_t default_points = 160;
+
+    explicit HashRing(std::size_t points = default_points)
+        : points_(points)
+    {}
+
+    // `name` places the node, so the same names give the same ring
+    void add(Node node, const std::string& name);
+    void remove(Node node);
+
+    bool empty() const { return ring_.empty(); }
+    bool contains(Node node) const;
+
+    // The ring must not be empty
+    Node owner(std::uint64_t key) const;
+
+private:
+    struct Point {
+        std::uint64_t hash;
+        Node node;
+    };
+
+    const std::size_t points_;
+    // Sorted by hash
+    std::vector<Point> ring_;
+};
+
+}
+
+}
@@ -0,0 +1,69 @@
+#include "risk/server/hibernation.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <system_error>
+
+namespace risk {
+
+namespace server {
+
+HibernationFile::HibernationFile(const std::string& path)
+    : file_(::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600))
+{
+    if (!file_) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    ::unlink(path.c_str());
+}
+
+HibernationFile::Slot HibernationFile::store(const std::uint8_t* data, std::size_t size)
+{
+    Slot slot{0, static_cast<std::uint32_t>(size)};
+    auto released = free_.find(capacity(size));
+    if (released != std::end(free_) && !released->second.empty()) {
+        slot.offset = released->second.back();
+        released->second.pop_back();
+    } else {
+        slot.offset = end_;
+        end_ += capacity(size);
+    }
+
+    for (std::size_t written = 0; written < size;) {
+        const auto count = ::pwrite(file_.get(), data + written, size - written, static_cast<off_t>(slot.offset + written));
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "pwrite");
+        }
+        written += static_cast<std::size_t>(count);
+    }
+    return slot;
+}
+
+void HibernationFile::load(Slot slot, Buffer& out) const
+{
+    out.resize(slot.size);
+    for (std::size_t read = 0; read < slot.size;) {
+        const auto count = ::pread(file_.get(), out.data() + read, slot.size - read, static_cast<off_t>(slot.offset + read));
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(count < 0 ? errno : EIO, std::generic_category(), "pread");
+        }
+        read += static_cast<std::size_t>(count);
+    }
+}
+
+void HibernationFile::release(Slot slot)
+{
+    free_[capacity(slot.size)].push_back(slot.offset);
+}
+
+}
+
+}
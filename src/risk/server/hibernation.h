@@ -0,0 +1,54 @@
+#pragma once
+
+#include "risk/server/buffer_pool.h"
+#include "risk/server/socket.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+// Encoded games evicted from memory, in slots of an unlinked file. The
+// file is only a cache: the log and snapshots still hold every game, so
+// nothing is synced and the file goes away with the process.
+//
+// Slots are sized in steps of 64 bytes, and a released slot is reused by
+// the next game that needs one of its size, so the file stays about as
+// large as the most games hibernated at once. Reads and writes are plain
+// pread and pwrite, which for slots this small are served by the page
+// cache in microseconds.
+class HibernationFile {
+public:
+    struct Slot {
+        std::uint64_t offset = 0;
+        std::uint32_t size = 0;
+    };
+
+    // Creates the file at `path` and unlinks it right away
+    explicit HibernationFile(const std::string& path);
+
+    Slot store(const std::uint8_t* data, std::size_t size);
+    // Replaces the contents of `out` with the slot's
+    void load(Slot slot, Buffer& out) const;
+    void release(Slot slot);
+
+    std::uint64_t file_size() const { return end_; }
+
+private:
+    static constexpr std::uint64_t step = 64;
+
+    static std::uint64_t capacity(std::size_t size) { return (size + step - 1) / step * step; }
+
+    FileDescriptor file_;
+    std::uint64_t end_ = 0;
+    // Offsets of released slots by capacity
+    std::unordered_map<std::uint64_t, std::vector<std::uint64_t>> free_;
+};
+
+}
+
+}
@@ -0,0 +1,142 @@
+#include "risk/server/history.h"
+
+#include "risk/rules/state.h"
+#include "risk/server/wal.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+namespace {
+
+template <typename T>
+T get(const std::uint8_t* in)
+{
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value |= std::uint64_t{in[i]} << (8 * i);
+    }
+    return static_cast<T>(value);
+}
+
+template <typename T>
+void put(std::uint8_t* out, T value)
+{
+    const auto bits = static_cast<std::uint64_t>(value);
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        out[i] = static_cast<std::uint8_t>(bits >> (8 * i));
+    }
+}
+
+void read_at(int fd, std::uint8_t* out, std::size_t size, std::uint64_t offset)
+{
+    for (std::size_t read = 0; read < size;) {
+        const auto count = ::pread(fd, out + read, size - read, static_cast<off_t>(offset + read));
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(count < 0 ? errno : EIO, std::generic_category(), "pread");
+        }
+        read += static_cast<std::size_t>(count);
+    }
+}
+
+}
+
+HistoryFile::HistoryFile(const std::string& path)
+    : path_(path)
+    , file_(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644))
+{
+    if (!file_) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    struct stat status{};
+    if (::fstat(file_.get(), &status) < 0) {
+        throw std::system_error(errno, std::generic_category(), "fstat " + path);
+    }
+    end_ = static_cast<std::uint64_t>(status.st_size);
+}
+
+std::uint64_t HistoryFile::add(
+    Buffer& batch, std::uint64_t game, std::uint64_t previous, const std::uint8_t* data, std::size_t size
+) const
+{
+    const auto start = batch.size();
+    batch.resize(start + chunk_header_size);
+    auto* out = batch.data() + start;
+    put(out + 4, static_cast<std::uint32_t>(size));
+    put(out + 8, game);
+    put(out + 16, previous);
+    batch.insert(std::end(batch), data, data + size);
+    put(batch.data() + start, crc32(batch.data() + start + 4, chunk_header_size - 4 + size));
+    return end_ + start + 1;
+}
+
+void HistoryFile::append(const Buffer& batch)
+{
+    for (std::size_t written = 0; written < batch.size();) {
+        const auto count = ::pwrite(file_.get(), batch.data() + written, batch.size() - written, static_cast<off_t>(end_ + written));
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "pwrite " + path_);
+        }
+        written += static_cast<std::size_t>(count);
+    }
+    advance(batch.size());
+}
+
+void HistoryFile::read(std::uint64_t last, Buffer& out) const
+{
+    const auto damaged = std::runtime_error(path_ + " is damaged");
+
+    // The chain runs backwards
+    struct Chunk {
+        std::uint64_t offset;
+        std::uint32_t size;
+    };
+    std::vector<Chunk> chunks;
+    std::uint8_t header[chunk_header_size];
+    std::uint64_t game = 0;
+    for (auto reference = last; reference != 0;) {
+        const auto offset = reference - 1;
+        rules::ensure(offset + chunk_header_size <= end_, damaged);
+        read_at(file_.get(), header, sizeof(header), offset);
+        const auto size = get<std::uint32_t>(header + 4);
+        rules::ensure(offset + chunk_header_size + size <= end_, damaged);
+        rules::ensure(chunks.empty() || get<std::uint64_t>(header + 8) == game, damaged);
+        game = get<std::uint64_t>(header + 8);
+
+        chunks.push_back(Chunk{offset, size});
+        const auto previous = get<std::uint64_t>(header + 16);
+        rules::ensure(previous < reference, damaged);
+        reference = previous;
+    }
+
+    for (auto chunk = chunks.rbegin(); chunk != chunks.rend(); ++chunk) {
+        const auto start = out.size();
+        out.resize(start + chunk_header_size + chunk->size);
+        read_at(file_.get(), out.data() + start, chunk_header_size + chunk->size, chunk->offset);
+        rules::ensure(
+            crc32(out.data() + start + 4, chunk_header_size - 4 + chunk->size) == get<std::uint32_t>(out.data() + start),
+            damaged
+        );
+        out.erase(std::begin(out) + static_cast<std::ptrdiff_t>(start), std::begin(out) + static_cast<std::ptrdiff_t>(start + chunk_header_size));
+    }
+}
+
+}
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "risk/server/buffer_pool.h"
+#include "risk/server/socket.h"
+
+#include <cstdint>
+#include <string>
+
+namespace risk {
+
+namespace server {
+
+// A shard's event logs up to its last snapshot, for archiving games once
+// they finish. At each snapshot a game's events since the last one are
+// appended as a chunk that refers to the chunk before it, so a game's log
+// is the chain of chunks ending at the one its snapshot record names.
+// Chunks nothing names, left by a crash before a snapshot was committed,
+// are never read. The file only grows.
+//
+// A chunk is a CRC-32 of the rest of it, then u32 size, u64 game id, u64
+// reference to the previous chunk and `size` bytes of the event log.
+// Integers are LE. A reference is the chunk's offset plus one, so that
+// zero is none.
+class HistoryFile {
+public:
+    explicit HistoryFile(const std::string& path);
+
+    int fd() const { return file_.get(); }
+    // Where the next batch of chunks goes
+    std::uint64_t end() const { return end_; }
+
+    // Appends a chunk to `batch`, which is to be written at end(), and
+    // returns its reference
+    std::uint64_t add(
+        Buffer& batch, std::uint64_t game, std::uint64_t previous, const std::uint8_t* data, std::size_t size
+    ) const;
+    // Once a batch of `size` bytes is handed to be written
+    void advance(std::uint64_t size) { end_ += size; }
+    // Writes a batch at end() right away, without syncing it
+    void append(const Buffer& batch);
+
+    // Appends the game's log up to chunk `last` to `out`. A damaged chunk
+    // is a std::runtime_error.
+    void read(std::uint64_t last, Buffer& out) const;
+
+private:
+    static constexpr std::size_t chunk_header_size = 24;
+
+    const std::string path_;
+    FileDescriptor file_;
+    std::uint64_t end_ = 0;
+};
+
+}
+
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace risk {
+
+namespace server {
+
+// A bounded multi-producer, single-consumer ring. Any number of threads
+// may push and one thread may pop, without locks. Each producer's
+// elements are popped in the order it pushed them.
+//
+// Every slot carries a sequence number telling whose turn it is: a
+// producer claims the tail by CAS, fills the slot and then bumps its
+// sequence to publish it, so the consumer never sees a half-written
+// element.
+template <typename T>
+class MpscQueue {
+public:
+    // `capacity` is rounded up to a power of two
+    explicit MpscQueue(std::size_t capacity)
+        : mask_(round_up(capacity) - 1)
+        , slots_(std::make_unique<Slot[]>(mask_ + 1))
+    {
+        for (std::size_t i = 0; i <= mask_; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    std::size_t capacity() const { return mask_ + 1; }
+
+    // Producer side, from any thread. Returns false, leaving `value`
+    // untouched, when full.
+    bool try_push(T&& value)
+    {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& slot = slots_[tail & mask_];
+            const auto sequence = slot.sequence.load(std::memory_order_acquire);
+            const auto lead = static_cast<std::intptr_t>(sequence - tail);
+            if (lead == 0) {
+                if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+                    slot.value = std::move(value);
+                    slot.sequence.store(tail + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (lead < 0) {
+                // The consumer has not freed this slot from the last lap
+                return false;
+            } else {
+                tail = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer side. Hands every published element to `consume` and
+    // returns how many there were. Stops early at a slot that has been
+    // claimed but not yet filled, which keeps each producer's order.
+    template <typename Consume>
+    std::size_t drain(Consume&& consume)
+    {
+        std::size_t count = 0;
+        for (;;) {
+            auto& slot = slots_[head_ & mask_];
+            if (slot.sequence.load(std::memory_order_acquire) != head_ + 1) {
+                return count;
+            }
+            consume(std::move(slot.value));
+            slot.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+            ++head_;
+            ++count;
+        }
+    }
+
+    // Consumer side
+    bool empty() const
+    {
+        return slots_[head_ & mask_].sequence.load(std::memory_order_acquire) != head_ + 1;
+    }
+
+private:
+    struct Slot {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    static std::size_t round_up(std::size_t capacity)
+    {
+        std::size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    // The contended tail gets a cache line to itself, away from the
+    // consumer's head
+    static constexpr std::size_t line = 64;
+
+    const std::size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+
+    alignas(line) std::atomic<std::size_t> tail_{0};
+
+    alignas(line) std::size_t head_ = 0;
+};
+
+}
+
+}
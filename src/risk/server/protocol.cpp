@@ -0,0 +1,354 @@
+#include "risk/server/protocol.h"
+
+#include <stdexcept>
+
+namespace risk {
+
+namespace server {
+
+using namespace risk::rules;
+
+namespace {
+
+// Type and game id
+constexpr std::size_t header_size = 1 + 8;
+constexpr std::size_t archived_size = 4 + 4 + 4 + 1 + 1 + 1;
+
+// Size of each request type after the length prefix, 0 for none
+constexpr std::size_t request_size(Frame type)
+{
+    switch (type) {
+    case Frame::New: return header_size + 1 + 8;
+    case Frame::Join: return header_size;
+    case Frame::Deal: return header_size + 8;
+    case Frame::Replay: return header_size;
+    case Frame::Export: return header_size;
+    case Frame::Release: return header_size;
+    case Frame::Resume: return header_size;
+    case Frame::Control: return header_size;
+    case Frame::Place: return header_size + 4 + 4;
+    case Frame::Trade: return header_size + 4 + 3;
+    case Frame::Attack: return header_size + 4 + 4 + 4 + 1;
+    case Frame::Occupy: return header_size + 4 + 4;
+    case Frame::Fortify: return header_size + 4 + 4 + 4 + 4;
+    case Frame::End: return header_size + 4;
+    default: return 0;
+    }
+}
+
+template <typename T>
+T load(const std::uint8_t* in)
+{
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value |= std::uint64_t{in[i]} << (8 * i);
+    }
+    return static_cast<T>(value);
+}
+
+template <typename T>
+void store(std::vector<std::uint8_t>& out, T value)
+{
+    const auto bits = static_cast<std::uint64_t>(value);
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        out.push_back(static_cast<std::uint8_t>(bits >> (8 * i)));
+    }
+}
+
+}
+
+bool decode_request(const std::uint8_t* frame, std::size_t size, Request& request)
+{
+    if (size == 0) {
+        return false;
+    }
+    const auto type = static_cast<Frame>(frame[0]);
+    // An Import is as long as its state
+    const bool valid = type == Frame::Import
+        ? size > header_size + 4
+        : request_size(type) != 0 && size == request_size(type);
+    if (!valid) {
+        return false;
+    }
+
+    request.type = type;
+    request.game = load<std::uint64_t>(frame + 1);
+
+    const auto* in = frame + header_size;
+    auto player = [in] { return load<std::int32_t>(in); };
+    switch (type) {
+    case Frame::New:
+        request.players = in[0];
+        request.seed = load<std::uint64_t>(in + 1);
+        break;
+    case Frame::Join:
+    case Frame::Replay:
+    case Frame::Export:
+    case Frame::Import:
+    case Frame::Release:
+    case Frame::Resume:
+    case Frame::Control:
+        break;
+    case Frame::Deal:
+        request.seed = load<std::uint64_t>(in);
+        break;
+    case Frame::Place:
+        request.command = PlaceUnit{player(), load<std::int32_t>(in + 4)};
+        break;
+    case Frame::Trade:
+        request.command = TradeCards{player(), {in[4], in[5], in[6]}};
+        break;
+    case Frame::Attack:
+        request.command = Attack{player(), load<std::int32_t>(in + 4), load<std::int32_t>(in + 8), in[12]};
+        break;
+    case Frame::Occupy:
+        request.command = Occupy{player(), load<std::uint32_t>(in + 4)};
+        break;
+    case Frame::Fortify:
+        request.command = Fortify{player(), load<std::int32_t>(in + 4), load<std::int32_t>(in + 8), load<std::uint32_t>(in + 12)};
+        break;
+    case Frame::End:
+        request.command = EndPhase{player()};
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+void encode_request(std::vector<std::uint8_t>& out, const Request& request)
+{
+    if (request.type >= Frame::Place && request.type <= Frame::End) {
+        encode_command(out, request.game, request.command);
+        return;
+    }
+
+    const auto start = begin_frame(out, request.type, request.game);
+    if (request.type == Frame::New) {
+        store<std::uint8_t>(out, request.players);
+        store<std::uint64_t>(out, request.seed);
+    } else if (request.type == Frame::Deal) {
+        store<std::uint64_t>(out, request.seed);
+    }
+    end_frame(out, start);
+}
+
+void encode_command(std::vector<std::uint8_t>& out, GameId game, const Command& command)
+{
+    const auto type = static_cast<Frame>(static_cast<std::size_t>(Frame::Place) + command.index());
+    const auto start = begin_frame(out, type, game);
+
+    std::visit(
+        [&out] (const auto& command) {
+            using T = std::decay_t<decltype(command)>;
+            store<std::int32_t>(out, command.player);
+            if constexpr (std::is_same_v<T, PlaceUnit>) {
+                store<std::int32_t>(out, command.territory);
+            } else if constexpr (std::is_same_v<T, TradeCards>) {
+                for (auto card : command.cards) {
+                    store<std::uint8_t>(out, card);
+                }
+            } else if constexpr (std::is_same_v<T, Attack>) {
+                store<std::int32_t>(out, command.from);
+                store<std::int32_t>(out, command.to);
+                store<std::uint8_t>(out, command.dice);
+            } else if constexpr (std::is_same_v<T, Occupy>) {
+                store<std::uint32_t>(out, command.units);
+            } else if constexpr (std::is_same_v<T, Fortify>) {
+                store<std::int32_t>(out, command.from);
+                store<std::int32_t>(out, command.to);
+                store<std::uint32_t>(out, command.units);
+            }
+        },
+        command
+    );
+
+    end_frame(out, start);
+}
+
+bool decode_reply(const std::uint8_t* frame, std::size_t size, Reply& reply)
+{
+    if (size < header_size) {
+        return false;
+    }
+
+    reply.type = static_cast<Frame>(frame[0]);
+    reply.game = load<std::uint64_t>(frame + 1);
+    reply.payload = frame + header_size;
+    reply.size = size - header_size;
+
+    switch (reply.type) {
+    case Frame::Ok:
+        return reply.size == 0;
+    case Frame::Error:
+        if (reply.size != 1) {
+            return false;
+        }
+        reply.error = static_cast<ErrorCode>(frame[header_size]);
+        return true;
+    case Frame::Snapshot:
+    case Frame::Delta:
+    case Frame::Log:
+        return true;
+    case Frame::Archived:
+        return reply.size == archived_size;
+    case Frame::Replica:
+        return reply.size >= 4;
+    case Frame::Synced:
+        return reply.size == 8;
+    case Frame::Record:
+        return reply.size > 8;
+    default:
+        return false;
+    }
+}
+
+std::size_t begin_frame(std::vector<std::uint8_t>& out, Frame type, GameId game)
+{
+    const auto start = out.size();
+    store<std::uint16_t>(out, 0);
+    store<std::uint8_t>(out, static_cast<std::uint8_t>(type));
+    store<std::uint64_t>(out, game);
+    return start;
+}
+
+void end_frame(std::vector<std::uint8_t>& out, std::size_t start)
+{
+    const auto length = out.size() - start - length_size;
+    ensure(length <= max_frame, std::length_error("Frame too long"));
+    out[start] = static_cast<std::uint8_t>(length);
+    out[start + 1] = static_cast<std::uint8_t>(length >> 8);
+}
+
+void encode_ok(std::vector<std::uint8_t>& out, GameId game)
+{
+    end_frame(out, begin_frame(out, Frame::Ok, game));
+}
+
+void encode_error(std::vector<std::uint8_t>& out, GameId game, ErrorCode error)
+{
+    const auto start = begin_frame(out, Frame::Error, game);
+    store<std::uint8_t>(out, static_cast<std::uint8_t>(error));
+    end_frame(out, start);
+}
+
+void encode_archived(std::vector<std::uint8_t>& out, GameId game, const ArchivedGame& archived)
+{
+    const auto start = begin_frame(out, Frame::Archived, game);
+    store<std::uint32_t>(out, archived.size);
+    store<std::uint32_t>(out, archived.length);
+    store<std::uint32_t>(out, archived.moves);
+    store<std::uint8_t>(out, archived.players);
+    store<std::uint8_t>(out, archived.winner);
+    store<std::uint8_t>(out, archived.map);
+    end_frame(out, start);
+}
+
+bool decode_archived(const Reply& reply, ArchivedGame& archived)
+{
+    if (reply.type != Frame::Archived || reply.size != archived_size) {
+        return false;
+    }
+    const auto* in = reply.payload;
+    archived.size = load<std::uint32_t>(in);
+    archived.length = load<std::uint32_t>(in + 4);
+    archived.moves = load<std::uint32_t>(in + 8);
+    archived.players = in[12];
+    archived.winner = in[13];
+    archived.map = in[14];
+    return true;
+}
+
+void encode_log_header(std::vector<std::uint8_t>& out, GameId game, std::size_t size)
+{
+    ensure(size <= max_payload, std::length_error("Frame too long"));
+    const auto start = begin_frame(out, Frame::Log, game);
+    const auto length = out.size() - start - length_size + size;
+    out[start] = static_cast<std::uint8_t>(length);
+    out[start + 1] = static_cast<std::uint8_t>(length >> 8);
+}
+
+void encode_follow(std::vector<std::uint8_t>& out, std::size_t shard, std::size_t shards)
+{
+    const auto start = begin_frame(out, Frame::Follow, 0);
+    store<std::uint16_t>(out, shard);
+    store<std::uint16_t>(out, shards);
+    end_frame(out, start);
+}
+
+bool decode_follow(const std::uint8_t* frame, std::size_t size, std::size_t& shard, std::size_t& shards)
+{
+    if (size != header_size + 2 + 2 || static_cast<Frame>(frame[0]) != Frame::Follow) {
+        return false;
+    }
+    shard = load<std::uint16_t>(frame + header_size);
+    shards = load<std::uint16_t>(frame + header_size + 2);
+    return shard < shards;
+}
+
+void encode_sequence(std::vector<std::uint8_t>& out, Frame type, std::uint64_t sequence)
+{
+    const auto start = begin_frame(out, type, 0);
+    store<std::uint64_t>(out, sequence);
+    end_frame(out, start);
+}
+
+bool decode_applied(const std::uint8_t* frame, std::size_t size, std::uint64_t& sequence)
+{
+    if (size != header_size + 8 || static_cast<Frame>(frame[0]) != Frame::Applied) {
+        return false;
+    }
+    sequence = load<std::uint64_t>(frame + header_size);
+    return true;
+}
+
+std::size_t begin_replica(std::vector<std::uint8_t>& out, GameId game, std::uint32_t dice)
+{
+    const auto start = begin_frame(out, Frame::Replica, game);
+    store<std::uint32_t>(out, dice);
+    return start;
+}
+
+std::size_t begin_record(std::vector<std::uint8_t>& out, std::uint64_t sequence)
+{
+    const auto start = begin_frame(out, Frame::Record, 0);
+    store<std::uint64_t>(out, sequence);
+    return start;
+}
+
+std::size_t begin_import(std::vector<std::uint8_t>& out, GameId game, std::uint32_t dice)
+{
+    const auto start = begin_frame(out, Frame::Import, game);
+    store<std::uint32_t>(out, dice);
+    return start;
+}
+
+void decode_import(const std::uint8_t* frame, std::size_t size, Replicated& imported)
+{
+    imported.dice = load<std::uint32_t>(frame + header_size);
+    imported.payload = frame + header_size + 4;
+    imported.size = size - header_size - 4;
+}
+
+bool decode_replicated(const Reply& reply, Replicated& replicated)
+{
+    switch (reply.type) {
+    case Frame::Replica:
+        replicated.dice = load<std::uint32_t>(reply.payload);
+        replicated.payload = reply.payload + 4;
+        replicated.size = reply.size - 4;
+        return true;
+    case Frame::Synced:
+    case Frame::Record:
+        replicated.sequence = load<std::uint64_t>(reply.payload);
+        replicated.payload = reply.payload + 8;
+        replicated.size = reply.size - 8;
+        return true;
+    default:
+        return false;
+    }
+}
+
+}
+
+}
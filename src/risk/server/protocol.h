@@ -0,0 +1,164 @@
+#pragma once
+
+#include "risk/rules/state.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+using GameId = std::uint64_t;
+
+// Frames are a little-endian u16 length, counting the bytes after it,
+// then a type byte and the game id as u64. Requests have a fixed layout
+// per type, so they are read straight from the receive buffer.
+enum class Frame : std::uint8_t {
+    // Requests
+    New = 0x01,     // u8 players, u64 seed. Players are numbered 1..players.
+    Join = 0x02,    // subscribe to updates
+    Deal = 0x03,    // u64 seed, see Game::deal_random_placement
+    Replay = 0x04,  // download the log of an archived game
+    // Only on replication streams, see encode_follow
+    Follow = 0x05,  // u16 shard, u16 shards
+    Applied = 0x06, // u64 sequence
+    // From a router moving a game between its workers, see Router. Only
+    // taken on a connection that sent Control first.
+    Export = 0x07,  // answered with a Replica of the game, which then holds still
+    Import = 0x08,  // u32 dice, StateCodec::encode
+    Release = 0x09, // forget the exported game, which was imported elsewhere
+    Resume = 0x0a,  // go on with the exported game, which could not be moved
+    Control = 0x0b, // unanswered, the connection is a router's from then on
+    // 0x10 + Command::index(), fields as i32 except for the small ones
+    Place = 0x10,   // player, territory
+    Trade = 0x11,   // player, u8 card * 3
+    Attack = 0x12,  // player, from, to, u8 dice
+    Occupy = 0x13,  // player, u32 units
+    Fortify = 0x14, // player, from, to, u32 units
+    End = 0x15,     // player
+
+    // Replies and updates
+    Ok = 0x80,
+    Error = 0x81,    // u8 ErrorCode
+    Snapshot = 0x82, // StateCodec::encode, sent on joining
+    Delta = 0x83,    // StateCodec::diff from the previous update
+    Archived = 0x84, // ArchivedGame, followed by Log frames
+    Log = 0x85,      // the next part of an archived game's compressed log
+    Replica = 0x86,  // u32 dice, StateCodec::encode
+    Synced = 0x87,   // u64 sequence
+    Record = 0x88,   // u64 sequence, a logged request frame
+};
+
+enum class ErrorCode : std::uint8_t {
+    BadRequest = 1,
+    NoSuchGame,
+    GameExists,
+    IllegalMove,
+    NotInTurn,
+    OutOfRange,
+    Rejected,
+    Standby,
+    // Unanswered, to the subscribers of a game that moved to another server
+    Moved,
+};
+
+constexpr std::size_t length_size = 2;
+constexpr std::size_t max_frame = 0xffff;
+// What a frame has room for after its type and game id
+constexpr std::size_t max_payload = max_frame - 1 - 8;
+
+struct Request {
+    Frame type = Frame::Join;
+    GameId game = 0;
+    std::size_t players = 0;
+    std::uint64_t seed = 0;
+    rules::Command command;
+};
+
+// Decodes a request from `frame`, which starts after the length prefix.
+// Returns false for anything malformed. Never allocates. Of an Import,
+// only the game is decoded, see decode_import.
+bool decode_request(const std::uint8_t* frame, std::size_t size, Request& request);
+void encode_request(std::vector<std::uint8_t>& out, const Request& request);
+// The request frame for a command, typed by its Command::index()
+void encode_command(std::vector<std::uint8_t>& out, GameId game, const rules::Command& command);
+
+struct Reply {
+    Frame type = Frame::Ok;
+    GameId game = 0;
+    ErrorCode error = ErrorCode::BadRequest;
+    // The state bytes of a Snapshot or Delta, pointing into the frame
+    const std::uint8_t* payload = nullptr;
+    std::size_t size = 0;
+};
+
+bool decode_reply(const std::uint8_t* frame, std::size_t size, Reply& reply);
+
+// Starts a frame in `out` and returns where it begins. end_frame fills in
+// its length once the rest has been appended.
+std::size_t begin_frame(std::vector<std::uint8_t>& out, Frame type, GameId game);
+void end_frame(std::vector<std::uint8_t>& out, std::size_t start);
+
+void encode_ok(std::vector<std::uint8_t>& out, GameId game);
+void encode_error(std::vector<std::uint8_t>& out, GameId game, ErrorCode error);
+
+// An archived game being downloaded. Its rules::EventLog, compressed with
+// zlib, follows in Log frames of up to max_payload bytes.
+struct ArchivedGame {
+    // Of the compressed log
+    std::uint32_t size = 0;
+    // Of the log uncompressed
+    std::uint32_t length = 0;
+    std::uint32_t moves = 0;
+    std::uint8_t players = 0;
+    std::uint8_t winner = 0;
+    std::uint8_t map = 0;
+};
+
+// As u32 size, u32 length, u32 moves, u8 players, u8 winner, u8 map
+void encode_archived(std::vector<std::uint8_t>& out, GameId game, const ArchivedGame& archived);
+bool decode_archived(const Reply& reply, ArchivedGame& archived);
+// The start of a Log frame, whose `size` bytes are sent after it as they are
+void encode_log_header(std::vector<std::uint8_t>& out, GameId game, std::size_t size);
+
+// Replication. Each shard of a standby sends Follow with its index, and
+// is sent a Replica of every game of the primary's shard with that index,
+// then Synced with the log sequence they are as of, then a Record of each
+// request the shard logs after that, once it is durable. Now and then the
+// standby answers with the sequence it has Applied. The game id of Follow,
+// Applied, Synced and Record is unused.
+void encode_follow(std::vector<std::uint8_t>& out, std::size_t shard, std::size_t shards);
+bool decode_follow(const std::uint8_t* frame, std::size_t size, std::size_t& shard, std::size_t& shards);
+// Synced or Applied
+void encode_sequence(std::vector<std::uint8_t>& out, Frame type, std::uint64_t sequence);
+bool decode_applied(const std::uint8_t* frame, std::size_t size, std::uint64_t& sequence);
+// Frames for end_frame to finish once the state or the record follows
+std::size_t begin_replica(std::vector<std::uint8_t>& out, GameId game, std::uint32_t dice);
+std::size_t begin_record(std::vector<std::uint8_t>& out, std::uint64_t sequence);
+
+struct Replicated {
+    // Of Synced and Record
+    std::uint64_t sequence = 0;
+    // Of Replica
+    std::uint32_t dice = 0;
+    // The state of a Replica, or the request frame of a Record
+    const std::uint8_t* payload = nullptr;
+    std::size_t size = 0;
+};
+
+// For a reply decode_reply accepted
+bool decode_replicated(const Reply& reply, Replicated& replicated);
+
+// Moving games. The Replica a worker answers Export with is turned into
+// an Import for the next worker, carrying the same dice and state. The
+// first worker keeps the game, taking no requests for it, until it is told
+// to Release it once the Import is answered with Ok, or to Resume it.
+std::size_t begin_import(std::vector<std::uint8_t>& out, GameId game, std::uint32_t dice);
+// The dice and state of an Import that decode_request accepted
+void decode_import(const std::uint8_t* frame, std::size_t size, Replicated& imported);
+
+}
+
+}
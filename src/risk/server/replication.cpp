@@ -0,0 +1,235 @@
+#include "risk/server/replication.h"
+
+#include "risk/rules/event_log.h"
+
+#include <algorithm>
+#include <exception>
+
+namespace risk {
+
+namespace server {
+
+Replicator::Replicator(EventLoop& loop, BufferPool& pool, Host& host)
+    : loop_(loop)
+    , pool_(pool)
+    , host_(host)
+{
+}
+
+Replication Replicator::status() const
+{
+    Replication replication;
+    replication.followers = follower_count_.load(std::memory_order_relaxed);
+    replication.behind = behind_.load(std::memory_order_relaxed);
+    replication.lag = std::chrono::microseconds{lag_.load(std::memory_order_relaxed)};
+    // A standby that stopped answering is as far behind as what it was sent
+    if (const auto since = waiting_since_.load(std::memory_order_relaxed); since != 0) {
+        const auto waiting = Clock::now().time_since_epoch() - std::chrono::nanoseconds{since};
+        replication.lag = std::max(replication.lag, std::chrono::duration_cast<std::chrono::microseconds>(waiting));
+    }
+    replication.following = streaming_.load(std::memory_order_relaxed) ? 1 : 0;
+    return replication;
+}
+
+void Replicator::add_follower(FileDescriptor fd, WriteAheadLog::Sequence from)
+{
+    // Batches from now on only hold records after the games it is sent
+    replicate(from);
+
+    const auto id = ++next_follower_;
+    auto& follower = followers_[id];
+    follower.connection = std::make_unique<Connection>(loop_, std::move(fd), static_cast<Listener&>(*this));
+    follower.from = from;
+    follower.sent = from;
+    follower.applied = from;
+
+    auto frames = std::make_shared<Buffer>();
+    host_.encode_games(*frames);
+    encode_sequence(*frames, Frame::Synced, from);
+
+    // Like a reply, the games are only sent as far as they are durable
+    host_.after_commit([this, id, games = SharedBuffer{std::move(frames)}] {
+        if (auto follower = followers_.find(id); follower != std::end(followers_)) {
+            follower->second.connection->send(games);
+        }
+    });
+    update_status();
+}
+
+void Replicator::add_record(WriteAheadLog::Sequence sequence, const std::uint8_t* record, std::size_t size)
+{
+    if (followers_.empty()) {
+        return;
+    }
+    const auto start = begin_record(replicated_, sequence);
+    replicated_.insert(std::end(replicated_), record, record + size);
+    end_frame(replicated_, start);
+}
+
+void Replicator::replicate(WriteAheadLog::Sequence last)
+{
+    if (replicated_.empty()) {
+        return;
+    }
+    const SharedBuffer records = std::make_shared<const Buffer>(std::move(replicated_));
+    replicated_.clear();
+
+    host_.after_commit([this, records, last] {
+        const auto now = Clock::now();
+        for (auto& [id, follower] : followers_) {
+            // One that joined since was sent the games with these records
+            // applied
+            auto& connection = *follower.connection;
+            if (follower.from >= last || connection.closed()) {
+                continue;
+            }
+            if (connection.pending() > follower_backlog) {
+                connection.close();
+                continue;
+            }
+            connection.send(records);
+            follower.sent = last;
+            follower.unapplied.push_back(Follower::Batch{last, now});
+        }
+        update_status();
+    });
+}
+
+void Replicator::follow(FileDescriptor primary, std::size_t shard, std::size_t shards)
+{
+    primary_ = std::make_unique<Connection>(loop_, std::move(primary), static_cast<Listener&>(*this));
+    following_ = true;
+
+    auto frame = pool_.acquire();
+    encode_follow(frame, shard, shards);
+    primary_->send(frame);
+    pool_.release(std::move(frame));
+}
+
+void Replicator::stop_following()
+{
+    following_ = false;
+    if (primary_) {
+        primary_->close();
+    }
+}
+
+void Replicator::on_frame(Connection& connection, const std::uint8_t* frame, std::size_t size)
+{
+    if (&connection == primary_.get()) {
+        on_replicated(frame, size);
+        return;
+    }
+    if (auto follower = follower_of(connection); follower != std::end(followers_)) {
+        on_applied(follower->second, frame, size);
+    }
+}
+
+void Replicator::on_close(Connection& connection)
+{
+    if (&connection == primary_.get()) {
+        primary_.reset();
+        streaming_.store(false, std::memory_order_relaxed);
+        return;
+    }
+    if (auto follower = follower_of(connection); follower != std::end(followers_)) {
+        followers_.erase(follower);
+        update_status();
+    }
+}
+
+std::unordered_map<std::uint64_t, Replicator::Follower>::iterator Replicator::follower_of(const Connection& connection)
+{
+    return std::find_if(std::begin(followers_), std::end(followers_), [&connection] (const auto& follower) {
+        return follower.second.connection.get() == &connection;
+    });
+}
+
+void Replicator::on_applied(Follower& follower, const std::uint8_t* frame, std::size_t size)
+{
+    WriteAheadLog::Sequence applied = 0;
+    if (!decode_applied(frame, size, applied) || applied <= follower.applied) {
+        return;
+    }
+    follower.applied = applied;
+
+    const auto now = Clock::now();
+    while (!follower.unapplied.empty() && follower.unapplied.front().last <= applied) {
+        const auto lag = std::chrono::duration_cast<std::chrono::microseconds>(now - follower.unapplied.front().sent_at);
+        lag_.store(lag.count(), std::memory_order_relaxed);
+        follower.unapplied.pop_front();
+    }
+    update_status();
+}
+
+void Replicator::update_status()
+{
+    std::uint64_t behind = 0;
+    std::int64_t waiting_since = 0;
+    for (const auto& [id, follower] : followers_) {
+        behind = std::max(behind, follower.sent - follower.applied);
+        if (!follower.unapplied.empty()) {
+            const auto sent_at = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                follower.unapplied.front().sent_at.time_since_epoch()
+            ).count();
+            waiting_since = waiting_since == 0 ? sent_at : std::min(waiting_since, sent_at);
+        }
+    }
+    follower_count_.store(followers_.size(), std::memory_order_relaxed);
+    behind_.store(behind, std::memory_order_relaxed);
+    waiting_since_.store(waiting_since, std::memory_order_relaxed);
+}
+
+void Replicator::on_replicated(const std::uint8_t* frame, std::size_t size)
+{
+    Reply reply;
+    Replicated replicated;
+    // An Error means the primary will not be followed
+    if (!decode_reply(frame, size, reply) || !decode_replicated(reply, replicated)) {
+        primary_->close();
+        return;
+    }
+
+    try {
+        if (reply.type == Frame::Replica) {
+            host_.on_replica(reply.game, replicated.dice, replicated.payload, replicated.size);
+            return;
+        }
+        applied_ = replicated.sequence;
+        if (reply.type == Frame::Synced) {
+            synced_ = true;
+            streaming_.store(true, std::memory_order_relaxed);
+            host_.on_synced();
+        } else {
+            rules::ensure(synced_, rules::DecodeError{});
+            host_.on_record(replicated.payload, replicated.size);
+        }
+        acknowledge();
+    } catch (const std::exception&) {
+        // The games no longer match the primary's, so stop following it
+        primary_->close();
+    }
+}
+
+void Replicator::acknowledge()
+{
+    if (acknowledge_scheduled_) {
+        return;
+    }
+    acknowledge_scheduled_ = true;
+
+    // Once per batch of records
+    loop_.defer([this] {
+        acknowledge_scheduled_ = false;
+        if (primary_) {
+            auto frame = pool_.acquire();
+            encode_sequence(frame, Frame::Applied, applied_);
+            primary_->send(frame);
+            pool_.release(std::move(frame));
+        }
+    });
+}
+
+}
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "risk/server/buffer_pool.h"
+#include "risk/server/connection.h"
+#include "risk/server/event_loop.h"
+#include "risk/server/protocol.h"
+#include "risk/server/socket.h"
+#include "risk/server/wal.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+namespace risk {
+
+namespace server {
+
+// How a shard's replication stream is doing
+struct Replication {
+    // Standbys following the shard
+    std::size_t followers = 0;
+    // The most records any of them has yet to apply
+    std::uint64_t behind = 0;
+    // How long after it was durable here a record was last applied,
+    // or has been waiting to be
+    std::chrono::microseconds lag{0};
+    // On a standby, 1 while the primary's games are streaming in
+    std::size_t following = 0;
+};
+
+// The replication stream of a shard, on the shard's thread. On a primary
+// it sends each standby that follows the shard every game as it stands,
+// then each batch of records once the log has made it durable, and keeps
+// track of how far behind the standbys are from their acknowledgements.
+// On a standby it follows the primary's shard, hands what it streams to
+// the shard and acknowledges it once per batch.
+//
+// A follower whose connection has more than `follower_backlog` bytes
+// queued is dropped, and has to follow again from the start.
+class Replicator : private Connection::Listener {
+public:
+    // The shard the stream belongs to
+    class Host {
+    public:
+        virtual ~Host() = default;
+        // Appends a Replica of every game to `frames`, for a new follower
+        virtual void encode_games(Buffer& frames) = 0;
+        // Runs `task` once everything logged so far is durable
+        virtual void after_commit(std::function<void ()> task) = 0;
+
+        // On a standby, a game of the primary as it stands
+        virtual void on_replica(GameId game, std::uint32_t dice, const std::uint8_t* state, std::size_t size) = 0;
+        // On a standby, every game of the primary has arrived
+        virtual void on_synced() = 0;
+        // On a standby, a request the primary logged. Throws if it does
+        // not apply, which ends the stream.
+        virtual void on_record(const std::uint8_t* record, std::size_t size) = 0;
+    };
+
+    static constexpr std::size_t follower_backlog = 64 * 1024 * 1024;
+
+    Replicator(EventLoop& loop, BufferPool& pool, Host& host);
+
+    // Safe to call from any thread
+    Replication status() const;
+
+    // Sends a standby connected on `fd` the games as of `from`, the last
+    // record logged, then the records after them
+    void add_follower(FileDescriptor fd, WriteAheadLog::Sequence from);
+    // Adds a record that was just logged to the next batch
+    void add_record(WriteAheadLog::Sequence sequence, const std::uint8_t* record, std::size_t size);
+    // Has the batch, which ends with `last`, sent once it is durable
+    void replicate(WriteAheadLog::Sequence last);
+
+    // Follows the primary's shard `shard` of `shards`, which `primary` is
+    // connected to
+    void follow(FileDescriptor primary, std::size_t shard, std::size_t shards);
+    bool following() const { return following_; }
+    void stop_following();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Follower {
+        std::unique_ptr<Connection> connection;
+        // It was sent the games as of this record
+        WriteAheadLog::Sequence from = 0;
+        WriteAheadLog::Sequence sent = 0;
+        WriteAheadLog::Sequence applied = 0;
+        // The last record of each batch it has not applied yet, and when
+        // the batch was sent
+        struct Batch {
+            WriteAheadLog::Sequence last;
+            Clock::time_point sent_at;
+        };
+        std::deque<Batch> unapplied;
+    };
+
+    void on_frame(Connection& connection, const std::uint8_t* frame, std::size_t size) override;
+    void on_close(Connection& connection) override;
+
+    std::unordered_map<std::uint64_t, Follower>::iterator follower_of(const Connection& connection);
+    void on_applied(Follower& follower, const std::uint8_t* frame, std::size_t size);
+    void update_status();
+    // On a standby, applies what the primary streams
+    void on_replicated(const std::uint8_t* frame, std::size_t size);
+    void acknowledge();
+
+    EventLoop& loop_;
+    BufferPool& pool_;
+    Host& host_;
+
+    std::unordered_map<std::uint64_t, Follower> followers_;
+    std::uint64_t next_follower_ = 0;
+    // Record frames for the followers, up to the next commit
+    Buffer replicated_;
+
+    // On a standby, the stream from the primary while it lasts
+    std::unique_ptr<Connection> primary_;
+    bool following_ = false;
+    bool synced_ = false;
+    WriteAheadLog::Sequence applied_ = 0;
+    bool acknowledge_scheduled_ = false;
+
+    // For status(), only written on the shard's thread
+    std::atomic<std::size_t> follower_count_{0};
+    std::atomic<std::uint64_t> behind_{0};
+    std::atomic<std::int64_t> lag_{0};
+    // When the oldest batch a follower has not applied was sent, as
+    // nanoseconds of Clock, 0 for none
+    std::atomic<std::int64_t> waiting_since_{0};
+    std::atomic<bool> streaming_{false};
+};
+
+}
+
+}
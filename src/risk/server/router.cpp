@@ -0,0 +1,738 @@
+#include "risk/server/router.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+namespace risk {
+
+namespace server {
+
+class Router::Acceptor : public EventLoop::Handler {
+public:
+    Acceptor(Router& router, FileDescriptor fd)
+        : router_(router)
+        , fd_(std::move(fd))
+    {
+        router_.loop_.add(fd_.get(), EPOLLIN, *this);
+    }
+
+    ~Acceptor() override { router_.loop_.remove(fd_.get()); }
+
+    void on_events(std::uint32_t) override { router_.accept(fd_.get()); }
+
+private:
+    Router& router_;
+    FileDescriptor fd_;
+};
+
+Router::Router(RouterOptions options)
+    : concurrent_moves_(std::max<std::size_t>(1, options.concurrent_moves))
+    , wakeup_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    if (!wakeup_) {
+        throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+    rules::ensure(!options.workers.empty(), std::invalid_argument("A router needs workers"));
+    loop_.add(wakeup_.get(), EPOLLIN, *this);
+    apply(connect_workers(options.workers));
+
+    if (options.port) {
+        auto fd = listen_tcp(options.host, *options.port);
+        port_ = local_port(fd.get());
+        acceptors_.push_back(std::make_unique<Acceptor>(*this, std::move(fd)));
+    }
+    if (!options.unix_path.empty()) {
+        acceptors_.push_back(std::make_unique<Acceptor>(*this, listen_unix(options.unix_path)));
+    }
+    rules::ensure(!acceptors_.empty(), std::invalid_argument("Router needs a TCP port or a Unix socket path"));
+}
+
+Router::~Router()
+{
+    acceptors_.clear();
+    loop_.remove(wakeup_.get());
+}
+
+void Router::run()
+{
+    loop_.run();
+}
+
+void Router::stop()
+{
+    loop_.stop();
+}
+
+void Router::set_workers(const std::vector<std::string>& workers)
+{
+    rules::ensure(!workers.empty(), std::invalid_argument("A router needs workers"));
+    auto connected = connect_workers(workers);
+    {
+        std::lock_guard<std::mutex> lock{pending_mutex_};
+        pending_ = std::move(connected);
+    }
+    const std::uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(wakeup_.get(), &one, sizeof(one));
+}
+
+Router::Migrations Router::migrations() const
+{
+    Migrations migrations;
+    migrations.moved = moved_.load(std::memory_order_relaxed);
+    migrations.moving = moving_count_.load(std::memory_order_relaxed);
+    migrations.longest_pause = std::chrono::microseconds{longest_pause_.load(std::memory_order_relaxed)};
+    migrations.total_pause = std::chrono::microseconds{total_pause_.load(std::memory_order_relaxed)};
+    return migrations;
+}
+
+void Router::on_events(std::uint32_t)
+{
+    std::uint64_t value;
+    while (::read(wakeup_.get(), &value, sizeof(value)) > 0) {}
+
+    std::optional<std::vector<std::pair<std::string, FileDescriptor>>> workers;
+    {
+        std::lock_guard<std::mutex> lock{pending_mutex_};
+        workers.swap(pending_);
+    }
+    if (workers) {
+        apply(std::move(*workers));
+    }
+}
+
+std::vector<std::pair<std::string, FileDescriptor>> Router::connect_workers(const std::vector<std::string>& workers)
+{
+    std::vector<std::pair<std::string, FileDescriptor>> connected;
+    for (const auto& address : workers) {
+        connected.emplace_back(address, connect_to(address));
+    }
+    return connected;
+}
+
+void Router::attach(WorkerId id, Worker& worker, FileDescriptor fd)
+{
+    worker.control = std::make_unique<Connection>(loop_, std::move(fd), static_cast<Listener&>(*this));
+    controls_[worker.control->fd()] = id;
+
+    auto frame = pool_.acquire();
+    encode_request(frame, Request{Frame::Control, 0, 0, 0, {}});
+    worker.control->send(frame);
+    pool_.release(std::move(frame));
+}
+
+void Router::apply(std::vector<std::pair<std::string, FileDescriptor>> workers)
+{
+    std::vector<WorkerId> kept;
+    for (auto& [address, fd] : workers) {
+        auto known = std::find_if(std::begin(workers_), std::end(workers_), [&address = address] (const auto& worker) {
+            return worker.second.address == address;
+        });
+        WorkerId id;
+        if (known != std::end(workers_)) {
+            id = known->first;
+            // The connection just made is only needed if the last one was
+            // lost, and is closed otherwise
+            auto& worker = known->second;
+            if (!worker.control) {
+                attach(id, worker, std::move(fd));
+            }
+            worker.leaving = false;
+        } else {
+            id = next_worker_++;
+            auto& worker = workers_[id];
+            worker.address = address;
+            attach(id, worker, std::move(fd));
+        }
+        if (!ring_.contains(id)) {
+            ring_.add(id, address);
+        }
+        kept.push_back(id);
+    }
+
+    std::vector<WorkerId> unused;
+    for (auto& [id, worker] : workers_) {
+        if (std::find(std::begin(kept), std::end(kept), id) != std::end(kept) || worker.leaving) {
+            continue;
+        }
+        worker.leaving = true;
+        ring_.remove(id);
+        if (idle(worker)) {
+            unused.push_back(id);
+        }
+    }
+    for (const auto id : unused) {
+        retire(id);
+    }
+
+    for (auto& [id, routed] : games_) {
+        rebalance(id, routed);
+    }
+    start_waiting();
+}
+
+void Router::accept(int listener)
+{
+    while (true) {
+        FileDescriptor fd{::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)};
+        if (!fd) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+
+        // Fails harmlessly on Unix sockets
+        const int on = 1;
+        ::setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        const auto id = ++next_client_;
+        auto& client = clients_[id];
+        client.connection = std::make_unique<Connection>(loop_, std::move(fd), static_cast<Listener&>(*this));
+        client_ids_[client.connection->fd()] = id;
+    }
+}
+
+void Router::on_frame(Connection& connection, const std::uint8_t* frame, std::size_t size)
+{
+    if (auto client = client_ids_.find(connection.fd()); client != std::end(client_ids_)) {
+        on_request(client->second, frame, size);
+    } else if (auto upstream = upstreams_.find(connection.fd()); upstream != std::end(upstreams_)) {
+        on_reply(*upstream->second, frame, size);
+    } else if (auto worker = controls_.find(connection.fd()); worker != std::end(controls_)) {
+        on_control(worker->second, frame, size);
+    }
+}
+
+void Router::on_close(Connection& connection)
+{
+    if (auto iter = client_ids_.find(connection.fd()); iter != std::end(client_ids_)) {
+        const auto id = iter->second;
+        client_ids_.erase(iter);
+        auto& client = clients_.at(id);
+        // They are cleaned up as they close
+        for (auto& [worker, upstream] : client.upstreams) {
+            upstream->connection->close();
+        }
+        for (const auto game : client.games) {
+            auto& subscribers = games_.at(game).subscribers;
+            subscribers.erase(std::remove(std::begin(subscribers), std::end(subscribers), id), std::end(subscribers));
+        }
+        clients_.erase(id);
+        return;
+    }
+
+    if (auto iter = upstreams_.find(connection.fd()); iter != std::end(upstreams_)) {
+        const auto upstream = std::move(iter->second);
+        upstreams_.erase(iter);
+        abandon(*upstream);
+
+        auto client = clients_.find(upstream->client);
+        if (client == std::end(clients_)) {
+            return;
+        }
+        client->second.upstreams.erase(upstream->worker);
+        // The client would miss replies and updates, unless the worker left
+        // and has none to send
+        auto worker = workers_.find(upstream->worker);
+        if (worker != std::end(workers_) && !worker->second.leaving) {
+            client->second.connection->close();
+        }
+        return;
+    }
+
+    if (auto iter = controls_.find(connection.fd()); iter != std::end(controls_)) {
+        const auto id = iter->second;
+        controls_.erase(iter);
+        const auto control = std::move(workers_.at(id).control);
+        // Its releases will not be answered
+        for (const auto& [game, count] : workers_.at(id).releasing) {
+            releases_ -= count;
+        }
+        workers_.at(id).releasing.clear();
+        count_moves();
+
+        // Moves through the worker are given up, and games it was to import
+        // go back to where they came from
+        for (auto& [game, routed] : games_) {
+            switch (routed.move) {
+            case Move::Draining:
+                if (routed.worker == id || routed.to == id) {
+                    finish_move(game, routed, routed.worker);
+                }
+                break;
+            case Move::Exporting:
+            case Move::Resuming:
+                if (routed.worker == id) {
+                    finish_move(game, routed, routed.worker);
+                }
+                break;
+            case Move::Importing:
+                // The old worker still has it. If that one is gone instead,
+                // the import goes on and only the release is lost.
+                if (routed.to == id) {
+                    resume_game(game, routed);
+                }
+                break;
+            case Move::None:
+            case Move::Waiting:
+                break;
+            }
+        }
+        auto worker = workers_.find(id);
+        if (worker != std::end(workers_) && worker->second.leaving && worker->second.games == 0) {
+            workers_.erase(worker);
+        }
+    }
+}
+
+Router::Routed& Router::route(GameId id)
+{
+    auto routed = games_.find(id);
+    if (routed == std::end(games_)) {
+        Routed game;
+        game.worker = ring_.owner(id);
+        ++workers_.at(game.worker).games;
+        routed = games_.emplace(id, std::move(game)).first;
+    }
+    return routed->second;
+}
+
+void Router::confirm(GameId id, Routed& routed)
+{
+    if (routed.confirmed) {
+        return;
+    }
+    routed.confirmed = true;
+    rebalance(id, routed);
+    start_waiting();
+}
+
+void Router::forget(GameId id, Routed& routed)
+{
+    if (routed.confirmed || routed.in_flight > 0 || routed.move != Move::None) {
+        return;
+    }
+    for (const auto client : routed.subscribers) {
+        if (auto iter = clients_.find(client); iter != std::end(clients_)) {
+            auto& games = iter->second.games;
+            games.erase(std::remove(std::begin(games), std::end(games), id), std::end(games));
+        }
+    }
+    const auto owner = routed.worker;
+    games_.erase(id);
+
+    auto& worker = workers_.at(owner);
+    --worker.games;
+    if (worker.leaving && idle(worker)) {
+        retire(owner);
+    }
+}
+
+void Router::unsubscribe(ClientId client, GameId id, Routed& routed)
+{
+    auto& subscribers = routed.subscribers;
+    subscribers.erase(std::remove(std::begin(subscribers), std::end(subscribers), client), std::end(subscribers));
+    if (auto iter = clients_.find(client); iter != std::end(clients_)) {
+        auto& games = iter->second.games;
+        games.erase(std::remove(std::begin(games), std::end(games), id), std::end(games));
+    }
+}
+
+void Router::on_request(ClientId client, const std::uint8_t* frame, std::size_t size)
+{
+    Request request;
+    if (!decode_request(frame, size, request)) {
+        reply_error(*clients_.at(client).connection, 0, ErrorCode::BadRequest);
+        return;
+    }
+    // Moves are the router's, and downloads are served by each worker's
+    // archive
+    if ((request.type >= Frame::Export && request.type <= Frame::Control) || request.type == Frame::Replay) {
+        reply_error(*clients_.at(client).connection, request.game, ErrorCode::BadRequest);
+        return;
+    }
+
+    auto& routed = route(request.game);
+    if (paused(routed.move)) {
+        auto held = pool_.acquire();
+        held.assign(frame, frame + size);
+        routed.held.push_back(Held{client, std::move(held)});
+        return;
+    }
+    forward(client, request.game, routed, frame, size, true);
+    // Unless it was sent after all
+    forget(request.game, routed);
+}
+
+void Router::forward(
+    ClientId client, GameId id, Routed& routed, const std::uint8_t* frame, std::size_t size, bool for_client
+)
+{
+    auto iter = clients_.find(client);
+    if (iter == std::end(clients_)) {
+        return;
+    }
+    auto& owner = iter->second;
+    auto* upstream = this->upstream(client, owner, routed.worker);
+    if (!upstream) {
+        if (for_client) {
+            reply_error(*owner.connection, id, ErrorCode::Rejected);
+        }
+        return;
+    }
+
+    send_frame(*upstream->connection, frame, size);
+    upstream->due[id].push_back(Upstream::Due{static_cast<Frame>(frame[0]), for_client});
+    ++routed.in_flight;
+
+    auto& subscribers = routed.subscribers;
+    if (for_client && static_cast<Frame>(frame[0]) == Frame::Join
+        && std::find(std::begin(subscribers), std::end(subscribers), client) == std::end(subscribers)) {
+        subscribers.push_back(client);
+        owner.games.push_back(id);
+    }
+}
+
+Router::Upstream* Router::upstream(ClientId id, Client& client, WorkerId worker)
+{
+    if (auto known = client.upstreams.find(worker); known != std::end(client.upstreams)) {
+        return known->second;
+    }
+
+    FileDescriptor fd;
+    try {
+        fd = connect_to(workers_.at(worker).address);
+    } catch (const std::system_error&) {
+        return nullptr;
+    }
+    auto upstream = std::make_unique<Upstream>();
+    upstream->connection = std::make_unique<Connection>(loop_, std::move(fd), static_cast<Listener&>(*this));
+    upstream->client = id;
+    upstream->worker = worker;
+    auto* added = upstream.get();
+    upstreams_[added->connection->fd()] = std::move(upstream);
+    client.upstreams[worker] = added;
+    return added;
+}
+
+void Router::on_reply(Upstream& upstream, const std::uint8_t* frame, std::size_t size)
+{
+    Reply reply;
+    bool for_client = true;
+    if (decode_reply(frame, size, reply)) {
+        auto routed = games_.find(reply.game);
+        if (reply.type == Frame::Error && reply.error == ErrorCode::Moved) {
+            // The router joins the subscribers again where the game went
+            for_client = false;
+        } else if (reply.type == Frame::Ok || reply.type == Frame::Error) {
+            auto due = upstream.due.find(reply.game);
+            if (due != std::end(upstream.due) && routed != std::end(games_)) {
+                const auto answered = due->second.front();
+                for_client = answered.for_client;
+                due->second.pop_front();
+                if (due->second.empty()) {
+                    upstream.due.erase(due);
+                }
+                auto& game = routed->second;
+                if (reply.type == Frame::Ok) {
+                    confirm(reply.game, game);
+                } else {
+                    // The worker did not subscribe the client
+                    if (answered.type == Frame::Join) {
+                        unsubscribe(upstream.client, reply.game, game);
+                    }
+                    if (reply.error == ErrorCode::NoSuchGame) {
+                        game.confirmed = false;
+                    }
+                }
+                if (--game.in_flight == 0 && game.move == Move::Draining) {
+                    export_game(reply.game, game);
+                }
+                forget(reply.game, game);
+            }
+        } else if (routed != std::end(games_) && routed->second.worker != upstream.worker) {
+            // From where the game was, and covered by the Snapshot from
+            // where it is now
+            for_client = false;
+        }
+    }
+
+    if (!for_client) {
+        return;
+    }
+    if (auto client = clients_.find(upstream.client); client != std::end(clients_)) {
+        send_frame(*client->second.connection, frame, size);
+    }
+}
+
+void Router::abandon(Upstream& upstream)
+{
+    auto due = std::move(upstream.due);
+    upstream.due.clear();
+    for (const auto& [game, replies] : due) {
+        auto& routed = games_.at(game);
+        routed.in_flight -= replies.size();
+        if (routed.in_flight == 0 && routed.move == Move::Draining) {
+            export_game(game, routed);
+        }
+        forget(game, routed);
+    }
+}
+
+void Router::rebalance(GameId id, Routed& routed)
+{
+    if (!routed.confirmed || routed.move != Move::None || ring_.owner(id) == routed.worker) {
+        return;
+    }
+    routed.move = Move::Waiting;
+    waiting_.push_back(id);
+    count_moves();
+}
+
+void Router::start_waiting()
+{
+    // Moves that finish straight away start the next ones from this loop
+    if (starting_) {
+        return;
+    }
+    starting_ = true;
+    while (moving_ < concurrent_moves_ && !waiting_.empty()) {
+        const auto id = waiting_.front();
+        waiting_.pop_front();
+        auto& routed = games_.at(id);
+        const auto owner = ring_.owner(id);
+        if (owner == routed.worker) {
+            routed.move = Move::None;
+            continue;
+        }
+
+        ++moving_;
+        routed.move = Move::Draining;
+        routed.to = owner;
+        routed.paused_at = Clock::now();
+        ++workers_.at(owner).games;
+        if (routed.in_flight == 0) {
+            export_game(id, routed);
+        }
+    }
+    starting_ = false;
+    count_moves();
+}
+
+void Router::export_game(GameId id, Routed& routed)
+{
+    auto& control = workers_.at(routed.worker).control;
+    if (!control || control->closed()) {
+        finish_move(id, routed, routed.worker);
+        return;
+    }
+    routed.move = Move::Exporting;
+    auto frame = pool_.acquire();
+    encode_request(frame, Request{Frame::Export, id, 0, 0, {}});
+    control->send(frame);
+    pool_.release(std::move(frame));
+}
+
+void Router::import_game(GameId id, Routed& routed)
+{
+    auto& control = workers_.at(routed.to).control;
+    if (!control || control->closed()) {
+        resume_game(id, routed);
+        return;
+    }
+    routed.move = Move::Importing;
+    control->send(routed.imported);
+}
+
+void Router::resume_game(GameId id, Routed& routed)
+{
+    auto& control = workers_.at(routed.worker).control;
+    if (!control || control->closed()) {
+        finish_move(id, routed, routed.worker);
+        return;
+    }
+    routed.move = Move::Resuming;
+    auto frame = pool_.acquire();
+    encode_request(frame, Request{Frame::Resume, id, 0, 0, {}});
+    control->send(frame);
+    pool_.release(std::move(frame));
+}
+
+void Router::on_control(WorkerId worker, const std::uint8_t* frame, std::size_t size)
+{
+    Reply reply;
+    if (!decode_reply(frame, size, reply)) {
+        return;
+    }
+    auto& from = workers_.at(worker);
+    if (auto released = from.releasing.find(reply.game); released != std::end(from.releasing)) {
+        if (--released->second == 0) {
+            from.releasing.erase(released);
+        }
+        --releases_;
+        count_moves();
+        if (from.leaving && idle(from)) {
+            retire(worker);
+        }
+        return;
+    }
+    auto iter = games_.find(reply.game);
+    if (iter == std::end(games_)) {
+        return;
+    }
+    const auto id = iter->first;
+    auto& routed = iter->second;
+
+    if (routed.move == Move::Exporting && worker == routed.worker) {
+        Replicated exported;
+        if (reply.type == Frame::Replica && decode_replicated(reply, exported)) {
+            routed.imported = pool_.acquire();
+            const auto start = begin_import(routed.imported, id, exported.dice);
+            routed.imported.insert(std::end(routed.imported), exported.payload, exported.payload + exported.size);
+            end_frame(routed.imported, start);
+            import_game(id, routed);
+        } else if (reply.type == Frame::Error && reply.error == ErrorCode::NoSuchGame) {
+            // Gone from the worker, archived perhaps, so there is nothing
+            // to move
+            routed.confirmed = false;
+            finish_move(id, routed, routed.worker);
+            forget(id, routed);
+        } else {
+            finish_move(id, routed, routed.worker);
+        }
+    } else if (routed.move == Move::Importing && worker == routed.to) {
+        if (reply.type != Frame::Ok) {
+            resume_game(id, routed);
+            return;
+        }
+        // The old worker forgets the game only now that the new one has it
+        auto& old = workers_.at(routed.worker);
+        if (old.control && !old.control->closed()) {
+            auto release = pool_.acquire();
+            encode_request(release, Request{Frame::Release, id, 0, 0, {}});
+            old.control->send(release);
+            pool_.release(std::move(release));
+            ++old.releasing[id];
+            ++releases_;
+        }
+        finish_move(id, routed, routed.to);
+    } else if (routed.move == Move::Resuming && worker == routed.worker) {
+        finish_move(id, routed, routed.worker);
+    }
+}
+
+void Router::finish_move(GameId id, Routed& routed, WorkerId owner)
+{
+    const auto from = routed.worker;
+    const auto to = routed.to;
+    // The game was counted on both workers while it moved
+    if (owner != from) {
+        --workers_.at(from).games;
+    }
+    if (owner != to && to != from) {
+        --workers_.at(to).games;
+    }
+    routed.worker = owner;
+    routed.move = Move::None;
+    pool_.release(std::exchange(routed.imported, {}));
+    --moving_;
+
+    const auto pause = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - routed.paused_at).count();
+    total_pause_.store(total_pause_.load(std::memory_order_relaxed) + pause, std::memory_order_relaxed);
+    if (pause > longest_pause_.load(std::memory_order_relaxed)) {
+        longest_pause_.store(pause, std::memory_order_relaxed);
+    }
+
+    if (owner != from) {
+        moved_.store(moved_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        // Subscribers start over from a Snapshot where the game is now
+        auto join = pool_.acquire();
+        encode_request(join, Request{Frame::Join, id, 0, 0, {}});
+        for (const auto client : routed.subscribers) {
+            forward(client, id, routed, join.data() + length_size, join.size() - length_size, false);
+        }
+        pool_.release(std::move(join));
+    }
+    // Then the requests made meanwhile go on, in order
+    auto held = std::move(routed.held);
+    routed.held.clear();
+    for (auto& request : held) {
+        forward(request.client, id, routed, request.frame.data(), request.frame.size(), true);
+        pool_.release(std::move(request.frame));
+    }
+
+    for (const auto worker : {from, to}) {
+        auto left = workers_.find(worker);
+        if (left != std::end(workers_) && left->second.leaving && idle(left->second)) {
+            retire(worker);
+        }
+    }
+    // Hashing may have changed while it moved. One that failed to move
+    // stays until the workers change again.
+    if (owner == to || ring_.owner(id) != to) {
+        rebalance(id, routed);
+    }
+    start_waiting();
+}
+
+void Router::retire(WorkerId id)
+{
+    auto& worker = workers_.at(id);
+    for (auto& [fd, upstream] : upstreams_) {
+        if (upstream->worker == id) {
+            upstream->connection->close();
+        }
+    }
+    // Forgotten once the connection is closed
+    if (worker.control) {
+        worker.control->close();
+    } else {
+        workers_.erase(id);
+    }
+}
+
+bool Router::idle(const Worker& worker)
+{
+    return worker.games == 0 && worker.releasing.empty();
+}
+
+bool Router::paused(Move move)
+{
+    return move == Move::Draining || move == Move::Exporting || move == Move::Importing || move == Move::Resuming;
+}
+
+void Router::count_moves()
+{
+    moving_count_.store(moving_ + waiting_.size() + releases_, std::memory_order_relaxed);
+}
+
+void Router::send_frame(Connection& connection, const std::uint8_t* frame, std::size_t size)
+{
+    auto out = pool_.acquire();
+    out.push_back(static_cast<std::uint8_t>(size));
+    out.push_back(static_cast<std::uint8_t>(size >> 8));
+    out.insert(std::end(out), frame, frame + size);
+    connection.send(out);
+    pool_.release(std::move(out));
+}
+
+void Router::reply_error(Connection& connection, GameId game, ErrorCode error)
+{
+    auto reply = pool_.acquire();
+    encode_error(reply, game, error);
+    connection.send(reply);
+    pool_.release(std::move(reply));
+}
+
+}
+
+}
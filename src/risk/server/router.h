@@ -0,0 +1,271 @@
+#pragma once
+
+#include "risk/server/buffer_pool.h"
+#include "risk/server/connection.h"
+#include "risk/server/event_loop.h"
+#include "risk/server/hash_ring.h"
+#include "risk/server/protocol.h"
+#include "risk/server/socket.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+struct RouterOptions {
+    // Listens on TCP when set. Port 0 picks a free port, see Router::port.
+    std::string host = "127.0.0.1";
+    std::optional<std::uint16_t> port;
+    // Listens on a Unix socket when not empty
+    std::string unix_path;
+    // The servers the games are spread over, "host:port" or a Unix socket
+    // path each
+    std::vector<std::string> workers;
+    // Games moved at once. The others keep being served where they are
+    // until their turn, so each game is only held up for its own move.
+    std::size_t concurrent_moves = 32;
+};
+
+// Spreads games over worker servers by consistent hashing of their ids,
+// and serves clients as one server would. A client's requests go to the
+// worker owning the game, on a connection to that worker the router opens
+// for the client, and what comes back on it goes to the client as it is.
+//
+// When the workers change, the games whose owner changed move, each on
+// its own: requests for the game are held back, and once those already
+// sent are answered the old worker Exports the game and the new one
+// Imports it. The old worker keeps the game until the Import is answered,
+// then Releases it, or Resumes it if the Import failed, so a game is never
+// lost on the way. Then the clients that had joined the game join it
+// again on the new worker, each getting a fresh Snapshot, and the held
+// requests go on there. A worker that left is disconnected once its games
+// are gone.
+//
+// The router moves games on a connection of its own to each worker, which
+// tells the worker so with a Control frame; workers take moves from no
+// other connection, and the router passes none on from its clients. It
+// only knows of the games a worker answered its requests for with Ok, so
+// the workers are only to be reached through it. A worker that goes away takes its games
+// with it: moves to or from it are given up, leaving the game where it
+// was.
+//
+// Runs on one thread, apart from set_workers.
+class Router : private EventLoop::Handler, private Connection::Listener {
+public:
+    struct Migrations {
+        // Since the router started
+        std::size_t moved = 0;
+        // Moving now, or waiting to, including games the old worker has
+        // yet to release
+        std::size_t moving = 0;
+        // How long the requests for a game were held back while it moved
+        std::chrono::microseconds longest_pause{0};
+        std::chrono::microseconds total_pause{0};
+    };
+
+    explicit Router(RouterOptions options);
+    ~Router() override;
+
+    // The bound TCP port
+    std::uint16_t port() const { return port_; }
+
+    // Runs until stop is called
+    void run();
+    // Safe to call from any thread or a signal handler
+    void stop();
+
+    // Moves the games to where hashing puts them among `workers`. Connects
+    // to new workers on the calling thread, so an unreachable one is a
+    // std::system_error and changes nothing. Safe to call from any thread.
+    void set_workers(const std::vector<std::string>& workers);
+
+    // Safe to call from any thread
+    Migrations migrations() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+    using WorkerId = HashRing::Node;
+    using ClientId = std::uint64_t;
+
+    class Acceptor;
+
+    struct Worker {
+        std::string address;
+        // The router's own connection, which moves games
+        std::unique_ptr<Connection> control;
+        // Off the ring, and disconnected once it has no games and no
+        // releases left to answer
+        bool leaving = false;
+        // Routed to it, or moving to it
+        std::size_t games = 0;
+        // Releases sent for each game and not answered yet, whose replies
+        // are not to be taken for those to later moves
+        std::unordered_map<GameId, std::size_t> releasing;
+    };
+
+    // A client's connection to a worker
+    struct Upstream {
+        std::unique_ptr<Connection> connection;
+        ClientId client = 0;
+        WorkerId worker = 0;
+        // For each game, the requests still to be answered, in order
+        struct Due {
+            Frame type;
+            // False for the router's own
+            bool for_client;
+        };
+        std::unordered_map<GameId, std::deque<Due>> due;
+    };
+
+    struct Client {
+        std::unique_ptr<Connection> connection;
+        // By worker, once the client had a request for it
+        std::unordered_map<WorkerId, Upstream*> upstreams;
+        // Joined, to be joined again wherever the games move
+        std::vector<GameId> games;
+    };
+
+    // A request held back while its game moves
+    struct Held {
+        ClientId client;
+        Buffer frame;
+    };
+
+    enum class Move : std::uint8_t {
+        None,
+        Waiting,   // for a free slot, requests still flow
+        Draining,  // requests are held until those sent are answered
+        Exporting, // the old worker is asked for the game
+        Importing, // the new worker is handed it
+        Resuming,  // the old worker is told to go on with it
+    };
+
+    // A game the router has routed a request for
+    struct Routed {
+        WorkerId worker = 0;
+        // The worker answered a request for it with Ok, so it has the
+        // game. Only such games are moved, and others are forgotten once
+        // their requests are answered, as are games the worker answers
+        // with NoSuchGame.
+        bool confirmed = false;
+        // Requests sent to the worker and not answered yet
+        std::size_t in_flight = 0;
+        std::vector<ClientId> subscribers;
+        Move move = Move::None;
+        WorkerId to = 0;
+        Clock::time_point paused_at{};
+        std::deque<Held> held;
+        // The Import frame, while it is being imported
+        Buffer imported;
+    };
+
+    // Wakeups from set_workers
+    void on_events(std::uint32_t events) override;
+
+    void on_frame(Connection& connection, const std::uint8_t* frame, std::size_t size) override;
+    void on_close(Connection& connection) override;
+
+    void accept(int listener);
+    // Makes `fd` the router's own connection to the worker
+    void attach(WorkerId id, Worker& worker, FileDescriptor fd);
+    // Connects to `workers` and hands the connections to the loop
+    std::vector<std::pair<std::string, FileDescriptor>> connect_workers(const std::vector<std::string>& workers);
+    // On the loop, puts the ring in line with `workers`
+    void apply(std::vector<std::pair<std::string, FileDescriptor>> workers);
+
+    Routed& route(GameId id);
+    // Moves the game if it was just confirmed where hashing no longer
+    // puts it
+    void confirm(GameId id, Routed& routed);
+    // Drops the route of a game that is not confirmed and has nothing
+    // under way
+    void forget(GameId id, Routed& routed);
+    void unsubscribe(ClientId client, GameId id, Routed& routed);
+    void on_request(ClientId client, const std::uint8_t* frame, std::size_t size);
+    // Sends a request to the worker the game is routed to, on the client's
+    // upstream connection to it. `for_client` is false for the router's own.
+    void forward(ClientId client, GameId id, Routed& routed, const std::uint8_t* frame, std::size_t size, bool for_client);
+    // The client's connection to the worker, made if it has none, or null
+    // if the worker cannot be reached
+    Upstream* upstream(ClientId id, Client& client, WorkerId worker);
+    void on_reply(Upstream& upstream, const std::uint8_t* frame, std::size_t size);
+    // Forgets what was due on a connection that closed
+    void abandon(Upstream& upstream);
+
+    // Moves a confirmed game if hashing puts it elsewhere now
+    void rebalance(GameId id, Routed& routed);
+    void export_game(GameId id, Routed& routed);
+    // Sends the exported game to where it moves, or has the old worker go
+    // on with it if that cannot be reached
+    void import_game(GameId id, Routed& routed);
+    void resume_game(GameId id, Routed& routed);
+    void on_control(WorkerId worker, const std::uint8_t* frame, std::size_t size);
+    // Routes the game to `owner` and lets its held requests go
+    void finish_move(GameId id, Routed& routed, WorkerId owner);
+    // Starts waiting moves while there is room
+    void start_waiting();
+    // Disconnects a worker that left and is idle
+    void retire(WorkerId worker);
+    // With no games and no releases to answer
+    static bool idle(const Worker& worker);
+    // Requests for a game are held back from draining until it has moved
+    static bool paused(Move move);
+    void count_moves();
+
+    // Adds the length prefix
+    void send_frame(Connection& connection, const std::uint8_t* frame, std::size_t size);
+    void reply_error(Connection& connection, GameId game, ErrorCode error);
+
+    const std::size_t concurrent_moves_;
+
+    EventLoop loop_;
+    FileDescriptor wakeup_;
+    BufferPool pool_;
+    std::vector<std::unique_ptr<Acceptor>> acceptors_;
+    std::uint16_t port_ = 0;
+
+    HashRing ring_;
+    std::unordered_map<WorkerId, Worker> workers_;
+    WorkerId next_worker_ = 0;
+    std::unordered_map<int, WorkerId> controls_;
+
+    ClientId next_client_ = 0;
+    std::unordered_map<int, ClientId> client_ids_;
+    std::unordered_map<ClientId, Client> clients_;
+    // Outlive their clients until they are closed too
+    std::unordered_map<int, std::unique_ptr<Upstream>> upstreams_;
+
+    std::unordered_map<GameId, Routed> games_;
+    // Moving games, apart from the waiting ones
+    std::size_t moving_ = 0;
+    // Releases sent to any worker and not answered yet
+    std::size_t releases_ = 0;
+    std::deque<GameId> waiting_;
+    bool starting_ = false;
+
+    // Handed over by set_workers
+    std::mutex pending_mutex_;
+    std::optional<std::vector<std::pair<std::string, FileDescriptor>>> pending_;
+
+    // For migrations(), only written on the loop's thread. Pauses are in
+    // microseconds.
+    std::atomic<std::size_t> moved_{0};
+    std::atomic<std::size_t> moving_count_{0};
+    std::atomic<std::int64_t> longest_pause_{0};
+    std::atomic<std::int64_t> total_pause_{0};
+};
+
+}
+
+}
@@ -0,0 +1,217 @@
+#include "risk/server/server.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+
+namespace risk {
+
+namespace server {
+
+// Listening sockets are served by the first shard, which hands the
+// connections out
+class Server::Acceptor : public EventLoop::Handler {
+public:
+    Acceptor(Server& server, FileDescriptor fd)
+        : server_(server)
+        , fd_(std::move(fd))
+    {
+        server_.shards_.front()->loop().add(fd_.get(), EPOLLIN, *this);
+    }
+
+    ~Acceptor() override { server_.shards_.front()->loop().remove(fd_.get()); }
+
+    void on_events(std::uint32_t) override { server_.accept(fd_.get()); }
+
+private:
+    Server& server_;
+    FileDescriptor fd_;
+};
+
+Server::Server(ServerOptions options)
+{
+    rules::ensure(options.shards > 0 && options.shards <= Shard::max_shards, std::invalid_argument("Shard count not in range"));
+
+    if (!options.archive_dir.empty()) {
+        rules::ensure(
+            !options.wal_dir.empty() && options.snapshot_interval.count() > 0,
+            std::invalid_argument("An archive needs a log with snapshots")
+        );
+        archiver_ = std::make_unique<Archiver>(options.archive_dir);
+        if (options.replay_port) {
+            auto fd = listen_tcp(options.host, *options.replay_port);
+            replay_port_ = local_port(fd.get());
+            archiver_->serve(std::move(fd));
+        }
+        if (!options.replay_unix_path.empty()) {
+            archiver_->serve(listen_unix(options.replay_unix_path));
+        }
+    }
+    rules::ensure(
+        archiver_ || (!options.replay_port && options.replay_unix_path.empty()),
+        std::invalid_argument("Replays need an archive")
+    );
+
+    shards_.reserve(options.shards);
+    for (std::size_t i = 0; i < options.shards; ++i) {
+        shards_.push_back(std::make_unique<Shard>(
+            i, options.shards, shards_, options.backlog, options.coalesce, options.turn_timeout
+        ));
+    }
+    if (!options.wal_dir.empty()) {
+        for (auto& shard : shards_) {
+            if (archiver_) {
+                shard->archive_to(*archiver_);
+            }
+            shard->open_log(options.wal_dir, options.commit_window, options.snapshot_interval, options.io);
+            if (options.hibernate_after.count() > 0) {
+                shard->hibernate_idle_games(options.hibernate_after);
+            }
+        }
+    }
+
+    if (!options.follow.empty()) {
+        rules::ensure(!archiver_, std::invalid_argument("A standby keeps no archive"));
+        for (auto& shard : shards_) {
+            shard->follow(connect_to(options.follow));
+        }
+    }
+
+    if (options.port) {
+        auto fd = listen_tcp(options.host, *options.port);
+        port_ = local_port(fd.get());
+        acceptors_.push_back(std::make_unique<Acceptor>(*this, std::move(fd)));
+    }
+    if (!options.unix_path.empty()) {
+        acceptors_.push_back(std::make_unique<Acceptor>(*this, listen_unix(options.unix_path)));
+    }
+    rules::ensure(!acceptors_.empty(), std::invalid_argument("Server needs a TCP port or a Unix socket path"));
+}
+
+Server::~Server()
+{
+    stop();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+    if (archiver_thread_.joinable()) {
+        archiver_->loop().stop();
+        archiver_thread_.join();
+    }
+    acceptors_.clear();
+}
+
+void Server::run()
+{
+    if (archiver_) {
+        archiver_thread_ = std::thread([archiver = archiver_.get()] { archiver->run(); });
+    }
+    for (std::size_t i = 1; i < shards_.size(); ++i) {
+        threads_.emplace_back([shard = shards_[i].get()] { shard->loop().run(); });
+    }
+
+    shards_.front()->loop().run();
+
+    stop();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+    threads_.clear();
+
+    // Once the shards can hand it nothing more
+    if (archiver_) {
+        archiver_->loop().stop();
+        archiver_thread_.join();
+    }
+}
+
+void Server::stop()
+{
+    for (auto& shard : shards_) {
+        shard->loop().stop();
+    }
+}
+
+void Server::promote()
+{
+    for (auto& shard : shards_) {
+        shard->promote();
+    }
+}
+
+std::size_t Server::games() const
+{
+    std::size_t games = 0;
+    for (const auto& shard : shards_) {
+        games += shard->games();
+    }
+    return games;
+}
+
+std::size_t Server::hibernated_games() const
+{
+    std::size_t games = 0;
+    for (const auto& shard : shards_) {
+        games += shard->hibernated_games();
+    }
+    return games;
+}
+
+std::size_t Server::connections() const
+{
+    std::size_t connections = 0;
+    for (const auto& shard : shards_) {
+        connections += shard->connections();
+    }
+    return connections;
+}
+
+Replication Server::replication() const
+{
+    Replication total;
+    for (const auto& shard : shards_) {
+        const auto replication = shard->replication();
+        total.followers += replication.followers;
+        total.behind = std::max(total.behind, replication.behind);
+        total.lag = std::max(total.lag, replication.lag);
+        total.following += replication.following;
+    }
+    return total;
+}
+
+void Server::accept(int listener)
+{
+    auto& first = *shards_.front();
+
+    while (true) {
+        FileDescriptor fd{::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)};
+        if (!fd) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // EAGAIN once drained. Out of descriptors is not fatal either,
+            // the backlog is retried on the next connection.
+            return;
+        }
+
+        // Updates are small and latency bound. Fails harmlessly on Unix sockets.
+        const int on = 1;
+        ::setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        const auto shard = next_shard_++ % shards_.size();
+        if (shard == 0) {
+            first.adopt(std::move(fd));
+        } else {
+            first.post(shard, Shard::Message{Shard::Message::Kind::Adopt, 0, 0, fd.release(), {}, {}});
+        }
+    }
+}
+
+}
+
+}
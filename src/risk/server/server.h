@@ -0,0 +1,129 @@
+#pragma once
+
+#include "risk/server/archive.h"
+#include "risk/server/event_loop.h"
+#include "risk/server/shard.h"
+#include "risk/server/socket.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+struct ServerOptions {
+    // Listens on TCP when set. Port 0 picks a free port, see Server::port.
+    std::string host = "127.0.0.1";
+    std::optional<std::uint16_t> port;
+    // Listens on a Unix socket when not empty
+    std::string unix_path;
+    // Worker threads, each running one Shard. Games are assigned to shards
+    // by id, connections round-robin.
+    std::size_t shards = 1;
+    // Bytes a subscriber may have waiting to be sent before it skips
+    // updates, to be sent a Snapshot once it has caught up
+    std::size_t backlog = Shard::default_backlog;
+    // A game's Delta is held back until this long after its previous one,
+    // so the moves in between go out as one. Zero sends every change.
+    std::chrono::milliseconds coalesce{0};
+    // A player who has not moved in a started game for this long has the
+    // rest of their turn played for them. Zero waits forever.
+    std::chrono::milliseconds turn_timeout{0};
+    // Logs every accepted request to a write-ahead log per shard in this
+    // directory when not empty, and replays the logs on startup. A log
+    // can only be replayed by a server with the same number of shards.
+    std::string wal_dir;
+    // How long the log gathers records before syncing them, at the cost of
+    // that much latency. Zero syncs once per batch of events.
+    std::chrono::milliseconds commit_window{0};
+    // How often each shard snapshots its games so its log can start over,
+    // which bounds how much of the log a restart replays. Zero never does.
+    std::chrono::milliseconds snapshot_interval{60000};
+    // A game nobody has asked for in this long is moved out of memory to
+    // a file in wal_dir, until it is asked for again. Zero keeps every
+    // game in memory, as does running without a log.
+    std::chrono::milliseconds hibernate_after{0};
+    // How the log is written and synced
+    DiskIo::Backend io = DiskIo::Backend::Automatic;
+    // Keeps every game that ends in an archive in this directory when not
+    // empty, as of the first snapshot after it ends. Needs wal_dir and a
+    // snapshot_interval.
+    std::string archive_dir;
+    // Serves downloads of archived games on this TCP port, see
+    // Server::replay_port, and/or Unix socket when set. They are served by
+    // the archive's thread, apart from the shards. Needs archive_dir.
+    std::optional<std::uint16_t> replay_port;
+    std::string replay_unix_path;
+    // Runs as a hot standby of the server at this address, "host:port" or
+    // a Unix socket path, when not empty. Each shard follows the shard of
+    // the primary with the same index, so both need as many shards, and
+    // the primary needs a log. The standby starts out empty, with its
+    // wal_dir if any, and serves the games as they change but takes no
+    // moves until it is promoted. It keeps no archive.
+    std::string follow;
+};
+
+// Hosts games on the classic board and serves them over the binary
+// protocol in protocol.h. Every request is answered with an Ok or Error
+// frame for its game; replies for the same game arrive in order. Joining
+// is answered with a Snapshot, and after every change each subscriber
+// gets a Delta to apply to the state it has; with `coalesce` one Delta
+// may cover several changes. A slow subscriber may get a new Snapshot in
+// place of the Deltas it could not keep up with. With a write-ahead log,
+// replies and updates are only sent once the change is durable. Standbys
+// connect to a server with a log like clients do and follow it, see
+// ServerOptions::follow.
+class Server {
+public:
+    explicit Server(ServerOptions options);
+    ~Server();
+
+    // The bound TCP port
+    std::uint16_t port() const { return port_; }
+    // The bound TCP port for downloads of archived games
+    std::uint16_t replay_port() const { return replay_port_; }
+
+    // Runs the first shard on the calling thread and the others on their
+    // own, until stop is called
+    void run();
+    // Safe to call from any thread or a signal handler
+    void stop();
+    // Has a standby stop following and take moves. Safe to call from any
+    // thread or a signal handler.
+    void promote();
+
+    std::size_t shards() const { return shards_.size(); }
+
+    // Only meaningful once the server has stopped
+    std::size_t games() const;
+    std::size_t hibernated_games() const;
+    std::size_t connections() const;
+    // Safe to call from any thread while running. Counts the followers and
+    // followed shards, and has the worst lag of any shard.
+    Replication replication() const;
+
+private:
+    class Acceptor;
+
+    void accept(int listener);
+
+    // Outlives the shards, which hand it games until they are gone
+    std::unique_ptr<Archiver> archiver_;
+    std::thread archiver_thread_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::vector<std::unique_ptr<Acceptor>> acceptors_;
+    std::vector<std::thread> threads_;
+    std::uint16_t port_ = 0;
+    std::uint16_t replay_port_ = 0;
+    std::size_t next_shard_ = 0;
+};
+
+}
+
+}
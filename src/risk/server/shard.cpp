@@ -0,0 +1,1461 @@
+#include "risk/server/shard.h"
+
+#include <dirent.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+namespace risk {
+
+namespace server {
+
+using namespace risk::rules;
+
+namespace {
+
+std::size_t shard_of_client(ClientId client)
+{
+    return client % Shard::max_shards;
+}
+
+// Taken from a router's connection only
+bool moves_game(Frame type)
+{
+    return type == Frame::Export || type == Frame::Import || type == Frame::Release || type == Frame::Resume;
+}
+
+// minstd_rand has no accessor for its state, only a stream operator, and
+// seeding it with its state restores it
+std::uint32_t dice_state(const std::minstd_rand& dice)
+{
+    std::ostringstream out;
+    out << dice;
+    return static_cast<std::uint32_t>(std::stoul(out.str()));
+}
+
+// Kept with each game in the arena
+constexpr std::uint32_t turn_running = 1;
+constexpr std::uint32_t game_over = 2;
+// In place of an exported or archived game, which keeps its slot
+constexpr std::uint32_t exported = 4;
+constexpr std::uint32_t archived = 8;
+
+std::uint32_t arena_flags(const State& state)
+{
+    if (state.phase() == Phase::GameOver) {
+        return game_over;
+    }
+    return state.phase() != Phase::Placing ? turn_running : 0;
+}
+
+// The generations of the shard's log files in `directory`, in order
+std::vector<std::uint64_t> log_generations(const std::string& directory, std::size_t shard)
+{
+    std::unique_ptr<DIR, int (*)(DIR*)> dir{::opendir(directory.c_str()), ::closedir};
+    if (!dir) {
+        throw std::system_error(errno, std::generic_category(), "opendir " + directory);
+    }
+
+    const auto prefix = "shard-" + std::to_string(shard) + ".";
+    const std::string suffix = ".wal";
+    std::vector<std::uint64_t> generations;
+    while (const auto* entry = ::readdir(dir.get())) {
+        const std::string name = entry->d_name;
+        if (name.size() > prefix.size() + suffix.size() && name.compare(0, prefix.size(), prefix) == 0
+            && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            generations.push_back(std::stoull(name.substr(prefix.size())));
+        }
+    }
+    std::sort(std::begin(generations), std::end(generations));
+    return generations;
+}
+
+// What a stalled player is made to do next, best first. The game decides
+// which of them is legal.
+std::vector<Command> fallback_moves(const State& state)
+{
+    const auto player = state.current_player();
+    const auto territories = state.board().territories();
+    std::vector<Command> moves;
+
+    switch (state.phase()) {
+    case Phase::Placing:
+        for (const auto& territory : territories) {
+            if (!territory.owner()) {
+                moves.push_back(PlaceUnit{player.id(), territory.id()});
+                return moves;
+            }
+        }
+        [[fallthrough]];
+    case Phase::Reinforce:
+        for (const auto& territory : territories) {
+            if (territory.owner() == player.id()) {
+                moves.push_back(PlaceUnit{player.id(), territory.id()});
+                return moves;
+            }
+        }
+        break;
+    case Phase::TradeCards: {
+        moves.push_back(EndPhase{player.id()});
+        const auto cards = player.cards().size();
+        for (std::size_t a = 0; a < cards; ++a) {
+            for (std::size_t b = a + 1; b < cards; ++b) {
+                for (std::size_t c = b + 1; c < cards; ++c) {
+                    moves.push_back(TradeCards{player.id(), {a, b, c}});
+                }
+            }
+        }
+        break;
+    }
+    case Phase::Occupy:
+        moves.push_back(Occupy{player.id(), state.turn().occupation->min_units});
+        break;
+    case Phase::Attack:
+    case Phase::Fortify:
+        moves.push_back(EndPhase{player.id()});
+        break;
+    case Phase::GameOver:
+        break;
+    }
+    return moves;
+}
+
+}
+
+Shard::Shard(std::size_t index, std::size_t count, const std::vector<std::unique_ptr<Shard>>& peers,
+             std::size_t backlog, std::chrono::milliseconds window, std::chrono::milliseconds turn_timeout)
+    : index_(index)
+    , peers_(peers)
+    , backlog_(backlog)
+    , window_(window)
+    , turn_timeout_(turn_timeout)
+    , wakeup_(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    , timer_(::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+    , codec_(classic_board())
+    , outbox_(count)
+    , wake_(count, false)
+    , replicator_(loop_, pool_, *this)
+    , timers_(tick(Clock::now()))
+{
+    ensure(count > 0 && count <= max_shards, std::invalid_argument("Shard count not in range"));
+    if (!wakeup_) {
+        throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+    if (!timer_) {
+        throw std::system_error(errno, std::generic_category(), "timerfd_create");
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+        inbox_.push_back(std::make_unique<SpscQueue<Message>>(queue_capacity));
+    }
+    loop_.add(wakeup_.get(), EPOLLIN, *this);
+    loop_.add(timer_.get(), EPOLLIN, *this);
+}
+
+Shard::~Shard()
+{
+    // Syncing the log may finish a snapshot, which needs the rest of the
+    // shard
+    if (io_) {
+        loop_.remove(io_->ready_fd());
+        wal_.reset();
+        io_.reset();
+    }
+    loop_.remove(timer_.get());
+    loop_.remove(wakeup_.get());
+}
+
+void Shard::adopt(FileDescriptor fd)
+{
+    const int client_fd = fd.get();
+    const ClientId id = (++next_client_ * max_shards) | index_;
+    auto connection = std::make_unique<Connection>(loop_, std::move(fd), static_cast<Listener&>(*this));
+    client_ids_[client_fd] = id;
+    clients_[id] = Client{std::move(connection), {}};
+}
+
+void Shard::post(std::size_t to, Message message)
+{
+    if (to == index_) {
+        receive(std::move(message));
+        return;
+    }
+
+    // Keep the order of messages to a shard once one had to wait
+    auto& outbox = outbox_[to];
+    if (!outbox.empty() || !peers_[to]->inbox_[index_]->try_push(std::move(message))) {
+        outbox.push_back(std::move(message));
+        backlogged_.store(true, std::memory_order_release);
+    }
+    wake_[to] = true;
+
+    // One wakeup per peer per batch of events
+    if (!flush_scheduled_) {
+        flush_scheduled_ = true;
+        loop_.defer([this] { flush_outbox(); });
+    }
+}
+
+void Shard::flush_outbox()
+{
+    flush_scheduled_ = false;
+
+    bool backlogged = false;
+    for (std::size_t to = 0; to < outbox_.size(); ++to) {
+        auto& outbox = outbox_[to];
+        auto& queue = *peers_[to]->inbox_[index_];
+        while (!outbox.empty() && queue.try_push(std::move(outbox.front()))) {
+            outbox.pop_front();
+        }
+        backlogged = backlogged || !outbox.empty();
+
+        if (wake_[to]) {
+            wake_[to] = false;
+            peers_[to]->wake();
+        }
+    }
+    backlogged_.store(backlogged, std::memory_order_release);
+}
+
+void Shard::wake()
+{
+    const std::uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(wakeup_.get(), &one, sizeof(one));
+}
+
+void Shard::on_events(std::uint32_t)
+{
+    std::uint64_t value;
+    while (::read(wakeup_.get(), &value, sizeof(value)) > 0) {}
+    while (::read(timer_.get(), &value, sizeof(value)) > 0) {}
+    if (promote_.exchange(false, std::memory_order_acq_rel)) {
+        take_over();
+    }
+    if (io_) {
+        io_->reap();
+        release_committed();
+    }
+
+    for (std::size_t from = 0; from < inbox_.size(); ++from) {
+        const auto count = inbox_[from]->drain([this] (Message&& message) { receive(std::move(message)); });
+
+        // The sender may be waiting for the room just made
+        if (count > 0 && from != index_ && peers_[from]->backlogged_.load(std::memory_order_acquire)) {
+            peers_[from]->wake();
+        }
+    }
+
+    expire_timers();
+
+    if (backlogged_.load(std::memory_order_relaxed) && !flush_scheduled_) {
+        flush_scheduled_ = true;
+        loop_.defer([this] { flush_outbox(); });
+    }
+}
+
+void Shard::receive(Message message)
+{
+    switch (message.kind) {
+    case Message::Kind::Adopt:
+        adopt(FileDescriptor{message.fd});
+        break;
+    case Message::Kind::Request:
+        handle(message.client, message.payload.data(), message.payload.size(), pool_.acquire());
+        pool_.release(std::move(message.payload));
+        break;
+    case Message::Kind::Resync: {
+        if (auto* hosted = find(message.game)) {
+            const auto& subscribers = hosted->subscribers;
+            if (std::find(std::begin(subscribers), std::end(subscribers), message.client) != std::end(subscribers)) {
+                send_snapshot(message.client, message.game, *hosted, pool_.acquire());
+            }
+        }
+        break;
+    }
+    case Message::Kind::Unsubscribe: {
+        // Not worth waking a hibernated game for
+        auto drop = [&message] (auto& subscribers) {
+            subscribers.erase(std::remove(std::begin(subscribers), std::end(subscribers), message.client), std::end(subscribers));
+        };
+        if (auto game = games_.find(message.game); game != std::end(games_)) {
+            drop(game->second->subscribers);
+        } else if (auto stub = hibernated_.find(message.game); stub != std::end(hibernated_)) {
+            drop(stub->second.subscribers);
+        }
+        break;
+    }
+    case Message::Kind::Deliver: {
+        auto client = clients_.find(message.client);
+        if (client != std::end(clients_)) {
+            client->second.connection->send(message.payload);
+        }
+        pool_.release(std::move(message.payload));
+        break;
+    }
+    case Message::Kind::Snapshot: {
+        auto client = clients_.find(message.client);
+        if (client == std::end(clients_)) {
+            // Closed while joining
+            post(shard_of(message.game), Message{Message::Kind::Unsubscribe, message.client, message.game, -1, {}, {}});
+        } else {
+            subscribe(message.client, message.game);
+            client->second.connection->send(message.payload);
+        }
+        pool_.release(std::move(message.payload));
+        break;
+    }
+    case Message::Kind::Update:
+        relay(message.game, message.update);
+        break;
+    case Message::Kind::Follow:
+        replicator_.add_follower(FileDescriptor{message.fd}, wal_->appended());
+        break;
+    case Message::Kind::Gone: {
+        auto relay = relays_.find(message.game);
+        if (relay == std::end(relays_)) {
+            break;
+        }
+        auto frame = pool_.acquire();
+        encode_error(frame, message.game, ErrorCode::Moved);
+        for (const auto& subscriber : relay->second) {
+            auto client = clients_.find(subscriber.client);
+            if (client == std::end(clients_)) {
+                continue;
+            }
+            auto& games = client->second.games;
+            games.erase(std::remove(std::begin(games), std::end(games), message.game), std::end(games));
+            client->second.connection->send(frame);
+        }
+        pool_.release(std::move(frame));
+        relays_.erase(relay);
+        break;
+    }
+    }
+}
+
+void Shard::subscribe(ClientId client, GameId game)
+{
+    auto& relay = relays_[game];
+    auto subscriber = std::find_if(
+        std::begin(relay), std::end(relay),
+        [client] (const Subscriber& subscriber) { return subscriber.client == client; }
+    );
+    if (subscriber != std::end(relay)) {
+        subscriber->lagging = false;
+        subscriber->resyncing = false;
+        return;
+    }
+
+    relay.push_back(Subscriber{client});
+    clients_.at(client).games.push_back(game);
+}
+
+void Shard::unsubscribe(ClientId client, GameId game)
+{
+    auto relay = relays_.find(game);
+    if (relay != std::end(relays_)) {
+        auto& subscribers = relay->second;
+        subscribers.erase(
+            std::remove_if(
+                std::begin(subscribers), std::end(subscribers),
+                [client] (const Subscriber& subscriber) { return subscriber.client == client; }
+            ),
+            std::end(subscribers)
+        );
+        if (subscribers.empty()) {
+            relays_.erase(relay);
+        }
+    }
+    post(shard_of(game), Message{Message::Kind::Unsubscribe, client, game, -1, {}, {}});
+}
+
+void Shard::relay(GameId game, const SharedBuffer& update)
+{
+    auto relay = relays_.find(game);
+    if (relay == std::end(relays_)) {
+        return;
+    }
+
+    for (auto& subscriber : relay->second) {
+        auto client = clients_.find(subscriber.client);
+        if (client == std::end(clients_) || subscriber.resyncing) {
+            continue;
+        }
+        auto& connection = *client->second.connection;
+
+        // Skip what a slow subscriber cannot take, then start it over
+        // from a Snapshot once it has caught up
+        if (subscriber.lagging) {
+            if (connection.pending() <= backlog_ / 4) {
+                subscriber.resyncing = true;
+                post(shard_of(game), Message{Message::Kind::Resync, subscriber.client, game, -1, {}, {}});
+            }
+            continue;
+        }
+        if (connection.pending() > backlog_) {
+            subscriber.lagging = true;
+            continue;
+        }
+
+        connection.send(update);
+    }
+}
+
+void Shard::on_frame(Connection& connection, const std::uint8_t* frame, std::size_t size)
+{
+    const auto client = client_ids_.at(connection.fd());
+
+    std::size_t shard = 0;
+    std::size_t shards = 0;
+    if (decode_follow(frame, size, shard, shards)) {
+        hand_over(connection, client, shard, shards);
+        return;
+    }
+
+    Request request;
+    if (!decode_request(frame, size, request)) {
+        Buffer reply;
+        encode_error(reply, 0, ErrorCode::BadRequest);
+        connection.send(reply);
+        return;
+    }
+    auto& sender = clients_.at(client);
+    if (request.type == Frame::Control) {
+        sender.control = true;
+        return;
+    }
+    if (moves_game(request.type) && !sender.control) {
+        Buffer reply;
+        encode_error(reply, request.game, ErrorCode::BadRequest);
+        connection.send(reply);
+        return;
+    }
+
+    // Local games are served straight from the receive buffer
+    const auto owner = shard_of(request.game);
+    if (owner == index_) {
+        handle(client, frame, size, pool_.acquire());
+        return;
+    }
+
+    auto payload = pool_.acquire();
+    payload.assign(frame, frame + size);
+    post(owner, Message{Message::Kind::Request, client, request.game, -1, std::move(payload), {}});
+}
+
+void Shard::on_close(Connection& connection)
+{
+    auto id = client_ids_.find(connection.fd());
+    if (id == std::end(client_ids_)) {
+        return;
+    }
+    const auto client = id->second;
+    client_ids_.erase(id);
+
+    auto iter = clients_.find(client);
+    const auto games = std::move(iter->second.games);
+    clients_.erase(iter);
+    for (auto game : games) {
+        unsubscribe(client, game);
+    }
+}
+
+void Shard::handle(ClientId client, const std::uint8_t* frame, std::size_t size, Buffer reply)
+{
+    Request request;
+    if (!decode_request(frame, size, request)) {
+        encode_error(reply, 0, ErrorCode::BadRequest);
+        deliver(client, std::move(reply));
+        return;
+    }
+    const auto id = request.game;
+
+    auto error = [&] (ErrorCode code) {
+        encode_error(reply, id, code);
+        this->reply(client, std::move(reply));
+    };
+
+    // Downloads are served by the archive, on listeners of their own
+    if (request.type == Frame::Replay) {
+        return error(ErrorCode::BadRequest);
+    }
+    // A standby's games only change as the primary's do
+    if (replicator_.following() && request.type != Frame::Join) {
+        return error(ErrorCode::Standby);
+    }
+
+    if (request.type == Frame::New) {
+        if (request.players < 2 || request.players > 6) {
+            return error(ErrorCode::BadRequest);
+        }
+        if (games_.count(id) > 0 || hibernated_.count(id) > 0 || archived_.count(id) > 0) {
+            return error(ErrorCode::GameExists);
+        }
+
+        log(create(id, request.players, request.seed), frame, size);
+        encode_ok(reply, id);
+        this->reply(client, std::move(reply));
+        return;
+    }
+
+    if (request.type == Frame::Import) {
+        if (games_.count(id) > 0 || hibernated_.count(id) > 0 || archived_.count(id) > 0) {
+            return error(ErrorCode::GameExists);
+        }
+        HostedGame* imported = nullptr;
+        try {
+            imported = &import(id, frame, size);
+        } catch (const std::exception&) {
+            return error(ErrorCode::BadRequest);
+        }
+
+        log(*imported, frame, size);
+        encode_ok(reply, id);
+        this->reply(client, std::move(reply));
+        if (imported->game.state().phase() != Phase::Placing) {
+            restart_turn_timer(id, *imported);
+        }
+        return;
+    }
+
+    auto* game = find(id);
+    if (!game) {
+        return error(ErrorCode::NoSuchGame);
+    }
+    auto& hosted = *game;
+    hosted.active_at = Clock::now();
+
+    // Nothing changes the game from its Replica on, turn clocks included,
+    // until the router releases or resumes it
+    if (request.type == Frame::Export) {
+        const auto start = begin_replica(reply, id, dice_state(*hosted.dice));
+        codec_.encode(hosted.game.state(), reply);
+        end_frame(reply, start);
+        hosted.exported = true;
+        timers_.cancel(hosted.turn_timer);
+        hosted.turn_timer = 0;
+        this->reply(client, std::move(reply));
+        return;
+    }
+    if (request.type == Frame::Release || request.type == Frame::Resume) {
+        if (!hosted.exported) {
+            return error(ErrorCode::BadRequest);
+        }
+        encode_ok(reply, id);
+        if (request.type == Frame::Release) {
+            if (wal_) {
+                append(frame, size);
+            }
+            drop(id);
+            this->reply(client, std::move(reply));
+            return;
+        }
+        hosted.exported = false;
+        this->reply(client, std::move(reply));
+        if (hosted.game.state().phase() != Phase::Placing) {
+            restart_turn_timer(id, hosted);
+        }
+        return;
+    }
+    if (hosted.exported) {
+        return error(ErrorCode::Rejected);
+    }
+
+    if (request.type == Frame::Join) {
+        encode_ok(reply, id);
+        if (committed()) {
+            join(client, id, std::move(reply));
+        } else {
+            after_commit([this, client, id, reply = std::move(reply)] () mutable { join(client, id, std::move(reply)); });
+        }
+        return;
+    }
+
+    try {
+        if (request.type == Frame::Deal) {
+            ensure(hosted.game.state().phase() == Phase::Placing, IllegalMove{});
+            hosted.game.deal_random_placement(request.seed);
+        } else {
+            hosted.game.apply(request.command);
+        }
+    } catch (const IllegalMove&) {
+        return error(ErrorCode::IllegalMove);
+    } catch (const PlayerNotInTurn&) {
+        return error(ErrorCode::NotInTurn);
+    } catch (const std::out_of_range&) {
+        return error(ErrorCode::OutOfRange);
+    } catch (const std::exception&) {
+        return error(ErrorCode::Rejected);
+    }
+
+    log(hosted, frame, size);
+    encode_ok(reply, id);
+    this->reply(client, std::move(reply));
+    publish(id, hosted);
+    restart_turn_timer(id, hosted);
+}
+
+Shard::HostedGame& Shard::create(GameId id, std::size_t players, std::uint64_t seed)
+{
+    std::vector<Player> seats;
+    for (std::size_t i = 1; i <= players; ++i) {
+        seats.emplace_back(static_cast<Player::Id>(i));
+    }
+    auto rng = std::make_shared<std::minstd_rand>(static_cast<std::minstd_rand::result_type>(seed));
+    Dice dice = [rng] { return std::uniform_int_distribution<int>{1, 6}(*rng); };
+    auto events = history_ ? std::make_unique<EventLog>() : nullptr;
+    Game game = events ? Game{classic_board(), seats, std::move(dice), *events} : Game{classic_board(), seats, std::move(dice)};
+    auto state = game.state();
+
+    auto& hosted = games_[id];
+    hosted = std::make_unique<HostedGame>(HostedGame{std::move(game), std::move(rng), {}, std::move(state)});
+    hosted->active_at = Clock::now();
+    hosted->events = std::move(events);
+    if (hibernation_) {
+        timers_.arm(tick(hosted->active_at + hibernate_after_), Timer{Timer::Kind::Idle, id});
+        arm_timer();
+    }
+    return *hosted;
+}
+
+Shard::HostedGame& Shard::restore(GameId id, State state, std::uint32_t dice)
+{
+    auto& hosted = create(id, state.players().size(), 0);
+    hosted.game.update(state);
+    hosted.published = std::move(state);
+    hosted.dice->seed(dice);
+    // Not the roll for the starting player that creating it made
+    if (hosted.events) {
+        *hosted.events = EventLog{};
+    }
+    return hosted;
+}
+
+Shard::HostedGame& Shard::import(GameId id, const std::uint8_t* frame, std::size_t size)
+{
+    Replicated imported;
+    decode_import(frame, size, imported);
+    auto state = codec_.decode(imported.payload, imported.size);
+    ensure(state.players().size() >= 2, DecodeError{});
+
+    // It may be coming back, in which case the arena is told with the
+    // game itself
+    exported_.erase(std::remove(std::begin(exported_), std::end(exported_), id), std::end(exported_));
+    return restore(id, std::move(state), imported.dice);
+}
+
+void Shard::drop(GameId id)
+{
+    auto game = games_.find(id);
+    if (game == std::end(games_)) {
+        return;
+    }
+    auto& hosted = *game->second;
+    timers_.cancel(hosted.turn_timer);
+    if (hosted.held) {
+        hosted.held = false;
+        broadcast(id, hosted);
+    }
+    // After the last Delta, as messages between two shards stay in order
+    std::bitset<max_shards> shards;
+    for (auto subscriber : hosted.subscribers) {
+        shards.set(shard_of_client(subscriber));
+    }
+    for (std::size_t shard = 0; shard < inbox_.size(); ++shard) {
+        if (shards.test(shard)) {
+            post(shard, Message{Message::Kind::Gone, 0, id, -1, {}, {}});
+        }
+    }
+    games_.erase(game);
+    if (arena_ && arena_->contains(id)) {
+        exported_.push_back(id);
+    }
+}
+
+Shard::HostedGame* Shard::find(GameId id)
+{
+    if (auto game = games_.find(id); game != std::end(games_)) {
+        return game->second.get();
+    }
+    auto stub = hibernated_.find(id);
+    if (stub == std::end(hibernated_)) {
+        return nullptr;
+    }
+
+    auto& hibernated = stub->second;
+    auto bytes = pool_.acquire();
+    if (hibernated.in_arena) {
+        arena_->load(id, bytes);
+    } else {
+        hibernation_->load(hibernated.slot, bytes);
+        hibernation_->release(hibernated.slot);
+    }
+    auto state = codec_.decode(bytes.data(), bytes.size());
+    pool_.release(std::move(bytes));
+
+    auto& hosted = restore(id, std::move(state), hibernated.dice);
+    hosted.subscribers.assign(std::begin(hibernated.subscribers), std::end(hibernated.subscribers));
+    hosted.turn_timer = hibernated.turn_timer;
+    hosted.dirty = !hibernated.in_arena;
+    hosted.history = hibernated.history;
+    hibernated_.erase(stub);
+    return &hosted;
+}
+
+void Shard::hibernate_idle_games(std::chrono::milliseconds idle)
+{
+    hibernation_ = std::make_unique<HibernationFile>(
+        log_directory_ + "/shard-" + std::to_string(index_) + ".hibernated"
+    );
+    hibernate_after_ = idle;
+    for (const auto& [id, hosted] : games_) {
+        timers_.arm(tick(hosted->active_at + hibernate_after_), Timer{Timer::Kind::Idle, id});
+    }
+    arm_timer();
+}
+
+void Shard::hibernate(GameId id)
+{
+    auto game = games_.find(id);
+    if (game == std::end(games_)) {
+        return;
+    }
+    auto& hosted = *game->second;
+
+    // Kept in memory while anything is pending for it: a held Delta, a
+    // record that is not durable yet or a move. A turn that will time out
+    // wakes it.
+    const auto due = hosted.active_at + hibernate_after_;
+    const bool pending = hosted.held || (wal_ && hosted.logged > wal_->durable()) || hosted.exported;
+    if (pending || Clock::now() < due) {
+        timers_.arm(tick(std::max(due, Clock::now() + hibernate_after_ / 4)), Timer{Timer::Kind::Idle, id});
+        return;
+    }
+
+    // A game the arena holds as it is needs no copy
+    HibernationFile::Slot slot;
+    if (hosted.dirty) {
+        auto bytes = pool_.acquire();
+        codec_.encode(hosted.game.state(), bytes);
+        slot = hibernation_->store(bytes.data(), bytes.size());
+        pool_.release(std::move(bytes));
+    }
+    // Its events go where the next snapshot will name them
+    if (hosted.events && !hosted.events->bytes().empty()) {
+        const auto& events = hosted.events->bytes();
+        auto batch = pool_.acquire();
+        hosted.history = history_->add(batch, id, hosted.history, events.data(), events.size());
+        history_->append(batch);
+        pool_.release(std::move(batch));
+    }
+
+    const auto& subscribers = hosted.subscribers;
+    hibernated_.emplace(id, Hibernated{
+        slot, !hosted.dirty, dice_state(*hosted.dice), arena_flags(hosted.game.state()), hosted.history, hosted.turn_timer,
+        std::pmr::vector<ClientId>(std::begin(subscribers), std::end(subscribers), &stub_memory_),
+    });
+    games_.erase(game);
+
+    // The allocator keeps what the games freed; hand it back to the system
+    // once per batch of hibernations
+    if (!trim_scheduled_) {
+        trim_scheduled_ = true;
+        timers_.arm(tick(Clock::now() + trim_delay), Timer{Timer::Kind::Trim, 0});
+    }
+}
+
+void Shard::join(ClientId client, GameId id, Buffer reply)
+{
+    auto* game = find(id);
+    if (!game) {
+        return;
+    }
+    auto& hosted = *game;
+
+    auto& subscribers = hosted.subscribers;
+    if (std::find(std::begin(subscribers), std::end(subscribers), client) == std::end(subscribers)) {
+        subscribers.push_back(client);
+    }
+    send_snapshot(client, id, hosted, std::move(reply));
+}
+
+void Shard::send_snapshot(ClientId client, GameId id, const HostedGame& hosted, Buffer frames)
+{
+    // Deltas are made against what was last published, so a subscriber
+    // starts over from that
+    const auto start = begin_frame(frames, Frame::Snapshot, id);
+    codec_.encode(hosted.published, frames);
+    end_frame(frames, start);
+
+    post(shard_of_client(client), Message{Message::Kind::Snapshot, client, id, -1, std::move(frames), {}});
+}
+
+void Shard::publish(GameId id, HostedGame& hosted)
+{
+    if (hosted.held) {
+        return;
+    }
+
+    // Subscribers only see what would survive a crash
+    if (wal_ && hosted.logged > wal_->durable()) {
+        // Once for any number of records, as a standby applies them
+        if (!hosted.awaiting_log) {
+            hosted.awaiting_log = true;
+            after_commit([this, id] {
+                auto game = games_.find(id);
+                if (game != std::end(games_)) {
+                    game->second->awaiting_log = false;
+                    publish(id, *game->second);
+                }
+            });
+        }
+        return;
+    }
+
+    // A game that was quiet for the window is sent right away, a busy
+    // one once per window
+    if (window_.count() > 0 && !hosted.subscribers.empty()) {
+        const auto now = Clock::now();
+        const auto due = hosted.published_at + window_;
+        if (now < due) {
+            hosted.held = true;
+            timers_.arm(tick(due), Timer{Timer::Kind::Publish, id});
+            arm_timer();
+            return;
+        }
+        hosted.published_at = now;
+    }
+    broadcast(id, hosted);
+}
+
+void Shard::time_out(GameId id)
+{
+    auto* game = find(id);
+    if (!game) {
+        return;
+    }
+    auto& hosted = *game;
+    hosted.turn_timer = 0;
+    hosted.active_at = Clock::now();
+
+    // Until the turn passes, or the game ends
+    const auto player = hosted.game.state().current_player().id();
+    do {
+        bool moved = false;
+        for (const auto& move : fallback_moves(hosted.game.state())) {
+            try {
+                hosted.game.apply(move);
+            } catch (const std::exception&) {
+                continue;
+            }
+            if (wal_) {
+                auto record = pool_.acquire();
+                encode_command(record, id, move);
+                log(hosted, record.data() + length_size, record.size() - length_size);
+                pool_.release(std::move(record));
+            }
+            moved = true;
+            break;
+        }
+        if (!moved) {
+            break;
+        }
+    } while (hosted.game.state().phase() != Phase::GameOver
+             && hosted.game.state().current_player().id() == player);
+
+    publish(id, hosted);
+    restart_turn_timer(id, hosted);
+}
+
+void Shard::restart_turn_timer(GameId id, HostedGame& hosted)
+{
+    if (turn_timeout_.count() == 0) {
+        return;
+    }
+
+    timers_.cancel(hosted.turn_timer);
+    hosted.turn_timer = 0;
+    if (hosted.game.state().phase() != Phase::GameOver) {
+        hosted.turn_timer = timers_.arm(tick(Clock::now() + turn_timeout_), Timer{Timer::Kind::Turn, id});
+    }
+    arm_timer();
+}
+
+void Shard::expire_timers()
+{
+    const auto now = Clock::now();
+    timers_.advance(tick(now), [this] (Timer timer) {
+        switch (timer.kind) {
+        case Timer::Kind::Turn:
+            time_out(timer.game);
+            break;
+        case Timer::Kind::Commit:
+            commit();
+            break;
+        case Timer::Kind::Snapshot:
+            take_snapshot();
+            break;
+        case Timer::Kind::Idle:
+            hibernate(timer.game);
+            break;
+        case Timer::Kind::Trim:
+            trim_scheduled_ = false;
+#ifdef __GLIBC__
+            ::malloc_trim(0);
+#endif
+            break;
+        case Timer::Kind::Publish: {
+            auto game = games_.find(timer.game);
+            if (game != std::end(games_) && game->second->held) {
+                game->second->held = false;
+                publish(timer.game, *game->second);
+            }
+            break;
+        }
+        }
+    });
+    arm_timer();
+}
+
+void Shard::arm_timer()
+{
+    const auto next = timers_.next().value_or(0);
+    if (next == armed_) {
+        return;
+    }
+    armed_ = next;
+
+    // Zero disarms the timer
+    const auto since_epoch = static_cast<std::int64_t>(next) * 1000000;
+    itimerspec spec{};
+    spec.it_value.tv_sec = since_epoch / 1000000000;
+    spec.it_value.tv_nsec = since_epoch % 1000000000;
+    if (::timerfd_settime(timer_.get(), TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+        throw std::system_error(errno, std::generic_category(), "timerfd_settime");
+    }
+}
+
+TimingWheel<Shard::Timer>::Tick Shard::tick(Clock::time_point time)
+{
+    const auto since_epoch = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch());
+    return static_cast<TimingWheel<Timer>::Tick>(since_epoch.count());
+}
+
+void Shard::broadcast(GameId id, HostedGame& hosted)
+{
+    if (hosted.subscribers.empty()) {
+        hosted.published = hosted.game.state();
+        return;
+    }
+
+    auto delta = std::make_shared<Buffer>();
+    const auto start = begin_frame(*delta, Frame::Delta, id);
+    codec_.diff(hosted.published, hosted.game.state(), *delta);
+    end_frame(*delta, start);
+    hosted.published = hosted.game.state();
+
+    // One message per shard with subscribers, all sharing the encoding
+    std::bitset<max_shards> shards;
+    for (auto subscriber : hosted.subscribers) {
+        shards.set(shard_of_client(subscriber));
+    }
+    const SharedBuffer update = std::move(delta);
+    for (std::size_t shard = 0; shard < inbox_.size(); ++shard) {
+        if (shards.test(shard)) {
+            post(shard, Message{Message::Kind::Update, 0, id, -1, {}, update});
+        }
+    }
+}
+
+void Shard::open_log(
+    const std::string& directory, std::chrono::milliseconds commit_window,
+    std::chrono::milliseconds snapshot_interval, DiskIo::Backend io
+)
+{
+    log_directory_ = directory;
+    const auto layout = static_cast<std::uint32_t>(inbox_.size());
+    io_ = DiskIo::create(io);
+    if (archiver_) {
+        history_ = std::make_unique<HistoryFile>(history_path());
+    }
+
+    // The arena's games stay there until they are asked for
+    arena_ = std::make_unique<SnapshotArena>(snapshot_path(), layout, [this] (const SnapshotArena::Game& game) {
+        if (game.flags & archived) {
+            archived_.insert(game.id);
+            return;
+        }
+        if (game.flags & exported) {
+            return;
+        }
+        TimingWheel<Timer>::Handle turn_timer = 0;
+        if ((game.flags & turn_running) && turn_timeout_.count() > 0) {
+            turn_timer = timers_.arm(tick(Clock::now() + turn_timeout_), Timer{Timer::Kind::Turn, game.id});
+        }
+        hibernated_.emplace(game.id, Hibernated{
+            {}, true, game.dice, game.flags, game.history, turn_timer, std::pmr::vector<ClientId>(&stub_memory_),
+        });
+    });
+    generation_ = arena_->generation();
+
+    // Games that ended before a crash kept them from the archive, or
+    // that were archived before one kept them from being evicted
+    if (archiver_) {
+        std::vector<Ended> ended;
+        std::vector<GameId> archived;
+        auto bytes = pool_.acquire();
+        for (const auto& [id, stub] : hibernated_) {
+            if (!(stub.flags & game_over)) {
+                continue;
+            }
+            if (archiver_->archive().find(id)) {
+                archived.push_back(id);
+            } else {
+                arena_->load(id, bytes);
+                ended.push_back(Ended{finished(id, codec_.decode(bytes.data(), bytes.size())), stub.history});
+            }
+        }
+        pool_.release(std::move(bytes));
+        archive(std::move(ended));
+        for (const auto id : archived) {
+            evict(id);
+        }
+    }
+
+    // Files before the snapshot are left when a crash interrupts deleting
+    // them, and files after it when one interrupts committing the next
+    std::vector<std::uint64_t> after;
+    for (const auto generation : log_generations(directory, index_)) {
+        if (generation < generation_) {
+            ::unlink(log_path(generation).c_str());
+        } else {
+            after.push_back(generation);
+        }
+    }
+    auto replay = [this] (const std::uint8_t* record, std::size_t size) { this->replay(record, size); };
+    for (std::size_t i = 0; i + 1 < after.size(); ++i) {
+        WriteAheadLog{*io_, log_path(after[i]), layout, replay};
+    }
+    if (!after.empty()) {
+        generation_ = after.back();
+    }
+    wal_ = std::make_unique<WriteAheadLog>(*io_, log_path(generation_), layout, replay);
+    commit_window_ = commit_window;
+    snapshot_interval_ = snapshot_interval;
+
+    for (auto& [id, hosted] : games_) {
+        hosted->published = hosted->game.state();
+        if (hosted->game.state().phase() != Phase::Placing) {
+            restart_turn_timer(id, *hosted);
+        }
+    }
+    loop_.add(io_->ready_fd(), EPOLLIN, *this);
+    schedule_snapshot();
+    arm_timer();
+}
+
+void Shard::replay(const std::uint8_t* record, std::size_t size)
+{
+    Request request;
+    ensure(decode_request(record, size, request), DecodeError{});
+
+    if (request.type == Frame::New) {
+        create(request.game, request.players, request.seed);
+        return;
+    }
+    if (request.type == Frame::Import) {
+        import(request.game, record, size);
+        return;
+    }
+
+    // Only accepted requests are logged, so they apply as they did before
+    auto* hosted = find(request.game);
+    ensure(hosted != nullptr, std::out_of_range("Log record for a game that does not exist"));
+    if (request.type == Frame::Release) {
+        drop(request.game);
+        return;
+    }
+    hosted->dirty = true;
+    auto& game = hosted->game;
+    if (request.type == Frame::Deal) {
+        game.deal_random_placement(request.seed);
+    } else {
+        game.apply(request.command);
+    }
+}
+
+void Shard::follow(FileDescriptor primary)
+{
+    ensure(games() == 0, std::invalid_argument("A standby has to start out empty"));
+    replicator_.follow(std::move(primary), index_, inbox_.size());
+}
+
+void Shard::promote()
+{
+    promote_.store(true, std::memory_order_release);
+    wake();
+}
+
+void Shard::hand_over(Connection& connection, ClientId client, std::size_t shard, std::size_t shards)
+{
+    // Followers need the log, the same shards, and a connection of their own
+    if (!wal_ || shards != inbox_.size() || !clients_.at(client).games.empty() || connection.pending() > 0) {
+        auto reply = pool_.acquire();
+        encode_error(reply, 0, ErrorCode::BadRequest);
+        connection.send(reply);
+        pool_.release(std::move(reply));
+        return;
+    }
+
+    client_ids_.erase(connection.fd());
+    auto fd = connection.release();
+    // Not while the connection is handing out its frames
+    loop_.defer([this, client] { clients_.erase(client); });
+    post(shard, Message{Message::Kind::Follow, 0, 0, fd.release(), {}, {}});
+}
+
+void Shard::encode_games(Buffer& frames)
+{
+    for (const auto& [game, hosted] : games_) {
+        const auto start = begin_replica(frames, game, dice_state(*hosted->dice));
+        codec_.encode(hosted->game.state(), frames);
+        end_frame(frames, start);
+    }
+    auto bytes = pool_.acquire();
+    for (const auto& [game, stub] : hibernated_) {
+        if (stub.in_arena) {
+            arena_->load(game, bytes);
+        } else {
+            hibernation_->load(stub.slot, bytes);
+        }
+        const auto start = begin_replica(frames, game, stub.dice);
+        frames.insert(std::end(frames), std::begin(bytes), std::end(bytes));
+        end_frame(frames, start);
+    }
+    pool_.release(std::move(bytes));
+}
+
+void Shard::on_replica(GameId game, std::uint32_t dice, const std::uint8_t* state, std::size_t size)
+{
+    restore(game, codec_.decode(state, size), dice);
+}
+
+void Shard::on_synced()
+{
+    // The games are only durable here once a snapshot stores them,
+    // whether or not a record follows
+    snapshot_at_ = std::numeric_limits<WriteAheadLog::Sequence>::max();
+}
+
+void Shard::on_record(const std::uint8_t* record, std::size_t size)
+{
+    Request request;
+    ensure(decode_request(record, size, request), DecodeError{});
+    replay(record, size);
+    if (auto* hosted = find(request.game)) {
+        log(*hosted, record, size);
+        publish(request.game, *hosted);
+    } else if (wal_) {
+        // Released
+        append(record, size);
+    }
+}
+
+void Shard::take_over()
+{
+    if (!replicator_.following()) {
+        return;
+    }
+    replicator_.stop_following();
+
+    // The primary's turn clocks did not come along
+    for (auto& [id, hosted] : games_) {
+        if (hosted->game.state().phase() != Phase::Placing) {
+            restart_turn_timer(id, *hosted);
+        }
+    }
+    if (turn_timeout_.count() > 0) {
+        for (auto& [id, stub] : hibernated_) {
+            if ((stub.flags & turn_running) && stub.turn_timer == 0) {
+                stub.turn_timer = timers_.arm(tick(Clock::now() + turn_timeout_), Timer{Timer::Kind::Turn, id});
+            }
+        }
+        arm_timer();
+    }
+}
+
+void Shard::log(HostedGame& hosted, const std::uint8_t* record, std::size_t size)
+{
+    if (!wal_) {
+        return;
+    }
+    hosted.logged = append(record, size);
+    hosted.dirty = true;
+}
+
+WriteAheadLog::Sequence Shard::append(const std::uint8_t* record, std::size_t size)
+{
+    const auto sequence = wal_->append(record, size);
+    replicator_.add_record(sequence, record, size);
+
+    if (commit_scheduled_) {
+        return sequence;
+    }
+    commit_scheduled_ = true;
+    if (commit_window_.count() == 0) {
+        loop_.defer([this] { commit(); });
+    } else {
+        timers_.arm(tick(Clock::now() + commit_window_), Timer{Timer::Kind::Commit, 0});
+        arm_timer();
+    }
+    return sequence;
+}
+
+void Shard::commit()
+{
+    commit_scheduled_ = false;
+    replicator_.replicate(wal_->appended());
+    wal_->commit();
+}
+
+bool Shard::committed() const
+{
+    return !wal_ || (held_.empty() && wal_->durable() == wal_->appended());
+}
+
+void Shard::after_commit(std::function<void ()> task)
+{
+    if (committed()) {
+        task();
+        return;
+    }
+    held_.push_back(Held{wal_->appended(), std::move(task)});
+}
+
+void Shard::release_committed()
+{
+    const auto durable = wal_->durable();
+    while (!held_.empty() && held_.front().sequence <= durable) {
+        auto task = std::move(held_.front().task);
+        held_.pop_front();
+        task();
+    }
+}
+
+void Shard::take_snapshot()
+{
+    if (archiver_) {
+        if (!unarchived_.empty()) {
+            archive({});
+        }
+        std::vector<std::uint64_t> archived;
+        archiver_->take_archived(index_, archived);
+        for (const auto id : archived) {
+            evict(id);
+        }
+    }
+    if (wal_->appended() == snapshot_at_) {
+        schedule_snapshot();
+        return;
+    }
+    snapshot_at_ = wal_->appended();
+
+    // Nothing runs on this thread in between, so the snapshot holds
+    // exactly what the records before the new file made of the games
+    const auto generation = generation_ + 1;
+    wal_->rotate(log_path(generation));
+    generation_ = generation;
+
+    // Only the games that changed since the last snapshot are stored
+    // again, along with the events that changed them
+    auto bytes = pool_.acquire();
+    auto chunks = pool_.acquire();
+    std::vector<Ended> ended;
+    for (auto& [id, hosted] : games_) {
+        if (!hosted->dirty) {
+            continue;
+        }
+        const auto& state = hosted->game.state();
+        if (hosted->events && !hosted->events->bytes().empty()) {
+            const auto& events = hosted->events->bytes();
+            hosted->history = history_->add(chunks, id, hosted->history, events.data(), events.size());
+            *hosted->events = EventLog{};
+        }
+        bytes.clear();
+        codec_.encode(state, bytes);
+        arena_->store(
+            SnapshotArena::Game{id, dice_state(*hosted->dice), arena_flags(state), hosted->history},
+            bytes.data(), bytes.size(), generation
+        );
+        hosted->dirty = false;
+        if (history_ && state.phase() == Phase::GameOver) {
+            ended.push_back(Ended{finished(id, state), hosted->history});
+        }
+    }
+    // Hibernated games are already encoded, and the arena holds them from
+    // now on
+    for (auto& [id, stub] : hibernated_) {
+        if (stub.in_arena) {
+            continue;
+        }
+        hibernation_->load(stub.slot, bytes);
+        arena_->store(SnapshotArena::Game{id, stub.dice, stub.flags, stub.history}, bytes.data(), bytes.size(), generation);
+        hibernation_->release(stub.slot);
+        stub.in_arena = true;
+        if (history_ && (stub.flags & game_over)) {
+            ended.push_back(Ended{finished(id, codec_.decode(bytes.data(), bytes.size())), stub.history});
+        }
+    }
+    pool_.release(std::move(bytes));
+    // The records of exported games keep their slots, marked as gone
+    for (const auto id : exported_) {
+        const std::uint8_t none = 0;
+        arena_->store(SnapshotArena::Game{id, 0, exported, 0}, &none, 0, generation);
+    }
+    exported_.clear();
+    for (const auto id : evicted_) {
+        const std::uint8_t none = 0;
+        arena_->store(SnapshotArena::Game{id, 0, archived, 0}, &none, 0, generation);
+    }
+    evicted_.clear();
+
+    // The snapshot includes records the old file may not have synced, and
+    // names history that has to be durable before it is
+    const auto offset = history_ ? history_->end() : 0;
+    if (history_) {
+        history_->advance(chunks.size());
+    }
+    after_commit([this, generation, offset, chunks = std::move(chunks), ended = std::move(ended)] () mutable {
+        auto commit = [this, generation] {
+            arena_->commit(*io_, generation, [this, generation] { trim_log(generation); });
+        };
+        if (!history_) {
+            pool_.release(std::move(chunks));
+            commit();
+            return;
+        }
+        io_->write_and_sync(
+            history_->fd(), offset, std::move(chunks),
+            [this, commit, ended = std::move(ended)] (Buffer chunks) mutable {
+                pool_.release(std::move(chunks));
+                archive(std::move(ended));
+                commit();
+            }
+        );
+    });
+    // Rotating may have waited for the log, and no completion is left to
+    // release what that made durable
+    release_committed();
+}
+
+void Shard::trim_log(std::uint64_t generation)
+{
+    for (const auto old : log_generations(log_directory_, index_)) {
+        if (old < generation) {
+            ::unlink(log_path(old).c_str());
+        }
+    }
+    schedule_snapshot();
+}
+
+FinishedGame Shard::finished(GameId id, const State& state) const
+{
+    return FinishedGame{
+        id, static_cast<std::uint8_t>(state.players().size()),
+        static_cast<std::uint8_t>(state.current_player().id()), Archive::classic_map, {},
+        static_cast<std::uint32_t>(index_),
+    };
+}
+
+void Shard::archive(std::vector<Ended> ended)
+{
+    for (auto& game : ended) {
+        history_->read(game.history, game.game.events);
+        unarchived_.push_back(std::move(game.game));
+    }
+    while (!unarchived_.empty() && archiver_->submit(std::move(unarchived_.front()))) {
+        unarchived_.pop_front();
+    }
+}
+
+void Shard::evict(GameId id)
+{
+    if (auto game = games_.find(id); game != std::end(games_)) {
+        timers_.cancel(game->second->turn_timer);
+        games_.erase(game);
+    } else if (auto stub = hibernated_.find(id); stub != std::end(hibernated_)) {
+        if (!stub->second.in_arena) {
+            hibernation_->release(stub->second.slot);
+        }
+        timers_.cancel(stub->second.turn_timer);
+        hibernated_.erase(stub);
+    } else {
+        return;
+    }
+    archived_.insert(id);
+    if (arena_->contains(id)) {
+        evicted_.push_back(id);
+    }
+}
+
+void Shard::schedule_snapshot()
+{
+    if (snapshot_interval_.count() > 0) {
+        timers_.arm(tick(Clock::now() + snapshot_interval_), Timer{Timer::Kind::Snapshot, 0});
+        arm_timer();
+    }
+}
+
+std::string Shard::log_path(std::uint64_t generation) const
+{
+    return log_directory_ + "/shard-" + std::to_string(index_) + "." + std::to_string(generation) + ".wal";
+}
+
+std::string Shard::snapshot_path() const
+{
+    return log_directory_ + "/shard-" + std::to_string(index_) + ".snapshot";
+}
+
+std::string Shard::history_path() const
+{
+    return log_directory_ + "/shard-" + std::to_string(index_) + ".history";
+}
+
+void Shard::reply(ClientId client, Buffer frames)
+{
+    if (committed()) {
+        deliver(client, std::move(frames));
+        return;
+    }
+    after_commit([this, client, frames = std::move(frames)] () mutable { deliver(client, std::move(frames)); });
+}
+
+void Shard::deliver(ClientId client, Buffer frames)
+{
+    const auto shard = shard_of_client(client);
+    if (shard != index_) {
+        post(shard, Message{Message::Kind::Deliver, client, 0, -1, std::move(frames), {}});
+        return;
+    }
+
+    auto iter = clients_.find(client);
+    if (iter != std::end(clients_)) {
+        iter->second.connection->send(frames);
+    }
+    pool_.release(std::move(frames));
+}
+
+}
+
+}
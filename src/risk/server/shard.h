@@ -0,0 +1,418 @@
+#pragma once
+
+#include "risk/rules/codec.h"
+#include "risk/rules/event_log.h"
+#include "risk/rules/game.h"
+#include "risk/server/archive.h"
+#include "risk/server/buffer_pool.h"
+#include "risk/server/connection.h"
+#include "risk/server/disk_io.h"
+#include "risk/server/event_loop.h"
+#include "risk/server/hibernation.h"
+#include "risk/server/history.h"
+#include "risk/server/protocol.h"
+#include "risk/server/replication.h"
+#include "risk/server/snapshot.h"
+#include "risk/server/spsc_queue.h"
+#include "risk/server/timing_wheel.h"
+#include "risk/server/wal.h"
+
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+// Unique across the server. The low byte is the shard that owns the
+// connection.
+using ClientId = std::uint64_t;
+
+// One worker thread's share of the server. A shard owns its games and
+// connections outright, so nothing it owns is ever locked. Requests for
+// a game on another shard, and updates for a connection on another
+// shard, travel through a SPSC queue per pair of shards.
+//
+// Updates fan out in two steps. A game encodes each update once and
+// passes the shared buffer to every shard with subscribers to it, which
+// hands it to its own subscribers. The game's shard decides who is
+// subscribed; the others learn of it from the Snapshot sent on joining.
+// A subscriber whose connection has more than `backlog` bytes queued
+// stops getting updates, and once it has caught up it is sent a fresh
+// Snapshot instead of what it missed.
+//
+// With a coalescing `window`, a game that changes again within the
+// window of its last update holds the Delta back until the window ends,
+// so a burst of moves goes out as one Delta.
+//
+// With a `turn_timeout`, a game whose current player has not moved for
+// that long has the rest of the turn played for them: units are placed
+// on their first territories, a forced trade is made and the remaining
+// phases are ended. The clock starts with the first move or deal.
+//
+// With a log, every accepted request is appended to the shard's
+// write-ahead log, and its reply and updates are held back until the
+// record is durable. Requests arriving meanwhile join the same batch, so
+// they share one sync. Every `snapshot_interval` the games that changed
+// are written to the shard's snapshot arena and the log goes on in a new
+// file, and once the snapshot is committed the files before it are
+// deleted. Recovery maps the arena, leaving its games hibernated there
+// until they are asked for, and replays only the log after it.
+//
+// Games that have been idle for a while can be hibernated: their State is
+// encoded to a file, or left in the arena if it holds them as they are,
+// and only a stub stays in memory. Any request for the game, or a
+// subscriber's resync, loads it back first.
+//
+// With an archive, each game's events are kept too: at every snapshot
+// the events since the last one go to the shard's history file, and a
+// game that has ended is handed to the archive once its history is
+// durable.
+//
+// A shard with a log can be followed by the shard with the same index of
+// a hot standby, over a connection that asks to Follow it. The follower
+// is handed over to this shard, sent every game as it stands, and from
+// then on each record the log makes durable. The standby applies the
+// records to its own games, logging them if it has a log of its own, and
+// serves them to its subscribers, but takes no moves until it is
+// promoted. Its acknowledgements tell how far behind it is. The stream
+// itself is a Replicator's.
+//
+// A router moves a game from one server to another by having the first
+// Export it, which answers with the game as it stands and holds it still,
+// and the next Import it. Once the Import is answered the first Releases
+// the game, or Resumes it if the Import failed. Only a connection that
+// said it is a router's may do any of these. Imports and releases are
+// logged like moves, and the snapshot after a release marks the game as
+// gone in the arena.
+class Shard : private EventLoop::Handler, private Connection::Listener, private Replicator::Host {
+public:
+    static constexpr std::size_t max_shards = 256;
+
+    struct Message {
+        enum class Kind {
+            Adopt,       // take over the connected socket `fd`
+            Request,     // a request frame for a game owned by the receiver
+            Resync,      // send `client` a Snapshot of `game`
+            Unsubscribe, // `client` is gone, stop sending it `game`
+            Deliver,     // frames for the receiver's connection `client`
+            Snapshot,    // frames for `client` ending in a Snapshot of `game`
+            Update,      // a Delta of `game` for the receiver's subscribers
+            Follow,      // stream the log to the standby connected on `fd`
+            Gone,        // `game` moved away, tell the receiver's subscribers
+        };
+
+        Kind kind = Kind::Deliver;
+        ClientId client = 0;
+        GameId game = 0;
+        int fd = -1;
+        Buffer payload;
+        SharedBuffer update;
+    };
+
+    static constexpr std::size_t default_backlog = 256 * 1024;
+
+    // `peers` will hold all `count` shards, this one included, at their
+    // index once the server has created them
+    Shard(std::size_t index, std::size_t count, const std::vector<std::unique_ptr<Shard>>& peers,
+          std::size_t backlog = default_backlog, std::chrono::milliseconds window = {},
+          std::chrono::milliseconds turn_timeout = {});
+    ~Shard() override;
+
+    std::size_t index() const { return index_; }
+    EventLoop& loop() { return loop_; }
+
+    std::size_t shard_of(GameId id) const { return id % inbox_.size(); }
+
+    // Replays the games in the shard's log in `directory`, then logs to it
+    // from now on. A batch of records is committed `commit_window` after
+    // its first record, or once the current events are handled if zero.
+    // A snapshot is taken every `snapshot_interval`, or never if zero.
+    // Writes go through `io`. Called before the shard runs.
+    void open_log(
+        const std::string& directory, std::chrono::milliseconds commit_window,
+        std::chrono::milliseconds snapshot_interval = {}, DiskIo::Backend io = DiskIo::Backend::Automatic
+    );
+
+    // Hibernates games that have not been asked for in `idle`. Needs the
+    // log's directory, so is called after open_log and before the shard
+    // runs.
+    void hibernate_idle_games(std::chrono::milliseconds idle);
+
+    // Hands games that end to `archiver`, as of the snapshot after they
+    // end. Called before open_log.
+    void archive_to(Archiver& archiver) { archiver_ = &archiver; }
+
+    // Makes the shard a standby of the primary's shard with the same index,
+    // which `primary` is connected to. The shard has to be empty. Called
+    // after open_log, if at all, and before the shard runs.
+    void follow(FileDescriptor primary);
+    // Stops following and takes moves from then on. Safe to call from any
+    // thread or a signal handler.
+    void promote();
+
+    // Called on this shard's thread
+    void adopt(FileDescriptor fd);
+    void post(std::size_t to, Message message);
+
+    // Only meaningful on this shard's thread or once it has stopped
+    std::size_t games() const { return games_.size() + hibernated_.size(); }
+    std::size_t hibernated_games() const { return hibernated_.size(); }
+    std::size_t connections() const { return clients_.size(); }
+    // Safe to call from any thread
+    Replication replication() const { return replicator_.status(); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Timer {
+        enum class Kind : std::uint8_t {
+            Publish, // the coalescing window of `game` has ended
+            Turn,    // the current player of `game` has stalled
+            Commit,  // the commit window of the log has ended
+            Snapshot, // time for the next snapshot
+            Idle,     // `game` may have been idle long enough to hibernate
+            Trim,     // return memory freed by hibernated games
+        };
+
+        Kind kind = Kind::Publish;
+        GameId game = 0;
+    };
+
+    struct HostedGame {
+        rules::Game game;
+        // Drives the game's Dice, and is kept in snapshots
+        std::shared_ptr<std::minstd_rand> dice;
+        std::vector<ClientId> subscribers;
+        // What the subscribers have seen, for the next Delta
+        rules::State published;
+        Clock::time_point published_at{};
+        // Changed since it was published, with a Delta due
+        bool held = false;
+        // To be published once its records are durable
+        bool awaiting_log = false;
+        TimingWheel<Timer>::Handle turn_timer = 0;
+        // The last record logged for the game
+        WriteAheadLog::Sequence logged = 0;
+        // When the game was last asked for
+        Clock::time_point active_at{};
+        // Changed since the arena last stored it
+        bool dirty = true;
+        // With an archive, what happened since the game's history was last
+        // written, and where that ends
+        std::unique_ptr<rules::EventLog> events = nullptr;
+        std::uint64_t history = 0;
+        // Exported, and taking no requests until it is released or resumed
+        bool exported = false;
+    };
+
+    // What stays in memory of a hibernated game
+    struct Hibernated {
+        // Unused if the game is as the arena last stored it
+        HibernationFile::Slot slot;
+        bool in_arena;
+        std::uint32_t dice;
+        std::uint32_t flags;
+        std::uint64_t history;
+        // Armed for games whose turn is running
+        TimingWheel<Timer>::Handle turn_timer;
+        std::pmr::vector<ClientId> subscribers;
+    };
+
+    // Runs once everything logged before it is durable
+    struct Held {
+        WriteAheadLog::Sequence sequence;
+        std::function<void ()> task;
+    };
+
+    // A game that ended, until its history is durable
+    struct Ended {
+        FinishedGame game;
+        std::uint64_t history;
+    };
+
+    struct Subscriber {
+        ClientId client;
+        // Skipping updates until it has caught up with its backlog
+        bool lagging = false;
+        // Skipping updates until the Snapshot it was promised arrives
+        bool resyncing = false;
+    };
+
+    struct Client {
+        std::unique_ptr<Connection> connection;
+        std::vector<GameId> games;
+        // A router's, which may move games
+        bool control = false;
+    };
+
+    static constexpr std::size_t queue_capacity = 4096;
+    static constexpr std::chrono::milliseconds trim_delay{1000};
+
+    // Mailbox wakeups and the coalescing timer
+    void on_events(std::uint32_t events) override;
+
+    void on_frame(Connection& connection, const std::uint8_t* frame, std::size_t size) override;
+    void on_close(Connection& connection) override;
+
+    void receive(Message message);
+    void subscribe(ClientId client, GameId game);
+    void unsubscribe(ClientId client, GameId game);
+    void relay(GameId game, const SharedBuffer& update);
+
+    // Appends the reply to the request to `reply`, then sends the update
+    // to subscribers if the request changed the game
+    void handle(ClientId client, const std::uint8_t* frame, std::size_t size, Buffer reply);
+    HostedGame& create(GameId id, std::size_t players, std::uint64_t seed);
+    // Creates the game as `state`, with its dice at `dice`
+    HostedGame& restore(GameId id, rules::State state, std::uint32_t dice);
+    // Creates the game an Import frame carries
+    HostedGame& import(GameId id, const std::uint8_t* frame, std::size_t size);
+    // Forgets a game that was exported and released, after sending its
+    // subscribers what they have not seen yet and then a Moved error
+    void drop(GameId id);
+    // The game, loaded back first if it was hibernated, or null
+    HostedGame* find(GameId id);
+    void hibernate(GameId id);
+    void join(ClientId client, GameId id, Buffer reply);
+    void replay(const std::uint8_t* record, std::size_t size);
+
+    // Hands the connection over to the shard it asks to follow
+    void hand_over(Connection& connection, ClientId client, std::size_t shard, std::size_t shards);
+    void take_over();
+
+    // The replication stream's view of the games
+    void encode_games(Buffer& frames) override;
+    void on_replica(GameId game, std::uint32_t dice, const std::uint8_t* state, std::size_t size) override;
+    void on_synced() override;
+    void on_record(const std::uint8_t* record, std::size_t size) override;
+
+    // Appends a request that changed the game to the log, if there is one
+    void log(HostedGame& hosted, const std::uint8_t* record, std::size_t size);
+    // Appends a record to the log, which there has to be, and has it
+    // committed
+    WriteAheadLog::Sequence append(const std::uint8_t* record, std::size_t size);
+    void commit();
+    // Whether everything logged is durable and nothing is held back
+    bool committed() const;
+    void after_commit(std::function<void ()> task) override;
+    void release_committed();
+    // Rotates the log and stores the games that changed before that point
+    // in the arena, which commits them once they and the log are durable
+    void take_snapshot();
+    // Deletes the log files the last snapshot covers
+    void trim_log(std::uint64_t generation);
+    FinishedGame finished(GameId id, const rules::State& state) const;
+    // Reads the games' history and hands them to the archiver
+    void archive(std::vector<Ended> ended);
+    // Forgets a game the archive holds, and keeps its id from being used
+    // again
+    void evict(GameId id);
+    void schedule_snapshot();
+    std::string log_path(std::uint64_t generation) const;
+    std::string snapshot_path() const;
+    std::string history_path() const;
+    // Replies in order with what was held back for the log
+    void reply(ClientId client, Buffer frames);
+    void send_snapshot(ClientId client, GameId id, const HostedGame& hosted, Buffer frames);
+    // Sends the update now, or holds it back for the coalescing window
+    void publish(GameId id, HostedGame& hosted);
+    void broadcast(GameId id, HostedGame& hosted);
+    // Plays the rest of the turn of a player who stalled
+    void time_out(GameId id);
+    void restart_turn_timer(GameId id, HostedGame& hosted);
+
+    // Runs the timers that are due, then sets timer_ for the next
+    void expire_timers();
+    void arm_timer();
+    // The wheel counts whole milliseconds of Clock
+    static TimingWheel<Timer>::Tick tick(Clock::time_point time);
+    // Sends frames to a connection on any shard
+    void deliver(ClientId client, Buffer frames);
+
+    // Pushes what did not fit into the peers' queues, then wakes them
+    void flush_outbox();
+    void wake();
+
+    const std::size_t index_;
+    const std::vector<std::unique_ptr<Shard>>& peers_;
+    const std::size_t backlog_;
+    const std::chrono::milliseconds window_;
+    const std::chrono::milliseconds turn_timeout_;
+
+    EventLoop loop_;
+    FileDescriptor wakeup_;
+    FileDescriptor timer_;
+    rules::StateCodec codec_;
+    BufferPool pool_;
+
+    // inbox_[i] is written by shard i only
+    std::vector<std::unique_ptr<SpscQueue<Message>>> inbox_;
+    // Messages waiting for room in outbox_[i]'s queue on shard i
+    std::vector<std::deque<Message>> outbox_;
+    std::vector<bool> wake_;
+    bool flush_scheduled_ = false;
+    // Set while outbox_ holds messages, so consumers wake this shard once
+    // they made room
+    std::atomic<bool> backlogged_{false};
+
+    ClientId next_client_ = 0;
+    std::unordered_map<int, ClientId> client_ids_;
+    std::unordered_map<ClientId, Client> clients_;
+    std::unordered_map<GameId, std::unique_ptr<HostedGame>> games_;
+    // This shard's subscribers to each game, wherever the game lives
+    std::unordered_map<GameId, std::vector<Subscriber>> relays_;
+    std::string log_directory_;
+    std::unique_ptr<SnapshotArena> arena_;
+    // Outlives the log, which syncs on the way out
+    std::unique_ptr<DiskIo> io_;
+    std::unique_ptr<WriteAheadLog> wal_;
+    // Of the log file being appended to
+    std::uint64_t generation_ = 0;
+    std::chrono::milliseconds commit_window_{0};
+    bool commit_scheduled_ = false;
+    std::deque<Held> held_;
+    std::chrono::milliseconds snapshot_interval_{0};
+    std::unique_ptr<HibernationFile> hibernation_;
+    std::chrono::milliseconds hibernate_after_{0};
+    // Stubs are allocated apart from the games, or they would pin the pages
+    // the games freed
+    std::pmr::unsynchronized_pool_resource stub_memory_;
+    std::pmr::unordered_map<GameId, Hibernated> hibernated_{&stub_memory_};
+    bool trim_scheduled_ = false;
+    // What the log had when the last snapshot was taken
+    WriteAheadLog::Sequence snapshot_at_ = 0;
+    // Exported games the arena holds, to be marked as gone by the next
+    // snapshot
+    std::vector<GameId> exported_;
+    Archiver* archiver_ = nullptr;
+    std::unique_ptr<HistoryFile> history_;
+    // Games the archiver had no room for, until the next snapshot
+    std::deque<FinishedGame> unarchived_;
+    // Games evicted once they were archived, which the arena holds until
+    // the next snapshot marks them as such
+    std::vector<GameId> evicted_;
+    std::unordered_set<GameId> archived_;
+
+    Replicator replicator_;
+    std::atomic<bool> promote_{false};
+
+    TimingWheel<Timer> timers_;
+    // When timer_ goes off, 0 for never
+    TimingWheel<Timer>::Tick armed_ = 0;
+};
+
+}
+
+}
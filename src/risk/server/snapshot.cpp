@@ -0,0 +1,289 @@
+#include "risk/server/snapshot.h"
+
+#include "risk/rules/state.h"
+#include "risk/server/wal.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace risk {
+
+namespace server {
+
+namespace {
+
+constexpr char magic[8] = {'r', 'i', 's', 'k', 'a', 'r', 'n', 'a'};
+
+template <typename T>
+T get(const std::uint8_t* in)
+{
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value |= std::uint64_t{in[i]} << (8 * i);
+    }
+    return static_cast<T>(value);
+}
+
+template <typename T>
+void put(std::uint8_t* out, T value)
+{
+    const auto bits = static_cast<std::uint64_t>(value);
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        out[i] = static_cast<std::uint8_t>(bits >> (8 * i));
+    }
+}
+
+void write_all(int fd, const Buffer& data, std::uint64_t offset)
+{
+    for (std::size_t written = 0; written < data.size();) {
+        const auto count = ::pwrite(fd, data.data() + written, data.size() - written, static_cast<off_t>(offset + written));
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "pwrite");
+        }
+        written += static_cast<std::size_t>(count);
+    }
+}
+
+}
+
+SnapshotArena::SnapshotArena(
+    const std::string& path, std::uint32_t layout, const std::function<void (const Game& game)>& found
+)
+    : path_(path)
+    , layout_(layout)
+    , file_(::open(path.c_str(), O_RDWR | O_CLOEXEC))
+{
+    if (!file_) {
+        if (errno != ENOENT) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+
+        // Only an arena with a header that made it to disk is put in place
+        const auto temporary = path + ".tmp";
+        file_ = FileDescriptor{::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+        if (!file_) {
+            throw std::system_error(errno, std::generic_category(), "open " + temporary);
+        }
+        if (::ftruncate(file_.get(), static_cast<off_t>(records_offset + initial_slots * 2 * record_size)) < 0) {
+            throw std::system_error(errno, std::generic_category(), "ftruncate " + temporary);
+        }
+        // Sequence n goes in header n % 2
+        write_all(file_.get(), header(1, 0), header_spacing);
+        if (::fdatasync(file_.get()) < 0) {
+            throw std::system_error(errno, std::generic_category(), "fdatasync " + temporary);
+        }
+        if (::rename(temporary.c_str(), path.c_str()) < 0) {
+            throw std::system_error(errno, std::generic_category(), "rename " + path);
+        }
+        sync_directory(path);
+    }
+
+    struct stat status{};
+    if (::fstat(file_.get(), &status) < 0) {
+        throw std::system_error(errno, std::generic_category(), "fstat " + path);
+    }
+    mapped_ = static_cast<std::size_t>(status.st_size);
+    rules::ensure(mapped_ >= records_offset, std::runtime_error(path + " is not a snapshot arena"));
+    auto* address = ::mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_SHARED, file_.get(), 0);
+    if (address == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap " + path);
+    }
+    map_ = static_cast<std::uint8_t*>(address);
+
+    // The newest header that is whole. Either is enough to tell what the
+    // file is, since a torn one leaves the other as it was.
+    const std::uint8_t* newest = nullptr;
+    for (std::size_t copy = 0; copy < 2; ++copy) {
+        const auto* in = map_ + copy * header_spacing;
+        if (std::memcmp(in, magic, sizeof(magic)) != 0 || crc32(in, header_size - 4) != get<std::uint32_t>(in + header_size - 4)) {
+            continue;
+        }
+        if (!newest || get<std::uint64_t>(in + 24) > get<std::uint64_t>(newest + 24)) {
+            newest = in;
+        }
+    }
+    rules::ensure(newest != nullptr, std::runtime_error(path + " is damaged"));
+    rules::ensure(
+        get<std::uint32_t>(newest + 8) == version && get<std::uint32_t>(newest + 16) == record_size,
+        std::runtime_error(path + " has an unsupported version")
+    );
+    rules::ensure(
+        get<std::uint32_t>(newest + 12) == layout,
+        std::runtime_error(path + " was written by a server with another layout")
+    );
+    sequence_ = get<std::uint64_t>(newest + 24);
+    generation_ = get<std::uint64_t>(newest + 32);
+    const auto slots = get<std::uint64_t>(newest + 40);
+    rules::ensure(
+        slots <= (mapped_ - records_offset) / (2 * record_size), std::runtime_error(path + " is damaged")
+    );
+    end_ = static_cast<std::uint32_t>(slots);
+
+    // Each slot's newest committed record. A game that moved slots after
+    // a crash may be in two; the newer one is where it is now.
+    std::unordered_map<std::uint64_t, std::uint64_t> generations;
+    for (std::uint32_t index = 0; index < end_; ++index) {
+        const std::uint8_t* best = nullptr;
+        std::uint8_t current = 0;
+        for (std::uint8_t copy = 0; copy < 2; ++copy) {
+            auto* in = record(index, copy);
+            const auto size = get<std::uint32_t>(in + 4);
+            if (size > max_state_size || crc32(in + 4, record_header_size - 4 + size) != get<std::uint32_t>(in)) {
+                continue;
+            }
+            const auto generation = get<std::uint64_t>(in + 16);
+            if (generation > generation_) {
+                // From a snapshot a crash cut short. Not to be mistaken for
+                // one the log later gives the same generation.
+                put(in, ~get<std::uint32_t>(in));
+                continue;
+            }
+            if (!best || generation > get<std::uint64_t>(best + 16)) {
+                best = in;
+                current = copy;
+            }
+        }
+        if (!best) {
+            free_.push_back(index);
+            continue;
+        }
+
+        const auto id = get<std::uint64_t>(best + 8);
+        const auto generation = get<std::uint64_t>(best + 16);
+        auto [seen, added] = generations.emplace(id, generation);
+        if (!added) {
+            if (seen->second > generation) {
+                free_.push_back(index);
+                continue;
+            }
+            free_.push_back(slots_[id].index);
+            seen->second = generation;
+        }
+        slots_[id] = Slot{index, current};
+    }
+
+    for (const auto& [id, slot] : slots_) {
+        const auto* in = record(slot.index, slot.current);
+        found(Game{id, get<std::uint32_t>(in + 24), get<std::uint32_t>(in + 28), get<std::uint64_t>(in + 32)});
+    }
+}
+
+SnapshotArena::~SnapshotArena()
+{
+    if (map_) {
+        ::munmap(map_, mapped_);
+    }
+}
+
+void SnapshotArena::load(std::uint64_t id, Buffer& out) const
+{
+    const auto& slot = slots_.at(id);
+    const auto* in = record(slot.index, slot.current);
+    const auto* state = in + record_header_size;
+    out.assign(state, state + get<std::uint32_t>(in + 4));
+}
+
+void SnapshotArena::store(const Game& game, const std::uint8_t* state, std::size_t size, std::uint64_t generation)
+{
+    if (size > max_state_size) {
+        throw std::length_error("State too long for a snapshot record");
+    }
+
+    auto iter = slots_.find(game.id);
+    if (iter == std::end(slots_)) {
+        std::uint32_t index;
+        if (!free_.empty()) {
+            index = free_.back();
+            free_.pop_back();
+        } else {
+            index = end_++;
+            reserve(end_);
+            // Past the slots in use there may be records a crash left
+            std::memset(record(index, 0), 0, 2 * record_size);
+        }
+        // The first store goes to record 0
+        iter = slots_.emplace(game.id, Slot{index, 1}).first;
+    }
+
+    // The other record may hold the last committed State, so this one is
+    // written in place
+    auto& slot = iter->second;
+    slot.current ^= 1;
+    auto* out = record(slot.index, slot.current);
+    put(out + 4, static_cast<std::uint32_t>(size));
+    put(out + 8, game.id);
+    put(out + 16, generation);
+    put(out + 24, game.dice);
+    put(out + 28, game.flags);
+    put(out + 32, game.history);
+    std::memcpy(out + record_header_size, state, size);
+    put(out, crc32(out + 4, record_header_size - 4 + size));
+}
+
+void SnapshotArena::commit(DiskIo& io, std::uint64_t generation, std::function<void ()> done)
+{
+    // Records go through the mapping, and are synced with the file
+    io.write_and_sync(file_.get(), 0, Buffer{}, [this, &io, generation, done = std::move(done)] (Buffer) mutable {
+        const auto sequence = sequence_ + 1;
+        const auto offset = sequence % 2 * header_spacing;
+        io.write_and_sync(file_.get(), offset, header(sequence, generation), [this, sequence, generation, done = std::move(done)] (Buffer) {
+            sequence_ = sequence;
+            generation_ = generation;
+            done();
+        });
+    });
+}
+
+std::uint8_t* SnapshotArena::record(std::uint32_t slot, std::uint8_t copy) const
+{
+    return map_ + records_offset + (std::size_t{slot} * 2 + copy) * record_size;
+}
+
+void SnapshotArena::reserve(std::uint32_t slots)
+{
+    const auto capacity = (mapped_ - records_offset) / (2 * record_size);
+    if (slots <= capacity) {
+        return;
+    }
+
+    const auto size = records_offset + std::max<std::size_t>(slots, capacity * 2) * 2 * record_size;
+    if (::ftruncate(file_.get(), static_cast<off_t>(size)) < 0) {
+        throw std::system_error(errno, std::generic_category(), "ftruncate " + path_);
+    }
+    auto* address = ::mremap(map_, mapped_, size, MREMAP_MAYMOVE);
+    if (address == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mremap " + path_);
+    }
+    map_ = static_cast<std::uint8_t*>(address);
+    mapped_ = size;
+}
+
+Buffer SnapshotArena::header(std::uint64_t sequence, std::uint64_t generation) const
+{
+    Buffer out(header_size);
+    std::memcpy(out.data(), magic, sizeof(magic));
+    put(out.data() + 8, version);
+    put(out.data() + 12, layout_);
+    put(out.data() + 16, static_cast<std::uint32_t>(record_size));
+    put(out.data() + 20, std::uint32_t{0});
+    put(out.data() + 24, sequence);
+    put(out.data() + 32, generation);
+    put(out.data() + 40, std::uint64_t{end_});
+    put(out.data() + header_size - 4, crc32(out.data(), header_size - 4));
+    return out;
+}
+
+}
+
+}
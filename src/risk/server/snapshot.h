@@ -0,0 +1,119 @@
+#pragma once
+
+#include "risk/server/buffer_pool.h"
+#include "risk/server/disk_io.h"
+#include "risk/server/socket.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+// A shard's games as of a point in its log, so that recovery can start
+// from there instead of from the first record. The snapshot's
+// `generation` is the first log file it does not cover; the files before
+// it can go.
+//
+// The games live in a file mapped into memory, at fixed places: each
+// game has two records of record_size bytes, and a snapshot writes only
+// the games that changed since the last one, each into the record that
+// does not hold its last committed state. Once the records are synced,
+// one of two headers is rewritten to commit the snapshot. Recovery maps
+// the file and takes the newest header and, for each game, the newest
+// record that belongs to it; a crash part way through a snapshot leaves
+// records from a generation no header has, or with a bad checksum, and
+// those are passed over. Nothing is decoded until the game is loaded.
+//
+// The file starts with the headers at 0 and 512: the magic "riskarna",
+// u32 version, u32 layout, u32 record size, u32 zero, u64 sequence, u64
+// generation, u64 slots in use and a CRC-32 of what comes before it.
+// Slot i's records are at 4096 + 2 * i * record_size. A record is a
+// CRC-32 of the rest of it, then u32 size, u64 game id, u64 generation,
+// u32 dice state, u32 flags, u64 history reference and `size` bytes of
+// State as encoded by StateCodec. Integers are LE.
+class SnapshotArena {
+public:
+    static constexpr std::uint32_t version = 2;
+    static constexpr std::size_t record_size = 512;
+    static constexpr std::size_t record_header_size = 40;
+    static constexpr std::size_t max_state_size = record_size - record_header_size;
+
+    struct Game {
+        std::uint64_t id;
+        std::uint32_t dice;
+        // Whatever the caller stored with the game
+        std::uint32_t flags;
+        // Where the game's event log ends in the shard's HistoryFile, 0 if
+        // it is not kept
+        std::uint64_t history;
+    };
+
+    // Maps the arena at `path`, creating it if there is none, and hands
+    // each game of the last committed snapshot to `found`. An arena that
+    // is damaged or was written with another version or layout is a
+    // std::runtime_error.
+    SnapshotArena(
+        const std::string& path, std::uint32_t layout, const std::function<void (const Game& game)>& found
+    );
+    ~SnapshotArena();
+
+    SnapshotArena(const SnapshotArena&) = delete;
+    SnapshotArena& operator=(const SnapshotArena&) = delete;
+
+    // Of the last snapshot committed, 0 if there is none
+    std::uint64_t generation() const { return generation_; }
+    std::size_t games() const { return slots_.size(); }
+    bool contains(std::uint64_t id) const { return slots_.count(id) > 0; }
+
+    // Replaces the contents of `out` with the State last stored for the game
+    void load(std::uint64_t id, Buffer& out) const;
+
+    // Writes the game's State as of `generation` to its spare record. A
+    // State longer than max_state_size is a std::length_error.
+    void store(const Game& game, const std::uint8_t* state, std::size_t size, std::uint64_t generation);
+
+    // Syncs what was stored, then commits it as the snapshot of
+    // `generation`. `done` runs from `io` once that is durable. One commit
+    // at a time.
+    void commit(DiskIo& io, std::uint64_t generation, std::function<void ()> done);
+
+private:
+    static constexpr std::size_t header_size = 52;
+    static constexpr std::size_t header_spacing = 512;
+    static constexpr std::size_t records_offset = 4096;
+    static constexpr std::uint32_t initial_slots = 1024;
+
+    struct Slot {
+        std::uint32_t index;
+        // Which of the two records holds the latest State
+        std::uint8_t current;
+    };
+
+    std::uint8_t* record(std::uint32_t slot, std::uint8_t copy) const;
+    // Makes room for at least `slots` slots
+    void reserve(std::uint32_t slots);
+    Buffer header(std::uint64_t sequence, std::uint64_t generation) const;
+
+    const std::string path_;
+    const std::uint32_t layout_;
+    FileDescriptor file_;
+    std::uint8_t* map_ = nullptr;
+    std::size_t mapped_ = 0;
+
+    std::uint64_t sequence_ = 0;
+    std::uint64_t generation_ = 0;
+    std::unordered_map<std::uint64_t, Slot> slots_;
+    // Slots of the arena with no committed game, and where the next new
+    // slot starts
+    std::vector<std::uint32_t> free_;
+    std::uint32_t end_ = 0;
+};
+
+}
+
+}
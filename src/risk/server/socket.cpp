@@ -0,0 +1,171 @@
+#include "risk/server/socket.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+namespace risk {
+
+namespace server {
+
+namespace {
+
+[[noreturn]] void throw_errno(const char* what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+sockaddr_in tcp_address(const std::string& host, std::uint16_t port)
+{
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+        throw std::invalid_argument("Not an IPv4 address: " + host);
+    }
+    return address;
+}
+
+sockaddr_un unix_address(const std::string& path)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Unix socket path too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+}
+
+FileDescriptor& FileDescriptor::operator=(FileDescriptor&& other) noexcept
+{
+    if (this != &other) {
+        reset(other.release());
+    }
+    return *this;
+}
+
+int FileDescriptor::release()
+{
+    const int fd = fd_;
+    fd_ = -1;
+    return fd;
+}
+
+void FileDescriptor::reset(int fd)
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    fd_ = fd;
+}
+
+void set_nonblocking(int fd)
+{
+    const int flags = ::fcntl(fd, F_GETFL);
+    if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        throw_errno("fcntl");
+    }
+}
+
+FileDescriptor listen_tcp(const std::string& host, std::uint16_t port)
+{
+    FileDescriptor fd{::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)};
+    if (!fd) {
+        throw_errno("socket");
+    }
+
+    const int on = 1;
+    ::setsockopt(fd.get(), SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    const auto address = tcp_address(host, port);
+    if (::bind(fd.get(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+        throw_errno("bind");
+    }
+    if (::listen(fd.get(), SOMAXCONN) < 0) {
+        throw_errno("listen");
+    }
+    return fd;
+}
+
+FileDescriptor listen_unix(const std::string& path)
+{
+    FileDescriptor fd{::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)};
+    if (!fd) {
+        throw_errno("socket");
+    }
+
+    ::unlink(path.c_str());
+    const auto address = unix_address(path);
+    if (::bind(fd.get(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+        throw_errno("bind");
+    }
+    if (::listen(fd.get(), SOMAXCONN) < 0) {
+        throw_errno("listen");
+    }
+    return fd;
+}
+
+std::uint16_t local_port(int fd)
+{
+    sockaddr_in address{};
+    socklen_t length = sizeof(address);
+    if (::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+        throw_errno("getsockname");
+    }
+    return ntohs(address.sin_port);
+}
+
+FileDescriptor connect_tcp(const std::string& host, std::uint16_t port)
+{
+    FileDescriptor fd{::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+    if (!fd) {
+        throw_errno("socket");
+    }
+
+    const auto address = tcp_address(host, port);
+    if (::connect(fd.get(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+        throw_errno("connect");
+    }
+
+    const int on = 1;
+    ::setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+FileDescriptor connect_unix(const std::string& path)
+{
+    FileDescriptor fd{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+    if (!fd) {
+        throw_errno("socket");
+    }
+
+    const auto address = unix_address(path);
+    if (::connect(fd.get(), reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+        throw_errno("connect");
+    }
+    return fd;
+}
+
+FileDescriptor connect_to(const std::string& address)
+{
+    const auto colon = address.rfind(':');
+    if (address.find('/') != std::string::npos || colon == std::string::npos) {
+        return connect_unix(address);
+    }
+    return connect_tcp(address.substr(0, colon), static_cast<std::uint16_t>(std::stoul(address.substr(colon + 1))));
+}
+
+}
+
+}
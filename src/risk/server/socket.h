@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace risk {
+
+namespace server {
+
+// Owns a file descriptor and closes it
+class FileDescriptor {
+public:
+    FileDescriptor() = default;
+    explicit FileDescriptor(int fd)
+        : fd_(fd)
+    {}
+
+    FileDescriptor(FileDescriptor&& other) noexcept
+        : fd_(other.release())
+    {}
+
+    FileDescriptor& operator=(FileDescriptor&& other) noexcept;
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    ~FileDescriptor() { reset(); }
+
+    int get() const { return fd_; }
+    explicit operator bool() const { return fd_ >= 0; }
+
+    int release();
+    void reset(int fd = -1);
+
+private:
+    int fd_ = -1;
+};
+
+void set_nonblocking(int fd);
+
+// Non-blocking listening sockets. Port 0 picks a free port.
+FileDescriptor listen_tcp(const std::string& host, std::uint16_t port);
+FileDescriptor listen_unix(const std::string& path);
+
+// The port a TCP socket is bound to
+std::uint16_t local_port(int fd);
+
+// Blocking client connections
+FileDescriptor connect_tcp(const std::string& host, std::uint16_t port);
+FileDescriptor connect_unix(const std::string& path);
+// "host:port", or a Unix socket path
+FileDescriptor connect_to(const std::string& address);
+
+}
+
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+
+namespace risk {
+
+namespace server {
+
+// A bounded single-producer, single-consumer ring. One thread may push
+// and one other thread may pop, without locks.
+template <typename T>
+class SpscQueue {
+public:
+    // `capacity` is rounded up to a power of two
+    explicit SpscQueue(std::size_t capacity)
+        : mask_(round_up(capacity) - 1)
+        , slots_(std::make_unique<T[]>(mask_ + 1))
+    {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    std::size_t capacity() const { return mask_ + 1; }
+
+    // Producer side. Returns false, leaving `value` untouched, when full.
+    bool try_push(T&& value)
+    {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ > mask_) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ > mask_) {
+                return false;
+            }
+        }
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Hands every queued element to `consume` and returns
+    // how many there were.
+    template <typename Consume>
+    std::size_t drain(Consume&& consume)
+    {
+        const auto head = head_.load(std::memory_order_relaxed);
+        const auto tail = tail_.load(std::memory_order_acquire);
+        for (auto i = head; i != tail; ++i) {
+            consume(std::move(slots_[i & mask_]));
+        }
+        head_.store(tail, std::memory_order_release);
+        return tail - head;
+    }
+
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    static std::size_t round_up(std::size_t capacity)
+    {
+        std::size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    // Producer and consumer indices live on separate cache lines, each
+    // next to the producer's or consumer's cached copy of the other
+    static constexpr std::size_t line = 64;
+
+    const std::size_t mask_;
+    std::unique_ptr<T[]> slots_;
+
+    alignas(line) std::atomic<std::size_t> tail_{0};
+    std::size_t head_cache_ = 0;
+
+    alignas(line) std::atomic<std::size_t> head_{0};
+};
+
+}
+
+}
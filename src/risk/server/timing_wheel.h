@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+// Timers on a hierarchical wheel of four levels of 64 slots, so arming and
+// cancelling are O(1) however many timers there are. Time is counted in
+// ticks of the caller's choosing.
+//
+// A timer sits on the lowest level whose current lap it expires in. As
+// time reaches the start of a higher level's slot, the slot's timers are
+// moved down a level, until they expire from the bottom one. Timers past
+// the top level's lap wait in an overflow list for the next lap.
+template <typename T>
+class TimingWheel {
+public:
+    using Tick = std::uint64_t;
+    // 0 is never a valid handle
+    using Handle = std::uint64_t;
+
+    explicit TimingWheel(Tick now = 0)
+        : now_(now)
+    {
+        heads_.fill(nil);
+    }
+
+    Tick now() const { return now_; }
+    std::size_t size() const { return size_; }
+
+    // Expires at `at`, or on the next tick if that has passed
+    Handle arm(Tick at, T value)
+    {
+        std::uint32_t index;
+        if (free_ != nil) {
+            index = free_;
+            free_ = nodes_[index].next;
+        } else {
+            index = static_cast<std::uint32_t>(nodes_.size());
+            nodes_.emplace_back();
+        }
+
+        auto& node = nodes_[index];
+        node.expires = std::max(at, now_ + 1);
+        node.value = std::move(value);
+        node.armed = true;
+        place(index);
+        ++size_;
+        return Handle{node.generation} << 32 | index;
+    }
+
+    // Returns false if the timer has already expired or been cancelled
+    bool cancel(Handle handle)
+    {
+        const auto index = static_cast<std::uint32_t>(handle);
+        if (handle == 0 || index >= nodes_.size()) {
+            return false;
+        }
+        auto& node = nodes_[index];
+        if (!node.armed || node.generation != handle >> 32) {
+            return false;
+        }
+        unlink(index);
+        release(index);
+        return true;
+    }
+
+    // The next tick at which advance has anything to do: expire timers or
+    // move them down a level
+    std::optional<Tick> next() const
+    {
+        std::optional<Tick> next;
+        auto consider = [&next] (Tick tick) {
+            next = next ? std::min(*next, tick) : tick;
+        };
+
+        // Occupied slots are all ahead of the current one on their level
+        for (unsigned level = 0; level < levels; ++level) {
+            if (occupied_[level] != 0) {
+                const auto shift = bits * level;
+                const Tick slot = __builtin_ctzll(occupied_[level]);
+                consider(((now_ >> (shift + bits)) << (shift + bits)) | (slot << shift));
+            }
+        }
+        if (heads_[overflow] != nil) {
+            consider(((now_ >> span_bits) + 1) << span_bits);
+        }
+        return next;
+    }
+
+    // Moves time forward to `now`, handing the value of every timer that
+    // expires on the way to `expire`, in order of expiry. `expire` may arm
+    // and cancel timers.
+    template <typename Expire>
+    void advance(Tick now, Expire&& expire)
+    {
+        while (now_ < now) {
+            const auto due = next();
+            if (!due || *due > now) {
+                now_ = now;
+                return;
+            }
+            now_ = *due;
+
+            // Top down, since a higher level may land timers in a lower
+            // level's slot that is due now
+            if ((now_ & ((Tick{1} << span_bits) - 1)) == 0) {
+                cascade(overflow);
+            }
+            for (unsigned level = levels - 1; level > 0; --level) {
+                const auto shift = bits * level;
+                if ((now_ & ((Tick{1} << shift) - 1)) == 0) {
+                    cascade(level * slots + ((now_ >> shift) & mask));
+                }
+            }
+
+            const auto slot = static_cast<std::size_t>(now_ & mask);
+            while (heads_[slot] != nil) {
+                const auto index = heads_[slot];
+                unlink(index);
+                auto value = std::move(nodes_[index].value);
+                release(index);
+                expire(std::move(value));
+            }
+        }
+    }
+
+private:
+    static constexpr unsigned bits = 6;
+    static constexpr unsigned levels = 4;
+    static constexpr std::size_t slots = std::size_t{1} << bits;
+    static constexpr Tick mask = slots - 1;
+    static constexpr unsigned span_bits = bits * levels;
+    static constexpr std::size_t overflow = levels * slots;
+    static constexpr std::uint32_t nil = std::numeric_limits<std::uint32_t>::max();
+
+    struct Node {
+        Tick expires = 0;
+        T value{};
+        std::uint32_t prev = nil;
+        std::uint32_t next = nil;
+        std::uint32_t generation = 1;
+        std::uint32_t list = 0;
+        bool armed = false;
+    };
+
+    void place(std::uint32_t index)
+    {
+        const auto expires = nodes_[index].expires;
+
+        std::size_t list = overflow;
+        for (unsigned level = 0; level < levels; ++level) {
+            const auto shift = bits * level;
+            if (expires >> (shift + bits) == now_ >> (shift + bits)) {
+                list = level * slots + ((expires >> shift) & mask);
+                break;
+            }
+        }
+        link(index, list);
+    }
+
+    void link(std::uint32_t index, std::size_t list)
+    {
+        auto& node = nodes_[index];
+        node.list = static_cast<std::uint32_t>(list);
+        node.prev = nil;
+        node.next = heads_[list];
+        if (node.next != nil) {
+            nodes_[node.next].prev = index;
+        }
+        heads_[list] = index;
+        if (list != overflow) {
+            occupied_[list / slots] |= std::uint64_t{1} << (list % slots);
+        }
+    }
+
+    void unlink(std::uint32_t index)
+    {
+        auto& node = nodes_[index];
+        if (node.prev != nil) {
+            nodes_[node.prev].next = node.next;
+        } else {
+            heads_[node.list] = node.next;
+        }
+        if (node.next != nil) {
+            nodes_[node.next].prev = node.prev;
+        }
+        if (heads_[node.list] == nil && node.list != overflow) {
+            occupied_[node.list / slots] &= ~(std::uint64_t{1} << (node.list % slots));
+        }
+    }
+
+    void release(std::uint32_t index)
+    {
+        auto& node = nodes_[index];
+        node.armed = false;
+        node.value = T{};
+        ++node.generation;
+        node.next = free_;
+        free_ = index;
+        --size_;
+    }
+
+    // Places the list's timers again, now that time has moved on
+    void cascade(std::size_t list)
+    {
+        auto index = heads_[list];
+        heads_[list] = nil;
+        if (list != overflow) {
+            occupied_[list / slots] &= ~(std::uint64_t{1} << (list % slots));
+        }
+        while (index != nil) {
+            const auto next = nodes_[index].next;
+            place(index);
+            index = next;
+        }
+    }
+
+    Tick now_;
+    std::vector<Node> nodes_;
+    std::uint32_t free_ = nil;
+    std::size_t size_ = 0;
+    std::array<std::uint32_t, levels * slots + 1> heads_;
+    std::array<std::uint64_t, levels> occupied_{};
+};
+
+}
+
+}
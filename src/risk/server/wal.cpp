@@ -0,0 +1,243 @@
+#include "risk/server/wal.h"
+
+#include "risk/rules/state.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace risk {
+
+namespace server {
+
+namespace {
+
+constexpr char magic[8] = {'r', 'i', 's', 'k', 'w', 'a', 'l', '1'};
+constexpr std::size_t header_size = sizeof(magic) + 4;
+constexpr std::size_t record_header_size = 8;
+
+std::array<std::uint32_t, 256> crc_table()
+{
+    std::array<std::uint32_t, 256> table{};
+    for (std::uint32_t i = 0; i < 256; ++i) {
+        auto crc = i;
+        for (unsigned bit = 0; bit < 8; ++bit) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+void put_u32(std::vector<std::uint8_t>& out, std::uint32_t value)
+{
+    for (unsigned i = 0; i < 4; ++i) {
+        out.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+    }
+}
+
+std::uint32_t get_u32(const std::uint8_t* in)
+{
+    return in[0] | std::uint32_t{in[1]} << 8 | std::uint32_t{in[2]} << 16 | std::uint32_t{in[3]} << 24;
+}
+
+void write_all(int fd, const std::uint8_t* data, std::size_t size)
+{
+    while (size > 0) {
+        const auto written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "write");
+        }
+        data += written;
+        size -= static_cast<std::size_t>(written);
+    }
+}
+
+}
+
+std::uint32_t crc32(const std::uint8_t* data, std::size_t size)
+{
+    static const auto table = crc_table();
+
+    std::uint32_t crc = 0xffffffff;
+    for (std::size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+std::vector<std::uint8_t> read_all(int fd)
+{
+    std::vector<std::uint8_t> bytes;
+    std::uint8_t chunk[64 * 1024];
+    for (;;) {
+        const auto count = ::read(fd, chunk, sizeof(chunk));
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "read");
+        }
+        if (count == 0) {
+            return bytes;
+        }
+        bytes.insert(std::end(bytes), chunk, chunk + count);
+    }
+}
+
+void sync_directory(const std::string& path)
+{
+    const auto slash = path.rfind('/');
+    const auto directory = slash == std::string::npos ? std::string{"."} : path.substr(0, slash + 1);
+    FileDescriptor fd{::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    if (!fd || ::fsync(fd.get()) < 0) {
+        throw std::system_error(errno, std::generic_category(), "fsync " + directory);
+    }
+}
+
+WriteAheadLog::WriteAheadLog(DiskIo& io, const std::string& path, std::uint32_t layout, const Replay& replay)
+    : io_(io)
+    , layout_(layout)
+    , segment_(open(path, layout, replay))
+{}
+
+WriteAheadLog::Segment WriteAheadLog::open(const std::string& path, std::uint32_t layout, const Replay& replay)
+{
+    FileDescriptor file{::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)};
+    if (!file) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+
+    const auto bytes = read_all(file.get());
+    std::size_t end = header_size;
+    if (bytes.empty()) {
+        std::vector<std::uint8_t> header(std::begin(magic), std::end(magic));
+        put_u32(header, layout);
+        write_all(file.get(), header.data(), header.size());
+        if (::fdatasync(file.get()) < 0) {
+            throw std::system_error(errno, std::generic_category(), "fdatasync");
+        }
+        sync_directory(path);
+    } else {
+        rules::ensure(
+            bytes.size() >= header_size && std::memcmp(bytes.data(), magic, sizeof(magic)) == 0,
+            std::runtime_error(path + " is not a write-ahead log")
+        );
+        rules::ensure(
+            get_u32(bytes.data() + sizeof(magic)) == layout,
+            std::runtime_error(path + " was written by a server with another layout")
+        );
+
+        while (bytes.size() - end >= record_header_size) {
+            const auto size = get_u32(bytes.data() + end);
+            const auto checksum = get_u32(bytes.data() + end + 4);
+            const auto* record = bytes.data() + end + record_header_size;
+            if (bytes.size() - end - record_header_size < size || crc32(record, size) != checksum) {
+                break;
+            }
+            replay(record, size);
+            end += record_header_size + size;
+        }
+
+        if (end < bytes.size() && ::ftruncate(file.get(), static_cast<off_t>(end)) < 0) {
+            throw std::system_error(errno, std::generic_category(), "ftruncate " + path);
+        }
+    }
+    return Segment{std::move(file), end};
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+    sync();
+}
+
+void WriteAheadLog::rotate(const std::string& path)
+{
+    // The file sealed last time is closed here, so nothing may still be
+    // on its way to it
+    if (sealed_.file && (writing_ || !sealed_batch_.empty())) {
+        sync();
+    }
+
+    auto next = open(path, layout_, [] (const std::uint8_t*, std::size_t) {});
+    if (!batch_.empty()) {
+        sealed_batch_ = std::move(batch_);
+        batch_.clear();
+        sealed_up_to_ = appended_;
+    }
+    // Kept open while a write to it may be in flight
+    sealed_ = std::move(segment_);
+    segment_ = std::move(next);
+    commit();
+}
+
+WriteAheadLog::Sequence WriteAheadLog::append(const std::uint8_t* record, std::size_t size)
+{
+    put_u32(batch_, static_cast<std::uint32_t>(size));
+    put_u32(batch_, crc32(record, size));
+    batch_.insert(std::end(batch_), record, record + size);
+    return ++appended_;
+}
+
+void WriteAheadLog::commit()
+{
+    if (batch_.empty() && sealed_batch_.empty()) {
+        return;
+    }
+    // Records appended by the time the write finishes go with the next one
+    if (writing_) {
+        pending_ = pending_ || !batch_.empty();
+        return;
+    }
+    write();
+}
+
+void WriteAheadLog::sync()
+{
+    commit();
+    while (durable_ < appended_) {
+        io_.wait();
+    }
+}
+
+void WriteAheadLog::write()
+{
+    // The sealed file's records come before any in the current one
+    const bool sealed = !sealed_batch_.empty();
+    auto& segment = sealed ? sealed_ : segment_;
+    auto batch = sealed ? std::move(sealed_batch_) : std::move(batch_);
+    const auto up_to = sealed ? sealed_up_to_ : appended_;
+    if (sealed) {
+        sealed_batch_.clear();
+    } else {
+        batch_ = std::move(spare_);
+        batch_.clear();
+        pending_ = false;
+    }
+
+    const auto offset = segment.end;
+    segment.end += batch.size();
+    writing_ = true;
+
+    io_.write_and_sync(segment.file.get(), offset, std::move(batch), [this, up_to] (Buffer batch) {
+        durable_ = up_to;
+        writing_ = false;
+        spare_ = std::move(batch);
+        if (pending_ || !sealed_batch_.empty()) {
+            write();
+        }
+    });
+}
+
+}
+
+}
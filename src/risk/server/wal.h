@@ -0,0 +1,100 @@
+#pragma once
+
+#include "risk/server/disk_io.h"
+#include "risk/server/socket.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace risk {
+
+namespace server {
+
+// A file of checksummed records, made durable in batches. Records are
+// appended to the current batch on the owner's thread, and commit hands
+// the batch to `io` to be written and synced at once, so a batch of
+// records shares one fdatasync. The next batch fills up while the last
+// one syncs. Only one batch is in flight at a time, so the file is
+// written in order.
+//
+// A record is its length and CRC-32, both u32 LE, then its bytes. After
+// a crash the log ends at the last record that was written completely.
+//
+// The log may go on in a new file with rotate, so that the files before
+// it can be deleted once a snapshot covers them.
+class WriteAheadLog {
+public:
+    // Records are numbered from 1 in the order they were appended since
+    // the log was opened, across rotations
+    using Sequence = std::uint64_t;
+    using Replay = std::function<void (const std::uint8_t* record, std::size_t size)>;
+
+    // Opens the log at `path` for appending, creating it if needed. The
+    // records already in it are handed to `replay` in order, and a torn
+    // record at the end is cut off. `layout` is stored with a new log and
+    // must match when it is opened again.
+    WriteAheadLog(DiskIo& io, const std::string& path, std::uint32_t layout, const Replay& replay);
+    // Syncs what was appended
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Records appended from now on go to a new file at `path`, while
+    // those before still go to the current one
+    void rotate(const std::string& path);
+
+    Sequence append(const std::uint8_t* record, std::size_t size);
+    Sequence appended() const { return appended_; }
+
+    // Hands the records appended so far to `io`, or has them follow the
+    // batch in flight
+    void commit();
+    // Commits, then reaps `io` until everything appended is durable
+    void sync();
+
+    // Moves on as `io` is reaped
+    Sequence durable() const { return durable_; }
+
+private:
+    struct Segment {
+        FileDescriptor file;
+        std::uint64_t end = 0;
+    };
+
+    // Opens or creates the file, returning it with its records replayed
+    static Segment open(const std::string& path, std::uint32_t layout, const Replay& replay);
+    void write();
+
+    DiskIo& io_;
+    const std::uint32_t layout_;
+    Segment segment_;
+
+    // The file before the last rotate, and what is left to write to it
+    Segment sealed_;
+    Buffer sealed_batch_;
+    Sequence sealed_up_to_ = 0;
+
+    Buffer batch_;
+    // The last batch written, kept for its capacity
+    Buffer spare_;
+    Sequence appended_ = 0;
+    bool writing_ = false;
+    // Committed while writing
+    bool pending_ = false;
+    Sequence durable_ = 0;
+};
+
+// Shared with the snapshots that take the log's place
+
+// CRC-32 as in zlib
+std::uint32_t crc32(const std::uint8_t* data, std::size_t size);
+std::vector<std::uint8_t> read_all(int fd);
+// A new or renamed file is only durable once its directory entry is
+void sync_directory(const std::string& path);
+
+}
+
+}
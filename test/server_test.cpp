@@ -0,0 +1,2025 @@
+#include <gtest/gtest.h>
+
+#include "risk/rules/codec.h"
+#include "risk/rules/event_log.h"
+#include "risk/rules/replay.h"
+#include "risk/server/archive.h"
+#include "risk/server/disk_io.h"
+#include "risk/server/hash_ring.h"
+#include "risk/server/protocol.h"
+#include "risk/server/router.h"
+#include "risk/server/server.h"
+#include "risk/server/snapshot.h"
+#include "risk/server/mpsc_queue.h"
+#include "risk/server/socket.h"
+#include "risk/server/spsc_queue.h"
+#include "risk/server/timing_wheel.h"
+#include "risk/server/wal.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using namespace risk::rules;
+using namespace risk::server;
+
+struct ServerFixture : public ::testing::Test
+{
+    explicit ServerFixture(ServerOptions options = {})
+        : path("/tmp/risk_server_test." + std::to_string(::getpid()))
+        , options(on_socket(std::move(options), path))
+        , server(this->options)
+        , thread([this] { server.run(); })
+        , client{connect_unix(path), {}, {}}
+        , codec(classic_board())
+    {
+    }
+
+    ~ServerFixture() override
+    {
+        server.stop();
+        if (thread.joinable()) {
+            thread.join();
+        }
+        ::unlink(path.c_str());
+    }
+
+protected:
+    static ServerOptions on_socket(ServerOptions options, const std::string& path)
+    {
+        options.unix_path = path;
+        return options;
+    }
+
+    struct Peer {
+        FileDescriptor fd;
+        std::vector<std::uint8_t> buffered;
+        std::vector<std::uint8_t> frame;
+    };
+
+    Reply request(const Request& request)
+    {
+        std::vector<std::uint8_t> frame;
+        encode_request(frame, request);
+        send(frame);
+        return receive();
+    }
+
+    Reply command(GameId game, const Command& command)
+    {
+        std::vector<std::uint8_t> frame;
+        encode_command(frame, game, command);
+        send(frame);
+        return receive();
+    }
+
+    void send(const std::vector<std::uint8_t>& data)
+    {
+        ASSERT_EQ(static_cast<ssize_t>(data.size()), ::write(client.fd.get(), data.data(), data.size()));
+    }
+
+    // The reply's payload stays valid until the next call
+    Reply receive()
+    {
+        Reply reply;
+        EXPECT_TRUE(receive(client, reply));
+        return reply;
+    }
+
+    // Reinforces the first territory it can, otherwise ends the phase
+    static Command next_move(const State& state)
+    {
+        const auto player = state.current_player().id();
+        if (state.phase() == Phase::Reinforce) {
+            for (const auto& territory : state.board().territories()) {
+                if (territory.owner() == player) {
+                    return PlaceUnit{player, territory.id()};
+                }
+            }
+        }
+        return EndPhase{player};
+    }
+
+    // Like next_move, but attacks where it can so that dice are rolled
+    static Command next_attack(const State& state)
+    {
+        const auto player = state.current_player().id();
+        if (state.phase() == Phase::Occupy) {
+            return Occupy{player, state.turn().occupation->min_units};
+        }
+        if (state.phase() == Phase::Attack) {
+            const auto territories = state.board().territories();
+            for (const auto& from : territories) {
+                for (const auto& to : territories) {
+                    if (from.owner() == player && from.units() > 1 && to.owner() != player
+                        && state.board().adjacent(from.id(), to.id())) {
+                        return Attack{player, from.id(), to.id(), 1};
+                    }
+                }
+            }
+        }
+        return next_move(state);
+    }
+
+    // Plays to win: reinforces and attacks from the strongest territories,
+    // and moves everything it can into what it conquers
+    static Command next_conquest(const State& state)
+    {
+        const auto player = state.current_player().id();
+        const auto territories = state.board().territories();
+        auto hostile = [&] (const Territory& from, const Territory& to) {
+            return from.owner() == player && to.owner() != player && state.board().adjacent(from.id(), to.id());
+        };
+
+        if (state.phase() == Phase::Reinforce) {
+            const Territory* strongest = nullptr;
+            for (const auto& from : territories) {
+                for (const auto& to : territories) {
+                    if (hostile(from, to) && (!strongest || from.units() > strongest->units())) {
+                        strongest = &from;
+                    }
+                }
+            }
+            if (strongest) {
+                return PlaceUnit{player, strongest->id()};
+            }
+        }
+        if (state.phase() == Phase::Occupy) {
+            const auto occupation = *state.turn().occupation;
+            for (const auto& from : territories) {
+                if (from.id() == occupation.from) {
+                    return Occupy{player, std::max(occupation.min_units, from.units() - 1)};
+                }
+            }
+        }
+        if (state.phase() == Phase::Attack) {
+            const Territory* from = nullptr;
+            const Territory* to = nullptr;
+            for (const auto& a : territories) {
+                for (const auto& b : territories) {
+                    if (hostile(a, b) && a.units() > b.units() && (!from || a.units() - b.units() > from->units() - to->units())) {
+                        from = &a;
+                        to = &b;
+                    }
+                }
+            }
+            if (from) {
+                return Attack{player, from->id(), to->id(), std::min<std::size_t>(3, from->units() - 1)};
+            }
+        }
+        return next_move(state);
+    }
+
+    // False once the peer's socket has nothing more to read
+    bool receive(Peer& peer, Reply& reply)
+    {
+        auto fill = [&peer] (std::size_t size) {
+            while (peer.buffered.size() < size) {
+                std::uint8_t chunk[4096];
+                const auto count = ::read(peer.fd.get(), chunk, sizeof(chunk));
+                if (count <= 0) {
+                    return false;
+                }
+                peer.buffered.insert(std::end(peer.buffered), chunk, chunk + count);
+            }
+            return true;
+        };
+
+        if (!fill(length_size)) {
+            return false;
+        }
+        const std::size_t length = peer.buffered[0] | std::size_t{peer.buffered[1]} << 8;
+        if (!fill(length_size + length)) {
+            return false;
+        }
+        auto& buffered = peer.buffered;
+        peer.frame.assign(std::begin(buffered) + length_size, std::begin(buffered) + length_size + length);
+        buffered.erase(std::begin(buffered), std::begin(buffered) + length_size + length);
+
+        return decode_reply(peer.frame.data(), peer.frame.size(), reply);
+    }
+
+    // Follows a game through its Snapshot and Delta updates
+    void expect_update(GameId game, State& state) { expect_update(client, game, state); }
+
+    void expect_update(Peer& peer, GameId game, State& state)
+    {
+        Reply reply;
+        ASSERT_TRUE(receive(peer, reply));
+        ASSERT_EQ(game, reply.game);
+        if (reply.type == Frame::Snapshot) {
+            codec.decode(reply.payload, reply.size, state);
+        } else {
+            ASSERT_EQ(Frame::Delta, reply.type);
+            codec.patch(reply.payload, reply.size, state);
+        }
+    }
+
+    std::string path;
+    ServerOptions options;
+    Server server;
+    std::thread thread;
+    Peer client;
+    StateCodec codec;
+};
+
+TEST_F(ServerFixture, joining_sends_the_current_state)
+{
+    EXPECT_EQ(Frame::Ok, request({Frame::New, 7, 3, 1, {}}).type);
+    EXPECT_EQ(Frame::Ok, request({Frame::Join, 7, 0, 0, {}}).type);
+
+    State state{Board{}, Phase::GameOver, {}, {}};
+    expect_update(7, state);
+    EXPECT_EQ(Phase::Placing, state.phase());
+    EXPECT_EQ(3U, state.players().size());
+}
+
+TEST_F(ServerFixture, subscribers_get_a_delta_after_each_command)
+{
+    request({Frame::New, 1, 2, 1, {}});
+    request({Frame::Join, 1, 0, 0, {}});
+    State state{Board{}, Phase::GameOver, {}, {}};
+    expect_update(1, state);
+
+    EXPECT_EQ(Frame::Ok, request({Frame::Deal, 1, 0, 5, {}}).type);
+    expect_update(1, state);
+    ASSERT_EQ(Phase::Reinforce, state.phase());
+
+    const auto player = state.current_player();
+    Territory::Id own = 0;
+    for (const auto& territory : state.board().territories()) {
+        if (territory.owner() == player.id()) {
+            own = territory.id();
+        }
+    }
+
+    EXPECT_EQ(Frame::Ok, command(1, PlaceUnit{player.id(), own}).type);
+    expect_update(1, state);
+    EXPECT_EQ(player.units() - 1, state.current_player().units());
+}
+
+TEST_F(ServerFixture, rejected_requests_are_answered_with_an_error)
+{
+    auto error = [] (const Reply& reply) {
+        return reply.type == Frame::Error ? reply.error : ErrorCode{};
+    };
+
+    EXPECT_EQ(ErrorCode::NoSuchGame, error(request({Frame::Join, 3, 0, 0, {}})));
+    EXPECT_EQ(ErrorCode::BadRequest, error(request({Frame::New, 3, 9, 1, {}})));
+
+    request({Frame::New, 3, 2, 1, {}});
+    EXPECT_EQ(ErrorCode::GameExists, error(request({Frame::New, 3, 2, 1, {}})));
+    EXPECT_EQ(ErrorCode::IllegalMove, error(command(3, EndPhase{1})));
+    EXPECT_EQ(ErrorCode::OutOfRange, error(command(3, PlaceUnit{9, 1})));
+
+    // A frame of the wrong size for its type
+    send({2, 0, static_cast<std::uint8_t>(Frame::Join), 3});
+    EXPECT_EQ(ErrorCode::BadRequest, error(receive()));
+}
+
+TEST_F(ServerFixture, serves_tcp_alongside_the_unix_socket)
+{
+    ServerOptions on_tcp;
+    on_tcp.port = 0;
+    Server tcp{on_tcp};
+    std::thread runner([&tcp] { tcp.run(); });
+
+    client.fd = connect_tcp("127.0.0.1", tcp.port());
+    const auto reply = request({Frame::Join, 1, 0, 0, {}});
+    EXPECT_EQ(Frame::Error, reply.type);
+    EXPECT_EQ(ErrorCode::NoSuchGame, reply.error);
+
+    tcp.stop();
+    runner.join();
+}
+
+struct ShardedServerFixture : public ServerFixture
+{
+    ShardedServerFixture()
+        : ServerFixture([] {
+            ServerOptions options;
+            options.shards = 4;
+            return options;
+        }())
+    {
+    }
+};
+
+TEST_F(ShardedServerFixture, games_on_every_shard_are_reachable_from_one_connection)
+{
+    std::vector<State> states(9, State{Board{}, Phase::GameOver, {}, {}});
+
+    for (GameId game = 1; game <= 8; ++game) {
+        EXPECT_EQ(Frame::Ok, request({Frame::New, game, 2, 1, {}}).type);
+        const auto joined = request({Frame::Join, game, 0, 0, {}});
+        EXPECT_EQ(Frame::Ok, joined.type);
+        EXPECT_EQ(game, joined.game);
+        expect_update(game, states[game]);
+    }
+
+    for (GameId game = 1; game <= 8; ++game) {
+        EXPECT_EQ(Frame::Ok, request({Frame::Deal, game, 0, 3, {}}).type);
+        expect_update(game, states[game]);
+        EXPECT_EQ(Phase::Reinforce, states[game].phase());
+    }
+}
+
+TEST_F(ShardedServerFixture, closed_connections_are_unsubscribed)
+{
+    {
+        auto other = connect_unix(path);
+        std::vector<std::uint8_t> frames;
+        encode_request(frames, {Frame::New, 5, 2, 1, {}});
+        encode_request(frames, {Frame::Join, 5, 0, 0, {}});
+        ASSERT_EQ(static_cast<ssize_t>(frames.size()), ::write(other.get(), frames.data(), frames.size()));
+        std::uint8_t reply[256];
+        ASSERT_GT(::read(other.get(), reply, sizeof(reply)), 0);
+    }
+
+    request({Frame::Join, 5, 0, 0, {}});
+    State state{Board{}, Phase::GameOver, {}, {}};
+    expect_update(5, state);
+    EXPECT_EQ(Frame::Ok, request({Frame::Deal, 5, 0, 3, {}}).type);
+    expect_update(5, state);
+}
+
+struct SlowSubscriberFixture : public ServerFixture
+{
+    SlowSubscriberFixture()
+        : ServerFixture([] {
+            ServerOptions options;
+            options.shards = 2;
+            options.backlog = 1024;
+            return options;
+        }())
+    {
+    }
+};
+
+TEST_F(SlowSubscriberFixture, slow_subscribers_skip_to_a_fresh_snapshot)
+{
+    request({Frame::New, 1, 2, 1, {}});
+    request({Frame::Join, 1, 0, 0, {}});
+    State state{Board{}, Phase::GameOver, {}, {}};
+    expect_update(1, state);
+
+    // Joins, then does not read while the game goes on
+    Peer spectator{connect_unix(path), {}, {}};
+    std::vector<std::uint8_t> join;
+    encode_request(join, {Frame::Join, 1, 0, 0, {}});
+    ASSERT_EQ(static_cast<ssize_t>(join.size()), ::write(spectator.fd.get(), join.data(), join.size()));
+
+    request({Frame::Deal, 1, 0, 5, {}});
+    expect_update(1, state);
+
+    auto play = [&] {
+        ASSERT_EQ(Frame::Ok, command(1, next_move(state)).type);
+        expect_update(1, state);
+    };
+
+    const int moves = 3000;
+    for (int i = 0; i < moves; ++i) {
+        play();
+    }
+
+    // Catch up on what was queued, then on the next move the spectator
+    // is sent the current state instead of everything it missed
+    timeval timeout{0, 200 * 1000};
+    ::setsockopt(spectator.fd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int deltas = 0;
+    Reply reply;
+    while (receive(spectator, reply)) {
+        deltas += reply.type == Frame::Delta;
+    }
+    EXPECT_LT(deltas, moves);
+
+    play();
+
+    State seen{Board{}, Phase::GameOver, {}, {}};
+    bool resynced = false;
+    while (!resynced && receive(spectator, reply)) {
+        if (reply.type == Frame::Snapshot) {
+            codec.decode(reply.payload, reply.size, seen);
+            resynced = true;
+        }
+    }
+    ASSERT_TRUE(resynced);
+    EXPECT_EQ(hash_state(state), hash_state(seen));
+
+    // And follows along from there
+    play();
+    ASSERT_TRUE(receive(spectator, reply));
+    ASSERT_EQ(Frame::Delta, reply.type);
+    codec.patch(reply.payload, reply.size, seen);
+    EXPECT_EQ(hash_state(state), hash_state(seen));
+}
+
+struct CoalescingFixture : public ServerFixture
+{
+    CoalescingFixture()
+        : ServerFixture([] {
+            ServerOptions options;
+            options.coalesce = std::chrono::milliseconds{100};
+            return options;
+        }())
+    {
+    }
+};
+
+TEST_F(CoalescingFixture, moves_within_the_window_arrive_as_one_delta)
+{
+    request({Frame::New, 1, 2, 1, {}});
+    request({Frame::Join, 1, 0, 0, {}});
+    State state{Board{}, Phase::GameOver, {}, {}};
+    expect_update(1, state);
+
+    // The first change after a quiet spell is sent right away
+    request({Frame::Deal, 1, 0, 5, {}});
+    expect_update(1, state);
+
+    const auto player = state.current_player();
+    Territory::Id own = 0;
+    std::size_t units = 0;
+    for (const auto& territory : state.board().territories()) {
+        if (territory.owner() == player.id()) {
+            own = territory.id();
+            units = territory.units();
+            break;
+        }
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_EQ(Frame::Ok, command(1, PlaceUnit{player.id(), own}).type);
+    }
+    expect_update(1, state);
+    EXPECT_EQ(player.units() - 3, state.current_player().units());
+    for (const auto& territory : state.board().territories()) {
+        if (territory.id() == own) {
+            EXPECT_EQ(units + 3, territory.units());
+        }
+    }
+
+    // Nothing else was held back
+    timeval timeout{0, 200 * 1000};
+    ::setsockopt(client.fd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    Reply reply;
+    EXPECT_FALSE(receive(client, reply));
+}
+
+struct TurnTimeoutFixture : public ServerFixture
+{
+    TurnTimeoutFixture()
+        : ServerFixture([] {
+            ServerOptions options;
+            options.turn_timeout = std::chrono::milliseconds{50};
+            return options;
+        }())
+    {
+    }
+};
+
+TEST_F(TurnTimeoutFixture, stalled_players_have_their_turn_played)
+{
+    request({Frame::New, 1, 3, 1, {}});
+    request({Frame::Join, 1, 0, 0, {}});
+    State state{Board{}, Phase::GameOver, {}, {}};
+    expect_update(1, state);
+
+    // Nothing happens to a game nobody has started
+    timeval timeout{0, 150 * 1000};
+    ::setsockopt(client.fd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    Reply reply;
+    EXPECT_FALSE(receive(client, reply));
+    timeout = timeval{5, 0};
+    ::setsockopt(client.fd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    request({Frame::Deal, 1, 0, 5, {}});
+    expect_update(1, state);
+    const auto first = state.current_player();
+    ASSERT_EQ(Phase::Reinforce, state.phase());
+
+    // All of the first player's units were placed, then their turn ended
+    expect_update(1, state);
+    ASSERT_NE(first.id(), state.current_player().id());
+    for (const auto& player : state.players()) {
+        if (player.id() == first.id()) {
+            EXPECT_EQ(0U, player.units());
+        }
+    }
+
+    // And so on for the next player
+    const auto second = state.current_player().id();
+    expect_update(1, state);
+    EXPECT_NE(second, state.current_player().id());
+}
+
+struct WalFixture : public ServerFixture
+{
+    WalFixture()
+        : ServerFixture([] {
+            ServerOptions options;
+            options.shards = 2;
+            options.wal_dir = make_directory();
+            return options;
+        }())
+    {
+    }
+
+    explicit WalFixture(ServerOptions options)
+        : ServerFixture(std::move(options))
+    {
+    }
+
+    ~WalFixture() override
+    {
+        // The server may still be writing to the directory otherwise
+        server.stop();
+        if (thread.joinable()) {
+            thread.join();
+        }
+        for (const auto& name : files()) {
+            ::unlink((options.wal_dir + "/" + name).c_str());
+        }
+        ::rmdir(options.wal_dir.c_str());
+    }
+
+    static std::string make_directory()
+    {
+        char directory[] = "/tmp/risk_wal_test.XXXXXX";
+        return ::mkdtemp(directory);
+    }
+
+    std::vector<std::string> files() const
+    {
+        std::vector<std::string> names;
+        std::unique_ptr<DIR, int (*)(DIR*)> dir{::opendir(options.wal_dir.c_str()), ::closedir};
+        while (const auto* entry = dir ? ::readdir(dir.get()) : nullptr) {
+            if (entry->d_name[0] != '.') {
+                names.emplace_back(entry->d_name);
+            }
+        }
+        std::sort(std::begin(names), std::end(names));
+        return names;
+    }
+};
+
+TEST_F(WalFixture, games_are_recovered_from_the_log)
+{
+    State states[2] = {
+        {Board{}, Phase::GameOver, {}, {}},
+        {Board{}, Phase::GameOver, {}, {}},
+    };
+    for (GameId game = 1; game <= 2; ++game) {
+        ASSERT_EQ(Frame::Ok, request({Frame::New, game, 3, game, {}}).type);
+        request({Frame::Join, game, 0, 0, {}});
+        expect_update(game, states[game - 1]);
+        request({Frame::Deal, game, 0, 7, {}});
+        expect_update(game, states[game - 1]);
+    }
+    for (int i = 0; i < 50; ++i) {
+        for (GameId game = 1; game <= 2; ++game) {
+            ASSERT_EQ(Frame::Ok, command(game, next_move(states[game - 1])).type);
+            expect_update(game, states[game - 1]);
+        }
+    }
+    // Rejected requests are not logged
+    ASSERT_EQ(Frame::Error, request({Frame::New, 1, 3, 1, {}}).type);
+
+    server.stop();
+    thread.join();
+
+    Server restarted{options};
+    std::thread running([&restarted] { restarted.run(); });
+    client = Peer{connect_unix(path), {}, {}};
+
+    for (GameId game = 1; game <= 2; ++game) {
+        const auto before = hash_state(states[game - 1]);
+        request({Frame::Join, game, 0, 0, {}});
+        expect_update(game, states[game - 1]);
+        EXPECT_EQ(before, hash_state(states[game - 1]));
+
+        // And the game goes on from there
+        ASSERT_EQ(Frame::Ok, command(game, next_move(states[game - 1])).type);
+        expect_update(game, states[game - 1]);
+    }
+
+    restarted.stop();
+    running.join();
+}
+
+struct SnapshotFixture : public WalFixture
+{
+    SnapshotFixture()
+        : WalFixture([] {
+            ServerOptions options;
+            options.shards = 2;
+            options.wal_dir = make_directory();
+            options.snapshot_interval = std::chrono::milliseconds{20};
+            return options;
+        }())
+    {
+    }
+};
+
+TEST_F(SnapshotFixture, restarts_from_the_snapshot_and_the_rest_of_the_log)
+{
+    State states[3] = {
+        {Board{}, Phase::GameOver, {}, {}},
+        {Board{}, Phase::GameOver, {}, {}},
+        {Board{}, Phase::GameOver, {}, {}},
+    };
+    std::vector<Command> played;
+    auto play = [&] (GameId game, int moves) {
+        for (int i = 0; i < moves; ++i) {
+            const auto move = next_attack(states[game - 1]);
+            ASSERT_EQ(Frame::Ok, command(game, move).type);
+            expect_update(game, states[game - 1]);
+            if (game == 1) {
+                played.push_back(move);
+            }
+        }
+    };
+    auto start = [&] (GameId game) {
+        ASSERT_EQ(Frame::Ok, request({Frame::New, game, 3, 5, {}}).type);
+        request({Frame::Join, game, 0, 0, {}});
+        expect_update(game, states[game - 1]);
+        request({Frame::Deal, game, 0, 7, {}});
+        expect_update(game, states[game - 1]);
+    };
+
+    for (GameId game = 1; game <= 2; ++game) {
+        start(game);
+        play(game, 100);
+    }
+
+    // Wait for both shards to have a snapshot and to have dropped the
+    // first file of their log
+    const std::vector<std::string> first = {"shard-0.0.wal", "shard-1.0.wal"};
+    auto snapshotted = [&] {
+        const auto names = files();
+        auto has = [&names] (const std::string& name) {
+            return std::find(std::begin(names), std::end(names), name) != std::end(names);
+        };
+        return has("shard-0.snapshot") && has("shard-1.snapshot") && !has(first[0]) && !has(first[1]);
+    };
+    for (int i = 0; i < 200 && !snapshotted(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    }
+    ASSERT_TRUE(snapshotted());
+
+    // More moves end up in the log after the snapshot
+    for (GameId game = 1; game <= 2; ++game) {
+        play(game, 20);
+    }
+
+    server.stop();
+    thread.join();
+
+    Server restarted{options};
+    std::thread running([&restarted] { restarted.run(); });
+    client = Peer{connect_unix(path), {}, {}};
+
+    for (GameId game = 1; game <= 2; ++game) {
+        const auto before = hash_state(states[game - 1]);
+        request({Frame::Join, game, 0, 0, {}});
+        expect_update(game, states[game - 1]);
+        EXPECT_EQ(before, hash_state(states[game - 1]));
+        play(game, 30);
+    }
+
+    // The dice went on where they were: a game with the same seed and
+    // moves that never went through a snapshot ends up the same
+    ASSERT_TRUE(std::any_of(std::begin(played), std::end(played), [] (const Command& move) {
+        return std::holds_alternative<Attack>(move);
+    }));
+    start(3);
+    for (const auto& move : played) {
+        ASSERT_EQ(Frame::Ok, command(3, move).type);
+        expect_update(3, states[2]);
+    }
+    EXPECT_EQ(hash_state(states[0]), hash_state(states[2]));
+
+    restarted.stop();
+    running.join();
+}
+
+struct HibernationFixture : public WalFixture
+{
+    HibernationFixture()
+        : WalFixture([] {
+            ServerOptions options;
+            options.shards = 1;
+            options.wal_dir = make_directory();
+            options.snapshot_interval = std::chrono::milliseconds{20};
+            options.hibernate_after = std::chrono::milliseconds{30};
+            return options;
+        }())
+    {
+    }
+};
+
+TEST_F(HibernationFixture, idle_games_come_back_when_asked_for)
+{
+    State states[3] = {
+        {Board{}, Phase::GameOver, {}, {}},
+        {Board{}, Phase::GameOver, {}, {}},
+        {Board{}, Phase::GameOver, {}, {}},
+    };
+    std::vector<Command> played;
+    auto play = [&] (GameId game, int moves) {
+        for (int i = 0; i < moves; ++i) {
+            const auto move = next_attack(states[game - 1]);
+            ASSERT_EQ(Frame::Ok, command(game, move).type);
+            expect_update(game, states[game - 1]);
+            if (game == 1) {
+                played.push_back(move);
+            }
+        }
+    };
+    auto start = [&] (GameId game) {
+        ASSERT_EQ(Frame::Ok, request({Frame::New, game, 3, 5, {}}).type);
+        request({Frame::Join, game, 0, 0, {}});
+        expect_update(game, states[game - 1]);
+        request({Frame::Deal, game, 0, 7, {}});
+        expect_update(game, states[game - 1]);
+    };
+
+    start(1);
+    start(2);
+    play(1, 60);
+
+    // Both go to sleep, and wake up for the next move with their
+    // subscriber still there
+    std::this_thread::sleep_for(std::chrono::milliseconds{300});
+    play(1, 30);
+    play(2, 1);
+
+    // With the dice where they were
+    start(3);
+    for (const auto& move : played) {
+        ASSERT_EQ(Frame::Ok, command(3, move).type);
+        expect_update(3, states[2]);
+    }
+    EXPECT_EQ(hash_state(states[0]), hash_state(states[2]));
+    ASSERT_EQ(Frame::Error, request({Frame::New, 2, 3, 5, {}}).type);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{300});
+    server.stop();
+    thread.join();
+    EXPECT_EQ(3U, server.games());
+    EXPECT_EQ(3U, server.hibernated_games());
+
+    // Snapshots taken while games were hibernated still hold them
+    Server restarted{options};
+    std::thread running([&restarted] { restarted.run(); });
+    client = Peer{connect_unix(path), {}, {}};
+    for (GameId game = 1; game <= 3; ++game) {
+        const auto before = hash_state(states[game - 1]);
+        request({Frame::Join, game, 0, 0, {}});
+        expect_update(game, states[game - 1]);
+        EXPECT_EQ(before, hash_state(states[game - 1]));
+    }
+    restarted.stop();
+    running.join();
+}
+
+struct HibernatingTurnFixture : public WalFixture
+{
+    HibernatingTurnFixture()
+        : WalFixture([] {
+            ServerOptions options;
+            options.shards = 1;
+            options.wal_dir = make_directory();
+            options.turn_timeout = std::chrono::milliseconds{400};
+            options.hibernate_after = std::chrono::milliseconds{30};
+            return options;
+        }())
+    {
+    }
+};
+
+TEST_F(HibernatingTurnFixture, running_turns_time_out_while_hibernated)
+{
+    State state{Board{}, Phase::GameOver, {}, {}};
+    ASSERT_EQ(Frame::Ok, request({Frame::New, 1, 3, 5, {}}).type);
+    request({Frame::Join, 1, 0, 0, {}});
+    expect_update(1, state);
+    request({Frame::Deal, 1, 0, 7, {}});
+    expect_update(1, state);
+    const auto first = state.current_player().id();
+
+    // The game sleeps through the turn, and wakes up to end it
+    expect_update(1, state);
+    EXPECT_NE(first, state.current_player().id());
+
+    // Then goes back to sleep with the next turn running
+    std::this_thread::sleep_for(std::chrono::milliseconds{200});
+    server.stop();
+    thread.join();
+    EXPECT_EQ(1U, server.hibernated_games());
+}
+
+struct ArchiveFixture : public WalFixture
+{
+    ArchiveFixture()
+        : WalFixture([] {
+            ServerOptions options;
+            options.shards = 2;
+            options.wal_dir = make_directory();
+            options.snapshot_interval = std::chrono::milliseconds{20};
+            options.archive_dir = make_directory();
+            options.replay_unix_path = "/tmp/risk_replay_test." + std::to_string(::getpid());
+            return options;
+        }())
+    {
+    }
+
+    ~ArchiveFixture() override
+    {
+        ::unlink(options.replay_unix_path.c_str());
+        std::unique_ptr<DIR, int (*)(DIR*)> dir{::opendir(options.archive_dir.c_str()), ::closedir};
+        while (const auto* entry = dir ? ::readdir(dir.get()) : nullptr) {
+            if (entry->d_name[0] != '.') {
+                ::unlink((options.archive_dir + "/" + entry->d_name).c_str());
+            }
+        }
+        ::rmdir(options.archive_dir.c_str());
+    }
+
+    // Whether anything has been archived yet
+    bool archived() const
+    {
+        struct stat status{};
+        return ::stat((options.archive_dir + "/0.segment").c_str(), &status) == 0 && status.st_size > 16;
+    }
+
+    // Asks the archive for a game and gathers its log, still compressed.
+    // Returns the Archived frame, or the Error it was answered with.
+    Reply download(Peer& peer, GameId game, ArchivedGame& archived, std::vector<std::uint8_t>& log)
+    {
+        std::vector<std::uint8_t> frame;
+        encode_request(frame, {Frame::Replay, game, 0, 0, {}});
+        EXPECT_EQ(static_cast<ssize_t>(frame.size()), ::write(peer.fd.get(), frame.data(), frame.size()));
+
+        Reply reply;
+        EXPECT_TRUE(receive(peer, reply));
+        if (!decode_archived(reply, archived)) {
+            return reply;
+        }
+        log.clear();
+        while (log.size() < archived.size) {
+            Reply part;
+            if (!receive(peer, part) || part.type != Frame::Log || part.game != game || part.size > max_payload) {
+                ADD_FAILURE() << "Log cut short";
+                break;
+            }
+            log.insert(std::end(log), part.payload, part.payload + part.size);
+        }
+        return reply;
+    }
+};
+
+TEST_F(ArchiveFixture, finished_games_are_archived_with_their_whole_log)
+{
+    State state{Board{}, Phase::GameOver, {}, {}};
+    std::size_t moves = 0;
+    auto play = [&] (std::size_t until) {
+        while (moves < until && state.phase() != Phase::GameOver) {
+            const auto player = state.current_player();
+            if (command(5, next_conquest(state)).type != Frame::Ok) {
+                // Holding too many cards to end the phase
+                ASSERT_EQ(Phase::TradeCards, state.phase());
+                const auto cards = player.cards().size();
+                bool traded = false;
+                for (std::size_t a = 0; a < cards && !traded; ++a) {
+                    for (std::size_t b = a + 1; b < cards && !traded; ++b) {
+                        for (std::size_t c = b + 1; c < cards && !traded; ++c) {
+                            traded = command(5, TradeCards{player.id(), {a, b, c}}).type == Frame::Ok;
+                        }
+                    }
+                }
+                ASSERT_TRUE(traded);
+            }
+            expect_update(5, state);
+            ++moves;
+        }
+    };
+
+    ASSERT_EQ(Frame::Ok, request({Frame::New, 5, 2, 3, {}}).type);
+    request({Frame::Join, 5, 0, 0, {}});
+    expect_update(5, state);
+    request({Frame::Deal, 5, 0, 7, {}});
+    expect_update(5, state);
+    ++moves;
+
+    // Part of the game is played before a restart, so its history comes
+    // from more than one run of the server
+    play(100);
+    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+    server.stop();
+    thread.join();
+    {
+        Server restarted{options};
+        std::thread running([&restarted] { restarted.run(); });
+        client = Peer{connect_unix(path), {}, {}};
+        request({Frame::Join, 5, 0, 0, {}});
+        expect_update(5, state);
+
+        play(100000);
+        ASSERT_EQ(Phase::GameOver, state.phase());
+        for (int i = 0; i < 200 && !archived(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        }
+
+        // Downloads are served on their own socket, and only there
+        EXPECT_EQ(Frame::Error, request({Frame::Replay, 5, 0, 0, {}}).type);
+        Peer downloads{connect_unix(options.replay_unix_path), {}, {}};
+        ArchivedGame archived;
+        std::vector<std::uint8_t> compressed;
+        auto reply = download(downloads, 6, archived, compressed);
+        EXPECT_EQ(Frame::Error, reply.type);
+        EXPECT_EQ(ErrorCode::NoSuchGame, reply.error);
+
+        reply = download(downloads, 5, archived, compressed);
+        ASSERT_EQ(Frame::Archived, reply.type);
+        EXPECT_EQ(5U, reply.game);
+        EXPECT_EQ(2U, archived.players);
+        EXPECT_EQ(state.current_player().id(), archived.winner);
+        EXPECT_EQ(moves, archived.moves);
+        ASSERT_EQ(archived.size, compressed.size());
+
+        std::vector<std::uint8_t> bytes(archived.length);
+        uLongf length = bytes.size();
+        ASSERT_EQ(Z_OK, ::uncompress(bytes.data(), &length, compressed.data(), compressed.size()));
+        ASSERT_EQ(bytes.size(), length);
+        const EventLog log{std::move(bytes)};
+        Replay<> replay{classic_board(), {Player{1}, Player{2}}, log};
+        replay.run();
+        EXPECT_EQ(hash_state(state), hash_state(replay.state()));
+
+        // Once archived, the game is evicted and its id is not given out
+        // again
+        reply = command(5, EndPhase{state.current_player().id()});
+        for (int i = 0; i < 200 && reply.error != ErrorCode::NoSuchGame; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+            reply = command(5, EndPhase{state.current_player().id()});
+        }
+        EXPECT_EQ(ErrorCode::NoSuchGame, reply.error);
+        reply = request({Frame::New, 5, 2, 3, {}});
+        EXPECT_EQ(ErrorCode::GameExists, reply.error);
+
+        restarted.stop();
+        running.join();
+        EXPECT_EQ(0U, restarted.games());
+    }
+    ASSERT_TRUE(archived());
+
+    // Not even after another restart
+    {
+        Server restarted{options};
+        std::thread running([&restarted] { restarted.run(); });
+        client = Peer{connect_unix(path), {}, {}};
+        EXPECT_EQ(ErrorCode::GameExists, request({Frame::New, 5, 2, 3, {}}).error);
+        restarted.stop();
+        running.join();
+        EXPECT_EQ(0U, restarted.games());
+    }
+
+    Archive archive{options.archive_dir};
+    EXPECT_EQ(1U, archive.games());
+    const auto entry = archive.find(5);
+    ASSERT_TRUE(entry);
+    EXPECT_EQ(2U, entry->players);
+    EXPECT_EQ(state.current_player().id(), entry->winner);
+    EXPECT_EQ(Archive::classic_map, entry->map);
+    EXPECT_EQ(moves, entry->moves);
+
+    // The log plays back to where the game ended
+    const auto log = archive.load(*entry);
+    Replay<> replay{classic_board(), {Player{1}, Player{2}}, log};
+    replay.run();
+    EXPECT_EQ(moves, replay.moves());
+    EXPECT_EQ(hash_state(state), hash_state(replay.state()));
+}
+
+struct ReplicationFixture : public WalFixture
+{
+    ReplicationFixture()
+        : WalFixture([] {
+            ServerOptions options;
+            options.shards = 2;
+            options.wal_dir = make_directory();
+            options.snapshot_interval = std::chrono::milliseconds{20};
+            options.hibernate_after = std::chrono::milliseconds{30};
+            return options;
+        }())
+    {
+    }
+
+    // Until `done` or a couple of seconds have passed
+    template <typename Done>
+    static bool wait_for(Done done)
+    {
+        for (int i = 0; i < 200 && !done(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        }
+        return done();
+    }
+};
+
+TEST_F(ReplicationFixture, a_standby_follows_the_primary_and_takes_over)
+{
+    State states[2] = {
+        {Board{}, Phase::GameOver, {}, {}},
+        {Board{}, Phase::GameOver, {}, {}},
+    };
+    auto play = [&] (GameId game, int moves) {
+        for (int i = 0; i < moves; ++i) {
+            ASSERT_EQ(Frame::Ok, command(game, next_attack(states[game - 1])).type);
+            expect_update(game, states[game - 1]);
+        }
+    };
+    for (GameId game = 1; game <= 2; ++game) {
+        ASSERT_EQ(Frame::Ok, request({Frame::New, game, 3, game, {}}).type);
+        request({Frame::Join, game, 0, 0, {}});
+        expect_update(game, states[game - 1]);
+        request({Frame::Deal, game, 0, 7, {}});
+        expect_update(game, states[game - 1]);
+        play(game, 20);
+    }
+    // The standby is sent hibernated games as well as live ones
+    std::this_thread::sleep_for(std::chrono::milliseconds{100});
+    play(1, 5);
+
+    ServerOptions standby_options;
+    standby_options.shards = 2;
+    standby_options.unix_path = path + ".standby";
+    standby_options.wal_dir = make_directory();
+    standby_options.follow = path;
+    State standby_states[2] = {
+        {Board{}, Phase::GameOver, {}, {}},
+        {Board{}, Phase::GameOver, {}, {}},
+    };
+    std::vector<Command> taken_over;
+    {
+        Server standby{standby_options};
+        std::thread following([&standby] { standby.run(); });
+        ASSERT_TRUE(wait_for([&standby] { return standby.replication().following == 2; }));
+        EXPECT_EQ(2U, server.replication().followers);
+
+        Peer watcher{connect_unix(standby_options.unix_path), {}, {}};
+        timeval timeout{2, 0};
+        ::setsockopt(watcher.fd.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        auto send = [&watcher] (const std::vector<std::uint8_t>& frame) {
+            ASSERT_EQ(static_cast<ssize_t>(frame.size()), ::write(watcher.fd.get(), frame.data(), frame.size()));
+        };
+        Reply reply;
+        for (GameId game = 1; game <= 2; ++game) {
+            std::vector<std::uint8_t> frame;
+            encode_request(frame, {Frame::Join, game, 0, 0, {}});
+            send(frame);
+            ASSERT_TRUE(receive(watcher, reply));
+            ASSERT_EQ(Frame::Ok, reply.type);
+            expect_update(watcher, game, standby_states[game - 1]);
+            EXPECT_EQ(hash_state(states[game - 1]), hash_state(standby_states[game - 1]));
+        }
+
+        // Moves on the primary reach the standby's subscribers
+        play(1, 30);
+        play(2, 10);
+        auto caught_up = [&] {
+            return hash_state(states[0]) == hash_state(standby_states[0])
+                && hash_state(states[1]) == hash_state(standby_states[1]);
+        };
+        // The games are on different shards, so their updates interleave
+        for (int i = 0; i < 80 && !caught_up(); ++i) {
+            ASSERT_TRUE(receive(watcher, reply));
+            ASSERT_EQ(Frame::Delta, reply.type);
+            codec.patch(reply.payload, reply.size, standby_states[reply.game - 1]);
+        }
+        EXPECT_TRUE(caught_up());
+        EXPECT_TRUE(wait_for([this] { return server.replication().behind == 0; }));
+
+        // But the standby takes none of its own
+        std::vector<std::uint8_t> frame;
+        encode_command(frame, 1, next_attack(standby_states[0]));
+        send(frame);
+        ASSERT_TRUE(receive(watcher, reply));
+        EXPECT_EQ(Frame::Error, reply.type);
+        EXPECT_EQ(ErrorCode::Standby, reply.error);
+
+        // Until it is promoted
+        standby.promote();
+        ASSERT_TRUE(wait_for([&standby] { return standby.replication().following == 0; }));
+        for (int i = 0; i < 20; ++i) {
+            const auto move = next_attack(standby_states[0]);
+            frame.clear();
+            encode_command(frame, 1, move);
+            send(frame);
+            ASSERT_TRUE(receive(watcher, reply));
+            ASSERT_EQ(Frame::Ok, reply.type);
+            expect_update(watcher, 1, standby_states[0]);
+            taken_over.push_back(move);
+        }
+
+        standby.stop();
+        following.join();
+    }
+    std::unique_ptr<DIR, int (*)(DIR*)> dir{::opendir(standby_options.wal_dir.c_str()), ::closedir};
+    while (const auto* entry = dir ? ::readdir(dir.get()) : nullptr) {
+        if (entry->d_name[0] != '.') {
+            ::unlink((standby_options.wal_dir + "/" + entry->d_name).c_str());
+        }
+    }
+    ::rmdir(standby_options.wal_dir.c_str());
+    ::unlink(standby_options.unix_path.c_str());
+
+    // The same moves on the primary roll the same dice
+    for (const auto& move : taken_over) {
+        ASSERT_EQ(Frame::Ok, command(1, move).type);
+        expect_update(1, states[0]);
+    }
+    EXPECT_EQ(hash_state(standby_states[0]), hash_state(states[0]));
+}
+
+struct RouterFixture : public ReplicationFixture
+{
+    // The fixture's server is the first worker, and the client talks to
+    // the router in front of it
+    RouterFixture()
+        : second_options(worker_options(path + ".second"))
+        , second(second_options)
+        , second_thread([this] { second.run(); })
+        , router([this] {
+            RouterOptions options;
+            options.unix_path = path + ".router";
+            options.workers = {path};
+            options.concurrent_moves = 4;
+            return options;
+        }())
+        , router_thread([this] { router.run(); })
+    {
+        client = Peer{connect_unix(path + ".router"), {}, {}};
+    }
+
+    ~RouterFixture() override
+    {
+        router.stop();
+        router_thread.join();
+        stop_second();
+        std::unique_ptr<DIR, int (*)(DIR*)> dir{::opendir(second_options.wal_dir.c_str()), ::closedir};
+        while (const auto* entry = dir ? ::readdir(dir.get()) : nullptr) {
+            if (entry->d_name[0] != '.') {
+                ::unlink((second_options.wal_dir + "/" + entry->d_name).c_str());
+            }
+        }
+        ::rmdir(second_options.wal_dir.c_str());
+        ::unlink(second_options.unix_path.c_str());
+        ::unlink((path + ".router").c_str());
+    }
+
+    ServerOptions worker_options(const std::string& unix_path) const
+    {
+        auto worker = options;
+        worker.unix_path = unix_path;
+        worker.wal_dir = make_directory();
+        return worker;
+    }
+
+    void stop_second()
+    {
+        second.stop();
+        if (second_thread.joinable()) {
+            second_thread.join();
+        }
+    }
+
+    ServerOptions second_options;
+    Server second;
+    std::thread second_thread;
+    Router router;
+    std::thread router_thread;
+};
+
+TEST_F(RouterFixture, games_move_between_workers_without_losing_a_move)
+{
+    constexpr GameId games = 16;
+    // By id, with one more to replay a game on
+    std::vector<State> states(games + 2, State{Board{}, Phase::GameOver, {}, {}});
+    std::vector<std::vector<Command>> played(games + 1);
+    auto play = [&] (GameId game, int moves) {
+        for (int i = 0; i < moves; ++i) {
+            const auto move = next_attack(states[game]);
+            ASSERT_EQ(Frame::Ok, command(game, move).type);
+            expect_update(game, states[game]);
+            played[game].push_back(move);
+        }
+    };
+    auto start = [&] (GameId game, std::uint64_t seed) {
+        ASSERT_EQ(Frame::Ok, request({Frame::New, game, 3, seed, {}}).type);
+        ASSERT_EQ(Frame::Ok, request({Frame::Join, game, 0, 0, {}}).type);
+        expect_update(game, states[game]);
+        ASSERT_EQ(Frame::Ok, request({Frame::Deal, game, 0, 7, {}}).type);
+        expect_update(game, states[game]);
+    };
+    for (GameId game = 1; game <= games; ++game) {
+        start(game, game);
+        play(game, 10);
+    }
+    // Each moved game is joined again where it went, which sends its
+    // subscribers a fresh Snapshot of the state they already have
+    auto expect_snapshots = [&] (std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            Reply reply;
+            ASSERT_TRUE(receive(client, reply));
+            ASSERT_EQ(Frame::Snapshot, reply.type);
+            ASSERT_GE(reply.game, 1U);
+            ASSERT_LE(reply.game, games);
+            auto moved = states[reply.game];
+            codec.decode(reply.payload, reply.size, moved);
+            EXPECT_EQ(hash_state(states[reply.game]), hash_state(moved));
+        }
+    };
+
+    // The router numbers workers in the order it first sees them
+    HashRing ring;
+    ring.add(0, path);
+    ring.add(1, second_options.unix_path);
+    std::size_t to_second = 0;
+    for (GameId game = 1; game <= games; ++game) {
+        to_second += ring.owner(game) == 1;
+    }
+
+    // Moves are counted from when the router picks up the new workers
+    auto moved = [this] (std::size_t moved) {
+        return wait_for([this, moved] {
+            const auto migrations = router.migrations();
+            return migrations.moved == moved && migrations.moving == 0;
+        });
+    };
+    router.set_workers({path, second_options.unix_path});
+    ASSERT_TRUE(moved(to_second));
+    expect_snapshots(to_second);
+    for (GameId game = 1; game <= games; ++game) {
+        play(game, 10);
+    }
+
+    // With the first worker gone, the rest of its games move too
+    router.set_workers({second_options.unix_path});
+    ASSERT_TRUE(moved(games));
+    expect_snapshots(games - to_second);
+    for (GameId game = 1; game <= games; ++game) {
+        play(game, 10);
+    }
+
+    // The dice moved with the games
+    start(games + 1, 1);
+    for (const auto& move : played[1]) {
+        ASSERT_EQ(Frame::Ok, command(games + 1, move).type);
+        expect_update(games + 1, states[games + 1]);
+    }
+    EXPECT_EQ(hash_state(states[1]), hash_state(states[games + 1]));
+
+    // The workers come back from their logs with just the games they kept
+    auto restart = [] (const ServerOptions& options) {
+        Server restarted{options};
+        std::thread running([&restarted] { restarted.run(); });
+        restarted.stop();
+        running.join();
+        return restarted.games();
+    };
+    server.stop();
+    thread.join();
+    EXPECT_EQ(0U, restart(options));
+    stop_second();
+    EXPECT_EQ(games + 1, restart(second_options));
+}
+
+TEST_F(RouterFixture, moves_fail_safely_and_tell_those_left_behind)
+{
+    HashRing ring;
+    ring.add(0, path);
+    ring.add(1, second_options.unix_path);
+    GameId clash = 1;
+    while (ring.owner(clash) != 1) {
+        ++clash;
+    }
+    GameId moving = clash + 1;
+    while (ring.owner(moving) != 1) {
+        ++moving;
+    }
+    GameId unknown = moving + 1;
+    while (ring.owner(unknown) != 1) {
+        ++unknown;
+    }
+
+    // The second worker already has a game by one of the first one's ids
+    Peer direct{connect_unix(second_options.unix_path), {}, {}};
+    std::vector<std::uint8_t> frame;
+    encode_request(frame, {Frame::New, clash, 2, 1, {}});
+    ASSERT_EQ(static_cast<ssize_t>(frame.size()), ::write(direct.fd.get(), frame.data(), frame.size()));
+    Reply reply;
+    ASSERT_TRUE(receive(direct, reply));
+    ASSERT_EQ(Frame::Ok, reply.type);
+
+    // Moves are only taken from the router
+    for (const auto type : {Frame::Export, Frame::Release, Frame::Resume}) {
+        frame.clear();
+        encode_request(frame, {type, clash, 0, 0, {}});
+        ASSERT_EQ(static_cast<ssize_t>(frame.size()), ::write(direct.fd.get(), frame.data(), frame.size()));
+        ASSERT_TRUE(receive(direct, reply));
+        EXPECT_EQ(Frame::Error, reply.type);
+        EXPECT_EQ(ErrorCode::BadRequest, reply.error);
+    }
+    EXPECT_EQ(ErrorCode::BadRequest, request({Frame::Export, moving, 0, 0, {}}).error);
+
+    State states[2] = {{Board{}, Phase::GameOver, {}, {}}, {Board{}, Phase::GameOver, {}, {}}};
+    for (std::size_t i = 0; i < 2; ++i) {
+        const auto game = i == 0 ? clash : moving;
+        ASSERT_EQ(Frame::Ok, request({Frame::New, game, 3, 5, {}}).type);
+        ASSERT_EQ(Frame::Ok, request({Frame::Join, game, 0, 0, {}}).type);
+        expect_update(game, states[i]);
+        ASSERT_EQ(Frame::Ok, request({Frame::Deal, game, 0, 7, {}}).type);
+        expect_update(game, states[i]);
+    }
+    // Asked for, but no worker has it, so it is not moved
+    EXPECT_EQ(ErrorCode::NoSuchGame, request({Frame::Join, unknown, 0, 0, {}}).error);
+    EXPECT_EQ(ErrorCode::NoSuchGame, command(unknown, EndPhase{1}).error);
+
+    // Joined on the first worker without the router
+    Peer watcher{connect_unix(path), {}, {}};
+    frame.clear();
+    encode_request(frame, {Frame::Join, moving, 0, 0, {}});
+    ASSERT_EQ(static_cast<ssize_t>(frame.size()), ::write(watcher.fd.get(), frame.data(), frame.size()));
+    ASSERT_TRUE(receive(watcher, reply));
+    ASSERT_EQ(Frame::Ok, reply.type);
+    ASSERT_TRUE(receive(watcher, reply));
+    ASSERT_EQ(Frame::Snapshot, reply.type);
+
+    // The import of the clashing game fails, and the first worker goes on
+    // with it
+    router.set_workers({path, second_options.unix_path});
+    ASSERT_TRUE(wait_for([this] {
+        const auto migrations = router.migrations();
+        return migrations.moved == 1 && migrations.moving == 0;
+    }));
+    expect_update(moving, states[1]);
+    // The other one's subscribers there are told it moved
+    ASSERT_TRUE(receive(watcher, reply));
+    EXPECT_EQ(Frame::Error, reply.type);
+    EXPECT_EQ(ErrorCode::Moved, reply.error);
+    EXPECT_EQ(moving, reply.game);
+    for (std::size_t i = 0; i < 2; ++i) {
+        const auto game = i == 0 ? clash : moving;
+        for (int move = 0; move < 5; ++move) {
+            ASSERT_EQ(Frame::Ok, command(game, next_attack(states[i])).type);
+            expect_update(game, states[i]);
+        }
+    }
+}
+
+TEST(WriteAheadLog, replays_what_was_synced)
+{
+    char directory[] = "/tmp/risk_wal_test.XXXXXX";
+    ASSERT_NE(nullptr, ::mkdtemp(directory));
+    const auto path = std::string{directory} + "/log";
+    auto ignore = [] (const std::uint8_t*, std::size_t) {};
+    auto io = DiskIo::create();
+
+    const std::vector<std::vector<std::uint8_t>> records = {{1, 2, 3}, {}, std::vector<std::uint8_t>(1000, 7)};
+    {
+        WriteAheadLog log{*io, path, 4, ignore};
+        for (const auto& record : records) {
+            log.append(record.data(), record.size());
+        }
+        log.commit();
+        log.sync();
+        EXPECT_EQ(3U, log.durable());
+    }
+
+    // A record cut short by a crash is dropped
+    {
+        FileDescriptor file{::open(path.c_str(), O_WRONLY | O_APPEND)};
+        const std::uint8_t torn[] = {10, 0, 0, 0, 1, 2, 3, 4, 5};
+        ASSERT_EQ(static_cast<ssize_t>(sizeof(torn)), ::write(file.get(), torn, sizeof(torn)));
+    }
+
+    std::vector<std::vector<std::uint8_t>> replayed;
+    auto collect = [&replayed] (const std::uint8_t* record, std::size_t size) {
+        replayed.emplace_back(record, record + size);
+    };
+    {
+        WriteAheadLog log{*io, path, 4, collect};
+        EXPECT_EQ(records, replayed);
+
+        const std::uint8_t more[] = {9};
+        log.append(more, sizeof(more));
+    }
+
+    replayed.clear();
+    WriteAheadLog{*io, path, 4, collect};
+    ASSERT_EQ(4U, replayed.size());
+    EXPECT_EQ(std::vector<std::uint8_t>{9}, replayed.back());
+
+    EXPECT_THROW(WriteAheadLog(*io, path, 5, ignore), std::runtime_error);
+
+    ::unlink(path.c_str());
+    ::rmdir(directory);
+}
+
+TEST(DiskIo, writes_are_complete_and_in_place)
+{
+    char directory[] = "/tmp/risk_disk_io_test.XXXXXX";
+    ASSERT_NE(nullptr, ::mkdtemp(directory));
+    const auto path = std::string{directory} + "/file";
+
+    for (auto backend : {DiskIo::Backend::Uring, DiskIo::Backend::Threads}) {
+        std::unique_ptr<DiskIo> io;
+        try {
+            io = DiskIo::create(backend);
+        } catch (const std::system_error&) {
+            // Not every kernel lets us have io_uring
+            ASSERT_EQ(DiskIo::Backend::Uring, backend);
+            continue;
+        }
+        SCOPED_TRACE(io->name());
+
+        FileDescriptor file{::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)};
+        ASSERT_TRUE(file);
+
+        // More writes than the ring has room for, some large enough to be
+        // written in parts
+        std::vector<Buffer> written;
+        std::uint64_t offset = 0;
+        for (std::size_t i = 0; i < 100; ++i) {
+            written.emplace_back(i % 10 == 0 ? 3 * 1024 * 1024 : 100 + i, static_cast<std::uint8_t>(i));
+        }
+        std::size_t done = 0;
+        for (const auto& data : written) {
+            io->write_and_sync(file.get(), offset, data, [&, expected = data] (Buffer returned) {
+                EXPECT_EQ(expected, returned);
+                ++done;
+            });
+            offset += data.size();
+        }
+        while (done < written.size()) {
+            io->wait();
+        }
+
+        Buffer expected;
+        for (const auto& data : written) {
+            expected.insert(std::end(expected), std::begin(data), std::end(data));
+        }
+        Buffer contents(expected.size() + 1);
+        ASSERT_EQ(static_cast<ssize_t>(expected.size()), ::pread(file.get(), contents.data(), contents.size(), 0));
+        contents.pop_back();
+        EXPECT_TRUE(expected == contents);
+    }
+
+    ::unlink(path.c_str());
+    ::rmdir(directory);
+}
+
+TEST(SnapshotArena, survives_a_crash_part_way_through_a_snapshot)
+{
+    char directory[] = "/tmp/risk_arena_test.XXXXXX";
+    ASSERT_NE(nullptr, ::mkdtemp(directory));
+    const auto path = std::string{directory} + "/arena";
+    auto io = DiskIo::create();
+
+    const Buffer first(100, 1), second(200, 2), third(SnapshotArena::max_state_size, 3), fourth(50, 4);
+    std::vector<SnapshotArena::Game> found;
+    auto find = [&found] (const SnapshotArena::Game& game) { found.push_back(game); };
+    auto commit = [&io] (SnapshotArena& arena, std::uint64_t generation) {
+        bool done = false;
+        arena.commit(*io, generation, [&done] { done = true; });
+        while (!done) {
+            io->wait();
+        }
+    };
+
+    {
+        SnapshotArena arena{path, 2, find};
+        EXPECT_TRUE(found.empty());
+        EXPECT_EQ(0U, arena.generation());
+        arena.store({7, 11, 0, 0}, first.data(), first.size(), 1);
+        arena.store({8, 22, 1, 5}, second.data(), second.size(), 1);
+        commit(arena, 1);
+        EXPECT_EQ(1U, arena.generation());
+
+        // Stored but never committed
+        arena.store({7, 33, 0, 0}, third.data(), third.size(), 2);
+        Buffer loaded;
+        arena.load(7, loaded);
+        EXPECT_TRUE(loaded == third);
+        EXPECT_THROW(arena.store({9, 0, 0, 0}, third.data(), third.size() + 1, 2), std::length_error);
+    }
+
+    {
+        SnapshotArena arena{path, 2, find};
+        EXPECT_EQ(1U, arena.generation());
+        ASSERT_EQ(2U, found.size());
+        std::sort(std::begin(found), std::end(found), [] (const auto& a, const auto& b) { return a.id < b.id; });
+        EXPECT_EQ(11U, found[0].dice);
+        EXPECT_EQ(1U, found[1].flags);
+        EXPECT_EQ(5U, found[1].history);
+        Buffer loaded;
+        arena.load(7, loaded);
+        EXPECT_TRUE(loaded == first);
+        arena.load(8, loaded);
+        EXPECT_TRUE(loaded == second);
+
+        // The next snapshot's header is torn
+        arena.store({8, 44, 0, 6}, fourth.data(), fourth.size(), 2);
+        commit(arena, 2);
+    }
+    {
+        FileDescriptor file{::open(path.c_str(), O_WRONLY)};
+        const std::uint8_t torn[8] = {};
+        ASSERT_EQ(8, ::pwrite(file.get(), torn, sizeof(torn), 512 + 30));
+    }
+
+    found.clear();
+    {
+        SnapshotArena arena{path, 2, find};
+        EXPECT_EQ(1U, arena.generation());
+        ASSERT_EQ(2U, found.size());
+        Buffer loaded;
+        arena.load(8, loaded);
+        EXPECT_TRUE(loaded == second);
+    }
+    EXPECT_THROW(SnapshotArena(path, 3, find), std::runtime_error);
+
+    ::unlink(path.c_str());
+    ::rmdir(directory);
+}
+
+TEST(Archive, finds_and_scans_games_across_segments)
+{
+    char directory[] = "/tmp/risk_archive_test.XXXXXX";
+    ASSERT_NE(nullptr, ::mkdtemp(directory));
+    auto segment = [&directory] (int number, const char* suffix) {
+        return std::string{directory} + "/" + std::to_string(number) + suffix;
+    };
+
+    // Game i deals and then makes i moves
+    auto game = [] (std::uint64_t id) {
+        EventLog log;
+        log.deal(id);
+        for (std::uint64_t i = 0; i < id; ++i) {
+            log.command(Attack{1, 2, 3, 1});
+            log.roll(static_cast<int>(i % 6 + 1));
+            log.roll(2);
+        }
+        return FinishedGame{id, 3, 2, Archive::classic_map, log.bytes(), 0};
+    };
+    auto expect_game = [&game] (const Archive& archive, std::uint64_t id) {
+        const auto entry = archive.find(id);
+        ASSERT_TRUE(entry);
+        EXPECT_EQ(3U, entry->players);
+        EXPECT_EQ(2U, entry->winner);
+        EXPECT_EQ(id + 1, entry->moves);
+        EXPECT_EQ(game(id).events, archive.load(*entry).bytes());
+    };
+
+    // Out of order, in batches, over segments of a few games each
+    std::vector<std::uint64_t> ids;
+    for (std::uint64_t id = 10; id <= 300; id += 10) {
+        ids.push_back(id);
+    }
+    std::reverse(std::begin(ids), std::begin(ids) + 15);
+    {
+        Archive archive{directory, 256};
+        for (std::size_t first = 0; first < ids.size(); first += 7) {
+            std::vector<FinishedGame> batch;
+            for (auto i = first; i < std::min(first + 7, ids.size()); ++i) {
+                batch.push_back(game(ids[i]));
+            }
+            archive.append(batch);
+        }
+        EXPECT_EQ(30U, archive.games());
+        expect_game(archive, 150);
+
+        // Archiving a game again changes nothing
+        archive.append({game(10), game(10)});
+        EXPECT_EQ(30U, archive.games());
+    }
+    EXPECT_EQ(0, ::access(segment(1, ".index").c_str(), F_OK));
+
+    // A game cut short at the end, and a sealed segment whose index was
+    // never written
+    {
+        FileDescriptor file{::open(segment(0, ".segment").c_str(), O_RDONLY)};
+        const auto bytes = read_all(file.get());
+        std::size_t active = 0;
+        while (::access(segment(static_cast<int>(active + 1), ".segment").c_str(), F_OK) == 0) {
+            ++active;
+        }
+        FileDescriptor last{::open(segment(static_cast<int>(active), ".segment").c_str(), O_WRONLY | O_APPEND)};
+        ASSERT_EQ(40, ::write(last.get(), bytes.data() + 16, 40));
+    }
+    ASSERT_EQ(0, ::unlink(segment(0, ".index").c_str()));
+
+    {
+        Archive archive{directory, 256};
+        EXPECT_EQ(30U, archive.games());
+        for (const auto id : ids) {
+            expect_game(archive, id);
+        }
+        EXPECT_FALSE(archive.find(15));
+        EXPECT_FALSE(archive.find(310));
+
+        const auto range = archive.scan(55, 125);
+        ASSERT_EQ(7U, range.size());
+        for (std::size_t i = 0; i < range.size(); ++i) {
+            EXPECT_EQ(60 + 10 * i, range[i].game);
+        }
+        EXPECT_TRUE(archive.scan(301, 400).empty());
+
+        archive.append({game(5)});
+    }
+    EXPECT_EQ(0, ::access(segment(0, ".index").c_str(), F_OK));
+
+    Archive archive{directory, 256};
+    EXPECT_EQ(31U, archive.games());
+    expect_game(archive, 5);
+    EXPECT_EQ(5U, archive.scan(0, 20).front().game);
+
+    std::unique_ptr<DIR, int (*)(DIR*)> dir{::opendir(directory), ::closedir};
+    while (const auto* entry = ::readdir(dir.get())) {
+        if (entry->d_name[0] != '.') {
+            ::unlink((std::string{directory} + "/" + entry->d_name).c_str());
+        }
+    }
+    ::rmdir(directory);
+}
+
+TEST(Archiver, sends_long_logs_in_parts)
+{
+    char directory[] = "/tmp/risk_archiver_test.XXXXXX";
+    ASSERT_NE(nullptr, ::mkdtemp(directory));
+    const auto path = std::string{directory} + "/replays";
+
+    // Rolls that compress badly, so the log takes several frames
+    EventLog log;
+    log.deal(1);
+    std::minstd_rand rng{3};
+    for (int i = 0; i < 100000; ++i) {
+        log.command(Attack{1, static_cast<int>(rng() % 42), static_cast<int>(rng() % 42), 3});
+        log.roll(static_cast<int>(rng() % 6 + 1));
+    }
+    Archive{directory}.append({FinishedGame{9, 4, 3, Archive::classic_map, log.bytes(), 0}});
+
+    Archiver archiver{directory};
+    archiver.serve(listen_unix(path));
+    std::thread running([&archiver] { archiver.run(); });
+
+    // Asked for twice before reading anything, so most of it waits for
+    // the socket
+    const auto client = connect_unix(path);
+    std::vector<std::uint8_t> requests;
+    encode_request(requests, {Frame::Replay, 9, 0, 0, {}});
+    encode_request(requests, {Frame::Replay, 9, 0, 0, {}});
+    ASSERT_EQ(static_cast<ssize_t>(requests.size()), ::write(client.get(), requests.data(), requests.size()));
+    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+
+    auto read_frame = [&client] (std::vector<std::uint8_t>& frame) {
+        auto read_exactly = [&client] (std::uint8_t* out, std::size_t size) {
+            for (std::size_t done = 0; done < size;) {
+                const auto count = ::read(client.get(), out + done, size - done);
+                ASSERT_GT(count, 0);
+                done += static_cast<std::size_t>(count);
+            }
+        };
+        std::uint8_t length[length_size];
+        read_exactly(length, sizeof(length));
+        frame.resize(length[0] | std::size_t{length[1]} << 8);
+        read_exactly(frame.data(), frame.size());
+    };
+
+    for (int download = 0; download < 2; ++download) {
+        std::vector<std::uint8_t> frame;
+        read_frame(frame);
+        Reply reply;
+        ArchivedGame archived;
+        ASSERT_TRUE(decode_reply(frame.data(), frame.size(), reply));
+        ASSERT_TRUE(decode_archived(reply, archived));
+        EXPECT_EQ(4U, archived.players);
+        EXPECT_EQ(100001U, archived.moves);
+        ASSERT_GT(archived.size, 2 * max_payload);
+
+        std::vector<std::uint8_t> compressed;
+        while (compressed.size() < archived.size) {
+            read_frame(frame);
+            ASSERT_TRUE(decode_reply(frame.data(), frame.size(), reply));
+            ASSERT_EQ(Frame::Log, reply.type);
+            compressed.insert(std::end(compressed), reply.payload, reply.payload + reply.size);
+        }
+        ASSERT_EQ(archived.size, compressed.size());
+
+        std::vector<std::uint8_t> bytes(archived.length);
+        uLongf length = bytes.size();
+        ASSERT_EQ(Z_OK, ::uncompress(bytes.data(), &length, compressed.data(), compressed.size()));
+        EXPECT_EQ(log.bytes(), bytes);
+    }
+
+    archiver.loop().stop();
+    running.join();
+
+    std::unique_ptr<DIR, int (*)(DIR*)> dir{::opendir(directory), ::closedir};
+    while (const auto* entry = ::readdir(dir.get())) {
+        if (entry->d_name[0] != '.') {
+            ::unlink((std::string{directory} + "/" + entry->d_name).c_str());
+        }
+    }
+    ::rmdir(directory);
+}
+
+TEST(TimingWheel, expires_timers_in_order)
+{
+    TimingWheel<int> wheel{1000};
+    const std::vector<TimingWheel<int>::Tick> at = {1001, 1064, 1063, 5000, 1000 + 70000, 1000 + (1 << 24) + 5, 1000};
+    for (std::size_t i = 0; i < at.size(); ++i) {
+        wheel.arm(at[i], static_cast<int>(i));
+    }
+    ASSERT_EQ(at.size(), wheel.size());
+    EXPECT_EQ(1001U, wheel.next());
+
+    // The timer armed in the past goes off on the next tick
+    std::vector<int> expired;
+    wheel.advance(1001, [&expired] (int value) { expired.push_back(value); });
+    std::sort(std::begin(expired), std::end(expired));
+    EXPECT_EQ((std::vector<int>{0, 6}), expired);
+
+    expired.clear();
+    wheel.advance(1000 + (1 << 25), [&] (int value) {
+        expired.push_back(value);
+        EXPECT_EQ(at[value], wheel.now());
+    });
+    EXPECT_EQ((std::vector<int>{2, 1, 3, 4, 5}), expired);
+    EXPECT_EQ(0U, wheel.size());
+    EXPECT_FALSE(wheel.next());
+}
+
+TEST(TimingWheel, cancelled_timers_do_not_expire)
+{
+    TimingWheel<int> wheel;
+    const auto kept = wheel.arm(100, 1);
+    const auto cancelled = wheel.arm(100, 2);
+    wheel.arm(200, 3);
+
+    EXPECT_TRUE(wheel.cancel(cancelled));
+    EXPECT_FALSE(wheel.cancel(cancelled));
+    EXPECT_FALSE(wheel.cancel(0));
+
+    std::vector<int> expired;
+    wheel.advance(150, [&expired] (int value) { expired.push_back(value); });
+    EXPECT_EQ(std::vector<int>{1}, expired);
+    EXPECT_FALSE(wheel.cancel(kept));
+
+    // A handle stays stale once its slot is reused
+    const auto reused = wheel.arm(300, 4);
+    EXPECT_FALSE(wheel.cancel(kept));
+    EXPECT_TRUE(wheel.cancel(reused));
+    EXPECT_EQ(1U, wheel.size());
+}
+
+TEST(TimingWheel, handles_many_timers)
+{
+    TimingWheel<std::uint32_t> wheel;
+    std::vector<TimingWheel<std::uint32_t>::Handle> handles;
+    const std::uint32_t count = 100000;
+    for (std::uint32_t i = 0; i < count; ++i) {
+        handles.push_back(wheel.arm((i * 7919) % 300000 + 1, i));
+    }
+    for (std::uint32_t i = 0; i < count; i += 2) {
+        EXPECT_TRUE(wheel.cancel(handles[i]));
+    }
+
+    std::uint32_t expired = 0;
+    TimingWheel<std::uint32_t>::Tick last = 0;
+    bool ordered = true;
+    wheel.advance(300000, [&] (std::uint32_t value) {
+        ordered = ordered && value % 2 == 1 && wheel.now() >= last && wheel.now() == (value * 7919) % 300000 + 1;
+        last = wheel.now();
+        ++expired;
+    });
+    EXPECT_TRUE(ordered);
+    EXPECT_EQ(count / 2, expired);
+}
+
+TEST(HashRing, adding_a_node_only_moves_its_share_of_keys)
+{
+    constexpr std::uint64_t keys = 10000;
+    HashRing ring;
+    for (HashRing::Node node = 0; node < 4; ++node) {
+        ring.add(node, "worker" + std::to_string(node));
+    }
+    std::vector<HashRing::Node> owners;
+    std::vector<std::size_t> counts(5, 0);
+    for (std::uint64_t key = 1; key <= keys; ++key) {
+        owners.push_back(ring.owner(key));
+        ++counts[owners.back()];
+    }
+    // Sequential keys are spread about evenly
+    for (HashRing::Node node = 0; node < 4; ++node) {
+        EXPECT_GT(counts[node], keys / 4 * 7 / 10);
+        EXPECT_LT(counts[node], keys / 4 * 13 / 10);
+    }
+
+    // The same names make the same ring, whatever the order
+    HashRing reversed;
+    for (HashRing::Node node = 4; node-- > 0;) {
+        reversed.add(node, "worker" + std::to_string(node));
+    }
+    for (std::uint64_t key = 1; key <= keys; ++key) {
+        ASSERT_EQ(owners[key - 1], reversed.owner(key));
+    }
+
+    ring.add(4, "worker4");
+    std::size_t moved = 0;
+    for (std::uint64_t key = 1; key <= keys; ++key) {
+        const auto owner = ring.owner(key);
+        if (owner != owners[key - 1]) {
+            ASSERT_EQ(4U, owner);
+            ++moved;
+        }
+    }
+    EXPECT_GT(moved, keys / 5 * 7 / 10);
+    EXPECT_LT(moved, keys / 5 * 13 / 10);
+
+    // And removing it hands back just those
+    ring.remove(4);
+    EXPECT_FALSE(ring.contains(4));
+    for (std::uint64_t key = 1; key <= keys; ++key) {
+        ASSERT_EQ(owners[key - 1], ring.owner(key));
+    }
+    ring.remove(0);
+    for (std::uint64_t key = 1; key <= keys; ++key) {
+        if (owners[key - 1] != 0) {
+            ASSERT_EQ(owners[key - 1], ring.owner(key));
+        }
+    }
+}
+
+TEST(Protocol, requests_survive_encoding)
+{
+    const std::vector<Command> commands{
+        PlaceUnit{1, 42},
+        TradeCards{-2, {0, 3, 4}},
+        Attack{3, 7, 8, 2},
+        Occupy{1, 5},
+        Fortify{2, 9, 10, 11},
+        EndPhase{4},
+    };
+
+    std::vector<std::uint8_t> out;
+    for (const auto& command : commands) {
+        encode_command(out, 1ULL << 40, command);
+    }
+
+    std::size_t offset = 0;
+    for (const auto& expected : commands) {
+        const std::size_t length = out[offset] | std::size_t{out[offset + 1]} << 8;
+        Request request;
+        ASSERT_TRUE(decode_request(out.data() + offset + length_size, length, request));
+        EXPECT_EQ(1ULL << 40, request.game);
+        ASSERT_EQ(expected.index(), request.command.index());
+
+        std::vector<std::uint8_t> a, b;
+        encode(a, expected);
+        encode(b, request.command);
+        EXPECT_EQ(a, b);
+        offset += length_size + length;
+    }
+    EXPECT_EQ(out.size(), offset);
+}
+
+TEST(Protocol, malformed_requests_are_rejected)
+{
+    std::vector<std::uint8_t> out;
+    encode_request(out, {Frame::New, 1, 2, 3, {}});
+
+    Request request;
+    EXPECT_TRUE(decode_request(out.data() + length_size, out.size() - length_size, request));
+    EXPECT_EQ(2U, request.players);
+    EXPECT_EQ(3U, request.seed);
+
+    EXPECT_FALSE(decode_request(out.data() + length_size, out.size() - length_size - 1, request));
+    out[length_size] = static_cast<std::uint8_t>(Frame::Delta);
+    EXPECT_FALSE(decode_request(out.data() + length_size, out.size() - length_size, request));
+    EXPECT_FALSE(decode_request(out.data(), 0, request));
+}
+
+TEST(SpscQueue, delivers_in_order_across_threads)
+{
+    SpscQueue<int> queue{64};
+    const int count = 100000;
+
+    std::thread producer([&queue] {
+        for (int i = 0; i < count; ++i) {
+            int value = i;
+            while (!queue.try_push(std::move(value))) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    int expected = 0;
+    bool ordered = true;
+    while (expected < count) {
+        const auto drained = queue.drain([&] (int value) {
+            ordered = ordered && value == expected;
+            ++expected;
+        });
+        if (drained == 0) {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+
+    EXPECT_TRUE(ordered);
+    EXPECT_TRUE(queue.empty());
+}
+
+TEST(SpscQueue, rejects_pushes_when_full)
+{
+    SpscQueue<int> queue{3};
+    ASSERT_EQ(4U, queue.capacity());
+
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_TRUE(queue.try_push(int{i}));
+    }
+    EXPECT_FALSE(queue.try_push(4));
+    EXPECT_EQ(4U, queue.drain([] (int) {}));
+    EXPECT_TRUE(queue.try_push(4));
+}
+
+TEST(MpscQueue, keeps_each_producers_order_under_contention)
+{
+    MpscQueue<std::uint64_t> queue{256};
+    const std::uint64_t producers = 16;
+    const std::uint64_t count = 20000;
+
+    std::vector<std::thread> threads;
+    for (std::uint64_t producer = 0; producer < producers; ++producer) {
+        threads.emplace_back([&queue, producer] {
+            for (std::uint64_t i = 0; i < count; ++i) {
+                auto value = producer << 32 | i;
+                while (!queue.try_push(std::move(value))) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::vector<std::uint64_t> next(producers, 0);
+    std::uint64_t received = 0;
+    bool ordered = true;
+    while (received < producers * count) {
+        const auto drained = queue.drain([&] (std::uint64_t value) {
+            auto& expected = next[value >> 32];
+            ordered = ordered && (value & 0xffffffff) == expected;
+            ++expected;
+        });
+        received += drained;
+        if (drained == 0) {
+            std::this_thread::yield();
+        }
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_TRUE(ordered);
+    EXPECT_TRUE(queue.empty());
+}
+
+TEST(MpscQueue, rejects_pushes_when_full)
+{
+    MpscQueue<int> queue{3};
+    ASSERT_EQ(4U, queue.capacity());
+
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_TRUE(queue.try_push(int{i}));
+    }
+    EXPECT_FALSE(queue.try_push(4));
+    EXPECT_EQ(4U, queue.drain([] (int) {}));
+    EXPECT_TRUE(queue.empty());
+    EXPECT_TRUE(queue.try_push(4));
+    EXPECT_FALSE(queue.empty());
+}
@@ -1,267 +1,15 @@
 #include <gtest/gtest.h>
 
+#include "risk/rules/codec.h"
+#include "risk/rules/event_log.h"
+#include "risk/rules/game.h"
+#include "risk/rules/replay.h"
+#include "risk/rules/state.h"
+
+#include <algorithm>
+#include <array>
+#include <random>
 #include <vector>
-#include <memory>
-#include <optional>
-#include <functional>
-
-namespace risk {
-
-namespace rules {
-
-class PlayerNotInTurn : public std::exception
-{
-public:
-};
-
-class IllegalMove : public std::exception
-{
-public:
-};
-
-class Card {};
-
-class Player {
-public:
-    using Id = int;
-    Player(Id id)
-        : id_(id)
-    {}
-    auto id() const { return id_; }
-    void give_units_to_place(std::size_t units) { units_left_to_place_ = units; }
-    void placed_unit();
-    std::size_t units() const { return units_left_to_place_; }
-private:
-    int id_;
-    std::size_t units_left_to_place_;
-};
-
-void Player::placed_unit()
-{
-    assert(units_left_to_place_);
-    --units_left_to_place_;
-}
-
-class Territory {
-public:
-    using Id = int;
-
-    Territory(Id id)
-        : id_(id)
-    {}
-
-    auto id() const { return id_; }
-
-    std::optional<Player::Id> owner() const { return owner_; }
-    void owner(Player::Id id) { owner_ = id; }
-
-private:
-    Id id_;
-    std::string_view name_;
-    std::optional<Player::Id> owner_;
-};
-
-class Board {
-public:
-    Board() = default; // TODO: Remove
-    Board(std::vector<Territory> territories)
-        : territories_(territories)
-    {}
-
-    auto territories() const { return territories_; }
-
-private:
-    std::vector<Territory> territories_;
-};
-
-enum class Phase {
-    Placing,
-    Playing,
-};
-
-class State {
-public:
-    State(Board board, Phase phase, std::vector<Player> players, std::vector<Card> cards)
-        : board_(board)
-        , phase_(phase)
-        , players_(players)
-        , cards_(cards)
-    {}
-
-    auto board() const { return board_; }
-    auto phase() const { return phase_; }
-    auto players() const { return players_; }
-    auto current_player() const { return players_.at(0); }
-    auto cards() const { return cards_; }
-
-private:
-    Board board_;
-    Phase phase_;
-    std::vector<Player> players_;
-    std::vector<Card> cards_;
-};
-
-using Dice = std::function<int ()>;
-
-class Game {
-public:
-    Game(Board board, std::vector<Player> players, Dice dice)
-        : state_(board, Phase::Placing, players, {})
-        , dice_(std::move(dice))
-    {
-        give_units_to_each_player();
-        decide_starting_player();
-    }
-
-    void give_units_to_each_player();
-    void decide_starting_player();
-
-    const auto& state() const { return state_; }
-    void update(State new_state) { state_ = new_state; }
-
-    int roll_dice() const { return dice_(); }
-
-    void place_unit(Player::Id id, Territory::Id territory);
-
-    template <typename Error>
-    void ensure(bool condition, Error err)
-    {
-        if (!condition) {
-            throw err;
-        }
-    }
-
-    bool is_player_turn(Player::Id id) const
-    {
-        return state().current_player().id() == id;
-    }
-
-    bool player_exists(Player::Id id) const
-    {
-        auto players = state().players();
-        return std::any_of(
-            std::begin(players), std::end(players),
-            [id] (const Player& player) {
-                return player.id() == id;
-            }
-        );
-    }
-
-    bool territory_exists(Territory::Id id) const
-    {
-        auto territories = state().board().territories();
-        return std::any_of(
-            std::begin(territories), std::end(territories),
-            [id] (const Territory& territory) {
-                return territory.id() == id;
-            }
-        );
-    }
-
-
-private:
-    State state_;
-    Dice dice_;
-};
-
-void Game::give_units_to_each_player()
-{
-    auto players = state().players();
-
-    std::for_each(
-        std::begin(players), std::end(players),
-        [] (Player& player) {
-            player.give_units_to_place(35);
-        }
-    );
-
-    auto new_state = State{
-        state().board(),
-        Phase::Placing,
-        players,
-        state().cards(),
-    };
-
-    update(new_state);
-}
-
-void Game::decide_starting_player()
-{
-    const int dice = roll_dice();
-
-    auto players = state().players();
-    std::rotate(std::begin(players), std::begin(players) + dice - 1, std::end(players));
-
-    auto new_state = State{
-        state().board(),
-        Phase::Placing,
-        players,
-        state().cards(),
-    };
-
-    update(new_state);
-}
-
-void Game::place_unit(Player::Id player_id, Territory::Id territory_id)
-{
-    // TODO: Correct phase
-    // TODO: Player exists
-
-    ensure(player_exists(player_id), std::out_of_range("Player ID not in range"));
-    ensure(territory_exists(territory_id), std::out_of_range("Territory ID not in range"));
-
-    ensure(is_player_turn(player_id), PlayerNotInTurn{});
-
-    // TODO: Any unclaimed territories?
-    // TODO:  - Selected territory must be unclaimed
-    auto territories = state().board().territories();
-    auto territory_iter = std::find_if(
-            std::begin(territories), std::end(territories),
-            [territory_id] (const Territory& territory) {
-                return territory.id() == territory_id;
-            }
-        );
-    auto& territory = *territory_iter;
-    if (!territory.owner()) {
-        territory.owner(player_id);
-    } else if (territory.owner() != player_id) {
-        throw IllegalMove{}; // "Player not allowed to place unit in a territory owned by another player"
-    }
-
-    auto players = state().players();
-
-    auto decrease_number_of_units_to_place = [] (Player& player) {
-        player.placed_unit();
-    };
-
-    decrease_number_of_units_to_place(players[0]);
-
-    auto next_players_turn = [] (std::vector<Player> players) {
-        std::rotate(std::begin(players), std::begin(players) + 1, std::end(players));
-        return players;
-    };
-
-    bool units_left_to_place =
-        std::any_of(
-            std::begin(players), std::end(players),
-            [] (const Player& player) {
-                return player.units() > 0U;
-            }
-        );
-
-    auto new_state = State{
-        Board{territories},
-        units_left_to_place ? Phase::Placing : Phase::Playing,
-        next_players_turn(players),
-        state().cards(),
-    };
-
-    update(new_state);
-}
-
-}
-
-}
 
 using namespace risk::rules;
 
@@ -399,7 +147,705 @@ TEST_F(PlacementPhaseFixture, placement_phase_ends_when_no_player_has_units_left
         ASSERT_NO_THROW(game.place_unit(Player::Id{3}, Territory::Id{3}));
     }
 
-    ASSERT_EQ(risk::rules::Phase::Playing, game.state().phase());
+    ASSERT_EQ(risk::rules::Phase::Reinforce, game.state().phase());
 }
 
 
+TEST_F(PlacementPhaseFixture, placement_phase_applied_as_a_single_batch)
+{
+    std::vector<Command> commands;
+    for (std::size_t i = 0; i < 35; ++i) {
+        commands.push_back(PlaceUnit{Player::Id{1}, Territory::Id{1}});
+        commands.push_back(PlaceUnit{Player::Id{2}, Territory::Id{2}});
+        commands.push_back(PlaceUnit{Player::Id{3}, Territory::Id{3}});
+    }
+
+    ASSERT_NO_THROW(game.apply_batch(commands));
+
+    ASSERT_EQ(risk::rules::Phase::Reinforce, game.state().phase());
+    EXPECT_EQ(Player::Id{1}, game.state().current_player().id());
+    EXPECT_EQ(Player::Id{2}, game.state().board().territories()[1].owner());
+}
+
+TEST_F(PlacementPhaseFixture, failing_batch_reports_index_and_leaves_state_unchanged)
+{
+    std::vector<Command> commands{
+        PlaceUnit{Player::Id{1}, Territory::Id{1}},
+        PlaceUnit{Player::Id{2}, Territory::Id{2}},
+        PlaceUnit{Player::Id{3}, Territory::Id{1}},
+    };
+
+    try {
+        game.apply_batch(commands);
+        FAIL() << "Expected BatchFailed";
+    } catch (const BatchFailed& e) {
+        EXPECT_EQ(2U, e.index());
+        EXPECT_THROW(std::rethrow_exception(e.reason()), IllegalMove);
+    }
+
+    EXPECT_EQ(Player::Id{1}, game.state().current_player().id());
+    EXPECT_FALSE(game.state().board().territories()[0].owner());
+}
+
+TEST_F(PlacementPhaseFixture, random_placement_deals_out_all_units)
+{
+    ASSERT_NO_THROW(game.deal_random_placement(42));
+
+    ASSERT_EQ(risk::rules::Phase::Reinforce, game.state().phase());
+    EXPECT_EQ(Player::Id{1}, game.state().current_player().id());
+
+    // The starting player has been given their first reinforcements
+    auto players = game.state().players();
+    EXPECT_EQ(3U, players[0].units());
+    EXPECT_EQ(0U, players[1].units());
+    EXPECT_EQ(0U, players[2].units());
+
+    std::size_t units = 0;
+    std::vector<Player::Id> owners;
+    for (const auto& territory : game.state().board().territories()) {
+        ASSERT_TRUE(territory.owner());
+        owners.push_back(*territory.owner());
+        units += territory.units();
+    }
+    EXPECT_EQ(105U, units);
+    std::sort(std::begin(owners), std::end(owners));
+    EXPECT_EQ((std::vector<Player::Id>{1, 2, 3}), owners);
+}
+
+TEST_F(PlacementPhaseFixture, random_placement_keeps_territories_already_claimed)
+{
+    ASSERT_NO_THROW(game.place_unit(Player::Id{1}, Territory::Id{3}));
+    ASSERT_NO_THROW(game.deal_random_placement(7));
+
+    EXPECT_EQ(Player::Id{1}, game.state().board().territories()[2].owner());
+    EXPECT_EQ(Player::Id{1}, game.state().current_player().id());
+}
+
+TEST_F(PlacementPhaseFixture, random_placement_is_only_allowed_while_placing)
+{
+    ASSERT_NO_THROW(game.deal_random_placement(1));
+    ASSERT_THROW(game.deal_random_placement(1), IllegalMove);
+}
+
+struct TurnFixture : public ::testing::Test
+{
+    TurnFixture()
+        : next_dice_throws{1}
+        , game(
+            Board{
+                {Territory{1}, Territory{2}, Territory{3}},
+                {{1, 2}, {2, 3}, {1, 3}},
+            },
+            {Player{1}, Player{2}},
+            [this] { return throw_dice(); }
+          )
+    {
+        // Player 1 holds territories 1 and 3, player 2 holds territory 2
+        std::vector<Command> placement{
+            PlaceUnit{Player::Id{1}, Territory::Id{1}},
+            PlaceUnit{Player::Id{2}, Territory::Id{2}},
+        };
+        for (std::size_t i = 1; i < 35; ++i) {
+            placement.push_back(PlaceUnit{Player::Id{1}, Territory::Id{3}});
+            placement.push_back(PlaceUnit{Player::Id{2}, Territory::Id{2}});
+        }
+        game.apply_batch(placement);
+    }
+
+protected:
+    int throw_dice()
+    {
+        if (next_dice_throws.empty()) {
+            throw std::runtime_error("next_dice_throws is empty");
+        }
+        auto eyes = next_dice_throws.front();
+        next_dice_throws.erase(next_dice_throws.begin());
+        return eyes;
+    }
+
+    void reinforce(Player::Id player, Territory::Id territory)
+    {
+        while (game.state().phase() == Phase::Reinforce) {
+            game.apply(PlaceUnit{player, territory});
+        }
+    }
+
+    Territory territory(Territory::Id id) const
+    {
+        return game.state().board().territories().at(id - 1);
+    }
+
+protected:
+    std::vector<int> next_dice_throws;
+    risk::rules::Game game;
+};
+
+TEST_F(TurnFixture, first_turn_starts_with_reinforcements)
+{
+    ASSERT_EQ(Phase::Reinforce, game.state().phase());
+    EXPECT_EQ(Player::Id{1}, game.state().current_player().id());
+    EXPECT_EQ(3U, game.state().current_player().units());
+}
+
+TEST_F(TurnFixture, commands_not_allowed_in_phase_are_rejected)
+{
+    ASSERT_THROW(game.apply(Attack{Player::Id{1}, Territory::Id{3}, Territory::Id{2}, 3}), IllegalMove);
+    ASSERT_THROW(game.apply(EndPhase{Player::Id{1}}), IllegalMove);
+    ASSERT_THROW(game.apply(Occupy{Player::Id{1}, 1}), IllegalMove);
+}
+
+TEST_F(TurnFixture, reinforcements_must_go_to_own_territory)
+{
+    ASSERT_THROW(game.apply(PlaceUnit{Player::Id{1}, Territory::Id{2}}), IllegalMove);
+    ASSERT_NO_THROW(reinforce(Player::Id{1}, Territory::Id{1}));
+
+    EXPECT_EQ(Phase::Attack, game.state().phase());
+    EXPECT_EQ(4U, territory(1).units());
+}
+
+TEST_F(TurnFixture, attack_removes_units_according_to_dice)
+{
+    reinforce(Player::Id{1}, Territory::Id{3});
+
+    next_dice_throws = {6, 2, 1, 5, 3};
+    ASSERT_NO_THROW(game.apply(Attack{Player::Id{1}, Territory::Id{3}, Territory::Id{2}, 3}));
+
+    // 6 beats 5, 2 loses to 3
+    EXPECT_EQ(Phase::Attack, game.state().phase());
+    EXPECT_EQ(36U, territory(3).units());
+    EXPECT_EQ(34U, territory(2).units());
+}
+
+TEST_F(TurnFixture, conquering_every_territory_ends_the_game)
+{
+    reinforce(Player::Id{1}, Territory::Id{3});
+
+    while (territory(2).units() > 1) {
+        next_dice_throws = {6, 6, 6, 1, 1};
+        ASSERT_NO_THROW(game.apply(Attack{Player::Id{1}, Territory::Id{3}, Territory::Id{2}, 3}));
+    }
+    next_dice_throws = {6, 6, 6, 1};
+    ASSERT_NO_THROW(game.apply(Attack{Player::Id{1}, Territory::Id{3}, Territory::Id{2}, 3}));
+
+    ASSERT_EQ(Phase::Occupy, game.state().phase());
+    EXPECT_EQ(Player::Id{1}, territory(2).owner());
+    ASSERT_THROW(game.apply(Occupy{Player::Id{1}, 2}), IllegalMove);
+    ASSERT_NO_THROW(game.apply(Occupy{Player::Id{1}, 3}));
+
+    EXPECT_EQ(Phase::GameOver, game.state().phase());
+    EXPECT_EQ(3U, territory(2).units());
+}
+
+TEST_F(TurnFixture, fortifying_ends_the_turn)
+{
+    reinforce(Player::Id{1}, Territory::Id{1});
+    ASSERT_NO_THROW(game.apply(EndPhase{Player::Id{1}}));
+    ASSERT_EQ(Phase::Fortify, game.state().phase());
+
+    ASSERT_THROW(game.apply(Fortify{Player::Id{1}, Territory::Id{3}, Territory::Id{2}, 1}), IllegalMove);
+    ASSERT_NO_THROW(game.apply(Fortify{Player::Id{1}, Territory::Id{3}, Territory::Id{1}, 10}));
+
+    EXPECT_EQ(14U, territory(1).units());
+    EXPECT_EQ(24U, territory(3).units());
+    EXPECT_EQ(Phase::Reinforce, game.state().phase());
+    EXPECT_EQ(Player::Id{2}, game.state().current_player().id());
+}
+
+TEST(RulesVariants, starting_units_come_from_the_rules)
+{
+    BasicGame<StartingUnits<20>> game(
+        Board{{Territory{1}}},
+        {Player{1}, Player{2}, Player{3}, Player{4}},
+        [] { return 1; }
+    );
+
+    for (const auto& player : game.state().players()) {
+        EXPECT_EQ(20U, player.units());
+    }
+    EXPECT_EQ(30U, ClassicRules{}.starting_units(4));
+}
+
+TEST(RulesVariants, classic_card_values_escalate)
+{
+    const ClassicRules rules;
+    const std::vector<Card> set{Card::Kind::Infantry, Card::Kind::Infantry, Card::Kind::Infantry};
+
+    EXPECT_EQ(4U, rules.trade_value(0, set));
+    EXPECT_EQ(15U, rules.trade_value(5, set));
+    EXPECT_EQ(20U, rules.trade_value(6, set));
+}
+
+TEST(RulesVariants, fixed_card_values_depend_on_the_set)
+{
+    const FixedCardValues<> rules;
+    using Kind = Card::Kind;
+
+    EXPECT_EQ(4U, rules.trade_value(9, {Kind::Infantry, Kind::Infantry, Kind::Wildcard}));
+    EXPECT_EQ(6U, rules.trade_value(9, {Kind::Cavalry, Kind::Cavalry, Kind::Cavalry}));
+    EXPECT_EQ(8U, rules.trade_value(9, {Kind::Artillery, Kind::Wildcard, Kind::Artillery}));
+    EXPECT_EQ(10U, rules.trade_value(9, {Kind::Infantry, Kind::Cavalry, Kind::Artillery}));
+    EXPECT_EQ(10U, rules.trade_value(9, {Kind::Infantry, Kind::Wildcard, Kind::Wildcard}));
+}
+
+TEST(RulesVariants, capitals_and_missions_decide_the_winner)
+{
+    std::vector<Territory> territories{Territory{1}, Territory{2}, Territory{3}};
+    territories[0].owner(1);
+    territories[1].owner(1);
+    territories[2].owner(2);
+
+    EXPECT_FALSE(ClassicRules{}.has_won(1, territories));
+    EXPECT_TRUE(CapitalRules<>({1, 2}).has_won(1, territories));
+    EXPECT_FALSE(CapitalRules<>({1, 3}).has_won(1, territories));
+    // No capitals is no shortcut
+    EXPECT_FALSE(CapitalRules<>{}.has_won(1, territories));
+    territories[2].owner(1);
+    EXPECT_TRUE(CapitalRules<>{}.has_won(1, territories));
+    // Nor is an empty mission
+    const MissionRules<> empty_mission({{1, std::vector<Territory::Id>{}}});
+    EXPECT_TRUE(empty_mission.has_won(1, territories));
+    territories[2].owner(2);
+    EXPECT_FALSE(empty_mission.has_won(1, territories));
+
+    // Variants compose
+    const std::unordered_map<Player::Id, std::vector<Territory::Id>> missions{{2, {3}}};
+    const FixedCardValues<MissionRules<>> rules(missions);
+    EXPECT_TRUE(rules.has_won(2, territories));
+    EXPECT_FALSE(rules.has_won(1, territories));
+}
+
+struct EventLogFixture : public ::testing::Test
+{
+    EventLogFixture()
+        : board{
+            {Territory{1}, Territory{2}, Territory{3}},
+            {{1, 2}, {2, 3}, {1, 3}},
+          }
+        , players{Player{1}, Player{2}}
+        , log(true)
+    {
+    }
+
+protected:
+    Game play()
+    {
+        std::mt19937 rng{1234};
+        Game game(board, players, [rng] () mutable { return static_cast<int>(rng() % 6) + 1; }, log);
+
+        game.deal_random_placement(99);
+        while (game.state().phase() != Phase::GameOver && log.bytes().size() < 4000) {
+            const auto state = game.state();
+            const auto player = state.current_player().id();
+            const auto territories = state.board().territories();
+
+            switch (state.phase()) {
+            case Phase::Reinforce:
+                for (const auto& territory : territories) {
+                    if (territory.owner() == player) {
+                        game.apply(PlaceUnit{player, territory.id()});
+                        break;
+                    }
+                }
+                break;
+            case Phase::Attack: {
+                bool attacked = false;
+                for (const auto& from : territories) {
+                    for (const auto& to : territories) {
+                        if (!attacked && from.owner() == player && to.owner() != player && from.units() > 3) {
+                            game.apply(Attack{player, from.id(), to.id(), 3});
+                            attacked = true;
+                        }
+                    }
+                }
+                if (!attacked) {
+                    game.apply(EndPhase{player});
+                }
+                break;
+            }
+            case Phase::Occupy:
+                game.apply(Occupy{player, state.turn().occupation->min_units});
+                break;
+            default:
+                game.apply(EndPhase{player});
+                break;
+            }
+        }
+        return game;
+    }
+
+    Board board;
+    std::vector<Player> players;
+    EventLog log;
+};
+
+TEST_F(EventLogFixture, replay_rebuilds_the_recorded_game)
+{
+    const auto game = play();
+
+    Replay<> replay(board, players, log, Verify::Hashes);
+    ASSERT_NO_THROW(replay.run());
+
+    EXPECT_GT(replay.moves(), 10U);
+    EXPECT_EQ(hash_state(game.state()), hash_state(replay.state()));
+    EXPECT_EQ(game.state().phase(), replay.state().phase());
+}
+
+TEST_F(EventLogFixture, replay_detects_a_tampered_roll)
+{
+    play();
+
+    auto bytes = log.bytes();
+    // Skip to the first roll made by a move
+    auto reader = log.reader();
+    reader.roll();
+    while (reader.peek() != EventLog::Event::Roll) {
+        switch (reader.peek()) {
+        case EventLog::Event::Command: reader.command(); break;
+        case EventLog::Event::Deal: reader.deal(); break;
+        default: reader.hash(); break;
+        }
+    }
+    const auto roll = reader.offset();
+    bytes[roll] = bytes[roll] == 0xc1 ? 0xc6 : 0xc1;
+
+    const EventLog tampered{bytes};
+    Replay<> replay(board, players, tampered, Verify::Hashes);
+    ASSERT_THROW(replay.run(), ReplayDiverged);
+}
+
+TEST(EventLog, commands_survive_encoding)
+{
+    EventLog log;
+    log.command(PlaceUnit{-1, 300});
+    log.command(TradeCards{2, {0, 1, 4}});
+    log.command(Fortify{3, 4, 5, 1000});
+
+    auto reader = log.reader();
+    auto place = std::get<PlaceUnit>(reader.command());
+    EXPECT_EQ(-1, place.player);
+    EXPECT_EQ(300, place.territory);
+    EXPECT_EQ((std::array<std::size_t, 3>{0, 1, 4}), std::get<TradeCards>(reader.command()).cards);
+    EXPECT_EQ(1000U, std::get<Fortify>(reader.command()).units);
+    EXPECT_TRUE(reader.done());
+}
+
+TEST_F(EventLogFixture, replay_index_seeks_to_any_move)
+{
+    play();
+
+    Replay<> replay(board, players, log);
+    std::vector<std::uint64_t> hashes{hash_state(replay.state())};
+    while (replay.step()) {
+        hashes.push_back(hash_state(replay.state()));
+    }
+
+    const ReplayIndex<> index(board, players, log, 7);
+    ASSERT_EQ(hashes.size() - 1, index.moves());
+
+    for (std::size_t move : {std::size_t{0}, std::size_t{6}, std::size_t{7}, std::size_t{15}, index.moves()}) {
+        EXPECT_EQ(hashes[move], hash_state(index.seek(move))) << "move " << move;
+    }
+    EXPECT_THROW(index.seek(index.moves() + 1), std::out_of_range);
+}
+
+TEST_F(EventLogFixture, replay_index_loads_saved_checkpoints)
+{
+    play();
+
+    const ReplayIndex<> index(board, players, log, 7);
+    std::vector<std::uint8_t> saved;
+    index.save(saved);
+
+    const ReplayIndex<> loaded(board, log, saved.data(), saved.size());
+    ASSERT_EQ(index.moves(), loaded.moves());
+    for (std::size_t move = 0; move <= index.moves(); ++move) {
+        EXPECT_EQ(hash_state(index.seek(move)), hash_state(loaded.seek(move))) << "move " << move;
+    }
+
+    EXPECT_THROW(ReplayIndex<>(board, log, saved.data(), saved.size() - 1), DecodeError);
+
+    // A move count the log does not hold
+    for (const std::size_t moves : {index.moves() - 1, index.moves() + 5}) {
+        const auto* in = saved.data();
+        const auto* end = saved.data() + saved.size();
+        std::vector<std::uint8_t> tampered;
+        put_varint(tampered, get_varint(in, end));
+        get_varint(in, end);
+        put_varint(tampered, moves);
+        tampered.insert(std::end(tampered), in, end);
+        EXPECT_THROW(ReplayIndex<>(board, log, tampered.data(), tampered.size()), DecodeError) << "moves " << moves;
+    }
+
+    // Made for a log that has since grown
+    EventLog longer = log;
+    longer.hash(0);
+    EXPECT_THROW(ReplayIndex<>(board, longer, saved.data(), saved.size()), DecodeError);
+}
+
+TEST_F(EventLogFixture, ownership_history_answers_who_owned_a_territory)
+{
+    play();
+
+    const ReplayIndex<> index(board, players, log, 5);
+    const OwnershipHistory history(board, players, log);
+
+    std::size_t total_conquests = 0;
+    for (std::size_t t = 0; t < 3; ++t) {
+        const Territory::Id id = t + 1;
+
+        std::size_t conquests = 0;
+        std::optional<Player::Id> previous;
+        for (std::size_t move = 0; move <= index.moves(); ++move) {
+            const auto owner = index.seek(move).board().territories()[t].owner();
+            EXPECT_EQ(owner, history.owner_at(id, move)) << "move " << move;
+            if (previous && owner != previous) {
+                ++conquests;
+            }
+            previous = owner;
+        }
+
+        EXPECT_EQ(conquests, history.times_conquered(id));
+        total_conquests += conquests;
+    }
+
+    EXPECT_GT(total_conquests, 0U);
+    EXPECT_THROW(history.owner_at(4, 0), std::out_of_range);
+}
+
+TEST_F(EventLogFixture, state_codec_round_trips_every_move)
+{
+    play();
+
+    const StateCodec codec{board};
+    std::vector<std::uint8_t> bytes;
+    Replay<> replay(board, players, log);
+    State decoded = replay.state();
+
+    do {
+        const auto state = replay.state();
+        bytes.clear();
+        codec.encode(state, bytes);
+        codec.decode(bytes.data(), bytes.size(), decoded);
+        ASSERT_EQ(hash_state(state), hash_state(decoded)) << "move " << replay.moves();
+    } while (replay.step());
+}
+
+TEST(StateCodec, classic_state_after_placement_is_small)
+{
+    std::mt19937 rng{5};
+    Game game(classic_board(), {Player{1}, Player{2}, Player{3}, Player{4}},
+              [&rng] { return static_cast<int>(rng() % 6) + 1; });
+    game.deal_random_placement(17);
+
+    const StateCodec codec{classic_board()};
+    std::vector<std::uint8_t> bytes;
+    codec.encode(game.state(), bytes);
+
+    EXPECT_LT(bytes.size(), 64U);
+    EXPECT_EQ(hash_state(game.state()), hash_state(codec.decode(bytes.data(), bytes.size())));
+}
+
+// Plays until a territory holds more than 127 units, cards have been
+// dealt and a player is out. Reinforces the strongest territory on a
+// front, attacks where it outnumbers the defender most and moves all it
+// can into what it conquers.
+struct MidGameFixture : public ::testing::Test
+{
+    MidGameFixture()
+        : rng(11)
+        , game(classic_board(), {Player{1}, Player{2}, Player{3}, Player{4}},
+               [this] { return static_cast<int>(rng() % 6) + 1; })
+    {
+        game.deal_random_placement(23);
+        for (std::size_t move = 0; move < 100000 && !mid_game(); ++move) {
+            game.apply(next_command(game.state()));
+        }
+    }
+
+    bool mid_game() const
+    {
+        const auto& state = game.state();
+        const auto territories = state.board().territories();
+        const auto players = state.players();
+        const bool large = std::any_of(std::begin(territories), std::end(territories), [] (const Territory& territory) {
+            return territory.units() > 127;
+        });
+        const bool dealt = std::any_of(std::begin(players), std::end(players), [] (const Player& player) {
+            return !player.cards().empty();
+        });
+        const bool eliminated = std::any_of(std::begin(players), std::end(players), [&] (const Player& player) {
+            return std::none_of(std::begin(territories), std::end(territories), [&player] (const Territory& territory) {
+                return territory.owner() == player.id();
+            });
+        });
+        return large && dealt && eliminated && state.phase() != Phase::GameOver;
+    }
+
+    static Command next_command(const State& state)
+    {
+        const auto player = state.current_player();
+        const auto& board = state.board();
+        const auto territories = board.territories();
+        auto front = [&] (const Territory& from) {
+            return from.owner() == player.id() && std::any_of(
+                std::begin(territories), std::end(territories),
+                [&] (const Territory& to) { return to.owner() != player.id() && board.adjacent(from.id(), to.id()); }
+            );
+        };
+        const Territory* strongest = nullptr;
+        for (const auto& territory : territories) {
+            if (front(territory) && (!strongest || territory.units() > strongest->units())) {
+                strongest = &territory;
+            }
+        }
+
+        switch (state.phase()) {
+        case Phase::Reinforce:
+            return PlaceUnit{player.id(), strongest->id()};
+        case Phase::TradeCards: {
+            const auto hand = player.cards();
+            for (std::size_t a = 0; a < hand.size(); ++a) {
+                for (std::size_t b = a + 1; b < hand.size(); ++b) {
+                    for (std::size_t c = b + 1; c < hand.size(); ++c) {
+                        if (tradable({hand[a], hand[b], hand[c]})) {
+                            return TradeCards{player.id(), {a, b, c}};
+                        }
+                    }
+                }
+            }
+            break;
+        }
+        case Phase::Attack: {
+            // Where it outnumbers the defender the most
+            const Territory* from = nullptr;
+            const Territory* to = nullptr;
+            for (const auto& a : territories) {
+                for (const auto& b : territories) {
+                    if (a.owner() == player.id() && b.owner() != player.id() && board.adjacent(a.id(), b.id())
+                        && a.units() > b.units() && (!from || a.units() - b.units() > from->units() - to->units())) {
+                        from = &a;
+                        to = &b;
+                    }
+                }
+            }
+            if (from) {
+                return Attack{player.id(), from->id(), to->id(), std::min<std::size_t>(3, from->units() - 1)};
+            }
+            break;
+        }
+        case Phase::Occupy: {
+            const auto occupation = *state.turn().occupation;
+            const auto from = std::find_if(std::begin(territories), std::end(territories), [&] (const Territory& territory) {
+                return territory.id() == occupation.from;
+            });
+            return Occupy{player.id(), std::max(occupation.min_units, from->units() - 1)};
+        }
+        default:
+            break;
+        }
+        return EndPhase{player.id()};
+    }
+
+    // Three of a kind or one of each, wildcards standing in for any
+    static bool tradable(const std::vector<Card>& set)
+    {
+        std::array<bool, 3> kinds{};
+        std::size_t wildcards = 0;
+        for (const auto& card : set) {
+            if (card.kind() == Card::Kind::Wildcard) {
+                ++wildcards;
+            } else {
+                kinds[static_cast<std::size_t>(card.kind())] = true;
+            }
+        }
+        const auto distinct = static_cast<std::size_t>(std::count(std::begin(kinds), std::end(kinds), true));
+        return distinct <= 1 || distinct + wildcards == 3;
+    }
+
+    std::mt19937 rng;
+    Game game;
+};
+
+TEST_F(MidGameFixture, classic_mid_game_state_is_small)
+{
+    ASSERT_TRUE(mid_game());
+
+    const StateCodec codec{classic_board()};
+    std::vector<std::uint8_t> bytes;
+    codec.encode(game.state(), bytes);
+
+    EXPECT_LT(bytes.size(), 64U);
+    EXPECT_EQ(hash_state(game.state()), hash_state(codec.decode(bytes.data(), bytes.size())));
+}
+
+TEST(StateCodec, truncated_snapshot_is_rejected)
+{
+    Game game(classic_board(), {Player{1}, Player{2}, Player{3}}, [] { return 1; });
+    game.deal_random_placement(3);
+
+    const StateCodec codec{classic_board()};
+    std::vector<std::uint8_t> bytes;
+    codec.encode(game.state(), bytes);
+
+    EXPECT_THROW(codec.decode(bytes.data(), bytes.size() / 2), DecodeError);
+}
+
+TEST_F(EventLogFixture, state_patches_follow_every_move)
+{
+    play();
+
+    const StateCodec codec{board};
+    Replay<> replay(board, players, log);
+    State client = replay.state();
+    State previous = client;
+
+    std::size_t patch_bytes = 0;
+    std::size_t snapshot_bytes = 0;
+    std::vector<std::uint8_t> bytes;
+    while (replay.step()) {
+        const auto state = replay.state();
+
+        bytes.clear();
+        codec.diff(previous, state, bytes);
+        codec.patch(bytes.data(), bytes.size(), client);
+        ASSERT_EQ(hash_state(state), hash_state(client)) << "move " << replay.moves();
+        patch_bytes += bytes.size();
+
+        bytes.clear();
+        codec.encode(state, bytes);
+        snapshot_bytes += bytes.size();
+
+        previous = state;
+    }
+
+    EXPECT_LT(patch_bytes, snapshot_bytes);
+}
+
+TEST(StateCodec, unchanged_state_gives_an_empty_patch)
+{
+    Game game(classic_board(), {Player{1}, Player{2}, Player{3}}, [] { return 1; });
+    game.deal_random_placement(3);
+
+    const StateCodec codec{classic_board()};
+    std::vector<std::uint8_t> bytes;
+    codec.diff(game.state(), game.state(), bytes);
+    EXPECT_EQ(1U, bytes.size());
+
+    // A reinforcement only touches one territory and the player placing
+    const auto before = game.state();
+    const auto territories = before.board().territories();
+    const auto own = std::find_if(
+        std::begin(territories), std::end(territories),
+        [&before] (const Territory& territory) {
+            return territory.owner() == before.current_player().id();
+        }
+    );
+    game.apply(PlaceUnit{before.current_player().id(), own->id()});
+
+    bytes.clear();
+    codec.diff(before, game.state(), bytes);
+
+    std::vector<std::uint8_t> snapshot;
+    codec.encode(game.state(), snapshot);
+    EXPECT_LT(bytes.size(), snapshot.size() / 2);
+}
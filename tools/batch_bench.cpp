@@ -0,0 +1,125 @@
+// Measures applying the placement phase of a game on the classic board as
+// one apply_batch against a loop of single place_unit calls. Each player
+// claims the first free territory, or reinforces their first one once all
+// are claimed, until every unit is placed. Both ways start from the same
+// fresh game each round and must end in the same state.
+
+#include "risk/rules/event_log.h"
+#include "risk/rules/game.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+using namespace risk::rules;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::size_t players = 3;
+    std::size_t rounds = 2000;
+};
+
+Game new_game(std::size_t players)
+{
+    std::vector<Player> seats;
+    for (std::size_t i = 1; i <= players; ++i) {
+        seats.emplace_back(static_cast<Player::Id>(i));
+    }
+    return Game{classic_board(), seats, [] { return 1; }};
+}
+
+std::vector<Command> placement(Game game)
+{
+    std::vector<Command> commands;
+    while (game.state().phase() == Phase::Placing) {
+        const auto player = game.state().current_player().id();
+        const auto territories = game.state().board().territories();
+        const Territory* target = nullptr;
+        for (const auto& territory : territories) {
+            if (!territory.owner() || (!target && territory.owner() == player)) {
+                target = &territory;
+                if (!territory.owner()) {
+                    break;
+                }
+            }
+        }
+        commands.push_back(PlaceUnit{player, target->id()});
+        game.apply(commands.back());
+    }
+    return commands;
+}
+
+// Nanoseconds per command
+template <typename Apply>
+double measure(const Options& options, std::size_t commands, std::uint64_t& hash, Apply apply)
+{
+    const auto fresh = new_game(options.players);
+    Clock::duration elapsed{};
+    for (std::size_t round = 0; round < options.rounds; ++round) {
+        auto game = fresh;
+        const auto start = Clock::now();
+        apply(game);
+        elapsed += Clock::now() - start;
+        hash = hash_state(game.state());
+    }
+    return std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(options.rounds * commands);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    const option long_options[] = {
+        {"players", required_argument, nullptr, 'p'},
+        {"rounds", required_argument, nullptr, 'r'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int option;
+    while ((option = ::getopt_long(argc, argv, "p:r:", long_options, nullptr)) != -1) {
+        switch (option) {
+        case 'p': options.players = std::strtoull(optarg, nullptr, 10); break;
+        case 'r': options.rounds = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [--players 2..6] [--rounds N]\n";
+            return 2;
+        }
+    }
+    if (options.players < 2 || options.players > 6) {
+        std::cerr << argv[0] << ": --players must be 2 to 6\n";
+        return 2;
+    }
+
+    const auto commands = placement(new_game(options.players));
+    std::uint64_t single_hash = 0;
+    std::uint64_t batch_hash = 0;
+
+    const auto single = measure(options, commands.size(), single_hash, [&commands] (Game& game) {
+        for (const auto& command : commands) {
+            const auto& place = std::get<PlaceUnit>(command);
+            game.place_unit(place.player, place.territory);
+        }
+    });
+    const auto batch = measure(options, commands.size(), batch_hash, [&commands] (Game& game) {
+        game.apply_batch(commands);
+    });
+    if (single_hash != batch_hash) {
+        std::cerr << argv[0] << ": the batch ended in a different state\n";
+        return 1;
+    }
+
+    std::cout
+        << options.players << " players, " << commands.size() << " placements, " << options.rounds << " rounds\n"
+        << "place_unit  " << single << " ns/command\n"
+        << "apply_batch " << batch << " ns/command (" << single / batch << "x)\n";
+}
@@ -0,0 +1,197 @@
+// Measures StateCodec throughput on the classic board. Records the state
+// after every command of a number of games played with random dice, then
+// encodes and decodes every state, and diffs and patches every pair of
+// consecutive ones, several times over. Reported are states per second and
+// the rate at which encoded bytes are produced or consumed.
+
+#include "risk/rules/codec.h"
+#include "risk/rules/game.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace risk::rules;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+volatile std::uint64_t sink;
+
+struct Options {
+    std::size_t games = 20;
+    std::size_t moves = 500;
+    std::size_t rounds = 20;
+};
+
+// Places on its first territory, attacks from the first one it can and
+// otherwise ends the phase
+Command next_command(const State& state)
+{
+    const auto player = state.current_player().id();
+    const auto& board = state.board();
+    const auto territories = board.territories();
+
+    switch (state.phase()) {
+    case Phase::Reinforce:
+        for (const auto& territory : territories) {
+            if (territory.owner() == player) {
+                return PlaceUnit{player, territory.id()};
+            }
+        }
+        break;
+    case Phase::Attack:
+        for (const auto& from : territories) {
+            if (from.owner() != player || from.units() <= 3) {
+                continue;
+            }
+            for (const auto& to : territories) {
+                if (to.owner() != player && board.adjacent(from.id(), to.id())) {
+                    return Attack{player, from.id(), to.id(), 3};
+                }
+            }
+        }
+        break;
+    case Phase::Occupy:
+        return Occupy{player, state.turn().occupation->min_units};
+    default:
+        break;
+    }
+    return EndPhase{player};
+}
+
+std::vector<State> play(const Options& options)
+{
+    std::vector<State> states;
+    for (std::size_t i = 0; i < options.games; ++i) {
+        std::mt19937 rng{static_cast<std::uint32_t>(i)};
+        Game game{classic_board(), {Player{1}, Player{2}, Player{3}, Player{4}}, [&rng] {
+            return static_cast<int>(rng() % 6) + 1;
+        }};
+        game.deal_random_placement(i);
+        states.push_back(game.state());
+        for (std::size_t move = 0; move < options.moves && game.state().phase() != Phase::GameOver; ++move) {
+            try {
+                game.apply(next_command(game.state()));
+            } catch (const std::exception&) {
+                // Holding five cards forces a trade this bot does not make
+                break;
+            }
+            states.push_back(game.state());
+        }
+    }
+    return states;
+}
+
+void report(const char* name, std::size_t states, std::size_t bytes, Clock::duration elapsed)
+{
+    const auto seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout
+        << name << static_cast<std::uint64_t>(states / seconds) << " states/s, "
+        << bytes / seconds / 1e6 << " MB/s\n";
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    const option long_options[] = {
+        {"games", required_argument, nullptr, 'g'},
+        {"moves", required_argument, nullptr, 'm'},
+        {"rounds", required_argument, nullptr, 'r'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int option;
+    while ((option = ::getopt_long(argc, argv, "g:m:r:", long_options, nullptr)) != -1) {
+        switch (option) {
+        case 'g': options.games = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        case 'm': options.moves = std::strtoull(optarg, nullptr, 10); break;
+        case 'r': options.rounds = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [--games N] [--moves N] [--rounds N]\n";
+            return 2;
+        }
+    }
+
+    const auto states = play(options);
+    const StateCodec codec{classic_board()};
+
+    // Encoded once up front, for decoding and patching
+    std::vector<std::vector<std::uint8_t>> snapshots(states.size());
+    std::vector<std::vector<std::uint8_t>> patches(states.size());
+    std::size_t snapshot_bytes = 0;
+    std::size_t patch_bytes = 0;
+    for (std::size_t i = 0; i < states.size(); ++i) {
+        codec.encode(states[i], snapshots[i]);
+        snapshot_bytes += snapshots[i].size();
+        if (i > 0) {
+            codec.diff(states[i - 1], states[i], patches[i]);
+            patch_bytes += patches[i].size();
+        }
+    }
+    std::cout
+        << states.size() << " states, " << snapshot_bytes / states.size() << " bytes per snapshot, "
+        << patch_bytes / std::max<std::size_t>(1, states.size() - 1) << " per patch\n";
+
+    const auto total = states.size() * options.rounds;
+    std::vector<std::uint8_t> out;
+    out.reserve(256);
+
+    auto start = Clock::now();
+    for (std::size_t round = 0; round < options.rounds; ++round) {
+        for (const auto& state : states) {
+            out.clear();
+            codec.encode(state, out);
+        }
+    }
+    report("encode  ", total, snapshot_bytes * options.rounds, Clock::now() - start);
+
+    auto decoded = states.front();
+    // Keeps the decoding from being optimized away
+    std::uint64_t check = 0;
+    start = Clock::now();
+    for (std::size_t round = 0; round < options.rounds; ++round) {
+        for (const auto& snapshot : snapshots) {
+            codec.decode(snapshot.data(), snapshot.size(), decoded);
+            check += decoded.trades();
+        }
+    }
+    report("decode  ", total, snapshot_bytes * options.rounds, Clock::now() - start);
+
+    start = Clock::now();
+    for (std::size_t round = 0; round < options.rounds; ++round) {
+        for (std::size_t i = 1; i < states.size(); ++i) {
+            out.clear();
+            codec.diff(states[i - 1], states[i], out);
+        }
+    }
+    report("diff    ", total - options.rounds, patch_bytes * options.rounds, Clock::now() - start);
+
+    // Each round patches its way through every state from the first
+    start = Clock::now();
+    for (std::size_t round = 0; round < options.rounds; ++round) {
+        for (std::size_t i = 0; i < states.size(); ++i) {
+            if (i == 0) {
+                decoded = states[i];
+            } else {
+                codec.patch(patches[i].data(), patches[i].size(), decoded);
+            }
+        }
+    }
+    if (hash_state(decoded) != hash_state(states.back())) {
+        std::cerr << argv[0] << ": patching went astray\n";
+        return 1;
+    }
+    report("patch   ", total - options.rounds, patch_bytes * options.rounds, Clock::now() - start);
+    sink = check;
+}
@@ -0,0 +1,147 @@
+// Measures write-ahead logging through each DiskIo backend. One thread
+// owns several logs, as a shard would, and keeps every log busy: it
+// appends a batch of records to each log with room for more, commits, and
+// waits for the disk. Reported are the durable records per second, the
+// syncs it took, and the CPU time the owning thread spent, which is what
+// a shard gives up to the log.
+//
+// The logs are created in a fresh directory under --dir, which should be
+// on the disk being measured rather than on a tmpfs.
+
+#include "risk/server/disk_io.h"
+#include "risk/server/wal.h"
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+using namespace risk::server;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string directory = ".";
+    std::size_t logs = 4;
+    std::size_t records = 100000;
+    std::size_t size = 64;
+    // Records appended to a log before waiting for it to catch up
+    std::size_t window = 256;
+};
+
+double thread_cpu_seconds()
+{
+    rusage usage{};
+    ::getrusage(RUSAGE_THREAD, &usage);
+    return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+        + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+void run(DiskIo::Backend backend, const Options& options)
+{
+    std::string directory = options.directory + "/disk_bench.XXXXXX";
+    if (!::mkdtemp(directory.data())) {
+        throw std::system_error(errno, std::generic_category(), "mkdtemp " + directory);
+    }
+
+    auto io = DiskIo::create(backend);
+    std::vector<std::unique_ptr<WriteAheadLog>> logs;
+    for (std::size_t i = 0; i < options.logs; ++i) {
+        logs.push_back(std::make_unique<WriteAheadLog>(
+            *io, directory + "/" + std::to_string(i) + ".wal", 1, [] (const std::uint8_t*, std::size_t) {}
+        ));
+    }
+
+    const std::vector<std::uint8_t> record(options.size, 0x5a);
+    const auto per_log = options.records / options.logs;
+    std::size_t waits = 0;
+
+    const auto start = Clock::now();
+    const auto start_cpu = thread_cpu_seconds();
+    for (;;) {
+        bool finished = true;
+        for (auto& log : logs) {
+            if (log->durable() < per_log) {
+                finished = false;
+            }
+            while (log->appended() < per_log && log->appended() - log->durable() < options.window) {
+                log->append(record.data(), record.size());
+            }
+            log->commit();
+        }
+        if (finished) {
+            break;
+        }
+        io->wait();
+        ++waits;
+    }
+    const auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    const auto cpu = thread_cpu_seconds() - start_cpu;
+
+    logs.clear();
+    for (std::size_t i = 0; i < options.logs; ++i) {
+        std::remove((directory + "/" + std::to_string(i) + ".wal").c_str());
+    }
+    ::rmdir(directory.c_str());
+
+    const auto total = per_log * options.logs;
+    std::cout
+        << io->name() << ": " << static_cast<std::uint64_t>(total / elapsed) << " records/s, "
+        << waits << " waits, " << cpu * 1e6 / total << " us of the owner's CPU per record ("
+        << 100 * cpu / elapsed << "% busy)\n";
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    const option long_options[] = {
+        {"dir", required_argument, nullptr, 'd'},
+        {"logs", required_argument, nullptr, 'l'},
+        {"records", required_argument, nullptr, 'n'},
+        {"size", required_argument, nullptr, 's'},
+        {"window", required_argument, nullptr, 'w'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int option;
+    while ((option = ::getopt_long(argc, argv, "d:l:n:s:w:", long_options, nullptr)) != -1) {
+        switch (option) {
+        case 'd': options.directory = optarg; break;
+        case 'l': options.logs = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        case 'n': options.records = std::strtoull(optarg, nullptr, 10); break;
+        case 's': options.size = std::strtoull(optarg, nullptr, 10); break;
+        case 'w': options.window = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        default:
+            std::cerr
+                << "usage: " << argv[0]
+                << " [--dir DIR] [--logs N] [--records N] [--size BYTES] [--window N]\n";
+            return 2;
+        }
+    }
+
+    std::cout
+        << options.logs << " logs, " << options.records << " records of " << options.size
+        << " bytes, up to " << options.window << " in flight per log\n";
+
+    try {
+        run(DiskIo::Backend::Uring, options);
+    } catch (const std::system_error& error) {
+        std::cout << "io_uring: unavailable (" << error.what() << ")\n";
+    }
+    run(DiskIo::Backend::Threads, options);
+}
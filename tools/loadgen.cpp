@@ -0,0 +1,366 @@
+// Drives risk_server over loopback. Each game gets a driver connection that
+// creates it, joins it and plays it with a simple bot, answering every
+// state update with the next command. Spectator connections join games
+// round-robin and only receive updates. With --threads the games are split
+// over that many client threads.
+//
+// Against a server with a write-ahead log, updates are only sent once the
+// move is durable, so the command rate is durable commands per second.
+
+#include "risk/rules/codec.h"
+#include "risk/server/buffer_pool.h"
+#include "risk/server/connection.h"
+#include "risk/server/event_loop.h"
+#include "risk/server/protocol.h"
+#include "risk/server/socket.h"
+
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace risk::rules;
+using namespace risk::server;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    std::uint16_t port = 7000;
+    std::string unix_path;
+    std::size_t games = 100;
+    std::size_t spectators = 0;
+    std::size_t players = 3;
+    unsigned seconds = 10;
+    std::size_t threads = 1;
+};
+
+struct Stats {
+    std::size_t connections = 0;
+    std::uint64_t commands = 0;
+    std::uint64_t updates = 0;
+    std::uint64_t errors = 0;
+    std::uint64_t finished = 0;
+    double seconds = 0;
+    std::vector<double> latencies;
+
+    void add(Stats&& other)
+    {
+        connections += other.connections;
+        commands += other.commands;
+        updates += other.updates;
+        errors += other.errors;
+        finished += other.finished;
+        seconds = std::max(seconds, other.seconds);
+        latencies.insert(std::end(latencies), std::begin(other.latencies), std::end(other.latencies));
+    }
+
+    void report()
+    {
+        std::sort(std::begin(latencies), std::end(latencies));
+        auto percentile = [this] (double p) {
+            return latencies.empty() ? 0.0 : latencies[static_cast<std::size_t>(p * (latencies.size() - 1))];
+        };
+
+        std::cout
+            << "connections " << connections << '\n'
+            << "commands    " << commands << " (" << static_cast<std::uint64_t>(commands / seconds) << "/s)\n"
+            << "updates     " << updates << " (" << static_cast<std::uint64_t>(updates / seconds) << "/s)\n"
+            << "errors      " << errors << '\n'
+            << "finished    " << finished << " games\n"
+            << "latency us  p50 " << percentile(0.5) << " p99 " << percentile(0.99) << '\n';
+    }
+};
+
+bool valid_set(const std::vector<Card>& hand, std::size_t a, std::size_t b, std::size_t c)
+{
+    std::array<int, 3> kinds{};
+    for (auto index : {a, b, c}) {
+        const auto kind = hand[index].kind();
+        if (kind != Card::Kind::Wildcard) {
+            ++kinds[static_cast<std::size_t>(kind)];
+        }
+    }
+    const auto most = *std::max_element(std::begin(kinds), std::end(kinds));
+    const auto wildcards = 3 - kinds[0] - kinds[1] - kinds[2];
+    return most + wildcards == 3 || most <= 1;
+}
+
+Command next_command(const State& state, const Board& board)
+{
+    const auto player = state.current_player();
+    const auto territories = state.board().territories();
+
+    switch (state.phase()) {
+    case Phase::Reinforce:
+        for (const auto& territory : territories) {
+            if (territory.owner() == player.id()) {
+                return PlaceUnit{player.id(), territory.id()};
+            }
+        }
+        break;
+    case Phase::TradeCards: {
+        const auto hand = player.cards();
+        for (std::size_t a = 0; a < hand.size(); ++a) {
+            for (std::size_t b = a + 1; b < hand.size(); ++b) {
+                for (std::size_t c = b + 1; c < hand.size(); ++c) {
+                    if (valid_set(hand, a, b, c)) {
+                        return TradeCards{player.id(), {a, b, c}};
+                    }
+                }
+            }
+        }
+        break;
+    }
+    case Phase::Attack:
+        for (const auto& from : territories) {
+            if (from.owner() != player.id() || from.units() <= 3) {
+                continue;
+            }
+            for (const auto& to : territories) {
+                if (to.owner() != player.id() && board.adjacent(from.id(), to.id())) {
+                    return Attack{player.id(), from.id(), to.id(), 3};
+                }
+            }
+        }
+        break;
+    case Phase::Occupy:
+        return Occupy{player.id(), state.turn().occupation->min_units};
+    default:
+        break;
+    }
+    return EndPhase{player.id()};
+}
+
+class LoadGenerator : private Connection::Listener {
+public:
+    // Plays games first_game + 1 up to first_game + options.games
+    LoadGenerator(Options options, std::uint64_t first_game)
+        : options_(std::move(options))
+        , first_game_(first_game)
+        , board_(classic_board())
+        , codec_(board_)
+    {}
+
+    Stats run()
+    {
+        for (std::size_t i = 0; i < options_.games; ++i) {
+            auto& client = connect();
+            client.game = first_game_ + i + 1;
+            client.driver = true;
+            Buffer frames;
+            encode_request(frames, Request{Frame::New, client.game, options_.players, client.game, {}});
+            encode_request(frames, Request{Frame::Join, client.game, 0, 0, {}});
+            encode_request(frames, Request{Frame::Deal, client.game, 0, client.game, {}});
+            client.connection->send(frames);
+        }
+
+        Timer timer{*this, options_.seconds};
+        start_ = Clock::now();
+        loop_.run();
+
+        stats_.connections = clients_.size();
+        stats_.seconds = std::chrono::duration<double>(Clock::now() - start_).count();
+        return std::move(stats_);
+    }
+
+private:
+    struct Client {
+        std::unique_ptr<Connection> connection;
+        std::uint64_t game = 0;
+        bool driver = false;
+        Clock::time_point sent;
+        State state{Board{}, Phase::Placing, {}, {}};
+    };
+
+    // Stops the run after the configured number of seconds
+    class Timer : public EventLoop::Handler {
+    public:
+        Timer(LoadGenerator& generator, unsigned seconds)
+            : generator_(generator)
+            , fd_(::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+        {
+            itimerspec spec{};
+            spec.it_value.tv_sec = seconds;
+            ::timerfd_settime(fd_.get(), 0, &spec, nullptr);
+            generator_.loop_.add(fd_.get(), EPOLLIN, *this);
+        }
+
+        void on_events(std::uint32_t) override { generator_.loop_.stop(); }
+
+    private:
+        LoadGenerator& generator_;
+        FileDescriptor fd_;
+    };
+
+    Client& connect()
+    {
+        auto fd = options_.unix_path.empty()
+            ? connect_tcp(options_.host, options_.port)
+            : connect_unix(options_.unix_path);
+        const int client_fd = fd.get();
+        auto& client = clients_[client_fd];
+        client.connection = std::make_unique<Connection>(loop_, std::move(fd), static_cast<Listener&>(*this));
+        return client;
+    }
+
+    void on_frame(Connection& connection, const std::uint8_t* frame, std::size_t size) override
+    {
+        auto& client = clients_.at(connection.fd());
+
+        Reply reply;
+        if (!decode_reply(frame, size, reply) || reply.type == Frame::Error) {
+            ++stats_.errors;
+            return;
+        }
+        if (reply.type == Frame::Ok) {
+            return;
+        }
+
+        ++stats_.updates;
+        if (!client.driver) {
+            return;
+        }
+
+        if (reply.type == Frame::Snapshot) {
+            codec_.decode(reply.payload, reply.size, client.state);
+        } else {
+            codec_.patch(reply.payload, reply.size, client.state);
+        }
+
+        const auto now = Clock::now();
+        if (client.sent != Clock::time_point{}) {
+            stats_.latencies.push_back(std::chrono::duration<double, std::micro>(now - client.sent).count());
+        }
+
+        switch (client.state.phase()) {
+        case Phase::Placing:
+            return;
+        case Phase::GameOver:
+            ++stats_.finished;
+            return;
+        default:
+            break;
+        }
+
+        // Once every game is being played, bring in the spectators
+        if (++started_ == options_.games) {
+            for (std::size_t i = 0; i < options_.spectators; ++i) {
+                Buffer join;
+                encode_request(join, Request{Frame::Join, first_game_ + i % options_.games + 1, 0, 0, {}});
+                connect().connection->send(join);
+            }
+        }
+
+        client.sent = now;
+        Buffer command;
+        encode_command(command, client.game, next_command(client.state, board_));
+        client.connection->send(command);
+        ++stats_.commands;
+    }
+
+    void on_close(Connection& connection) override
+    {
+        clients_.erase(connection.fd());
+    }
+
+    Options options_;
+    std::uint64_t first_game_;
+    Board board_;
+    StateCodec codec_;
+    EventLoop loop_;
+    std::unordered_map<int, Client> clients_;
+    Clock::time_point start_;
+    std::size_t started_ = 0;
+    Stats stats_;
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    const option long_options[] = {
+        {"host", required_argument, nullptr, 'h'},
+        {"port", required_argument, nullptr, 'p'},
+        {"unix", required_argument, nullptr, 'u'},
+        {"games", required_argument, nullptr, 'g'},
+        {"spectators", required_argument, nullptr, 's'},
+        {"players", required_argument, nullptr, 'n'},
+        {"seconds", required_argument, nullptr, 't'},
+        {"threads", required_argument, nullptr, 'j'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int option;
+    while ((option = ::getopt_long(argc, argv, "h:p:u:g:s:n:t:j:", long_options, nullptr)) != -1) {
+        switch (option) {
+        case 'h': options.host = optarg; break;
+        case 'p': options.port = static_cast<std::uint16_t>(std::atoi(optarg)); break;
+        case 'u': options.unix_path = optarg; break;
+        case 'g': options.games = std::strtoull(optarg, nullptr, 10); break;
+        case 's': options.spectators = std::strtoull(optarg, nullptr, 10); break;
+        case 'n': options.players = std::strtoull(optarg, nullptr, 10); break;
+        case 't': options.seconds = static_cast<unsigned>(std::atoi(optarg)); break;
+        case 'j': options.threads = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        default:
+            std::cerr
+                << "usage: " << argv[0] << " [--host ADDRESS] [--port PORT] [--unix PATH]\n"
+                << "       [--games N] [--spectators N] [--players N] [--seconds N] [--threads N]\n";
+            return 2;
+        }
+    }
+
+    rlimit limit{};
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+
+    try {
+        // Each thread gets an equal share of the games and spectators
+        auto share = options;
+        share.games = std::max<std::size_t>(1, options.games / options.threads);
+        share.spectators = options.spectators / options.threads;
+
+        std::vector<Stats> results(options.threads);
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < options.threads; ++i) {
+            threads.emplace_back([&share, &results, i, program = argv[0]] {
+                try {
+                    results[i] = LoadGenerator{share, i * share.games}.run();
+                } catch (const std::exception& error) {
+                    std::cerr << program << ": " << error.what() << '\n';
+                }
+            });
+        }
+
+        Stats total;
+        for (std::size_t i = 0; i < options.threads; ++i) {
+            threads[i].join();
+            total.add(std::move(results[i]));
+        }
+        total.report();
+    } catch (const std::exception& error) {
+        std::cerr << argv[0] << ": " << error.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,382 @@
+// Measures how long games are held up while a router moves them between
+// workers. Forks --workers risk servers, each on a Unix socket in a fresh
+// directory under --dir, and a spare one, and routes to all but the spare
+// from this process. A client creates --games games through the router and
+// keeps playing them, one command at a time. Then the spare worker is
+// added, and once its share of the games has moved the first worker is
+// removed and its games move too.
+//
+// Reported are the games moved and how long the router held back requests
+// for each, as well as the slowest command the client saw. Exits with 1 if
+// a game was held back for --max-pause or longer.
+
+#include "risk/rules/codec.h"
+#include "risk/server/protocol.h"
+#include "risk/server/router.h"
+#include "risk/server/server.h"
+#include "risk/server/socket.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using namespace risk::rules;
+using namespace risk::server;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string directory = "/tmp";
+    std::size_t workers = 2;
+    std::size_t shards = 1;
+    std::size_t games = 1000;
+    std::size_t concurrent_moves = RouterOptions{}.concurrent_moves;
+    // Gives each worker a write-ahead log
+    bool log = false;
+    std::chrono::milliseconds max_pause{10};
+};
+
+// Runs a worker in a process of its own until it is killed
+pid_t spawn_worker(const Options& options, const std::string& path, const std::string& wal_dir)
+{
+    const auto pid = ::fork();
+    if (pid < 0) {
+        throw std::system_error(errno, std::generic_category(), "fork");
+    }
+    if (pid > 0) {
+        return pid;
+    }
+    try {
+        ServerOptions worker;
+        worker.unix_path = path;
+        worker.shards = options.shards;
+        worker.wal_dir = wal_dir;
+        Server server{worker};
+        server.run();
+    } catch (const std::exception& error) {
+        std::cerr << path << ": " << error.what() << '\n';
+    }
+    ::_exit(0);
+}
+
+// Until the worker listens, or a few seconds have passed
+void wait_for_worker(const std::string& path)
+{
+    for (int i = 0;; ++i) {
+        try {
+            connect_unix(path);
+            return;
+        } catch (const std::system_error&) {
+            if (i == 500) {
+                throw;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    }
+}
+
+void remove_directory(const std::string& path)
+{
+    if (DIR* dir = ::opendir(path.c_str())) {
+        while (const auto* entry = ::readdir(dir)) {
+            if (entry->d_name[0] != '.') {
+                std::remove((path + "/" + entry->d_name).c_str());
+            }
+        }
+        ::closedir(dir);
+    }
+    ::rmdir(path.c_str());
+}
+
+// Plays every game a command at a time over one connection to the router,
+// following the games through their updates
+class Player {
+public:
+    Player(const std::string& path, std::size_t games)
+        : fd_(connect_unix(path))
+        , board_(classic_board())
+        , codec_(board_)
+        , states_(games + 1, State{Board{}, Phase::Placing, {}, {}})
+    {
+        std::vector<std::uint8_t> frames;
+        for (GameId game = 1; game <= games; ++game) {
+            encode_request(frames, Request{Frame::New, game, 3, game, {}});
+            encode_request(frames, Request{Frame::Join, game, 0, 0, {}});
+            encode_request(frames, Request{Frame::Deal, game, 0, game, {}});
+        }
+        send(frames);
+        for (std::size_t replies = 0; replies < 3 * games;) {
+            replies += receive() != nullptr;
+        }
+        // Dealt once the Delta for the Deal is in
+        auto dealt = [this] {
+            return std::none_of(std::begin(states_) + 1, std::end(states_), [] (const State& state) {
+                return state.phase() == Phase::Placing;
+            });
+        };
+        while (!dealt()) {
+            receive();
+        }
+    }
+
+    // Until `stop`, answered or not
+    void run(const std::atomic<bool>& stop)
+    {
+        for (GameId game = 1; !stop.load(std::memory_order_relaxed); game = game % (states_.size() - 1) + 1) {
+            const auto& state = states_[game];
+            if (state.phase() == Phase::GameOver) {
+                continue;
+            }
+            std::vector<std::uint8_t> frame;
+            encode_command(frame, game, next_command(state));
+            const auto sent = Clock::now();
+            send(frame);
+            while (true) {
+                const auto* reply = receive();
+                if (reply && reply->game == game) {
+                    break;
+                }
+            }
+            slowest = std::max(slowest, std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - sent));
+            ++commands;
+        }
+    }
+
+    std::size_t commands = 0;
+    std::size_t errors = 0;
+    std::chrono::microseconds slowest{0};
+
+private:
+    // Reinforces the first territory it can, otherwise ends the phase
+    static Command next_command(const State& state)
+    {
+        const auto player = state.current_player().id();
+        if (state.phase() == Phase::Reinforce) {
+            for (const auto& territory : state.board().territories()) {
+                if (territory.owner() == player) {
+                    return PlaceUnit{player, territory.id()};
+                }
+            }
+        }
+        return EndPhase{player};
+    }
+
+    void send(const std::vector<std::uint8_t>& data)
+    {
+        for (std::size_t sent = 0; sent < data.size();) {
+            const auto count = ::write(fd_.get(), data.data() + sent, data.size() - sent);
+            if (count < 0) {
+                throw std::system_error(errno, std::generic_category(), "write");
+            }
+            sent += static_cast<std::size_t>(count);
+        }
+    }
+
+    // The next frame, applied if it is an update. Returns Ok and Error
+    // replies and null for updates.
+    const Reply* receive()
+    {
+        auto fill = [this] (std::size_t size) {
+            while (buffered_.size() < size) {
+                std::uint8_t chunk[4096];
+                const auto count = ::read(fd_.get(), chunk, sizeof(chunk));
+                if (count <= 0) {
+                    throw std::runtime_error("The router closed the connection");
+                }
+                buffered_.insert(std::end(buffered_), chunk, chunk + count);
+            }
+        };
+        fill(length_size);
+        const std::size_t length = buffered_[0] | std::size_t{buffered_[1]} << 8;
+        fill(length_size + length);
+        frame_.assign(std::begin(buffered_) + length_size, std::begin(buffered_) + length_size + length);
+        buffered_.erase(std::begin(buffered_), std::begin(buffered_) + length_size + length);
+
+        if (!decode_reply(frame_.data(), frame_.size(), reply_)) {
+            throw std::runtime_error("Malformed frame from the router");
+        }
+        switch (reply_.type) {
+        case Frame::Ok:
+            return &reply_;
+        case Frame::Error:
+            ++errors;
+            return &reply_;
+        case Frame::Snapshot:
+            codec_.decode(reply_.payload, reply_.size, states_.at(reply_.game));
+            return nullptr;
+        case Frame::Delta:
+            codec_.patch(reply_.payload, reply_.size, states_.at(reply_.game));
+            return nullptr;
+        default:
+            return nullptr;
+        }
+    }
+
+    FileDescriptor fd_;
+    Board board_;
+    StateCodec codec_;
+    // By game id
+    std::vector<State> states_;
+    std::vector<std::uint8_t> buffered_;
+    std::vector<std::uint8_t> frame_;
+    Reply reply_;
+};
+
+// Until nothing is left to move
+void wait_for_moves(const Router& router)
+{
+    // The router picks up the new workers on its own thread, so the moves
+    // may not have started yet
+    for (int i = 0; i < 1000 && router.migrations().moving == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+    while (router.migrations().moving > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+}
+
+int run(const Options& options)
+{
+    std::string directory = options.directory + "/migration_bench.XXXXXX";
+    if (!::mkdtemp(directory.data())) {
+        throw std::system_error(errno, std::generic_category(), "mkdtemp " + directory);
+    }
+
+    // Forked before any threads are started
+    std::vector<std::string> workers;
+    std::vector<std::string> wal_dirs;
+    std::vector<pid_t> pids;
+    for (std::size_t i = 0; i <= options.workers; ++i) {
+        workers.push_back(directory + "/worker" + std::to_string(i));
+        wal_dirs.push_back(options.log ? workers.back() + ".wal" : "");
+        if (options.log) {
+            ::mkdir(wal_dirs.back().c_str(), 0700);
+        }
+        pids.push_back(spawn_worker(options, workers.back(), wal_dirs.back()));
+    }
+    for (const auto& worker : workers) {
+        wait_for_worker(worker);
+    }
+
+    RouterOptions router_options;
+    router_options.unix_path = directory + "/router";
+    router_options.workers.assign(std::begin(workers), std::end(workers) - 1);
+    router_options.concurrent_moves = options.concurrent_moves;
+    Router router{router_options};
+    std::thread routing([&router] { router.run(); });
+
+    Player player{router_options.unix_path, options.games};
+    std::atomic<bool> stop{false};
+    std::thread playing([&player, &stop] {
+        try {
+            player.run(stop);
+        } catch (const std::exception& error) {
+            std::cerr << error.what() << '\n';
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{500});
+    const auto start = Clock::now();
+    router.set_workers(workers);
+    wait_for_moves(router);
+    const auto added = router.migrations().moved;
+    const auto adding = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{500});
+    const auto second = Clock::now();
+    router.set_workers({std::begin(workers) + 1, std::end(workers)});
+    wait_for_moves(router);
+    const auto removing = std::chrono::duration<double, std::milli>(Clock::now() - second).count();
+    std::this_thread::sleep_for(std::chrono::milliseconds{500});
+
+    stop = true;
+    playing.join();
+    router.stop();
+    routing.join();
+    for (const auto pid : pids) {
+        ::kill(pid, SIGKILL);
+        ::waitpid(pid, nullptr, 0);
+    }
+    for (const auto& wal_dir : wal_dirs) {
+        if (!wal_dir.empty()) {
+            remove_directory(wal_dir);
+        }
+    }
+    remove_directory(directory);
+
+    const auto migrations = router.migrations();
+    const auto mean = migrations.moved ? migrations.total_pause.count() / static_cast<double>(migrations.moved) : 0.0;
+    std::cout
+        << "adding a worker   moved " << added << " games in " << adding << " ms\n"
+        << "removing a worker moved " << migrations.moved - added << " games in " << removing << " ms\n"
+        << "paused per game   mean " << mean << " us, longest " << migrations.longest_pause.count() << " us\n"
+        << "client            " << player.commands << " commands, " << player.errors
+        << " errors, slowest " << player.slowest.count() << " us\n";
+    return migrations.longest_pause < options.max_pause ? 0 : 1;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    const option long_options[] = {
+        {"dir", required_argument, nullptr, 'd'},
+        {"workers", required_argument, nullptr, 'w'},
+        {"shards", required_argument, nullptr, 's'},
+        {"games", required_argument, nullptr, 'g'},
+        {"concurrent-moves", required_argument, nullptr, 'm'},
+        {"log", no_argument, nullptr, 'l'},
+        {"max-pause", required_argument, nullptr, 'p'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int option;
+    while ((option = ::getopt_long(argc, argv, "d:w:s:g:m:lp:", long_options, nullptr)) != -1) {
+        switch (option) {
+        case 'd': options.directory = optarg; break;
+        case 'w': options.workers = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        case 's': options.shards = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        case 'g': options.games = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        case 'm': options.concurrent_moves = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        case 'l': options.log = true; break;
+        case 'p': options.max_pause = std::chrono::milliseconds{std::atoi(optarg)}; break;
+        default:
+            std::cerr
+                << "usage: " << argv[0] << " [--dir DIR] [--workers N] [--shards N] [--games N]\n"
+                << "       [--concurrent-moves N] [--log] [--max-pause MS]\n";
+            return 2;
+        }
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::cout
+        << options.games << " games on " << options.workers << " workers of " << options.shards
+        << " shards" << (options.log ? " with logs" : "") << ", moving " << options.concurrent_moves
+        << " at a time\n";
+    try {
+        return run(options);
+    } catch (const std::exception& error) {
+        std::cerr << argv[0] << ": " << error.what() << '\n';
+        return 1;
+    }
+}
@@ -0,0 +1,174 @@
+// Measures Game::apply by turn phase. Plays games on the classic board with
+// random dice and a simple bot that trades whenever it can, attacks from
+// its strongest territories and otherwise ends the phase, and times every
+// command by the phase it was given in. Games stop at GameOver or after
+// --moves commands.
+
+#include "risk/rules/game.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace risk::rules;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::size_t games = 200;
+    std::size_t players = 4;
+    std::size_t moves = 3000;
+};
+
+struct PhaseStats {
+    std::size_t commands = 0;
+    Clock::duration elapsed{};
+};
+
+constexpr std::array<const char*, phase_count> phase_names{
+    "Placing", "Reinforce", "TradeCards", "Attack", "Occupy", "Fortify", "GameOver",
+};
+
+bool valid_set(const std::vector<Card>& hand, std::size_t a, std::size_t b, std::size_t c)
+{
+    std::array<int, 3> kinds{};
+    for (auto index : {a, b, c}) {
+        const auto kind = hand[index].kind();
+        if (kind != Card::Kind::Wildcard) {
+            ++kinds[static_cast<std::size_t>(kind)];
+        }
+    }
+    const auto most = *std::max_element(std::begin(kinds), std::end(kinds));
+    const auto wildcards = 3 - kinds[0] - kinds[1] - kinds[2];
+    return most + wildcards == 3 || most <= 1;
+}
+
+Command next_command(const State& state)
+{
+    const auto player = state.current_player();
+    const auto& board = state.board();
+    const auto territories = board.territories();
+
+    switch (state.phase()) {
+    case Phase::Placing:
+        for (const auto& territory : territories) {
+            if (!territory.owner()) {
+                return PlaceUnit{player.id(), territory.id()};
+            }
+        }
+        [[fallthrough]];
+    case Phase::Reinforce:
+        for (const auto& territory : territories) {
+            if (territory.owner() == player.id()) {
+                return PlaceUnit{player.id(), territory.id()};
+            }
+        }
+        break;
+    case Phase::TradeCards: {
+        const auto hand = player.cards();
+        for (std::size_t a = 0; a < hand.size(); ++a) {
+            for (std::size_t b = a + 1; b < hand.size(); ++b) {
+                for (std::size_t c = b + 1; c < hand.size(); ++c) {
+                    if (valid_set(hand, a, b, c)) {
+                        return TradeCards{player.id(), {a, b, c}};
+                    }
+                }
+            }
+        }
+        break;
+    }
+    case Phase::Attack:
+        for (const auto& from : territories) {
+            if (from.owner() != player.id() || from.units() <= 3) {
+                continue;
+            }
+            for (const auto& to : territories) {
+                if (to.owner() != player.id() && board.adjacent(from.id(), to.id())) {
+                    return Attack{player.id(), from.id(), to.id(), 3};
+                }
+            }
+        }
+        break;
+    case Phase::Occupy:
+        return Occupy{player.id(), state.turn().occupation->min_units};
+    default:
+        break;
+    }
+    return EndPhase{player.id()};
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    const option long_options[] = {
+        {"games", required_argument, nullptr, 'g'},
+        {"players", required_argument, nullptr, 'p'},
+        {"moves", required_argument, nullptr, 'm'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int option;
+    while ((option = ::getopt_long(argc, argv, "g:p:m:", long_options, nullptr)) != -1) {
+        switch (option) {
+        case 'g': options.games = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        case 'p': options.players = std::strtoull(optarg, nullptr, 10); break;
+        case 'm': options.moves = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [--games N] [--players 2..6] [--moves N]\n";
+            return 2;
+        }
+    }
+    if (options.players < 2 || options.players > 6) {
+        std::cerr << argv[0] << ": --players must be 2 to 6\n";
+        return 2;
+    }
+
+    std::array<PhaseStats, phase_count> stats{};
+    std::size_t finished = 0;
+    for (std::size_t i = 0; i < options.games; ++i) {
+        std::vector<Player> seats;
+        for (std::size_t seat = 1; seat <= options.players; ++seat) {
+            seats.emplace_back(static_cast<Player::Id>(seat));
+        }
+        std::mt19937 rng{static_cast<std::uint32_t>(i)};
+        Game game{classic_board(), seats, [&rng] { return static_cast<int>(rng() % 6) + 1; }};
+
+        for (std::size_t move = 0; move < options.moves && game.state().phase() != Phase::GameOver; ++move) {
+            const auto phase = game.state().phase();
+            const auto command = next_command(game.state());
+            const auto start = Clock::now();
+            game.apply(command);
+            auto& phase_stats = stats[static_cast<std::size_t>(phase)];
+            phase_stats.elapsed += Clock::now() - start;
+            ++phase_stats.commands;
+        }
+        finished += game.state().phase() == Phase::GameOver;
+    }
+
+    std::cout << options.games << " games of " << options.players << " players, " << finished << " finished\n";
+    for (std::size_t phase = 0; phase < phase_count; ++phase) {
+        const auto& phase_stats = stats[phase];
+        if (phase_stats.commands == 0) {
+            continue;
+        }
+        const auto ns = std::chrono::duration<double, std::nano>(phase_stats.elapsed).count();
+        std::cout
+            << std::left << std::setw(11) << phase_names[phase] << std::right
+            << std::setw(9) << phase_stats.commands << " commands "
+            << std::setw(8) << std::fixed << std::setprecision(0) << ns / static_cast<double>(phase_stats.commands)
+            << " ns/command\n";
+    }
+}
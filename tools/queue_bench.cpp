@@ -0,0 +1,164 @@
+// Measures handing commands to a single consumer from many producer
+// threads, through MpscQueue and through a mutex-guarded vector the
+// consumer swaps out in batches. Producers push as fast as they can and
+// yield when the queue is full; the consumer drains in a loop.
+
+#include "risk/rules/state.h"
+#include "risk/server/mpsc_queue.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace risk::rules;
+using namespace risk::server;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::size_t producers = 16;
+    std::size_t commands = 200000;
+    std::size_t capacity = 4096;
+};
+
+struct Queued {
+    std::uint32_t producer = 0;
+    std::uint32_t sequence = 0;
+    Command command = EndPhase{0};
+};
+
+// The baseline: one lock around a vector
+class LockedQueue {
+public:
+    explicit LockedQueue(std::size_t capacity)
+        : capacity_(capacity)
+    {}
+
+    bool try_push(Queued&& value)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (queued_.size() >= capacity_) {
+            return false;
+        }
+        queued_.push_back(std::move(value));
+        return true;
+    }
+
+    template <typename Consume>
+    std::size_t drain(Consume&& consume)
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            batch_.swap(queued_);
+        }
+        for (auto& value : batch_) {
+            consume(std::move(value));
+        }
+        const auto count = batch_.size();
+        batch_.clear();
+        return count;
+    }
+
+private:
+    const std::size_t capacity_;
+    std::mutex mutex_;
+    std::vector<Queued> queued_;
+    std::vector<Queued> batch_;
+};
+
+template <typename Queue>
+void run(const std::string& name, Queue& queue, const Options& options)
+{
+    const auto total = options.producers * options.commands;
+    std::uint64_t full = 0;
+    std::mutex full_mutex;
+
+    const auto start = Clock::now();
+    std::vector<std::thread> producers;
+    for (std::size_t p = 0; p < options.producers; ++p) {
+        producers.emplace_back([&, p] {
+            std::uint64_t retries = 0;
+            for (std::size_t i = 0; i < options.commands; ++i) {
+                Queued value{static_cast<std::uint32_t>(p), static_cast<std::uint32_t>(i), PlaceUnit{1, 1}};
+                while (!queue.try_push(std::move(value))) {
+                    ++retries;
+                    std::this_thread::yield();
+                }
+            }
+            std::lock_guard<std::mutex> lock{full_mutex};
+            full += retries;
+        });
+    }
+
+    // Check each producer's order while consuming, as a game would rely on it
+    std::vector<std::uint32_t> next(options.producers, 0);
+    std::size_t received = 0;
+    std::size_t drains = 0;
+    bool ordered = true;
+    while (received < total) {
+        const auto count = queue.drain([&] (Queued&& value) {
+            ordered = ordered && value.sequence == next[value.producer]++;
+        });
+        if (count == 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        received += count;
+        ++drains;
+    }
+    const auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    for (auto& producer : producers) {
+        producer.join();
+    }
+
+    std::cout
+        << name << ": " << static_cast<std::uint64_t>(total / elapsed) << " commands/s, "
+        << elapsed * 1e9 / total << " ns each, "
+        << static_cast<double>(total) / std::max<std::size_t>(1, drains) << " per drain, "
+        << full << " pushes found it full"
+        << (ordered ? "" : ", OUT OF ORDER") << '\n';
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    const option long_options[] = {
+        {"producers", required_argument, nullptr, 'p'},
+        {"commands", required_argument, nullptr, 'n'},
+        {"capacity", required_argument, nullptr, 'c'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int option;
+    while ((option = ::getopt_long(argc, argv, "p:n:c:", long_options, nullptr)) != -1) {
+        switch (option) {
+        case 'p': options.producers = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        case 'n': options.commands = std::strtoull(optarg, nullptr, 10); break;
+        case 'c': options.capacity = std::max<std::size_t>(1, std::strtoull(optarg, nullptr, 10)); break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [--producers N] [--commands N per producer] [--capacity N]\n";
+            return 2;
+        }
+    }
+
+    std::cout << options.producers << " producers, " << options.commands << " commands each\n";
+
+    MpscQueue<Queued> mpsc{options.capacity};
+    run("mpsc  ", mpsc, options);
+
+    LockedQueue locked{mpsc.capacity()};
+    run("locked", locked, options);
+}